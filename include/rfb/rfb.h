@@ -386,6 +386,62 @@ typedef struct _rfbScreenInfo
      * its listening sockets from the current listenInterface/listen6Interface/
      * port/ipv6port values on its next loop iteration. Cleared by the thread. */
     rfbBool rebindListenSockets;
+    /** Track how often and with how many colours each part of the screen
+     * changes, and send text and UI losslessly but video with a lossy
+     * encoding, as far as each client's encodings allow. Off by default. */
+    rfbBool adaptiveEncoding;
+    /** tile statistics for adaptiveEncoding, private to classify.c */
+    void *tileClassifier;
+    /** Look for scrolled and moved areas in regions marked as modified and
+     * send them as CopyRect. This keeps a copy of the framebuffer. Off by
+     * default. */
+    rfbBool detectCopies;
+    /** previous framebuffer contents for detectCopies, private to
+     * copydetect.c */
+    void *copyDetector;
+    /** Resend areas a client only got with a lossy encoding losslessly once
+     * nothing was sent lossily for this many milliseconds and there is
+     * nothing else to send. 0, the default, turns this off. */
+    int losslessRefreshDelay;
+    /** TLS state shared by the WebSockets clients, built from sslkeyfile
+     * and sslcertfile and reloaded when they change, private to
+     * rfbssl_*.c */
+    void *sslServerCtx;
+    /** zlib level for compressing messages to WebSockets clients which
+     * offer permessage-deflate, 0 (the default) to not negotiate it.
+     * Messages carrying already compressed encodings are sent as they
+     * are. */
+    int webSocketsDeflateLevel;
+    /** open HTTP connections and what is known about the files served,
+     * private to httpd.c. httpSock is not used anymore. */
+    void *httpState;
+    /** Look for (TLS) WebSockets handshakes on the RFB port. Every plain
+     * RFB connection then waits a moment for one to arrive first. TRUE by
+     * default; WebSockets clients can also connect to the HTTP port. */
+    rfbBool webSocketsOnRfbPort;
+    /** How many threads accept RFB connections when running the event loop
+     * in the background. Above 1, each thread gets its own SO_REUSEPORT
+     * socket and the kernel spreads new connections over them. Has to be
+     * set before rfbInitServer(). */
+    int listenerThreads;
+    /** the additional listener threads, private to main.c */
+    void *sharedListeners;
+    /** Set TCP_CORK while a framebuffer update is written, so its headers
+     * and rectangles leave in full segments. TRUE by default. */
+    rfbBool corkUpdates;
+    /** Fit SO_SNDBUF of the clients to their bandwidth-delay product as
+     * measured by the kernel, instead of leaving it to autotuning. */
+    rfbBool tuneSendBuffer;
+    /** If > 0, the TCP_NOTSENT_LOWAT of the clients in bytes: keeps the data
+     * queued but not yet in flight small, so updates stay fresh on slow
+     * links. 0 (the default) leaves the system setting. */
+    int notSentLowWater;
+#if defined(LIBVNCSERVER_HAVE_LIBPTHREAD) || defined(LIBVNCSERVER_HAVE_WIN32THREADS)
+    /** guards sslServerCtx, which clients set up TLS from concurrently */
+    MUTEX(sslMutex);
+    /** serializes rfbNewClient(), which the listener threads call concurrently */
+    MUTEX(newClientMutex);
+#endif
 } rfbScreenInfo, *rfbScreenInfoPtr;
 
 
@@ -444,6 +500,11 @@ typedef struct _rfbStatList {
 typedef struct _rfbSslCtx rfbSslCtx;
 typedef struct _wsCtx wsCtx;
 
+/** how many frame encodings of a SetEncodings message are remembered */
+#define RFB_MAX_FRAME_ENCODINGS 16
+/** how many copies can be pending besides rfbClientRec::copyRegion */
+#define RFB_MAX_EXTRA_COPIES 7
+
 typedef struct _rfbClientRec {
 
     /** back pointer to the screen */
@@ -517,6 +578,9 @@ typedef struct _rfbClientRec {
         RFB_SHUTDOWN,           /**< Client is shutting down */
 
         RFB_CHANNEL_SECURITY_TYPE, /**< negotiating security (RFB v.3.7) */
+        RFB_WEBSOCKETS_CHECK,   /**< waiting for a possible WebSockets handshake */
+        RFB_TLS_HANDSHAKE,      /**< TLS handshake of a secure WebSockets client */
+        RFB_WEBSOCKETS_HANDSHAKE, /**< HTTP upgrade request of a WebSockets client */
     } state;
 
     rfbBool reverseConnection;
@@ -545,6 +609,10 @@ typedef struct _rfbClientRec {
        the region of the screen which has been modified in some other way
        (modifiedRegion).
 
+       Copies with a different translation scheduled while the first one is
+       still pending are kept in extraCopyRegion, see below, and sent after
+       it in the order they were scheduled.
+
        Although the copy is of a single region, this region may have many
        rectangles.  When sending an update, the copyRegion is always sent
        before the modifiedRegion.  This is because the modifiedRegion may
@@ -740,6 +808,63 @@ typedef struct _rfbClientRec {
     ClientPeekAtSocket peekAtSocket;             /* Peek at data from socket */
     ClientHasPendingOnSocket hasPendingOnSocket; /* Has pending data on socket */
     ClientWriteToSocket writeToSocket;           /* Write data to socket */
+
+    /** H.264 encoder state, private to h264.c */
+    void *h264Data;
+    /** the next H.264 frame sent to this client has to be a keyframe */
+    rfbBool h264ForceKeyframe;
+
+    /** the frame encodings from the client's last SetEncodings message,
+     * in its order of preference */
+    uint32_t frameEncodings[RFB_MAX_FRAME_ENCODINGS];
+    int nFrameEncodings;
+
+    /** Copies pending after the one in copyRegion, oldest first, each with
+     * its own translation.  The destinations of all pending copies are
+     * disjoint, and none copies from the destination of an earlier one. */
+    sraRegionPtr extraCopyRegion[RFB_MAX_EXTRA_COPIES];
+    int extraCopyDX[RFB_MAX_EXTRA_COPIES];
+    int extraCopyDY[RFB_MAX_EXTRA_COPIES];
+    int nExtraCopies;
+
+    /** For losslessRefreshDelay: the areas the client last got with a lossy
+     * encoding, when that last happened (see rfbCurrentTimeMs() in main.c),
+     * and the areas scheduled to be resent losslessly. */
+    sraRegionPtr lossyRegion;
+    unsigned long lastLossyUpdate;
+    sraRegionPtr refreshRegion;
+
+    /** For WebSockets over TLS: whether the kernel does the record
+     * encryption (kTLS) when sending and receiving, and how many bytes
+     * were sent straight to the socket because of it. */
+    rfbBool sslKernelSend;
+    rfbBool sslKernelRecv;
+    unsigned long sslKernelBytesSent;
+
+    /** When the client started the current part of its handshake, for the
+     * handshake deadline, 0 if it did not yet. */
+    unsigned long handshakeStart;
+    /** A partial handshake message read without blocking by
+     * rfbReadHandshake() in sockets.c */
+    char handshakeBuf[CHALLENGESIZE];
+    int handshakeLen;
+    /** The SO_SNDBUF set with tuneSendBuffer, 0 if none yet, and when it
+     * was last checked */
+    int sendBufferSize;
+    unsigned long sendBufferChecked;
+
+    /** The part of the WebSockets upgrade request read so far in the
+     * RFB_WEBSOCKETS_HANDSHAKE state */
+    char *wsRequest;
+    int wsRequestLen;
+
+    /** The encoding of the rectangle last put into the update buffer, or
+     * -1 outside of framebuffer updates, so that WebSockets messages
+     * carrying already compressed data do not get compressed again */
+    int sendingEncoding;
+
+    /** whether it was logged why H.264 can not be used for this client */
+    rfbBool h264Logged;
 } rfbClientRec, *rfbClientPtr;
 
 /**
@@ -754,7 +879,8 @@ typedef struct _rfbClientRec {
 	(cl)->cursorY != (cl)->screen->cursorY))) ||                       \
      ((cl)->useNewFBSize && (cl)->newFBSizePending) ||                     \
      ((cl)->enableCursorPosUpdates && (cl)->cursorWasMoved) ||             \
-     !sraRgnEmpty((cl)->copyRegion) || !sraRgnEmpty((cl)->modifiedRegion))
+     !sraRgnEmpty((cl)->copyRegion) || (cl)->nExtraCopies > 0 ||         \
+     !sraRgnEmpty((cl)->modifiedRegion))
 
 /*
  * Macros for endian swapping.
@@ -820,10 +946,12 @@ extern rfbBool rfbSetNonBlocking(rfbSocket sock);
 /* websockets.c */
 
 extern rfbBool webSocketsCheck(rfbClientPtr cl);
+extern rfbBool webSocketsUpgrade(rfbClientPtr cl, const char *request);
 extern rfbBool webSocketCheckDisconnect(rfbClientPtr cl);
 extern int webSocketsEncode(rfbClientPtr cl, const char *src, int len, char **dst);
 extern int webSocketsDecode(rfbClientPtr cl, char *dst, int len);
 extern rfbBool webSocketsHasDataInBuffer(rfbClientPtr cl);
+extern void webSocketsFree(rfbClientPtr cl);
 #endif
 
 /* rfbserver.c */
@@ -842,6 +970,9 @@ extern void rfbDecrClientRef(rfbClientPtr cl);
 extern void rfbNewClientConnection(rfbScreenInfoPtr rfbScreen,rfbSocket sock);
 extern rfbClientPtr rfbNewClient(rfbScreenInfoPtr rfbScreen,rfbSocket sock);
 extern rfbClientPtr rfbNewUDPClient(rfbScreenInfoPtr rfbScreen);
+#ifdef LIBVNCSERVER_WITH_WEBSOCKETS
+extern rfbClientPtr rfbNewWebSocketsClient(rfbScreenInfoPtr rfbScreen,rfbSocket sock,const char *request);
+#endif
 extern rfbClientPtr rfbReverseConnection(rfbScreenInfoPtr rfbScreen,char *host, int port);
 /**
  * @brief Make a connection to an UltraVNC repeater in mode 2
@@ -1016,6 +1147,11 @@ extern void rfbDefaultPtrAddEvent(int buttonMask,int x,int y,rfbClientPtr cl);
 extern rfbBool rfbSendRectEncodingZRLE(rfbClientPtr cl, int x, int y, int w,int h);
 #endif
 
+/* h264.c */
+#ifdef LIBVNCSERVER_HAVE_LIBAVCODEC
+extern rfbBool rfbSendRectEncodingH264(rfbClientPtr cl, int x, int y, int w, int h);
+#endif
+
 /* stats.c */
 
 extern void rfbResetStats(rfbClientPtr cl);
@@ -106,6 +106,8 @@ typedef struct {
   struct timeval tv;
   rfbBool readTimestamp;
   rfbBool doNotSleep;
+  /** State of seekable recordings. For internal use only. */
+  void* indexed;
 } rfbVNCRec;
 
 /** client data */
@@ -216,6 +218,20 @@ typedef void (*GotFrameBufferUpdateProc)(struct _rfbClient* client, int x, int y
    @param client The client which finished processing an rfbFramebufferUpdate
  */
 typedef void (*FinishedFrameBufferUpdateProc)(struct _rfbClient* client);
+/**
+   Callback indicating that the server answered a fence sent with SendFence().
+   @param client The client which received the fence response
+   @param flags The flags the server understood, without rfbFenceFlagRequest
+   @param data The payload of the fence, as it was sent
+   @param len The length of the payload in bytes
+ */
+typedef void (*GotFenceProc)(struct _rfbClient* client, uint32_t flags, const char* data, int len);
+/**
+   Callback indicating that a probe sent with SendLatencyProbe() came back.
+   @param client The client which received the probe
+   @param usec The round trip time of the probe in microseconds
+ */
+typedef void (*GotLatencyProc)(struct _rfbClient* client, unsigned int usec);
 typedef char* (*GetPasswordProc)(struct _rfbClient* client);
 typedef rfbCredential* (*GetCredentialProc)(struct _rfbClient* client, int credentialType);
 /**
@@ -274,10 +290,22 @@ typedef struct _rfbClient {
 	/** Note that the CoRRE encoding uses this buffer and assumes it is big enough
 	   to hold 255 * 255 * 32 bits -> 260100 bytes.  640*480 = 307200 bytes.
 	   Hextile also assumes it is big enough to hold 16 * 16 * 32 bits.
-	   Tight encoding assumes BUFFER_SIZE is at least 16384 bytes. */
+	   Tight encoding assumes BUFFER_SIZE is at least 16384 bytes.
+	   It is only allocated once a rectangle needs it, bufferSize bytes,
+	   which is less than RFB_BUFFER_SIZE as long as only Hextile did.
+
+	   Up to libvncclient.so.1, buffer, buf, zlib_buffer, zlibStream,
+	   tightPalette and tightPrevRow were arrays inside rfbClient.  They are
+	   pointers now, which changed the layout of everything after buffer and
+	   is why the soname went to 2.  Each of them is NULL until it is first
+	   needed, so code outside of libvncclient has to check for that and
+	   must not take sizeof() of them; bufferSize and bufSize hold the sizes
+	   of the first two, zlibStream holds 4 streams and the others are
+	   ZLIB_BUFFER_SIZE, TIGHT_PALETTE_SIZE and TIGHT_PREV_ROW_SIZE bytes. */
 
 #define RFB_BUFFER_SIZE (640*480)
-	char buffer[RFB_BUFFER_SIZE];
+	char *buffer;
+	int bufferSize;
 
 	/* rfbproto.c */
 
@@ -289,10 +317,20 @@ typedef struct _rfbClient {
 	rfbServerInitMsg si;
 
 	/* sockets.c */
+	/** The receive buffer is allocated with RFB_BUF_SIZE bytes on the first
+	   read and doubles, up to RFB_BUF_MAX_SIZE, each time a read fills it.
+	   It goes back to RFB_BUF_SIZE once empty after RFB_BUF_SHRINK_READS
+	   reads in a row brought no more than RFB_BUF_SIZE bytes each, or
+	   after WaitForMessage() waited RFB_BUF_IDLE_USECS for nothing. */
 #define RFB_BUF_SIZE 8192
-	char buf[RFB_BUF_SIZE];
+#define RFB_BUF_MAX_SIZE (256*1024)
+#define RFB_BUF_SHRINK_READS 64
+#define RFB_BUF_IDLE_USECS 100000
+	char *buf;
 	char *bufoutptr;
 	unsigned int buffered;
+	int bufSize;
+	int bufSmallReads;
 
 	/* The zlib encoding requires expansion/decompression/deflation of the
 	   compressed data in the "buffer" above into another, result buffer.
@@ -319,20 +357,25 @@ typedef struct _rfbClient {
 	 * Variables for the ``tight'' encoding implementation.
 	 */
 
+	/* The buffers below are only allocated once a Tight (or, for
+	   zlib_buffer, ZYWRLE) rectangle arrives. */
+
 	/** Separate buffer for compressed data. */
 #define ZLIB_BUFFER_SIZE 30000
-	char zlib_buffer[ZLIB_BUFFER_SIZE];
+	char *zlib_buffer;
 
 	/* Four independent compression streams for zlib library. */
-	z_stream zlibStream[4];
+	z_stream *zlibStream;
 	rfbBool zlibStreamActive[4];
 
 	/* Filter stuff. Should be initialized by filter initialization code. */
 #define TIGHT_GRADIENT_MAX_WIDTH 2048
 	rfbBool cutZeros;
 	int rectWidth, rectColors;
-	char tightPalette[256*4];
-	uint8_t tightPrevRow[TIGHT_GRADIENT_MAX_WIDTH*3*sizeof(uint16_t)];
+#define TIGHT_PALETTE_SIZE (256*4)
+	char *tightPalette;
+#define TIGHT_PREV_ROW_SIZE (TIGHT_GRADIENT_MAX_WIDTH*3*sizeof(uint16_t))
+	uint8_t *tightPrevRow;
 
 #ifdef LIBVNCSERVER_HAVE_LIBJPEG
 	/** JPEG decoder state (obsolete-- do not use). */
@@ -506,8 +549,111 @@ typedef struct _rfbClient {
         rfbBool isUpdateRectManagedByLib;
 
         GetX509CertFingerprintMismatchDecisionProc GetX509CertFingerprintMismatchDecision;
+
+	/** H.264 decoder state. For internal use only. */
+	void *h264Data;
+
+	/**
+	 * Set to TRUE before rfbInitClient() to receive from the server in a
+	 * separate thread, so the network keeps flowing while updates are
+	 * decoded. Plain connections only, needs thread support.
+	 * Decoding itself stays on the thread calling
+	 * HandleRFBServerMessage(), one rectangle after the other: the
+	 * decoders share client->buffer, the zlib streams and the Tight
+	 * filter state. Only Tight JPEG rectangles, which need none of it,
+	 * are decoded in parallel, see jpegDecodeThreads.
+	 */
+	rfbBool pipelineReceive;
+	/** State of the receive thread. For internal use only. */
+	void *receiveQueue;
+
+	/**
+	 * Number of threads decoding the JPEG rectangles of Tight updates in
+	 * parallel. 0 or 1 decode them one after the other while reading.
+	 */
+	int jpegDecodeThreads;
+	/** JPEG decoding threads. For internal use only. */
+	void *jpegPool;
+
+	/**
+	 * Set to TRUE to have servers supporting continuous updates push
+	 * updates for updateRect as they happen, instead of waiting for an
+	 * incremental request after each update.
+	 */
+	rfbBool continuousUpdates;
+	/** TRUE while the server sends continuous updates. Read only. */
+	rfbBool continuousUpdatesActive;
+	/** Area continuous updates were enabled for. For internal use only. */
+	rfbRectangle continuousUpdatesRect;
+	/** Callback fired when the server answers a fence sent with SendFence(). */
+	GotFenceProc GotFence;
+	/** Callback fired when a probe sent with SendLatencyProbe() comes back. */
+	GotLatencyProc GotLatency;
+	/** Round trip time of the last latency probe in microseconds, 0 if none yet. */
+	unsigned int latency;
+
+	/**
+	 * Set to TRUE before rfbInitClient() to play a recording as fast as it
+	 * decodes instead of at the speed it was recorded with.
+	 */
+	rfbBool vncRecDoNotSleep;
+	/** State of rfbVNCRecStart(). For internal use only. */
+	void *vncRecWriter;
+	/** State of rfbClientLoopAdd(). For internal use only. */
+	void *clientLoopEntry;
 } rfbClient;
 
+/* clientloop.c */
+#ifdef LIBVNCSERVER_WITH_CLIENT_LOOP
+/** Serves the messages of many clients from one thread. */
+typedef struct _rfbClientLoop rfbClientLoop;
+/**
+ * Called by rfbClientLoopRun() for a client whose connection failed, after
+ * the client was removed from the loop. It may call rfbClientCleanup().
+ */
+typedef void (*rfbClientLoopClosedProc)(rfbClientLoop* loop, rfbClient* client);
+/**
+ * Creates an empty loop.
+ * @param closed Called for every client whose connection fails, may be NULL
+ * @return the loop or NULL if epoll could not be set up
+ */
+extern rfbClientLoop* rfbClientLoopCreate(rfbClientLoopClosedProc closed);
+/**
+ * Adds a connected client, as returned by rfbInitClient(), to the loop,
+ * which handles all its server messages from then on. The client gets a
+ * stack of its own for them, so the message being received when a read
+ * would block is suspended until more of it arrives, while the loop serves
+ * the others. Callbacks run on that stack. Clients with pipelineReceive
+ * or playing a recording can not be added.
+ * @param loop The loop to add to
+ * @param client The client to add
+ * @return true if the client was added, false otherwise
+ */
+extern rfbBool rfbClientLoopAdd(rfbClientLoop* loop, rfbClient* client);
+/**
+ * Removes a client from the loop, blocking until the message it is in the
+ * middle of, if any, is received. rfbClientCleanup() does this as well.
+ * A client's own callbacks may remove it, which happens once the message
+ * being handled is done.
+ * @param loop The loop the client was added to
+ * @param client The client to remove
+ */
+extern void rfbClientLoopRemove(rfbClientLoop* loop, rfbClient* client);
+/**
+ * Waits up to timeout milliseconds for data from any of the clients and
+ * handles everything that arrived, then returns.
+ * @param loop The loop to run
+ * @param timeout Milliseconds to wait at most, -1 to wait for data
+ * @return the number of clients served, or -1 if waiting failed
+ */
+extern int rfbClientLoopRun(rfbClientLoop* loop, int timeout);
+/**
+ * Removes all clients, as with rfbClientLoopRemove(), and frees the loop.
+ * @param loop The loop to destroy
+ */
+extern void rfbClientLoopDestroy(rfbClientLoop* loop);
+#endif /* LIBVNCSERVER_WITH_CLIENT_LOOP */
+
 /* cursor.c */
 /**
  * Handles XCursor and RichCursor shape updates from the server.
@@ -686,6 +832,43 @@ extern rfbBool TextChatClose(rfbClient* client);
 extern rfbBool TextChatFinish(rfbClient* client);
 extern rfbBool PermitServerInput(rfbClient* client, int enabled);
 extern rfbBool SendXvpMsg(rfbClient* client, uint8_t version, uint8_t code);
+/**
+ * Asks the server to start or stop sending continuous updates for the given
+ * area. Stopping is confirmed by the server; until then, updates may still
+ * arrive. Setting client->continuousUpdates before rfbInitClient() makes the
+ * library do this for updateRect on its own.
+ * @param client The client through which to send the message
+ * @param enable TRUE to start continuous updates, FALSE to stop them
+ * @param x The horizontal position of the area
+ * @param y The vertical position of the area
+ * @param w The width of the area
+ * @param h The height of the area
+ * @return true if the server supports continuous updates and the message was
+ * sent successfully, false otherwise
+ */
+extern rfbBool SendEnableContinuousUpdates(rfbClient* client, rfbBool enable, int x, int y, int w, int h);
+/**
+ * Sends a fence to the server. If flags contains rfbFenceFlagRequest, the
+ * server answers it once the conditions given by the other flags are met,
+ * and the answer is passed to client->GotFence.
+ * @param client The client through which to send the fence
+ * @param flags A combination of the rfbFenceFlag* values
+ * @param data The payload of the fence
+ * @param len The length of the payload, at most rfbFenceMaxPayload bytes
+ * @return true if the server supports fences and the fence was sent
+ * successfully, false otherwise
+ */
+extern rfbBool SendFence(rfbClient* client, uint32_t flags, const char *data, int len);
+/**
+ * Measures the round trip time to the server with a fence. When the answer
+ * comes back, client->latency is updated and client->GotLatency is called.
+ * Unlike a framebuffer update request, the answer is not delayed by the
+ * server waiting for changes.
+ * @param client The client through which to send the probe
+ * @return true if the server supports fences and the probe was sent
+ * successfully, false otherwise
+ */
+extern rfbBool SendLatencyProbe(rfbClient* client);
 
 extern void PrintPixelFormat(rfbPixelFormat *format);
 
@@ -761,6 +944,8 @@ void rfbClientRegisterExtension(rfbClientProtocolExtension* e);
 extern rfbBool errorMessageOnReadFailure;
 
 extern rfbBool ReadFromRFBServer(rfbClient* client, char *out, unsigned int n);
+extern rfbBool ReadRowsFromRFBServer(rfbClient* client, char *out, unsigned int rowLen,
+                                     unsigned int stride, unsigned int rows);
 extern rfbBool WriteToRFBServer(rfbClient* client, const char *buf, unsigned int n);
 extern int FindFreeTcpPort(void);
 extern rfbSocket ListenAtTcpPort(int port);
@@ -827,6 +1012,48 @@ extern rfbBool SameMachine(rfbSocket sock);
  */
 extern int WaitForMessage(rfbClient* client,unsigned int usecs);
 
+/* vncrec.c */
+/**
+ * Starts recording the session to a seekable file, which can be played by
+ * passing its name as server with serverPort -1. Rectangles of encodings
+ * that depend on earlier updates are stored as the pixels they decoded to,
+ * and a snapshot of the framebuffer is stored every keyframeInterval
+ * seconds, so playback can jump to any point. Call this between messages,
+ * once the framebuffer is allocated.
+ * @note The recording is taken from client->frameBuffer in client->format,
+ * which must not change while recording. Cursor shapes only get recorded
+ * as they are sent.
+ * @param client The client whose session to record
+ * @param filename The file to write the recording to
+ * @param keyframeInterval Seconds between framebuffer snapshots, 0 for
+ * only one at the start
+ * @return true if the recording was started, false otherwise
+ */
+extern rfbBool rfbVNCRecStart(rfbClient* client, const char *filename, int keyframeInterval);
+/**
+ * Finishes the recording started by rfbVNCRecStart(). rfbClientCleanup()
+ * does this as well.
+ * @param client The client whose session is recorded
+ */
+extern void rfbVNCRecStop(rfbClient* client);
+/**
+ * Jumps to a point of the recording being played, starting from the
+ * snapshot of the framebuffer before it. Only works with recordings
+ * written by rfbVNCRecStart(), which are played in the pixel format they
+ * were recorded in. Call this between messages.
+ * @param client The client playing the recording
+ * @param time Milliseconds since the start of the recording
+ * @return true if the framebuffer now shows the recording at time, false
+ * otherwise
+ */
+extern rfbBool rfbVNCRecSeek(rfbClient* client, unsigned int time);
+/**
+ * Returns the length of the recording being played in milliseconds, or 0
+ * if it was not written by rfbVNCRecStart().
+ * @param client The client playing the recording
+ */
+extern unsigned int rfbVNCRecDuration(rfbClient* client);
+
 /* vncviewer.c */
 /**
  * Allocates and returns a pointer to an rfbClient structure. This will probably
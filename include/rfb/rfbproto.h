@@ -408,6 +408,7 @@ typedef struct {
 /* Modif sf@2002 */
 #define rfbResizeFrameBuffer 4
 #define rfbPalmVNCReSizeFrameBuffer 0xF
+#define rfbEndOfContinuousUpdates 150
 
 /* client -> server */
 
@@ -431,6 +432,10 @@ typedef struct {
 /* Modif cs@2005 */
 /* PalmVNC 1.4 & 2.0 SetScale Factor message */
 #define rfbPalmVNCSetScaleFactor 0xF
+/* EnableContinuousUpdates client -> server message */
+#define rfbEnableContinuousUpdates 150
+/* Fence message - bidirectional */
+#define rfbFence 248
 /* Xvp message - bidirectional */
 #define rfbXvp 250
 /* SetDesktopSize client -> server message */
@@ -460,6 +465,8 @@ typedef struct {
 #define rfbEncodingZRLE 16
 #define rfbEncodingZYWRLE 17
 
+/* LibVNC's own number ("H264"), not registered with the RFB protocol, see
+   rfbH264Header for the payload */
 #define rfbEncodingH264               0x48323634
 
 /* Cache & XOR-Zlib - rdv@2002 */
@@ -516,6 +523,8 @@ typedef struct {
 #define rfbEncodingLastRect           0xFFFFFF20
 #define rfbEncodingNewFBSize          0xFFFFFF21
 #define rfbEncodingExtDesktopSize     0xFFFFFECC
+#define rfbEncodingFence              0xFFFFFEC8 /* -312 */
+#define rfbEncodingContinuousUpdates  0xFFFFFEC7 /* -313 */
 
 #define rfbEncodingQualityLevel0   0xFFFFFFE0
 #define rfbEncodingQualityLevel1   0xFFFFFFE1
@@ -738,6 +747,30 @@ typedef struct {
 
 #define sz_rfbZlibHeader 4
 
+/*- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * H.264 Encoding.  We have an rfbH264Header structure giving the number of
+ * bytes of H.264 bitstream (Annex B byte stream format) following and a set
+ * of flags.  Each rectangle has its own decoder context which is keyed by
+ * the rectangle's position and size; if rfbH264FlagResetContext is set, the
+ * client has to discard the context for this rectangle before decoding, if
+ * rfbH264FlagResetAllContexts is set, all contexts are to be discarded.
+ *
+ * This is an encoding private to LibVNCServer and LibVNCClient, both ends
+ * have to be LibVNC to use it.  The payload is laid out like that of the
+ * registered Open H.264 encoding (50), but that number is neither sent nor
+ * understood.
+ */
+
+typedef struct {
+    uint32_t length;
+    uint32_t flags;
+} rfbH264Header;
+
+#define sz_rfbH264Header 8
+
+#define rfbH264FlagResetContext 1
+#define rfbH264FlagResetAllContexts 2
+
 #ifdef LIBVNCSERVER_HAVE_LIBZ
 
 /*- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
@@ -1212,6 +1245,65 @@ typedef struct rfbSetDesktopSizeMsg {
 #define sz_rfbSetDesktopSizeMsg (8)
 
 
+/*-----------------------------------------------------------------------------
+ * EnableContinuousUpdates client -> server message
+ *
+ * A server which supports continuous updates declares this by sending an
+ * EndOfContinuousUpdates message when the client asks for the
+ * ContinuousUpdates pseudo-encoding. With enable set, the server sends
+ * updates for the given area as they happen, without waiting for a
+ * FramebufferUpdateRequest. With enable clear, the server stops doing so and
+ * answers with another EndOfContinuousUpdates.
+ */
+
+typedef struct {
+    uint8_t type;			/* always rfbEnableContinuousUpdates */
+    uint8_t enable;
+    uint16_t x;
+    uint16_t y;
+    uint16_t w;
+    uint16_t h;
+} rfbEnableContinuousUpdatesMsg;
+
+#define sz_rfbEnableContinuousUpdatesMsg (10)
+
+/*-----------------------------------------------------------------------------
+ * EndOfContinuousUpdates server -> client message
+ */
+
+typedef struct {
+    uint8_t type;			/* always rfbEndOfContinuousUpdates */
+} rfbEndOfContinuousUpdatesMsg;
+
+#define sz_rfbEndOfContinuousUpdatesMsg (1)
+
+/*-----------------------------------------------------------------------------
+ * Fence - bidirectional message
+ *
+ * A server which supports fences declares this by sending a Fence request
+ * when the client asks for the Fence pseudo-encoding. A Fence with the
+ * rfbFenceFlagRequest bit set must be echoed back by the receiver, with the
+ * same payload and the flags it understood, once the conditions given by the
+ * other flags have been met.
+ */
+
+typedef struct {
+    uint8_t type;			/* always rfbFence */
+    uint8_t pad[3];
+    uint32_t flags;
+    uint8_t length;			/* length of payload, at most 64 */
+    /* followed by char payload[length] */
+} rfbFenceMsg;
+
+#define sz_rfbFenceMsg (9)
+
+#define rfbFenceFlagBlockBefore 0x00000001
+#define rfbFenceFlagBlockAfter  0x00000002
+#define rfbFenceFlagSyncNext    0x00000004
+#define rfbFenceFlagRequest     0x80000000
+#define rfbFenceMaxPayload 64
+
+
 /*-----------------------------------------------------------------------------
  * Modif sf@2002
  * ResizeFrameBuffer - The Client must change the size of its framebuffer  
@@ -1267,6 +1359,8 @@ typedef union {
 	rfbTextChatMsg tc;
 	rfbXvpMsg xvp;
 	rfbExtDesktopSizeMsg eds;
+	rfbEndOfContinuousUpdatesMsg eocu;
+	rfbFenceMsg f;
 } rfbServerToClientMsg;
 
 
@@ -1545,6 +1639,8 @@ typedef union {
 	rfbTextChatMsg tc;
 	rfbXvpMsg xvp;
 	rfbSetDesktopSizeMsg sdm;
+	rfbEnableContinuousUpdatesMsg ecu;
+	rfbFenceMsg f;
 } rfbClientToServerMsg;
 
 /* 
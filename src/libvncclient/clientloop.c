@@ -0,0 +1,432 @@
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/*
+ * clientloop.c - serve the messages of many clients from one thread.
+ *
+ * HandleRFBServerMessage() reads a whole message, waiting for the socket
+ * whenever the rest of it has not arrived yet. So that one thread can wait
+ * for thousands of servers, every client added to an rfbClientLoop handles
+ * its messages on a stack of its own. When a read would block,
+ * YieldToClientLoop() switches back to the loop, which resumes the client
+ * once epoll reports more data: a partly received message waits right
+ * where it stopped, with what arrived of it kept in the client's receive
+ * buffer.
+ *
+ * Between messages, a client is resumed when its socket becomes readable
+ * or when it still has data buffered. Clients with a readTimeout are also
+ * resumed every 100 ms while in the middle of a message, so they time out
+ * just like with blocking reads.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <rfb/rfbclient.h>
+#include "clientloop.h"
+
+#define STACK_SIZE (256*1024)
+#define EVENTS_PER_WAIT 256
+#define MSECS_WAIT_PER_RETRY 100 /* USECS_WAIT_PER_RETRY of sockets.c */
+
+typedef struct _rfbClientLoopEntry rfbClientLoopEntry;
+
+typedef struct {
+  rfbClientLoopEntry *first, *last;
+} rfbClientLoopQueue;
+
+struct _rfbClientLoopEntry {
+  rfbClientLoop *loop;
+  rfbClient *client;       /* NULL once removed */
+  ucontext_t context;      /* on the client's stack */
+  ucontext_t caller;       /* to switch back to */
+  char *stack;
+  rfbBool active;          /* running on its stack */
+  rfbBool inMessage;       /* suspended in the middle of a message */
+  rfbBool blocking;        /* finish the message without suspending */
+  rfbBool result;          /* of the last HandleRFBServerMessage() */
+  rfbBool removed;
+  rfbBool closed;          /* to report to loop->Closed */
+  unsigned long retryAt;   /* when to resume it for its readTimeout */
+  rfbClientLoopQueue *queue;
+  rfbClientLoopEntry *prev, *next;           /* in queue */
+  rfbClientLoopEntry *prevEntry, *nextEntry; /* in loop->entries */
+  rfbClientLoopEntry *nextDetach;            /* in loop->detach */
+  rfbClientLoopEntry *nextFree;              /* in loop->graveyard */
+};
+
+struct _rfbClientLoop {
+  int epollFd;
+  rfbClientLoopClosedProc Closed;
+  rfbClientLoopEntry *entries;
+  rfbClientLoopEntry *running;   /* innermost active entry */
+  rfbBool inRun;
+  rfbClientLoopQueue ready;      /* to resume without waiting */
+  rfbClientLoopQueue timed;      /* to resume at their retryAt */
+  rfbClientLoopEntry *detach;    /* to remove before rfbClientLoopRun() returns */
+  rfbClientLoopEntry *graveyard; /* to free before rfbClientLoopRun() returns */
+};
+
+/* milliseconds, compared by their difference as they may wrap around */
+static unsigned long
+Now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void
+Dequeue(rfbClientLoopEntry *entry)
+{
+  rfbClientLoopQueue *queue = entry->queue;
+
+  if (!queue)
+    return;
+  if (entry->prev)
+    entry->prev->next = entry->next;
+  else
+    queue->first = entry->next;
+  if (entry->next)
+    entry->next->prev = entry->prev;
+  else
+    queue->last = entry->prev;
+  entry->queue = NULL;
+  entry->prev = entry->next = NULL;
+}
+
+static void
+Enqueue(rfbClientLoopQueue *queue, rfbClientLoopEntry *entry)
+{
+  Dequeue(entry);
+  entry->queue = queue;
+  entry->prev = queue->last;
+  if (queue->last)
+    queue->last->next = entry;
+  else
+    queue->first = entry;
+  queue->last = entry;
+}
+
+/*
+ * The function running on a client's stack. makecontext() only passes ints,
+ * hence the entry split in two halves.
+ */
+
+static void
+RunClient(unsigned int high, unsigned int low)
+{
+  rfbClientLoopEntry *entry =
+    (rfbClientLoopEntry *)((uintptr_t)high << 16 << 16 | (uintptr_t)low);
+
+  for (;;) {
+    entry->result = HandleRFBServerMessage(entry->client);
+    swapcontext(&entry->context, &entry->caller);
+  }
+}
+
+/*
+ * Switch to the client's stack until it handled a message or is suspended
+ * in the middle of one, then queue it for its next turn.
+ */
+
+static void
+Resume(rfbClientLoopEntry *entry)
+{
+  rfbClientLoop *loop = entry->loop;
+  rfbClientLoopEntry *outer = loop->running;
+  rfbClient *client = entry->client;
+
+  Dequeue(entry);
+  loop->running = entry;
+  entry->active = TRUE;
+  swapcontext(&entry->caller, &entry->context);
+  entry->active = FALSE;
+  loop->running = outer;
+
+  if (entry->removed)
+    return;
+  if (entry->inMessage) {
+    if (client->readTimeout > 0) {
+      entry->retryAt = Now() + MSECS_WAIT_PER_RETRY;
+      Enqueue(&loop->timed, entry);
+    }
+  } else if (!entry->result) {
+    entry->removed = TRUE;
+    entry->closed = TRUE;
+    entry->nextDetach = loop->detach;
+    loop->detach = entry;
+  } else if (client->buffered > 0)
+    Enqueue(&loop->ready, entry);
+}
+
+/*
+ * Take the client off the loop, finishing the message it is in the middle
+ * of first. Within rfbClientLoopRun(), the entry itself is only freed once
+ * no event can refer to it anymore.
+ */
+
+static void
+Detach(rfbClientLoopEntry *entry)
+{
+  rfbClientLoop *loop = entry->loop;
+  rfbClient *client = entry->client;
+
+  entry->removed = TRUE;
+  if (entry->inMessage) {
+    entry->blocking = TRUE;
+    Resume(entry);
+  }
+  Dequeue(entry);
+  epoll_ctl(loop->epollFd, EPOLL_CTL_DEL, client->sock, NULL);
+  munmap(entry->stack, STACK_SIZE);
+
+  if (entry->prevEntry)
+    entry->prevEntry->nextEntry = entry->nextEntry;
+  else
+    loop->entries = entry->nextEntry;
+  if (entry->nextEntry)
+    entry->nextEntry->prevEntry = entry->prevEntry;
+
+  client->clientLoopEntry = NULL;
+  entry->client = NULL;
+  if (loop->inRun) {
+    entry->nextFree = loop->graveyard;
+    loop->graveyard = entry;
+  } else
+    free(entry);
+}
+
+rfbBool
+YieldToClientLoop(rfbClient* client)
+{
+  rfbClientLoopEntry *entry = (rfbClientLoopEntry *)client->clientLoopEntry;
+
+  if (!entry || !entry->active || entry->blocking || entry->loop->running != entry)
+    return FALSE;
+  entry->inMessage = TRUE;
+  swapcontext(&entry->context, &entry->caller);
+  entry->inMessage = FALSE;
+  return TRUE;
+}
+
+void
+LeaveClientLoop(rfbClient* client)
+{
+  rfbClientLoopEntry *entry = (rfbClientLoopEntry *)client->clientLoopEntry;
+
+  if (entry)
+    rfbClientLoopRemove(entry->loop, client);
+}
+
+rfbClientLoop*
+rfbClientLoopCreate(rfbClientLoopClosedProc closed)
+{
+  rfbClientLoop *loop = (rfbClientLoop *)calloc(1, sizeof(rfbClientLoop));
+
+  if (!loop) {
+    rfbClientErr("rfbClientLoopCreate: out of memory\n");
+    return NULL;
+  }
+  loop->epollFd = epoll_create1(EPOLL_CLOEXEC);
+  if (loop->epollFd < 0) {
+    rfbClientErr("epoll_create1 (%d: %s)\n", errno, strerror(errno));
+    free(loop);
+    return NULL;
+  }
+  loop->Closed = closed;
+  return loop;
+}
+
+/*
+ * Only plain connections qualify, as for pipelineReceive: data TLS or SASL
+ * already decrypted would go unnoticed by epoll.
+ */
+
+rfbBool
+rfbClientLoopAdd(rfbClientLoop* loop, rfbClient* client)
+{
+  rfbClientLoopEntry *entry;
+  struct epoll_event event;
+
+  if (client->clientLoopEntry || client->serverPort == -1 ||
+      client->sock == RFB_INVALID_SOCKET || client->receiveQueue) {
+    rfbClientErr("rfbClientLoopAdd: client is not connected or already served otherwise\n");
+    return FALSE;
+  }
+  if (client->tlsSession
+#ifdef LIBVNCSERVER_HAVE_SASL
+      || client->saslconn
+#endif
+      ) {
+    rfbClientErr("rfbClientLoopAdd: can not serve encrypted connections\n");
+    return FALSE;
+  }
+  if (!SetNonBlocking(client->sock))
+    return FALSE;
+
+  entry = (rfbClientLoopEntry *)calloc(1, sizeof(rfbClientLoopEntry));
+  if (!entry) {
+    rfbClientErr("rfbClientLoopAdd: out of memory\n");
+    return FALSE;
+  }
+  entry->stack = mmap(NULL, STACK_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (entry->stack == MAP_FAILED) {
+    rfbClientErr("rfbClientLoopAdd: can not allocate stack (%d: %s)\n", errno, strerror(errno));
+    free(entry);
+    return FALSE;
+  }
+  /* a guard page at the end the stack grows to */
+  mprotect(entry->stack, sysconf(_SC_PAGESIZE), PROT_NONE);
+
+  getcontext(&entry->context);
+  entry->context.uc_stack.ss_sp = entry->stack;
+  entry->context.uc_stack.ss_size = STACK_SIZE;
+  entry->context.uc_link = NULL;
+  makecontext(&entry->context, (void (*)(void))RunClient, 2,
+              (unsigned int)((uintptr_t)entry >> 16 >> 16),
+              (unsigned int)(uintptr_t)entry);
+
+  entry->loop = loop;
+  entry->client = client;
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.ptr = entry;
+  if (epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, client->sock, &event) != 0) {
+    rfbClientErr("epoll_ctl (%d: %s)\n", errno, strerror(errno));
+    munmap(entry->stack, STACK_SIZE);
+    free(entry);
+    return FALSE;
+  }
+
+  entry->nextEntry = loop->entries;
+  if (loop->entries)
+    loop->entries->prevEntry = entry;
+  loop->entries = entry;
+  client->clientLoopEntry = entry;
+
+  /* what the handshake read ahead will not wake epoll */
+  if (client->buffered > 0)
+    Enqueue(&loop->ready, entry);
+  return TRUE;
+}
+
+void
+rfbClientLoopRemove(rfbClientLoop* loop, rfbClient* client)
+{
+  rfbClientLoopEntry *entry = (rfbClientLoopEntry *)client->clientLoopEntry;
+
+  if (!entry || entry->loop != loop)
+    return;
+  if (entry->active) {
+    /* from its own callbacks, once the message is handled */
+    if (!entry->removed) {
+      entry->removed = TRUE;
+      entry->nextDetach = loop->detach;
+      loop->detach = entry;
+    }
+    return;
+  }
+  Detach(entry);
+}
+
+int
+rfbClientLoopRun(rfbClientLoop* loop, int timeout)
+{
+  struct epoll_event events[EVENTS_PER_WAIT];
+  rfbClientLoopEntry *entry;
+  int n, i, ready = 0, served = 0;
+  unsigned long now;
+
+  if (loop->ready.first)
+    timeout = 0;
+  else if (loop->timed.first) {
+    long wait = (long)(loop->timed.first->retryAt - Now());
+    if (wait < 0)
+      wait = 0;
+    if (timeout < 0 || wait < timeout)
+      timeout = (int)wait;
+  }
+
+  n = epoll_wait(loop->epollFd, events, EVENTS_PER_WAIT, timeout);
+  if (n < 0) {
+    if (errno != EINTR) {
+      rfbClientErr("epoll_wait (%d: %s)\n", errno, strerror(errno));
+      return -1;
+    }
+    n = 0;
+  }
+
+  loop->inRun = TRUE;
+
+  for (i = 0; i < n; i++) {
+    entry = (rfbClientLoopEntry *)events[i].data.ptr;
+    if (entry->removed)
+      continue;
+    Resume(entry);
+    served++;
+  }
+
+  /* one message for each client that was ready, then it is the others' turn */
+  for (entry = loop->ready.first; entry; entry = entry->next)
+    ready++;
+  while (ready-- > 0 && (entry = loop->ready.first)) {
+    Resume(entry);
+    served++;
+  }
+
+  now = Now();
+  while ((entry = loop->timed.first) && (long)(entry->retryAt - now) <= 0) {
+    Resume(entry);
+    served++;
+  }
+
+  while ((entry = loop->detach)) {
+    rfbClient *client = entry->client;
+    loop->detach = entry->nextDetach;
+    if (!client)
+      continue;
+    Detach(entry);
+    if (entry->closed && loop->Closed)
+      loop->Closed(loop, client);
+  }
+
+  loop->inRun = FALSE;
+  while ((entry = loop->graveyard)) {
+    loop->graveyard = entry->nextFree;
+    free(entry);
+  }
+  return served;
+}
+
+void
+rfbClientLoopDestroy(rfbClientLoop* loop)
+{
+  if (!loop)
+    return;
+  while (loop->entries)
+    Detach(loop->entries);
+  close(loop->epollFd);
+  free(loop);
+}
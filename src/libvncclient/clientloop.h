@@ -0,0 +1,40 @@
+#ifndef RFBCLIENTLOOP_H
+#define RFBCLIENTLOOP_H
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#ifdef LIBVNCSERVER_WITH_CLIENT_LOOP
+
+#include <rfb/rfbclient.h>
+
+/*
+ * Called by the read loops instead of waiting for the socket. Suspends the
+ * message a client of an rfbClientLoop is in the middle of and returns TRUE
+ * once the loop resumes it, or returns FALSE right away if the client is
+ * not running on its loop stack.
+ */
+rfbBool YieldToClientLoop(rfbClient* client);
+
+/*
+ * Remove client from the loop it was added to, if any.
+ */
+void LeaveClientLoop(rfbClient* client);
+
+#endif /* LIBVNCSERVER_WITH_CLIENT_LOOP */
+
+#endif /* RFBCLIENTLOOP_H */
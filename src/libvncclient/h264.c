@@ -0,0 +1,280 @@
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/*
+ * h264.c - handle H.264 encoding using FFmpeg's libavcodec.
+ *
+ * We keep a single decoder context.  It belongs to the rectangle it was
+ * opened for; a rectangle of different geometry or one with a reset flag
+ * set starts a new context.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <rfb/rfbclient.h>
+#include "h264.h"
+
+#include <libavcodec/avcodec.h>
+#include <libswscale/swscale.h>
+
+/* sanity limit for the size of one encoded frame */
+#define H264_MAX_FRAME_SIZE (64 * 1024 * 1024)
+
+typedef struct {
+  AVCodecContext *ctx;
+  AVFrame *frame;
+  AVPacket *pkt;
+  struct SwsContext *sws;
+  int x, y, w, h;         /* rectangle the decoder context belongs to */
+  uint8_t *buf;           /* encoded data, padded as libavcodec wants it */
+  int bufSize;
+} rfbClientH264Data;
+
+/*
+ * Find the libswscale pixel format matching the client's pixel format,
+ * AV_PIX_FMT_NONE if there is none.
+ */
+
+static enum AVPixelFormat
+H264DestFormat(const rfbPixelFormat *pf)
+{
+  if (!pf->trueColour)
+    return AV_PIX_FMT_NONE;
+
+  if (pf->bitsPerPixel == 32 && pf->redMax == 255 &&
+      pf->greenMax == 255 && pf->blueMax == 255 &&
+      pf->redShift % 8 == 0 && pf->greenShift % 8 == 0 &&
+      pf->blueShift % 8 == 0) {
+    /* byte offset of each component in memory */
+    int r = pf->bigEndian ? 3 - pf->redShift / 8 : pf->redShift / 8;
+    int g = pf->bigEndian ? 3 - pf->greenShift / 8 : pf->greenShift / 8;
+    int b = pf->bigEndian ? 3 - pf->blueShift / 8 : pf->blueShift / 8;
+
+    if (r == 0 && g == 1 && b == 2)
+      return AV_PIX_FMT_RGB0;
+    if (b == 0 && g == 1 && r == 2)
+      return AV_PIX_FMT_BGR0;
+    if (r == 1 && g == 2 && b == 3)
+      return AV_PIX_FMT_0RGB;
+    if (b == 1 && g == 2 && r == 3)
+      return AV_PIX_FMT_0BGR;
+    return AV_PIX_FMT_NONE;
+  }
+
+  if (pf->bitsPerPixel == 16 && pf->redMax == 31 && pf->blueMax == 31) {
+    if (pf->greenMax == 63 && pf->greenShift == 5) {
+      if (pf->redShift == 11 && pf->blueShift == 0)
+        return pf->bigEndian ? AV_PIX_FMT_RGB565BE : AV_PIX_FMT_RGB565LE;
+      if (pf->redShift == 0 && pf->blueShift == 11)
+        return pf->bigEndian ? AV_PIX_FMT_BGR565BE : AV_PIX_FMT_BGR565LE;
+    }
+    if (pf->greenMax == 31 && pf->greenShift == 5) {
+      if (pf->redShift == 10 && pf->blueShift == 0)
+        return pf->bigEndian ? AV_PIX_FMT_RGB555BE : AV_PIX_FMT_RGB555LE;
+      if (pf->redShift == 0 && pf->blueShift == 10)
+        return pf->bigEndian ? AV_PIX_FMT_BGR555BE : AV_PIX_FMT_BGR555LE;
+    }
+  }
+
+  /* the BGR233 format vncviewer uses for 8 bit */
+  if (pf->bitsPerPixel == 8 && pf->redMax == 7 && pf->greenMax == 7 &&
+      pf->blueMax == 3 && pf->redShift == 0 && pf->greenShift == 3 &&
+      pf->blueShift == 6)
+    return AV_PIX_FMT_BGR8;
+
+  return AV_PIX_FMT_NONE;
+}
+
+static void
+H264CloseDecoder(rfbClientH264Data *d)
+{
+  avcodec_free_context(&d->ctx);
+  av_frame_free(&d->frame);
+  av_packet_free(&d->pkt);
+}
+
+void
+FreeH264(rfbClient* client)
+{
+  rfbClientH264Data *d = (rfbClientH264Data *)client->h264Data;
+
+  if (!d)
+    return;
+  H264CloseDecoder(d);
+  if (d->sws)
+    sws_freeContext(d->sws);
+  free(d->buf);
+  free(d);
+  client->h264Data = NULL;
+}
+
+static rfbBool
+H264OpenDecoder(rfbClientH264Data *d, int rx, int ry, int rw, int rh)
+{
+  const AVCodec *codec;
+
+  H264CloseDecoder(d);
+
+  codec = avcodec_find_decoder(AV_CODEC_ID_H264);
+  if (!codec) {
+    rfbClientErr("H.264: no decoder available\n");
+    return FALSE;
+  }
+  d->ctx = avcodec_alloc_context3(codec);
+  if (!d->ctx) {
+    rfbClientErr("H.264: could not allocate decoder context\n");
+    return FALSE;
+  }
+  /* output every frame as soon as it is decoded */
+  d->ctx->flags |= AV_CODEC_FLAG_LOW_DELAY;
+  if (avcodec_open2(d->ctx, codec, NULL) < 0) {
+    rfbClientErr("H.264: could not open decoder\n");
+    H264CloseDecoder(d);
+    return FALSE;
+  }
+  d->frame = av_frame_alloc();
+  d->pkt = av_packet_alloc();
+  if (!d->frame || !d->pkt) {
+    rfbClientErr("H.264: could not allocate frame\n");
+    H264CloseDecoder(d);
+    return FALSE;
+  }
+
+  d->x = rx;
+  d->y = ry;
+  d->w = rw;
+  d->h = rh;
+  return TRUE;
+}
+
+/*
+ * Convert a decoded picture to the client's pixel format, writing it to
+ * the rectangle's place in the framebuffer.  The picture may be larger
+ * than the rectangle because H.264 needs even dimensions.
+ */
+
+static rfbBool
+H264WriteFrame(rfbClient* client, rfbClientH264Data *d, int rx, int ry, int rw, int rh)
+{
+  enum AVPixelFormat dstFormat = H264DestFormat(&client->format);
+  int bytesPerPixel = client->format.bitsPerPixel / 8;
+  uint8_t *dst[4] = { NULL, NULL, NULL, NULL };
+  int dstStride[4] = { 0, 0, 0, 0 };
+
+  if (dstFormat == AV_PIX_FMT_NONE) {
+    rfbClientLog("H.264: unsupported client pixel format\n");
+    return FALSE;
+  }
+  if (d->frame->width < rw || d->frame->height < rh) {
+    rfbClientLog("H.264: decoded picture %dx%d smaller than rect %dx%d\n",
+                 d->frame->width, d->frame->height, rw, rh);
+    return FALSE;
+  }
+  if (client->frameBuffer == NULL)
+    return TRUE;
+
+  d->sws = sws_getCachedContext(d->sws, rw, rh, (enum AVPixelFormat)d->frame->format,
+                                rw, rh, dstFormat, SWS_POINT, NULL, NULL, NULL);
+  if (!d->sws) {
+    rfbClientErr("H.264: could not set up colour conversion\n");
+    return FALSE;
+  }
+
+  dst[0] = (uint8_t *)client->frameBuffer + (ry * client->width + rx) * bytesPerPixel;
+  dstStride[0] = client->width * bytesPerPixel;
+  sws_scale(d->sws, (const uint8_t * const *)d->frame->data, d->frame->linesize,
+            0, rh, dst, dstStride);
+  return TRUE;
+}
+
+rfbBool
+HandleH264(rfbClient* client, int rx, int ry, int rw, int rh)
+{
+  rfbH264Header hdr;
+  rfbClientH264Data *d = (rfbClientH264Data *)client->h264Data;
+  uint32_t length, flags;
+  int ret;
+
+  if (!ReadFromRFBServer(client, (char *)&hdr, sz_rfbH264Header))
+    return FALSE;
+
+  length = rfbClientSwap32IfLE(hdr.length);
+  flags = rfbClientSwap32IfLE(hdr.flags);
+
+  if (length > H264_MAX_FRAME_SIZE) {
+    rfbClientLog("H.264: frame of %u bytes too large\n", length);
+    return FALSE;
+  }
+
+  if (!d) {
+    d = (rfbClientH264Data *)calloc(1, sizeof(rfbClientH264Data));
+    if (!d) {
+      rfbClientErr("H.264: out of memory\n");
+      return FALSE;
+    }
+    client->h264Data = d;
+  }
+
+  if (flags & (rfbH264FlagResetContext | rfbH264FlagResetAllContexts))
+    H264CloseDecoder(d);
+
+  if (length == 0)
+    return TRUE;
+
+  if ((int)length + AV_INPUT_BUFFER_PADDING_SIZE > d->bufSize) {
+    uint8_t *newBuf = realloc(d->buf, length + AV_INPUT_BUFFER_PADDING_SIZE);
+    if (!newBuf) {
+      rfbClientErr("H.264: out of memory\n");
+      return FALSE;
+    }
+    d->buf = newBuf;
+    d->bufSize = length + AV_INPUT_BUFFER_PADDING_SIZE;
+  }
+  if (!ReadFromRFBServer(client, (char *)d->buf, length))
+    return FALSE;
+  memset(d->buf + length, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+
+  if (!d->ctx || d->x != rx || d->y != ry || d->w != rw || d->h != rh) {
+    if (!H264OpenDecoder(d, rx, ry, rw, rh))
+      return FALSE;
+  }
+
+  d->pkt->data = d->buf;
+  d->pkt->size = length;
+  if (avcodec_send_packet(d->ctx, d->pkt) < 0) {
+    rfbClientLog("H.264: error decoding frame, resetting decoder\n");
+    H264CloseDecoder(d);
+    return TRUE;
+  }
+
+  for (;;) {
+    ret = avcodec_receive_frame(d->ctx, d->frame);
+    if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+      break;
+    if (ret < 0) {
+      rfbClientLog("H.264: error decoding frame, resetting decoder\n");
+      H264CloseDecoder(d);
+      return TRUE;
+    }
+    ret = H264WriteFrame(client, d, rx, ry, rw, rh);
+    av_frame_unref(d->frame);
+    if (!ret)
+      return FALSE;
+  }
+
+  return TRUE;
+}
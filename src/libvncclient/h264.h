@@ -0,0 +1,37 @@
+#ifndef RFBH264_H
+#define RFBH264_H
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#ifdef LIBVNCSERVER_HAVE_LIBAVCODEC
+
+#include <rfb/rfbclient.h>
+
+/*
+ * Decode an H.264 rectangle straight into client->frameBuffer.
+ */
+rfbBool HandleH264(rfbClient* client, int rx, int ry, int rw, int rh);
+
+/*
+ * Free the H.264 decoder state.
+ */
+void FreeH264(rfbClient* client);
+
+#endif  /* LIBVNCSERVER_HAVE_LIBAVCODEC */
+
+#endif /* RFBH264_H */
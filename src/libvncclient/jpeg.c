@@ -0,0 +1,315 @@
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/*
+ * jpeg.c - decode the JPEG rectangles of the Tight encoding straight into
+ * the framebuffer, on a small pool of threads if the client asks for it.
+ *
+ * The JPEG rectangles of an update are independent of each other, unlike
+ * the zlib streams of the other Tight subencodings. Queued rectangles are
+ * only reported to the application once they are decoded, in
+ * FlushJpegRects(), which rfbclient.c calls before anything else may
+ * touch their pixels and at the end of every update.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <rfb/rfbclient.h>
+#include "turbojpeg.h"
+#include "jpeg.h"
+
+#define JPEG_MAX_THREADS 16
+
+typedef struct rfbJpegJob {
+  struct rfbJpegJob *next;
+  uint8_t *data;
+  int len;
+  int pixelFormat;
+  int x, y, w, h;
+  rfbBool failed;
+} rfbJpegJob;
+
+typedef struct {
+  rfbClient *client;
+  int nThreads;
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+  pthread_t threads[JPEG_MAX_THREADS];
+  pthread_mutex_t mutex;
+  pthread_cond_t workCond;   /* a job was queued or the pool stops */
+  pthread_cond_t doneCond;   /* a job was finished */
+#endif
+  rfbJpegJob *jobs, *lastJob; /* the queued jobs, in update order */
+  rfbJpegJob *nextJob;        /* the first one no thread took yet */
+  int nJobs, nPending;
+  rfbBool stop;
+} rfbJpegPool;
+
+int
+JpegPixelFormat(rfbClient* client)
+{
+  rfbPixelFormat *f = &client->format;
+  int r, g, b;
+
+  if (f->bitsPerPixel != 32 || !f->trueColour ||
+      f->redMax != 255 || f->greenMax != 255 || f->blueMax != 255 ||
+      f->redShift % 8 || f->greenShift % 8 || f->blueShift % 8)
+    return -1;
+
+  /* where the channels are in memory */
+  r = f->bigEndian ? 3 - f->redShift / 8 : f->redShift / 8;
+  g = f->bigEndian ? 3 - f->greenShift / 8 : f->greenShift / 8;
+  b = f->bigEndian ? 3 - f->blueShift / 8 : f->blueShift / 8;
+
+  if (r == 0 && g == 1 && b == 2)
+    return TJPF_RGBX;
+  if (r == 2 && g == 1 && b == 0)
+    return TJPF_BGRX;
+  if (r == 1 && g == 2 && b == 3)
+    return TJPF_XRGB;
+  if (r == 3 && g == 2 && b == 1)
+    return TJPF_XBGR;
+  return -1;
+}
+
+static rfbBool
+Decode(rfbClient* client, tjhandle tj, uint8_t* data, int len, int pixelFormat,
+       int x, int y, int w, int h)
+{
+  int pitch = client->width * 4;
+
+  /* tjDecompress2() scales a bigger image down to fit into w x h */
+  if (tjDecompress2(tj, data, (unsigned long)len,
+                    client->frameBuffer + y * pitch + x * 4,
+                    w, pitch, h, pixelFormat, 0) == -1) {
+    rfbClientLog("TurboJPEG error: %s\n", tjGetErrorStr());
+    return FALSE;
+  }
+  return TRUE;
+}
+
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+static void *
+JpegThread(void *data)
+{
+  rfbJpegPool *pool = (rfbJpegPool *)data;
+  rfbJpegJob *job;
+  tjhandle tj = tjInitDecompress();
+
+  pthread_mutex_lock(&pool->mutex);
+  while (!pool->stop) {
+    if (!pool->nextJob) {
+      pthread_cond_wait(&pool->workCond, &pool->mutex);
+      continue;
+    }
+    job = pool->nextJob;
+    pool->nextJob = job->next;
+    pthread_mutex_unlock(&pool->mutex);
+
+    job->failed = !tj || !Decode(pool->client, tj, job->data, job->len, job->pixelFormat,
+                                 job->x, job->y, job->w, job->h);
+    free(job->data);
+    job->data = NULL;
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->nPending--;
+    pthread_cond_broadcast(&pool->doneCond);
+  }
+  pthread_mutex_unlock(&pool->mutex);
+
+  if (tj)
+    tjDestroy(tj);
+  return NULL;
+}
+
+static rfbJpegPool *
+StartPool(rfbClient* client)
+{
+  rfbJpegPool *pool = (rfbJpegPool *)calloc(1, sizeof(rfbJpegPool));
+  int i, n = client->jpegDecodeThreads;
+
+  if (!pool)
+    return NULL;
+  if (n > JPEG_MAX_THREADS)
+    n = JPEG_MAX_THREADS;
+
+  pool->client = client;
+  pthread_mutex_init(&pool->mutex, NULL);
+  pthread_cond_init(&pool->workCond, NULL);
+  pthread_cond_init(&pool->doneCond, NULL);
+  for (i = 0; i < n; i++)
+    if (pthread_create(&pool->threads[i], NULL, JpegThread, pool) != 0)
+      break;
+  pool->nThreads = i;
+
+  if (pool->nThreads == 0) {
+    rfbClientErr("Can't start the JPEG decoding threads\n");
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->workCond);
+    pthread_cond_destroy(&pool->doneCond);
+    free(pool);
+    return NULL;
+  }
+  return pool;
+}
+#endif
+
+rfbBool
+DecodeJpegRect(rfbClient* client, uint8_t* data, int len, int x, int y, int w, int h)
+{
+  rfbJpegPool *pool = (rfbJpegPool *)client->jpegPool;
+  rfbJpegJob *job;
+  rfbBool ok;
+
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+  if (!pool && client->jpegDecodeThreads > 1)
+    client->jpegPool = pool = StartPool(client);
+#endif
+
+  if (!pool) {
+    if (!client->tjhnd && (client->tjhnd = tjInitDecompress()) == NULL) {
+      rfbClientLog("TurboJPEG error: %s\n", tjGetErrorStr());
+      free(data);
+      return FALSE;
+    }
+    ok = Decode(client, client->tjhnd, data, len, JpegPixelFormat(client), x, y, w, h);
+    free(data);
+    return ok;
+  }
+
+  job = (rfbJpegJob *)calloc(1, sizeof(rfbJpegJob));
+  if (!job) {
+    rfbClientLog("Memory allocation error.\n");
+    free(data);
+    return FALSE;
+  }
+  job->data = data;
+  job->len = len;
+  job->pixelFormat = JpegPixelFormat(client);
+  job->x = x;
+  job->y = y;
+  job->w = w;
+  job->h = h;
+
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+  pthread_mutex_lock(&pool->mutex);
+  if (pool->lastJob)
+    pool->lastJob->next = job;
+  else
+    pool->jobs = job;
+  pool->lastJob = job;
+  if (!pool->nextJob)
+    pool->nextJob = job;
+  pool->nJobs++;
+  pool->nPending++;
+  pthread_cond_signal(&pool->workCond);
+  pthread_mutex_unlock(&pool->mutex);
+#endif
+  return TRUE;
+}
+
+int
+QueuedJpegRects(rfbClient* client)
+{
+  rfbJpegPool *pool = (rfbJpegPool *)client->jpegPool;
+
+  return pool ? pool->nJobs : 0;
+}
+
+rfbBool
+SyncJpegRects(rfbClient* client, rfbFramebufferUpdateRectHeader* rect)
+{
+  rfbJpegPool *pool = (rfbJpegPool *)client->jpegPool;
+  rfbJpegJob *job;
+
+  if (!pool || !pool->jobs)
+    return TRUE;
+
+  /* other encodings may copy, resize or read back from anywhere */
+  if (rect->encoding != rfbEncodingTight)
+    return FlushJpegRects(client);
+
+  /* the jobs list is only changed by this thread */
+  for (job = pool->jobs; job; job = job->next)
+    if (rect->r.x < job->x + job->w && job->x < rect->r.x + rect->r.w &&
+        rect->r.y < job->y + job->h && job->y < rect->r.y + rect->r.h)
+      return FlushJpegRects(client);
+  return TRUE;
+}
+
+rfbBool
+FlushJpegRects(rfbClient* client)
+{
+  rfbJpegPool *pool = (rfbJpegPool *)client->jpegPool;
+  rfbJpegJob *job, *next;
+  rfbBool ok = TRUE;
+
+  if (!pool || !pool->jobs)
+    return TRUE;
+
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+  pthread_mutex_lock(&pool->mutex);
+  while (pool->nPending > 0)
+    pthread_cond_wait(&pool->doneCond, &pool->mutex);
+  job = pool->jobs;
+  pool->jobs = pool->lastJob = pool->nextJob = NULL;
+  pool->nJobs = 0;
+  pthread_mutex_unlock(&pool->mutex);
+#endif
+
+  for (; job; job = next) {
+    next = job->next;
+    if (job->failed)
+      ok = FALSE;
+    else if (ok)
+      client->GotFrameBufferUpdate(client, job->x, job->y, job->w, job->h);
+    free(job);
+  }
+  return ok;
+}
+
+void
+FreeJpeg(rfbClient* client)
+{
+  rfbJpegPool *pool = (rfbJpegPool *)client->jpegPool;
+  rfbJpegJob *job, *next;
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+  int i;
+#endif
+
+  if (!pool)
+    return;
+
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+  pthread_mutex_lock(&pool->mutex);
+  pool->stop = TRUE;
+  pthread_cond_broadcast(&pool->workCond);
+  pthread_mutex_unlock(&pool->mutex);
+  for (i = 0; i < pool->nThreads; i++)
+    pthread_join(pool->threads[i], NULL);
+  pthread_mutex_destroy(&pool->mutex);
+  pthread_cond_destroy(&pool->workCond);
+  pthread_cond_destroy(&pool->doneCond);
+#endif
+
+  for (job = pool->jobs; job; job = next) {
+    next = job->next;
+    free(job->data);
+    free(job);
+  }
+  free(pool);
+  client->jpegPool = NULL;
+}
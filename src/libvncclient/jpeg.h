@@ -0,0 +1,68 @@
+#ifndef RFBJPEG_H
+#define RFBJPEG_H
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <rfb/rfbclient.h>
+
+#ifdef LIBVNCSERVER_HAVE_LIBJPEG
+
+/*
+ * The TurboJPEG pixel format matching client->format, or -1 if JPEG
+ * rectangles can't be decoded straight into the framebuffer.
+ */
+int JpegPixelFormat(rfbClient* client);
+
+/*
+ * Decode a JPEG rectangle into client->frameBuffer, which has to be in a
+ * format JpegPixelFormat() accepts. With client->jpegDecodeThreads > 1 it
+ * is only queued for the decoding threads. Takes over data.
+ */
+rfbBool DecodeJpegRect(rfbClient* client, uint8_t* data, int len, int x, int y, int w, int h);
+
+/*
+ * The number of JPEG rectangles queued since the last FlushJpegRects().
+ */
+int QueuedJpegRects(rfbClient* client);
+
+/*
+ * Wait for the queued JPEG rectangles if the given rectangle of the update
+ * might touch their pixels.
+ */
+rfbBool SyncJpegRects(rfbClient* client, rfbFramebufferUpdateRectHeader* rect);
+
+/*
+ * Wait for all queued JPEG rectangles and report them to the application
+ * with GotFrameBufferUpdate(). FALSE if one of them failed to decode.
+ */
+rfbBool FlushJpegRects(rfbClient* client);
+
+/*
+ * Stop the decoding threads.
+ */
+void FreeJpeg(rfbClient* client);
+
+#else
+
+#define QueuedJpegRects(client) 0
+#define SyncJpegRects(client, rect) TRUE
+#define FlushJpegRects(client) TRUE
+
+#endif  /* LIBVNCSERVER_HAVE_LIBJPEG */
+
+#endif /* RFBJPEG_H */
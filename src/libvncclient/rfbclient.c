@@ -64,6 +64,10 @@
 #include "minilzo.h"
 #endif
 #include "tls.h"
+#include "h264.h"
+#include "jpeg.h"
+#include "simd.h"
+#include "vncrec.h"
 
 #define MAX_TEXTCHAT_SIZE 10485760 /* 10MB */
 
@@ -295,8 +299,7 @@ ConnectToRFBServer(rfbClient* client,const char *hostname, int port)
 {
   if (client->serverPort==-1) {
     /* serverHost is a file recorded by vncrec. */
-    const char* magic="vncLog0.0";
-    char buffer[10];
+    char buffer[VNCREC_MAGIC_SIZE];
     rfbVNCRec* rec = (rfbVNCRec*)malloc(sizeof(rfbVNCRec));
     if(!rec) {
         rfbClientLog("Could not allocate rfbVNCRec memory\n");
@@ -307,7 +310,8 @@ ConnectToRFBServer(rfbClient* client,const char *hostname, int port)
     rec->file = fopen(client->serverHost,"rb");
     rec->tv.tv_sec = 0;
     rec->readTimestamp = FALSE;
-    rec->doNotSleep = FALSE;
+    rec->doNotSleep = client->vncRecDoNotSleep;
+    rec->indexed = NULL;
     
     if (!rec->file) {
       rfbClientLog("Could not open %s.\n",client->serverHost);
@@ -315,9 +319,16 @@ ConnectToRFBServer(rfbClient* client,const char *hostname, int port)
     }
     setbuf(rec->file,NULL);
 
-    if (fread(buffer,1,strlen(magic),rec->file) != strlen(magic) || strncmp(buffer,magic,strlen(magic))) {
+    if (fread(buffer,1,VNCREC_MAGIC_SIZE,rec->file) != VNCREC_MAGIC_SIZE ||
+        (strncmp(buffer,VNCREC_MAGIC,VNCREC_MAGIC_SIZE) &&
+         strncmp(buffer,VNCREC_INDEXED_MAGIC,VNCREC_MAGIC_SIZE))) {
       rfbClientLog("File %s was not recorded by vncrec.\n",client->serverHost);
       fclose(rec->file);
+      rec->file = NULL;
+      return FALSE;
+    }
+    if (!strncmp(buffer,VNCREC_INDEXED_MAGIC,VNCREC_MAGIC_SIZE) && !OpenIndexedRecording(client)) {
+      rfbClientLog("Could not read the index of %s.\n",client->serverHost);
       return FALSE;
     }
     client->sock = RFB_INVALID_SOCKET;
@@ -406,6 +417,7 @@ rfbBool ConnectToRFBRepeater(rfbClient* client,const char *repeaterHost, int rep
 
 extern void rfbClientEncryptBytes(unsigned char* bytes, char* passwd);
 extern void rfbClientEncryptBytes2(unsigned char *where, const int length, unsigned char *key);
+extern void rfbClientCopyRectangle(rfbClient* client, const uint8_t* buffer, int x, int y, int w, int h);
 
 static void
 ReadReason(rfbClient* client)
@@ -1212,6 +1224,11 @@ InitialiseRFBConnection(rfbClient* client)
   client->si.format.blueMax = rfbClientSwap16IfLE(client->si.format.blueMax);
   client->si.nameLength = rfbClientSwap32IfLE(client->si.nameLength);
 
+  /* seekable recordings have to be played in the format they were
+     recorded in, their keyframes are stored that way */
+  if (client->serverPort==-1 && client->vncRec->indexed)
+    client->format = client->si.format;
+
   if (client->si.nameLength > 1<<20) {
       rfbClientErr("Too big desktop name length sent by server: %u B > 1 MB\n", (unsigned int)client->si.nameLength);
       return FALSE;
@@ -1331,6 +1348,12 @@ SetFormatAndEncodings(rfbClient* client)
         /* There are 2 encodings used in 'ultra' */
         encs[se->nEncodings++] = rfbClientSwap32IfLE(rfbEncodingUltra);
         encs[se->nEncodings++] = rfbClientSwap32IfLE(rfbEncodingUltraZip);
+#ifdef LIBVNCSERVER_HAVE_LIBAVCODEC
+      } else if (strncasecmp(encStr,"h264",encStrLen) == 0) {
+	encs[se->nEncodings++] = rfbClientSwap32IfLE(rfbEncodingH264);
+	if (client->appData.enableJPEG)
+	  requestQualityLevel = TRUE;
+#endif
       } else if (strncasecmp(encStr,"corre",encStrLen) == 0) {
 	encs[se->nEncodings++] = rfbClientSwap32IfLE(rfbEncodingCoRRE);
       } else if (strncasecmp(encStr,"rre",encStrLen) == 0) {
@@ -1427,6 +1450,12 @@ SetFormatAndEncodings(rfbClient* client)
   if (se->nEncodings < MAX_ENCODINGS)
     encs[se->nEncodings++] = rfbClientSwap32IfLE(rfbEncodingExtDesktopSize);
 
+  /* Fence and Continuous Updates */
+  if (se->nEncodings < MAX_ENCODINGS)
+    encs[se->nEncodings++] = rfbClientSwap32IfLE(rfbEncodingFence);
+  if (se->nEncodings < MAX_ENCODINGS)
+    encs[se->nEncodings++] = rfbClientSwap32IfLE(rfbEncodingContinuousUpdates);
+
   /* Last Rect */
   if (se->nEncodings < MAX_ENCODINGS && requestLastRectEncoding)
     encs[se->nEncodings++] = rfbClientSwap32IfLE(rfbEncodingLastRect);
@@ -1653,6 +1682,139 @@ rfbBool SendXvpMsg(rfbClient* client, uint8_t version, uint8_t code)
 }
 
 
+/*
+ * SendEnableContinuousUpdates.
+ */
+
+rfbBool
+SendEnableContinuousUpdates(rfbClient* client, rfbBool enable, int x, int y, int w, int h)
+{
+  rfbEnableContinuousUpdatesMsg ecu;
+
+  if (!SupportsClient2Server(client, rfbEnableContinuousUpdates)) return FALSE;
+
+  ecu.type = rfbEnableContinuousUpdates;
+  ecu.enable = enable ? 1 : 0;
+  ecu.x = rfbClientSwap16IfLE(x);
+  ecu.y = rfbClientSwap16IfLE(y);
+  ecu.w = rfbClientSwap16IfLE(w);
+  ecu.h = rfbClientSwap16IfLE(h);
+
+  if (!WriteToRFBServer(client, (char *)&ecu, sz_rfbEnableContinuousUpdatesMsg))
+    return FALSE;
+
+  /* stopping only takes effect with the server's EndOfContinuousUpdates */
+  if (enable) {
+    client->continuousUpdatesActive = TRUE;
+    client->continuousUpdatesRect.x = x;
+    client->continuousUpdatesRect.y = y;
+    client->continuousUpdatesRect.w = w;
+    client->continuousUpdatesRect.h = h;
+  }
+
+  return TRUE;
+}
+
+
+/*
+ * SendFence.
+ */
+
+rfbBool
+SendFence(rfbClient* client, uint32_t flags, const char *data, int len)
+{
+  char buf[sz_rfbFenceMsg + rfbFenceMaxPayload];
+  rfbFenceMsg f;
+
+  if (!SupportsClient2Server(client, rfbFence)) return FALSE;
+
+  if (len < 0 || len > rfbFenceMaxPayload) {
+    rfbClientLog("Fence payload of %d bytes is too large\n", len);
+    return FALSE;
+  }
+
+  memset(&f, 0, sizeof(f));
+  f.type = rfbFence;
+  f.flags = rfbClientSwap32IfLE(flags);
+  f.length = len;
+
+  /* send header and payload in one go */
+  memcpy(buf, &f, sz_rfbFenceMsg);
+  if (len > 0)
+    memcpy(buf + sz_rfbFenceMsg, data, len);
+
+  return WriteToRFBServer(client, buf, sz_rfbFenceMsg + len);
+}
+
+
+/*
+ * Latency probes are fences carrying the time they were sent, so several
+ * can be in flight and nothing needs to be remembered about them.
+ */
+
+#if !defined LIBVNCSERVER_HAVE_GETTIMEOFDAY && defined WIN32
+/* also for vncrec.c and sockets.c, see vncrec.h; since the epoch like
+   the real one, so that times do not jump back at midnight */
+void gettimeofday(struct timeval* tv,char* dummy)
+{
+   FILETIME ft;
+   ULARGE_INTEGER t;
+   GetSystemTimeAsFileTime(&ft);
+   t.LowPart=ft.dwLowDateTime;
+   t.HighPart=ft.dwHighDateTime;
+   /* 100ns units since 1601 */
+   t.QuadPart=t.QuadPart/10-11644473600000000ULL;
+   tv->tv_sec=(long)(t.QuadPart/1000000);
+   tv->tv_usec=(long)(t.QuadPart%1000000);
+}
+#endif
+
+static const char latencyProbeTag[4] = { 'L', 'V', 'C', 'p' };
+#define sz_latencyProbe (sizeof(latencyProbeTag) + 2 * sizeof(uint32_t))
+
+rfbBool
+SendLatencyProbe(rfbClient* client)
+{
+  char probe[sz_latencyProbe];
+  struct timeval now;
+  uint32_t sent[2];
+
+  gettimeofday(&now, NULL);
+  sent[0] = (uint32_t)now.tv_sec;
+  sent[1] = (uint32_t)now.tv_usec;
+  memcpy(probe, latencyProbeTag, sizeof(latencyProbeTag));
+  memcpy(probe + sizeof(latencyProbeTag), sent, sizeof(sent));
+
+  /* BlockBefore: answered only after everything sent before it was handled */
+  return SendFence(client, rfbFenceFlagRequest | rfbFenceFlagBlockBefore,
+		   probe, sz_latencyProbe);
+}
+
+/* returns FALSE if the fence response is not one of our probes */
+static rfbBool
+HandleLatencyProbe(rfbClient* client, const char *data, int len)
+{
+  struct timeval now;
+  uint32_t sent[2];
+  long usec;
+
+  if (len != sz_latencyProbe || memcmp(data, latencyProbeTag, sizeof(latencyProbeTag)) != 0)
+    return FALSE;
+
+  memcpy(sent, data + sizeof(latencyProbeTag), sizeof(sent));
+  gettimeofday(&now, NULL);
+  usec = (long)((uint32_t)now.tv_sec - sent[0]) * 1000000L + (long)now.tv_usec - (long)sent[1];
+  if (usec < 0)
+    usec = 0;
+
+  client->latency = (unsigned int)usec;
+  if (client->GotLatency)
+    client->GotLatency(client, client->latency);
+
+  return TRUE;
+}
+
+
 /*
  * SendPointerEvent.
  */
@@ -1679,7 +1841,7 @@ SendPointerEvent(rfbClient* client,int x, int y, int buttonMask)
  * Resize client
  */
 
-static rfbBool
+rfbBool
 ResizeClientBuffer(rfbClient* client, int width, int height)
 {
   client->width = width;
@@ -2045,6 +2207,73 @@ void rfbClientGetUpdateRect(rfbClient *client, rfbRectangle *rect, rfbBool *isMa
     *isManagedByLib = client->isUpdateRectManagedByLib;
 }
 
+/*
+ * The decoding buffers are allocated when the first rectangle needing them
+ * arrives, so that a client only pays for the encodings the server uses.
+ */
+
+/* biggest Hextile tile payload: 255 subrects of a 32 bpp colour and x/y, w/h */
+#define HEXTILE_BUFFER_SIZE (255 * (4 + 2))
+
+static rfbBool
+AllocateBuffer(rfbClient* client, int size)
+{
+  char *buffer;
+
+  if (client->bufferSize >= size)
+    return TRUE;
+  buffer = realloc(client->buffer, size);
+  if (!buffer) {
+    rfbClientErr("Could not allocate %d bytes decoding buffer\n", size);
+    return FALSE;
+  }
+  client->buffer = buffer;
+  client->bufferSize = size;
+  return TRUE;
+}
+
+static rfbBool
+AllocateDecodeBuffers(rfbClient* client, int32_t encoding)
+{
+  switch (encoding) {
+  case rfbEncodingHextile:
+    return AllocateBuffer(client, HEXTILE_BUFFER_SIZE);
+  case rfbEncodingCoRRE:
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+  case rfbEncodingZlib:
+  case rfbEncodingZRLE:
+#endif
+    return AllocateBuffer(client, RFB_BUFFER_SIZE);
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+  case rfbEncodingZYWRLE:
+    if (!client->zlib_buffer && !(client->zlib_buffer = malloc(ZLIB_BUFFER_SIZE))) {
+      rfbClientErr("Could not allocate ZYWRLE buffer\n");
+      return FALSE;
+    }
+    return AllocateBuffer(client, RFB_BUFFER_SIZE);
+#ifdef LIBVNCSERVER_HAVE_LIBJPEG
+  case rfbEncodingTight:
+    if (!client->zlib_buffer)
+      client->zlib_buffer = malloc(ZLIB_BUFFER_SIZE);
+    if (!client->tightPalette)
+      client->tightPalette = malloc(TIGHT_PALETTE_SIZE);
+    if (!client->tightPrevRow)
+      client->tightPrevRow = malloc(TIGHT_PREV_ROW_SIZE);
+    if (!client->zlibStream)
+      client->zlibStream = calloc(4, sizeof(z_stream));
+    if (!client->zlib_buffer || !client->tightPalette ||
+	!client->tightPrevRow || !client->zlibStream) {
+      rfbClientErr("Could not allocate Tight buffers\n");
+      return FALSE;
+    }
+    return AllocateBuffer(client, RFB_BUFFER_SIZE);
+#endif
+#endif
+  default:
+    return TRUE;
+  }
+}
+
 /*
  * HandleRFBServerMessage.
  */
@@ -2056,6 +2285,7 @@ HandleRFBServerMessage(rfbClient* client)
 
   if (client->serverPort==-1)
     client->vncRec->readTimestamp = TRUE;
+  RecordMessageStart(client);
   if (!ReadFromRFBServer(client, (char *)&msg, 1))
     return FALSE;
 
@@ -2095,6 +2325,7 @@ HandleRFBServerMessage(rfbClient* client)
     rfbFramebufferUpdateRectHeader rect;
     int linesToRead;
     int bytesPerLine;
+    int queuedJpegRects;
     int i;
 
     if (!ReadFromRFBServer(client, ((char *)&msg.fu) + 1,
@@ -2116,6 +2347,10 @@ HandleRFBServerMessage(rfbClient* client)
       rect.r.w = rfbClientSwap16IfLE(rect.r.w);
       rect.r.h = rfbClientSwap16IfLE(rect.r.h);
 
+      /* JPEG rectangles still being decoded have to be in place before
+         this one may touch their pixels */
+      if (!SyncJpegRects(client, &rect))
+	return FALSE;
 
       if (rect.encoding == rfbEncodingXCursor ||
 	  rect.encoding == rfbEncodingRichCursor) {
@@ -2272,15 +2507,38 @@ HandleRFBServerMessage(rfbClient* client)
         client->SoftCursorLockArea(client, rect.r.x, rect.r.y, rect.r.w, rect.r.h);
       }
 
+      if (!AllocateDecodeBuffers(client, rect.encoding))
+        return FALSE;
+
+      queuedJpegRects = QueuedJpegRects(client);
+      RecordRectStart(client, &rect);
+
       switch (rect.encoding) {
 
       case rfbEncodingRaw: {
 	int y=rect.r.y, h=rect.r.h;
 
 	bytesPerLine = rect.r.w * client->format.bitsPerPixel / 8;
+
+	/* with the default GotBitmap, the pixels are already in the
+	   framebuffer's format: read them right into place */
+	if (client->GotBitmap == rfbClientCopyRectangle && client->frameBuffer && bytesPerLine &&
+	    (client->format.bitsPerPixel == 8 || client->format.bitsPerPixel == 16 ||
+	     client->format.bitsPerPixel == 32)) {
+	  int stride = client->width * client->format.bitsPerPixel / 8;
+
+	  if (!ReadRowsFromRFBServer(client, (char *)client->frameBuffer + y * stride +
+				     rect.r.x * client->format.bitsPerPixel / 8,
+				     bytesPerLine, stride, h))
+	    return FALSE;
+	  break;
+	}
+
 	/* RealVNC 4.x-5.x on OSX can induce bytesPerLine==0, 
 	   usually during GPU accel. */
 	/* Regardless of cause, do not divide by zero. */
+	if (!AllocateBuffer(client, RFB_BUFFER_SIZE))
+	  return FALSE;
 	linesToRead = bytesPerLine ? (RFB_BUFFER_SIZE / bytesPerLine) : 0;
 
 	while (linesToRead && h > 0) {
@@ -2542,6 +2800,13 @@ HandleRFBServerMessage(rfbClient* client)
 
 #endif
 
+#ifdef LIBVNCSERVER_HAVE_LIBAVCODEC
+      case rfbEncodingH264:
+	if (!HandleH264(client, rect.r.x,rect.r.y,rect.r.w,rect.r.h))
+	  return FALSE;
+	break;
+#endif
+
       case rfbEncodingQemuExtendedKeyEvent:
         SetClient2Server(client, rfbQemuEvent);
         break;
@@ -2566,10 +2831,29 @@ HandleRFBServerMessage(rfbClient* client)
       /* Now we may discard "soft cursor locks". */
       client->SoftCursorUnlockScreen(client);
 
-      client->GotFrameBufferUpdate(client, rect.r.x, rect.r.y, rect.r.w, rect.r.h);
+      /* a rectangle queued for the JPEG threads is reported once decoded */
+      if (QueuedJpegRects(client) == queuedJpegRects)
+        client->GotFrameBufferUpdate(client, rect.r.x, rect.r.y, rect.r.w, rect.r.h);
+
+      if (!RecordRectEnd(client, &rect))
+	return FALSE;
     }
 
-    if (!SendIncrementalFramebufferUpdateRequest(client))
+    if (!FlushJpegRects(client))
+      return FALSE;
+
+    if (client->continuousUpdatesActive) {
+      /* the server pushes updates on its own; follow resizes and
+         changes of updateRect */
+      if (client->continuousUpdatesRect.x != client->updateRect.x ||
+	  client->continuousUpdatesRect.y != client->updateRect.y ||
+	  client->continuousUpdatesRect.w != client->updateRect.w ||
+	  client->continuousUpdatesRect.h != client->updateRect.h)
+	if (!SendEnableContinuousUpdates(client, TRUE,
+					 client->updateRect.x, client->updateRect.y,
+					 client->updateRect.w, client->updateRect.h))
+	  return FALSE;
+    } else if (!SendIncrementalFramebufferUpdateRequest(client))
       return FALSE;
 
     if (client->FinishedFrameBufferUpdate)
@@ -2696,6 +2980,60 @@ HandleRFBServerMessage(rfbClient* client)
     break;
   }
 
+  case rfbEndOfContinuousUpdates:
+  {
+    rfbBool announced = SupportsClient2Server(client, rfbEnableContinuousUpdates);
+
+    SetClient2Server(client, rfbEnableContinuousUpdates);
+    SetServer2Client(client, rfbEndOfContinuousUpdates);
+
+    if (client->continuousUpdatesActive) {
+      /* continuous updates stopped, go back to asking for them */
+      client->continuousUpdatesActive = FALSE;
+      if (!SendIncrementalFramebufferUpdateRequest(client))
+	return FALSE;
+    } else if (!announced && client->continuousUpdates) {
+      /* the first one announces support */
+      if (!SendEnableContinuousUpdates(client, TRUE,
+				       client->updateRect.x, client->updateRect.y,
+				       client->updateRect.w, client->updateRect.h))
+	return FALSE;
+    }
+
+    break;
+  }
+
+  case rfbFence:
+  {
+    char data[256];
+    uint32_t flags;
+
+    if (!ReadFromRFBServer(client, ((char *)&msg) + 1,
+                           sz_rfbFenceMsg - 1))
+      return FALSE;
+    if (!ReadFromRFBServer(client, data, msg.f.length))
+      return FALSE;
+    if (msg.f.length > rfbFenceMaxPayload) {
+      rfbClientLog("Ignoring fence with too large payload (%d bytes)\n", msg.f.length);
+      break;
+    }
+
+    SetClient2Server(client, rfbFence);
+    SetServer2Client(client, rfbFence);
+
+    flags = rfbClientSwap32IfLE(msg.f.flags);
+    if (flags & rfbFenceFlagRequest) {
+      /* Messages are handled one after the other, so what BlockBefore and
+	 BlockAfter ask for holds anyway. SyncNext is not supported. */
+      flags &= rfbFenceFlagBlockBefore | rfbFenceFlagBlockAfter;
+      if (!SendFence(client, flags, data, msg.f.length))
+	return FALSE;
+    } else if (!HandleLatencyProbe(client, data, msg.f.length) && client->GotFence)
+      client->GotFence(client, flags, data, msg.f.length);
+
+    break;
+  }
+
   case rfbResizeFrameBuffer:
   {
     if (!ReadFromRFBServer(client, ((char *)&msg) + 1,
@@ -2739,6 +3077,8 @@ HandleRFBServerMessage(rfbClient* client)
     }
   }
 
+  RecordMessageEnd(client);
+
   return TRUE;
 }
 
@@ -0,0 +1,447 @@
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/*
+ * simd.c - vectorized inner loops of the ZRLE, TRLE and Hextile decoders.
+ *
+ * The implementation is picked at run time from what the CPU supports:
+ * SSE2 and SSSE3 on x86, NEON on little endian ARM64. Palette lookups
+ * keep the palette in four 16 byte tables, one per byte of the pixel, and
+ * look up 16 indices at once with a byte shuffle. CPIXELs are expanded
+ * with a byte shuffle as well, four at a time.
+ *
+ * The NEON loops are only built with the WITH_NEON CMake option, which is
+ * off until they have been run against test/simdtest.c on ARM64.
+ */
+
+#include <string.h>
+#include <rfb/rfbclient.h>
+#include "simd.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMD_X86
+#include <emmintrin.h>
+#include <tmmintrin.h>
+#define TARGET(isa) __attribute__((target(isa)))
+#endif
+
+#if defined(LIBVNCSERVER_WITH_NEON) && defined(__aarch64__) && defined(__ARM_NEON) && \
+    defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define SIMD_NEON
+#include <arm_neon.h>
+#endif
+
+#define MAX_PIXEL_OPS 4
+
+
+/*
+ * Scalar versions, doing what the decoders used to do inline.
+ */
+
+static void
+fillScalar(uint32_t *dst, int n, uint32_t colour)
+{
+  while (n-- > 0)
+    *dst++ = colour;
+}
+
+static const uint8_t *
+unpackRowScalar(uint32_t *dst, const uint8_t *src, int n, int bpp,
+                const uint32_t *palette)
+{
+  int i, shift = 8 - bpp, mask = (1 << bpp) - 1;
+
+  for (i = 0; i < n; i++) {
+    dst[i] = palette[(*src >> shift) & mask];
+    shift -= bpp;
+    if (shift < 0) {
+      shift = 8 - bpp;
+      src++;
+    }
+  }
+  if (shift < 8 - bpp)
+    src++;
+
+  return src;
+}
+
+static void
+unpackPaletteScalar(uint32_t *dst, int stride, const uint8_t *src,
+                    int w, int h, int bpp, const uint32_t *palette)
+{
+  for (; h > 0; h--, dst += stride)
+    src = unpackRowScalar(dst, src, w, bpp, palette);
+}
+
+static uint32_t
+uncompressCPixel(const uint8_t *src, int uncomp)
+{
+  uint32_t p;
+
+  memcpy(&p, src, sizeof(p));
+  if (uncomp > 0)
+    return p >> uncomp;
+  else if (uncomp < 0)
+    return p << -uncomp;
+  return p;
+}
+
+static void
+expandCPixelsScalar(uint32_t *dst, int stride, const uint8_t *src,
+                    int w, int h, int uncomp)
+{
+  int i;
+
+  for (; h > 0; h--, dst += stride)
+    for (i = 0; i < w; i++, src += 3)
+      dst[i] = uncompressCPixel(src, uncomp);
+}
+
+
+/*
+ * Tables shared by the vector versions.
+ */
+
+#if defined(SIMD_X86) || defined(SIMD_NEON)
+
+/*
+ * For 16 indices of bpp bits: a byte shuffle moving the source byte of
+ * each index into the low byte of its own 16 bit lane, and the factor
+ * that brings the index to bits 8 and up of that lane.
+ */
+static void
+spreadTables(int bpp, uint8_t spread[32], uint16_t factor[8])
+{
+  int perByte = 8 / bpp, j;
+
+  for (j = 0; j < 16; j++) {
+    spread[2 * j] = j / perByte;
+    spread[2 * j + 1] = 0x80;
+  }
+  for (j = 0; j < 8; j++)
+    factor[j] = 1 << (bpp * (j % perByte + 1));
+}
+
+/*
+ * A byte shuffle turning the CPIXELs in 16 source bytes into 4 pixels,
+ * FALSE for shifts other than 0 and 8 bits.
+ */
+static rfbBool
+expandTable(int uncomp, uint8_t table[16])
+{
+  int p, b;
+
+  if (uncomp != 0 && uncomp != 8 && uncomp != -8)
+    return FALSE;
+
+  for (p = 0; p < 4; p++)
+    for (b = 0; b < 4; b++) {
+      int from = b + uncomp / 8;
+      table[4 * p + b] = from < 0 || from > 3 ? 0x80 : 3 * p + from;
+    }
+
+  return TRUE;
+}
+
+#endif
+
+
+#ifdef SIMD_X86
+
+TARGET("sse2") static void
+fillSSE2(uint32_t *dst, int n, uint32_t colour)
+{
+  __m128i v = _mm_set1_epi32((int)colour);
+
+  for (; n >= 8; n -= 8, dst += 8) {
+    _mm_storeu_si128((__m128i *)dst, v);
+    _mm_storeu_si128((__m128i *)(dst + 4), v);
+  }
+  if (n >= 4) {
+    _mm_storeu_si128((__m128i *)dst, v);
+    n -= 4;
+    dst += 4;
+  }
+  while (n-- > 0)
+    *dst++ = colour;
+}
+
+/* the 2 * bpp source bytes of 16 indices, in the low bytes of a vector */
+TARGET("sse2") static __m128i
+loadIndexBytesSSE2(const uint8_t *src, int bpp)
+{
+  uint32_t u32;
+  uint16_t u16;
+
+  if (bpp == 4)
+    return _mm_loadl_epi64((const __m128i *)src);
+  if (bpp == 2) {
+    memcpy(&u32, src, sizeof(u32));
+    return _mm_cvtsi32_si128((int)u32);
+  }
+  memcpy(&u16, src, sizeof(u16));
+  return _mm_cvtsi32_si128(u16);
+}
+
+TARGET("ssse3") static void
+unpackPaletteSSSE3(uint32_t *dst, int stride, const uint8_t *src,
+                   int w, int h, int bpp, const uint32_t *palette)
+{
+  uint8_t spread[32];
+  uint16_t factor[8];
+  __m128i spreadLo, spreadHi, mul, mask, plane0, plane1, plane2, plane3;
+  __m128i gather, e0, e1, e2, e3;
+  int bytes = 2 * bpp, i;
+
+  spreadTables(bpp, spread, factor);
+  spreadLo = _mm_loadu_si128((const __m128i *)spread);
+  spreadHi = _mm_loadu_si128((const __m128i *)(spread + 16));
+  mul = _mm_loadu_si128((const __m128i *)factor);
+  mask = _mm_set1_epi16((1 << bpp) - 1);
+
+  /* transpose the palette into one table per pixel byte */
+  gather = _mm_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15);
+  e0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)palette), gather);
+  e1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(palette + 4)), gather);
+  e2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(palette + 8)), gather);
+  e3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(palette + 12)), gather);
+  plane0 = _mm_unpacklo_epi32(e0, e1);
+  plane2 = _mm_unpackhi_epi32(e0, e1);
+  plane1 = _mm_unpacklo_epi32(e2, e3);
+  plane3 = _mm_unpackhi_epi32(e2, e3);
+  e0 = plane0;
+  e2 = plane2;
+  plane0 = _mm_unpacklo_epi64(e0, plane1);
+  plane1 = _mm_unpackhi_epi64(e0, plane1);
+  plane2 = _mm_unpacklo_epi64(e2, plane3);
+  plane3 = _mm_unpackhi_epi64(e2, plane3);
+
+  for (; h > 0; h--, dst += stride) {
+    for (i = 0; i + 16 <= w; i += 16, src += bytes) {
+      __m128i v, lo, hi, idx, b0, b1, b2, b3, t01lo, t01hi, t23lo, t23hi;
+
+      v = loadIndexBytesSSE2(src, bpp);
+      lo = _mm_mullo_epi16(_mm_shuffle_epi8(v, spreadLo), mul);
+      hi = _mm_mullo_epi16(_mm_shuffle_epi8(v, spreadHi), mul);
+      lo = _mm_and_si128(_mm_srli_epi16(lo, 8), mask);
+      hi = _mm_and_si128(_mm_srli_epi16(hi, 8), mask);
+      idx = _mm_packus_epi16(lo, hi);
+
+      b0 = _mm_shuffle_epi8(plane0, idx);
+      b1 = _mm_shuffle_epi8(plane1, idx);
+      b2 = _mm_shuffle_epi8(plane2, idx);
+      b3 = _mm_shuffle_epi8(plane3, idx);
+      t01lo = _mm_unpacklo_epi8(b0, b1);
+      t01hi = _mm_unpackhi_epi8(b0, b1);
+      t23lo = _mm_unpacklo_epi8(b2, b3);
+      t23hi = _mm_unpackhi_epi8(b2, b3);
+      _mm_storeu_si128((__m128i *)(dst + i), _mm_unpacklo_epi16(t01lo, t23lo));
+      _mm_storeu_si128((__m128i *)(dst + i + 4), _mm_unpackhi_epi16(t01lo, t23lo));
+      _mm_storeu_si128((__m128i *)(dst + i + 8), _mm_unpacklo_epi16(t01hi, t23hi));
+      _mm_storeu_si128((__m128i *)(dst + i + 12), _mm_unpackhi_epi16(t01hi, t23hi));
+    }
+    src = unpackRowScalar(dst + i, src, w - i, bpp, palette);
+  }
+}
+
+TARGET("ssse3") static void
+expandCPixelsSSSE3(uint32_t *dst, int stride, const uint8_t *src,
+                   int w, int h, int uncomp)
+{
+  const uint8_t *end = src + 3 * w * h;
+  uint8_t table[16];
+  __m128i shuffle;
+  int i;
+
+  if (!expandTable(uncomp, table)) {
+    expandCPixelsScalar(dst, stride, src, w, h, uncomp);
+    return;
+  }
+  shuffle = _mm_loadu_si128((const __m128i *)table);
+
+  for (; h > 0; h--, dst += stride) {
+    /* a full 16 byte load has to stay inside the CPIXELs */
+    for (i = 0; i + 4 <= w && src + 16 <= end; i += 4, src += 12)
+      _mm_storeu_si128((__m128i *)(dst + i),
+                       _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)src), shuffle));
+    for (; i < w; i++, src += 3)
+      dst[i] = uncompressCPixel(src, uncomp);
+  }
+}
+
+static const rfbPixelOps sse2Ops = {
+  "sse2", fillSSE2, unpackPaletteScalar, expandCPixelsScalar
+};
+
+static const rfbPixelOps ssse3Ops = {
+  "ssse3", fillSSE2, unpackPaletteSSSE3, expandCPixelsSSSE3
+};
+
+#endif /* SIMD_X86 */
+
+
+#ifdef SIMD_NEON
+
+static void
+fillNEON(uint32_t *dst, int n, uint32_t colour)
+{
+  uint32x4_t v = vdupq_n_u32(colour);
+
+  for (; n >= 8; n -= 8, dst += 8) {
+    vst1q_u32(dst, v);
+    vst1q_u32(dst + 4, v);
+  }
+  if (n >= 4) {
+    vst1q_u32(dst, v);
+    n -= 4;
+    dst += 4;
+  }
+  while (n-- > 0)
+    *dst++ = colour;
+}
+
+/* the 2 * bpp source bytes of 16 indices, in the low bytes of a vector */
+static uint8x16_t
+loadIndexBytesNEON(const uint8_t *src, int bpp)
+{
+  uint32_t u32;
+  uint16_t u16;
+
+  if (bpp == 4)
+    return vcombine_u8(vld1_u8(src), vdup_n_u8(0));
+  if (bpp == 2) {
+    memcpy(&u32, src, sizeof(u32));
+    return vreinterpretq_u8_u32(vsetq_lane_u32(u32, vdupq_n_u32(0), 0));
+  }
+  memcpy(&u16, src, sizeof(u16));
+  return vreinterpretq_u8_u16(vsetq_lane_u16(u16, vdupq_n_u16(0), 0));
+}
+
+static void
+unpackPaletteNEON(uint32_t *dst, int stride, const uint8_t *src,
+                  int w, int h, int bpp, const uint32_t *palette)
+{
+  uint8_t spread[32];
+  uint16_t factor[8];
+  uint8x16_t spreadLo, spreadHi;
+  uint16x8_t mul, mask;
+  uint8x16x4_t planes;
+  int bytes = 2 * bpp, i;
+
+  spreadTables(bpp, spread, factor);
+  spreadLo = vld1q_u8(spread);
+  spreadHi = vld1q_u8(spread + 16);
+  mul = vld1q_u16(factor);
+  mask = vdupq_n_u16((1 << bpp) - 1);
+
+  /* one table per pixel byte */
+  planes = vld4q_u8((const uint8_t *)palette);
+
+  for (; h > 0; h--, dst += stride) {
+    for (i = 0; i + 16 <= w; i += 16, src += bytes) {
+      uint8x16_t v, idx;
+      uint16x8_t lo, hi;
+      uint8x16x4_t out;
+
+      v = loadIndexBytesNEON(src, bpp);
+      lo = vmulq_u16(vreinterpretq_u16_u8(vqtbl1q_u8(v, spreadLo)), mul);
+      hi = vmulq_u16(vreinterpretq_u16_u8(vqtbl1q_u8(v, spreadHi)), mul);
+      lo = vandq_u16(vshrq_n_u16(lo, 8), mask);
+      hi = vandq_u16(vshrq_n_u16(hi, 8), mask);
+      idx = vcombine_u8(vmovn_u16(lo), vmovn_u16(hi));
+
+      out.val[0] = vqtbl1q_u8(planes.val[0], idx);
+      out.val[1] = vqtbl1q_u8(planes.val[1], idx);
+      out.val[2] = vqtbl1q_u8(planes.val[2], idx);
+      out.val[3] = vqtbl1q_u8(planes.val[3], idx);
+      vst4q_u8((uint8_t *)(dst + i), out);
+    }
+    src = unpackRowScalar(dst + i, src, w - i, bpp, palette);
+  }
+}
+
+static void
+expandCPixelsNEON(uint32_t *dst, int stride, const uint8_t *src,
+                  int w, int h, int uncomp)
+{
+  const uint8_t *end = src + 3 * w * h;
+  uint8_t table[16];
+  uint8x16_t shuffle;
+  int i;
+
+  if (!expandTable(uncomp, table)) {
+    expandCPixelsScalar(dst, stride, src, w, h, uncomp);
+    return;
+  }
+  shuffle = vld1q_u8(table);
+
+  for (; h > 0; h--, dst += stride) {
+    /* a full 16 byte load has to stay inside the CPIXELs */
+    for (i = 0; i + 4 <= w && src + 16 <= end; i += 4, src += 12)
+      vst1q_u8((uint8_t *)(dst + i), vqtbl1q_u8(vld1q_u8(src), shuffle));
+    for (; i < w; i++, src += 3)
+      dst[i] = uncompressCPixel(src, uncomp);
+  }
+}
+
+static const rfbPixelOps neonOps = {
+  "neon", fillNEON, unpackPaletteNEON, expandCPixelsNEON
+};
+
+#endif /* SIMD_NEON */
+
+
+static const rfbPixelOps scalarOps = {
+  "scalar", fillScalar, unpackPaletteScalar, expandCPixelsScalar
+};
+
+int
+AllPixelOps(const rfbPixelOps** list, int max)
+{
+  const rfbPixelOps* all[MAX_PIXEL_OPS];
+  int n = 0, i;
+
+  all[n++] = &scalarOps;
+#ifdef SIMD_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse2"))
+    all[n++] = &sse2Ops;
+  if (__builtin_cpu_supports("ssse3"))
+    all[n++] = &ssse3Ops;
+#endif
+#ifdef SIMD_NEON
+  all[n++] = &neonOps;
+#endif
+
+  for (i = 0; i < n && i < max; i++)
+    list[i] = all[i];
+
+  return n;
+}
+
+const rfbPixelOps*
+PixelOps(void)
+{
+  static const rfbPixelOps* best = NULL;
+
+  if (best == NULL) {
+    const rfbPixelOps* all[MAX_PIXEL_OPS];
+    best = all[AllPixelOps(all, MAX_PIXEL_OPS) - 1];
+  }
+
+  return best;
+}
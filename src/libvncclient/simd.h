@@ -0,0 +1,63 @@
+#ifndef RFBSIMD_H
+#define RFBSIMD_H
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <rfb/rfbclient.h>
+
+/*
+ * The inner loops of the 32 bpp ZRLE, TRLE and Hextile decoders. Every
+ * implementation gives exactly the same result as the scalar one.
+ */
+typedef struct {
+  const char *name;
+
+  /* Set n pixels to colour. */
+  void (*fill)(uint32_t *dst, int n, uint32_t colour);
+
+  /*
+   * Fill a w x h rectangle of dst, stride pixels apart, from palette
+   * indices of bpp (1, 2 or 4) bits each, packed most significant bits
+   * first with every row starting on a new byte. palette has to have 16
+   * entries.
+   */
+  void (*unpackPalette)(uint32_t *dst, int stride, const uint8_t *src,
+                        int w, int h, int bpp, const uint32_t *palette);
+
+  /*
+   * Fill a w x h rectangle of dst, stride pixels apart, from 3 byte
+   * CPIXELs, read as 32 bit values and shifted right by uncomp bits, or
+   * left if uncomp is negative. Like the scalar decoders, this reads one
+   * byte past the last CPIXEL.
+   */
+  void (*expandCPixels)(uint32_t *dst, int stride, const uint8_t *src,
+                        int w, int h, int uncomp);
+} rfbPixelOps;
+
+/*
+ * The fastest implementation this CPU supports.
+ */
+const rfbPixelOps* PixelOps(void);
+
+/*
+ * All implementations this CPU supports, the scalar one first. Returns
+ * their number, of which at most max are stored in list.
+ */
+int AllPixelOps(const rfbPixelOps** list, int max);
+
+#endif /* RFBSIMD_H */
@@ -37,14 +37,116 @@
 #include <fcntl.h>
 #include <assert.h>
 #include <rfb/rfbclient.h>
+#ifndef WIN32
+#include <sys/uio.h>
+#endif
 #include "sockets.h"
 #include "tls.h"
 #include "sasl.h"
+#include "vncrec.h"
+#include "clientloop.h"
 
 void PrintInHex(char *buf, int len);
 
 rfbBool errorMessageOnReadFailure = TRUE;
 
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+static rfbBool ReadFromReceiveQueue(rfbClient* client, char *out, unsigned int n);
+static int WaitForReceiveQueue(rfbClient* client, unsigned int usecs);
+#endif
+static int WaitForSocket(rfbClient* client, unsigned int usecs);
+
+/*
+ * A read filling the whole receive buffer means more data was waiting:
+ * double the buffer, up to RFB_BUF_MAX_SIZE, so that busy connections need
+ * fewer system calls. If that fails, the current buffer is kept.
+ */
+
+static void
+GrowReceiveBuffer(rfbClient* client)
+{
+  char *buf;
+  int size = client->bufSize * 2;
+
+  if (size > RFB_BUF_MAX_SIZE)
+    size = RFB_BUF_MAX_SIZE;
+  if (size <= client->bufSize)
+    return;
+  buf = realloc(client->buf, size);
+  if (!buf)
+    return;
+  client->bufoutptr = buf + (client->bufoutptr - client->buf);
+  client->buf = buf;
+  client->bufSize = size;
+}
+
+/*
+ * Go back to RFB_BUF_SIZE once the receive buffer is empty, so that a
+ * burst does not keep RFB_BUF_MAX_SIZE bytes around for good.
+ */
+
+static void
+ShrinkReceiveBuffer(rfbClient* client)
+{
+  char *buf;
+
+  client->bufSmallReads = 0;
+  if (client->bufSize <= RFB_BUF_SIZE || client->buffered > 0)
+    return;
+  buf = realloc(client->buf, RFB_BUF_SIZE);
+  if (!buf)
+    return;
+  client->buf = client->bufoutptr = buf;
+  client->bufSize = RFB_BUF_SIZE;
+}
+
+/*
+ * Adapt the receive buffer to a read that brought len bytes into it:
+ * grow it if the read filled it, count the reads a small buffer would
+ * have served as well.
+ */
+
+static void
+CountReceived(rfbClient* client, int len)
+{
+  if (client->buffered == (unsigned int)client->bufSize) {
+    client->bufSmallReads = 0;
+    GrowReceiveBuffer(client);
+  } else if (len <= RFB_BUF_SIZE) {
+    client->bufSmallReads++;
+  } else {
+    client->bufSmallReads = 0;
+  }
+}
+
+/*
+ * Read up to n bytes from the socket into out and, in the same system call,
+ * whatever follows them into the (empty) receive buffer.
+ */
+
+static int
+ReadIntoAndRefill(rfbClient* client, char *out, unsigned int n)
+{
+#ifndef WIN32
+  struct iovec iov[2];
+  int i;
+
+  iov[0].iov_base = out;
+  iov[0].iov_len = n;
+  iov[1].iov_base = client->buf;
+  iov[1].iov_len = client->bufSize;
+  i = readv(client->sock, iov, 2);
+  if (i > 0 && (unsigned int)i > n) {
+    client->buffered = i - n;
+    CountReceived(client, client->buffered);
+    return n;
+  }
+  return i;
+#else
+  return read(client->sock, out, n);
+#endif
+}
+
 /*
  * ReadFromRFBServer is called whenever we want to read some data from the RFB
  * server.  It is non-trivial for two reasons:
@@ -52,15 +154,16 @@ rfbBool errorMessageOnReadFailure = TRUE;
  * 1. For efficiency it performs some intelligent buffering, avoiding invoking
  *    the read() system call too often.  For small chunks of data, it simply
  *    copies the data out of an internal buffer.  For large amounts of data it
- *    reads directly into the buffer provided by the caller.
+ *    reads directly into the buffer provided by the caller, refilling the
+ *    internal buffer in the same readv() call.
  *
  * 2. Whenever read() would block, it invokes the Xt event dispatching
  *    mechanism to process X events.  In fact, this is the only place these
  *    events are processed, as there is no XtAppMainLoop in the program.
  */
 
-rfbBool
-ReadFromRFBServer(rfbClient* client, char *out, unsigned int n)
+static rfbBool
+ReadFromServer(rfbClient* client, char *out, unsigned int n)
 {
   const int USECS_WAIT_PER_RETRY = 100000;
   int retries = 0;
@@ -82,6 +185,9 @@ ReadFromRFBServer(rfbClient* client, char *out, unsigned int n)
     rfbVNCRec* rec = client->vncRec;
     struct timeval tv;
 
+    if (rec->indexed)
+      return ReadFromIndexedRecording(client, out, n);
+
     if (rec->readTimestamp) {
       rec->readTimestamp = FALSE;
       if (!fread(&tv,sizeof(struct timeval),1,rec->file))
@@ -112,8 +218,11 @@ ReadFromRFBServer(rfbClient* client, char *out, unsigned int n)
     return (fread(out,1,n,rec->file) != n ? FALSE : TRUE);
   }
   
+  /* until the first read, buf and bufoutptr are NULL, which memcpy()
+     must not get even for 0 bytes */
   if (n <= client->buffered) {
-    memcpy(out, client->bufoutptr, n);
+    if (n > 0)
+      memcpy(out, client->bufoutptr, n);
     client->bufoutptr += n;
     client->buffered -= n;
 #ifdef DEBUG_READ_EXACT
@@ -122,27 +231,43 @@ ReadFromRFBServer(rfbClient* client, char *out, unsigned int n)
     return TRUE;
   }
 
-  memcpy(out, client->bufoutptr, client->buffered);
+  if (client->buffered > 0)
+    memcpy(out, client->bufoutptr, client->buffered);
 
   out += client->buffered;
   n -= client->buffered;
 
+  if (!client->buf) {
+    client->buf = malloc(RFB_BUF_SIZE);
+    if (!client->buf) {
+      rfbClientErr("Could not allocate receive buffer\n");
+      return FALSE;
+    }
+    client->bufSize = RFB_BUF_SIZE;
+  }
   client->bufoutptr = client->buf;
   client->buffered = 0;
+  if (client->bufSmallReads >= RFB_BUF_SHRINK_READS)
+    ShrinkReceiveBuffer(client);
 
-  if (n <= RFB_BUF_SIZE) {
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+  if (client->receiveQueue)
+    return ReadFromReceiveQueue(client, out, n);
+#endif
+
+  if (n <= (unsigned int)client->bufSize) {
 
     while (client->buffered < n) {
-      int i;
+      int i, len = client->bufSize - client->buffered;
       if (client->tlsSession)
-        i = ReadFromTLS(client, client->buf + client->buffered, RFB_BUF_SIZE - client->buffered);
+        i = ReadFromTLS(client, client->buf + client->buffered, len);
       else
 #ifdef LIBVNCSERVER_HAVE_SASL
       if (client->saslconn)
-        i = ReadFromSASL(client, client->buf + client->buffered, RFB_BUF_SIZE - client->buffered);
+        i = ReadFromSASL(client, client->buf + client->buffered, len);
       else {
 #endif /* LIBVNCSERVER_HAVE_SASL */
-        i = read(client->sock, client->buf + client->buffered, RFB_BUF_SIZE - client->buffered);
+        i = read(client->sock, client->buf + client->buffered, len);
 #ifdef WIN32
 	if (i < 0) errno=WSAGetLastError();
 #endif
@@ -162,7 +287,7 @@ ReadFromRFBServer(rfbClient* client, char *out, unsigned int n)
 	    /* TODO:
 	       ProcessXtEvents();
 	    */
-	    WaitForMessage(client, USECS_WAIT_PER_RETRY);
+	    WaitForSocket(client, USECS_WAIT_PER_RETRY);
 	    i = 0;
 	  } else {
 	    rfbClientErr("read (%d: %s)\n",errno,strerror(errno));
@@ -176,6 +301,8 @@ ReadFromRFBServer(rfbClient* client, char *out, unsigned int n)
 	}
       }
       client->buffered += i;
+      if (i > 0)
+        CountReceived(client, i);
     }
 
     memcpy(out, client->bufoutptr, n);
@@ -194,7 +321,7 @@ ReadFromRFBServer(rfbClient* client, char *out, unsigned int n)
         i = ReadFromSASL(client, out, n);
       else
 #endif
-        i = read(client->sock, out, n);
+        i = ReadIntoAndRefill(client, out, n);
 
       if (i <= 0) {
 	if (i < 0) {
@@ -211,7 +338,7 @@ ReadFromRFBServer(rfbClient* client, char *out, unsigned int n)
 	    /* TODO:
 	       ProcessXtEvents();
 	    */
-	    WaitForMessage(client, USECS_WAIT_PER_RETRY);
+	    WaitForSocket(client, USECS_WAIT_PER_RETRY);
 	    i = 0;
 	  } else {
 	    rfbClientErr("read (%s)\n",strerror(errno));
@@ -241,6 +368,133 @@ hexdump:
   return TRUE;
 }
 
+/*
+ * Everything read is also handed to the recording writer, if one is
+ * running.
+ */
+
+rfbBool
+ReadFromRFBServer(rfbClient* client, char *out, unsigned int n)
+{
+  if (!ReadFromServer(client, out, n))
+    return FALSE;
+  if (client->vncRecWriter)
+    RecordBytes(client, out, n);
+  return TRUE;
+}
+
+
+/*
+ * ReadRowsFromRFBServer reads rows rows of rowLen bytes each into out, the
+ * rows being stride bytes apart, like the lines of a rectangle in the
+ * framebuffer. Large rectangles on a plain socket are read with readv()
+ * straight into place, the last call also refilling the internal buffer
+ * with what follows. Anything else goes
+ * row by row through ReadFromRFBServer().
+ */
+
+#define ROWS_PER_READV 64
+
+rfbBool
+ReadRowsFromRFBServer(rfbClient* client, char *out, unsigned int rowLen,
+                      unsigned int stride, unsigned int rows)
+{
+#ifndef WIN32
+  const int USECS_WAIT_PER_RETRY = 100000;
+  int retries = 0;
+  struct iovec iov[ROWS_PER_READV + 1];
+  unsigned int done = 0; /* bytes of the first row already read */
+#endif
+
+  if (rowLen == stride)
+    return ReadFromRFBServer(client, out, rowLen * rows);
+
+#ifndef WIN32
+  if (client->serverPort != -1 && !client->tlsSession && !client->receiveQueue
+#ifdef LIBVNCSERVER_HAVE_SASL
+      && !client->saslconn
+#endif
+      && !client->vncRecWriter
+      && rowLen > 0 && (uint64_t)rowLen * rows > (uint64_t)client->bufSize) {
+
+    /* what is already buffered comes first */
+    while (rows > 0 && client->buffered > 0) {
+      unsigned int n = rowLen - done;
+      if (n > (unsigned int)client->buffered)
+        n = client->buffered;
+      memcpy(out + done, client->bufoutptr, n);
+      client->bufoutptr += n;
+      client->buffered -= n;
+      done += n;
+      if (done == rowLen) {
+        out += stride;
+        rows--;
+        done = 0;
+      }
+    }
+    if (client->buffered == 0)
+      client->bufoutptr = client->buf;
+
+    while (rows > 0) {
+      int nIov, i;
+      uint64_t total;
+
+      for (nIov = 0; nIov < ROWS_PER_READV && (unsigned int)nIov < rows; nIov++) {
+        iov[nIov].iov_base = out + nIov * stride;
+        iov[nIov].iov_len = rowLen;
+      }
+      iov[0].iov_base = out + done;
+      iov[0].iov_len = rowLen - done;
+      /* the last rows also refill the receive buffer */
+      if ((unsigned int)nIov == rows && client->buf) {
+        iov[nIov].iov_base = client->buf;
+        iov[nIov].iov_len = client->bufSize;
+        nIov++;
+      }
+
+      i = readv(client->sock, iov, nIov);
+
+      if (i <= 0) {
+	if (i < 0) {
+	  if (errno == EWOULDBLOCK || errno == EAGAIN) {
+	    if (client->readTimeout > 0 &&
+		++retries > (client->readTimeout * 1000 * 1000 / USECS_WAIT_PER_RETRY))
+	    {
+	      rfbClientLog("Connection timed out\n");
+	      return FALSE;
+	    }
+	    WaitForSocket(client, USECS_WAIT_PER_RETRY);
+	    continue;
+	  }
+	  rfbClientErr("readv (%d: %s)\n",errno,strerror(errno));
+	  return FALSE;
+	}
+	if (errorMessageOnReadFailure) {
+	  rfbClientLog("VNC server closed connection\n");
+	}
+	return FALSE;
+      }
+
+      total = done + (unsigned int)i;
+      if (total > (uint64_t)rowLen * rows) {
+        client->buffered = total - (uint64_t)rowLen * rows;
+        CountReceived(client, client->buffered);
+        break;
+      }
+      out += total / rowLen * stride;
+      rows -= total / rowLen;
+      done = total % rowLen;
+    }
+    return TRUE;
+  }
+#endif
+
+  for (; rows > 0; rows--, out += stride)
+    if (!ReadFromRFBServer(client, out, rowLen))
+      return FALSE;
+  return TRUE;
+}
+
 
 /*
  * Write an exact number of bytes, and don't return until you've sent them.
@@ -855,8 +1109,6 @@ PrintInHex(char *buf, int len)
 
 int WaitForMessage(rfbClient* client,unsigned int usecs)
 {
-  fd_set fds;
-  struct timeval timeout;
   int num;
 
   if (client->serverPort==-1)
@@ -868,6 +1120,37 @@ int WaitForMessage(rfbClient* client,unsigned int usecs)
     return 1;
   }
 
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+  if (client->receiveQueue)
+    return WaitForReceiveQueue(client, usecs);
+#endif
+
+  num = WaitForSocket(client, usecs);
+  /* nothing came for a while, the big buffer is not needed now */
+  if (num == 0 && usecs >= RFB_BUF_IDLE_USECS)
+    ShrinkReceiveBuffer(client);
+  return num;
+}
+
+/*
+ * Wait for the socket itself to become readable. Unlike WaitForMessage(),
+ * this does not return early for buffered data, so the read loops can wait
+ * for the rest of a message they have only partly buffered. Clients of an
+ * rfbClientLoop let the loop do the waiting.
+ */
+
+static int
+WaitForSocket(rfbClient* client, unsigned int usecs)
+{
+  fd_set fds;
+  struct timeval timeout;
+  int num;
+
+#ifdef LIBVNCSERVER_WITH_CLIENT_LOOP
+  if (YieldToClientLoop(client))
+    return 1;
+#endif
+
   timeout.tv_sec=(usecs/1000000);
   timeout.tv_usec=(usecs%1000000);
 
@@ -891,3 +1174,231 @@ int WaitForMessage(rfbClient* client,unsigned int usecs)
 }
 
 
+
+
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+/*
+ * The receive thread of pipelineReceive: it reads from the socket into a ring
+ * buffer as fast as the server sends, while the application's thread decodes
+ * what arrived before. ReadFromRFBServer() and WaitForMessage() then work on
+ * the ring buffer instead of the socket.
+ */
+
+#define RECEIVE_QUEUE_SIZE (4*1024*1024)
+#define RECEIVE_POLL_USECS 100000
+
+typedef struct {
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t dataCond;   /* data arrived or the connection ended */
+  pthread_cond_t spaceCond;  /* data was taken out */
+  char *ring;
+  size_t start, len;
+  rfbBool stop, eof;
+  int error;                 /* errno if eof came from a failed read */
+} rfbReceiveQueue;
+
+static void *
+ReceiveThread(void *data)
+{
+  rfbClient *client = (rfbClient *)data;
+  rfbReceiveQueue *q = (rfbReceiveQueue *)client->receiveQueue;
+  fd_set fds;
+  struct timeval tv;
+  size_t pos, space;
+  int n;
+
+  pthread_mutex_lock(&q->mutex);
+  while (!q->stop) {
+    if (q->len == RECEIVE_QUEUE_SIZE) {
+      pthread_cond_wait(&q->spaceCond, &q->mutex);
+      continue;
+    }
+    /* the free span after the data; the reader won't touch it */
+    pos = (q->start + q->len) % RECEIVE_QUEUE_SIZE;
+    space = pos < q->start ? q->start - pos : RECEIVE_QUEUE_SIZE - pos;
+    pthread_mutex_unlock(&q->mutex);
+
+    /* wake up now and then to notice the stop */
+    FD_ZERO(&fds);
+    FD_SET(client->sock, &fds);
+    tv.tv_sec = 0;
+    tv.tv_usec = RECEIVE_POLL_USECS;
+    n = select(client->sock + 1, &fds, NULL, NULL, &tv);
+    if (n > 0)
+      n = read(client->sock, q->ring + pos, space);
+    else if (n == 0) {
+      n = -1;
+      errno = EAGAIN;
+    }
+
+    pthread_mutex_lock(&q->mutex);
+    if (n > 0) {
+      q->len += n;
+      pthread_cond_signal(&q->dataCond);
+    } else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+      q->error = n == 0 ? 0 : errno;
+      q->eof = TRUE;
+      pthread_cond_signal(&q->dataCond);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&q->mutex);
+  return NULL;
+}
+
+/* wait for dataCond until usecs from now have passed, FALSE on timeout */
+static rfbBool
+WaitForData(rfbReceiveQueue *q, unsigned long usecs)
+{
+  struct timeval now;
+  struct timespec deadline;
+
+  gettimeofday(&now, NULL);
+  deadline.tv_sec = now.tv_sec + usecs / 1000000;
+  deadline.tv_nsec = (now.tv_usec + usecs % 1000000) * 1000;
+  if (deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+  return pthread_cond_timedwait(&q->dataCond, &q->mutex, &deadline) == 0;
+}
+
+static rfbBool
+ReadFromReceiveQueue(rfbClient* client, char *out, unsigned int n)
+{
+  rfbReceiveQueue *q = (rfbReceiveQueue *)client->receiveQueue;
+  size_t chunk;
+
+  pthread_mutex_lock(&q->mutex);
+  while (n > 0) {
+    if (q->len == 0) {
+      if (q->eof) {
+	pthread_mutex_unlock(&q->mutex);
+	if (q->error)
+	  rfbClientErr("read (%d: %s)\n",q->error,strerror(q->error));
+	else if (errorMessageOnReadFailure)
+	  rfbClientLog("VNC server closed connection\n");
+	return FALSE;
+      }
+      if (client->readTimeout > 0) {
+	if (!WaitForData(q, client->readTimeout * 1000000UL) && q->len == 0 && !q->eof) {
+	  pthread_mutex_unlock(&q->mutex);
+	  rfbClientLog("Connection timed out\n");
+	  return FALSE;
+	}
+      } else
+	pthread_cond_wait(&q->dataCond, &q->mutex);
+      continue;
+    }
+
+    chunk = q->len;
+    if (chunk > RECEIVE_QUEUE_SIZE - q->start)
+      chunk = RECEIVE_QUEUE_SIZE - q->start;
+    if (chunk > n)
+      chunk = n;
+
+    /* the receive thread only appends, copy without holding it up */
+    pthread_mutex_unlock(&q->mutex);
+    memcpy(out, q->ring + q->start, chunk);
+    pthread_mutex_lock(&q->mutex);
+
+    out += chunk;
+    n -= chunk;
+    q->start = (q->start + chunk) % RECEIVE_QUEUE_SIZE;
+    q->len -= chunk;
+    pthread_cond_signal(&q->spaceCond);
+  }
+  pthread_mutex_unlock(&q->mutex);
+  return TRUE;
+}
+
+static int
+WaitForReceiveQueue(rfbClient* client, unsigned int usecs)
+{
+  rfbReceiveQueue *q = (rfbReceiveQueue *)client->receiveQueue;
+  int num;
+
+  pthread_mutex_lock(&q->mutex);
+  if (q->len == 0 && !q->eof && usecs > 0)
+    WaitForData(q, usecs);
+  /* like select(), report the end of the connection as readable */
+  num = (q->len > 0 || q->eof) ? 1 : 0;
+  pthread_mutex_unlock(&q->mutex);
+  return num;
+}
+#endif
+
+/*
+ * StartReceiveThread starts receiving in the background if the client asked
+ * for pipelineReceive. Only plain connections qualify: TLS and SASL read
+ * and write through one session that would have to be shared with the
+ * thread.
+ */
+
+rfbBool
+StartReceiveThread(rfbClient* client)
+{
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+  rfbReceiveQueue *q;
+
+  if (!client->pipelineReceive || client->receiveQueue ||
+      client->serverPort == -1 || client->sock == RFB_INVALID_SOCKET)
+    return TRUE;
+  if (client->tlsSession
+#ifdef LIBVNCSERVER_HAVE_SASL
+      || client->saslconn
+#endif
+      ) {
+    rfbClientLog("Not receiving in the background on an encrypted connection\n");
+    return TRUE;
+  }
+
+  q = (rfbReceiveQueue *)calloc(1, sizeof(rfbReceiveQueue));
+  if (!q || !(q->ring = malloc(RECEIVE_QUEUE_SIZE))) {
+    free(q);
+    rfbClientErr("StartReceiveThread: out of memory\n");
+    return FALSE;
+  }
+  pthread_mutex_init(&q->mutex, NULL);
+  pthread_cond_init(&q->dataCond, NULL);
+  pthread_cond_init(&q->spaceCond, NULL);
+
+  client->receiveQueue = q;
+  if (pthread_create(&q->thread, NULL, ReceiveThread, client) != 0) {
+    rfbClientErr("StartReceiveThread: can't create thread\n");
+    client->receiveQueue = NULL;
+    pthread_mutex_destroy(&q->mutex);
+    pthread_cond_destroy(&q->dataCond);
+    pthread_cond_destroy(&q->spaceCond);
+    free(q->ring);
+    free(q);
+    return FALSE;
+  }
+#endif
+  return TRUE;
+}
+
+void
+StopReceiveThread(rfbClient* client)
+{
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+  rfbReceiveQueue *q = (rfbReceiveQueue *)client->receiveQueue;
+
+  if (!q)
+    return;
+
+  pthread_mutex_lock(&q->mutex);
+  q->stop = TRUE;
+  pthread_cond_signal(&q->spaceCond);
+  pthread_mutex_unlock(&q->mutex);
+  pthread_join(q->thread, NULL);
+
+  client->receiveQueue = NULL;
+  pthread_mutex_destroy(&q->mutex);
+  pthread_cond_destroy(&q->dataCond);
+  pthread_cond_destroy(&q->spaceCond);
+  free(q->ring);
+  free(q);
+#endif
+}
@@ -0,0 +1,37 @@
+#ifndef RFBCLIENT_SOCKETS_H
+#define RFBCLIENT_SOCKETS_H
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/* the platform socket defines shared with LibVNCServer */
+#include "../common/sockets.h"
+#include <rfb/rfbclient.h>
+
+/*
+ * Start the receive thread of rfbClient::pipelineReceive, once the
+ * connection is set up. Does nothing unless the client asked for it on a
+ * plain connection; FALSE only if the thread could not be started.
+ */
+rfbBool StartReceiveThread(rfbClient* client);
+
+/*
+ * Stop the receive thread, if any, and free what it received.
+ */
+void StopReceiveThread(rfbClient* client);
+
+#endif /* RFBCLIENT_SOCKETS_H */
@@ -557,7 +557,7 @@ InitFilterPaletteBPP (rfbClient* client, int rw, int rh)
 #if BPP == 32
   if (client->format.depth == 24 && client->format.redMax == 0xFF &&
       client->format.greenMax == 0xFF && client->format.blueMax == 0xFF) {
-    if (!ReadFromRFBServer(client, (char*)&client->tightPalette, client->rectColors * 3))
+    if (!ReadFromRFBServer(client, client->tightPalette, client->rectColors * 3))
       return 0;
     for (i = client->rectColors - 1; i >= 0; i--) {
       palette[i] = RGB24_TO_PIXEL32(client->tightPalette[i*3],
@@ -568,7 +568,7 @@ InitFilterPaletteBPP (rfbClient* client, int rw, int rh)
   }
 #endif
 
-  if (!ReadFromRFBServer(client, (char*)&client->tightPalette, client->rectColors * (BPP / 8)))
+  if (!ReadFromRFBServer(client, client->tightPalette, client->rectColors * (BPP / 8)))
     return 0;
 
   return (client->rectColors == 2) ? 1 : 8;
@@ -635,6 +635,12 @@ DecompressJpegRectBPP(rfbClient* client, int x, int y, int w, int h)
 
   if(client->GotJpeg != NULL)
     return client->GotJpeg(client, compressedData, compressedLen, x, y, w, h);
+
+#if BPP == 32
+  /* the framebuffer has a layout TurboJPEG can write to directly */
+  if (JpegPixelFormat(client) != -1)
+    return DecodeJpegRect(client, compressedData, compressedLen, x, y, w, h);
+#endif
   
   if (!client->tjhnd) {
     if ((client->tjhnd = tjInitDecompress()) == NULL) {
@@ -50,14 +50,46 @@
 #define UncompressCPixel(pointer) (*(CARDBPP *)pointer)
 #endif
 
+#if defined(UNCOMP)
+#define CPIXEL_SHIFT UNCOMP
+#else
+#define CPIXEL_SHIFT 0
+#endif
+
+/* set n pixels from dst on; longer runs of 32 bit pixels are vectorized */
+#if BPP == 32
+#define FillRun(dst, n, colour)                                                \
+  do {                                                                         \
+    if ((n) >= 8)                                                              \
+      ops->fill((dst), (n), (colour));                                         \
+    else {                                                                     \
+      int k;                                                                   \
+      for (k = 0; k < (n); k++)                                                \
+        (dst)[k] = (colour);                                                   \
+    }                                                                          \
+  } while (0)
+#else
+#define FillRun(dst, n, colour)                                                \
+  do {                                                                         \
+    int k;                                                                     \
+    for (k = 0; k < (n); k++)                                                  \
+      (dst)[k] = (colour);                                                     \
+  } while (0)
+#endif
+
 static rfbBool HandleTRLE(rfbClient *client, int rx, int ry, int rw, int rh) {
   int x, y, w, h;
   uint8_t type, last_type = 0;
   int min_buffer_size = 16 * 16 * (REALBPP / 8) * 2;
   uint8_t *buffer;
   CARDBPP palette[128];
-  int bpp = 0, mask = 0, divider = 0;
+  int bpp = 0, divider = 0;
   CARDBPP color = 0;
+#if BPP == 32
+  const rfbPixelOps *ops = PixelOps();
+#else
+  int mask = 0;
+#endif
 
   /* First make sure we have a large enough raw buffer to hold the
    * decompressed data.  In practice, with a fixed REALBPP, fixed frame
@@ -95,7 +127,10 @@ static rfbBool HandleTRLE(rfbClient *client, int rx, int ry, int rw, int rh) {
       case 0: {
         if (!ReadFromRFBServer(client, (char *)buffer, w * h * REALBPP / 8))
           return FALSE;
-#if REALBPP != BPP
+#if BPP == 32 && REALBPP == 24
+        ops->expandCPixels((CARDBPP *)client->frameBuffer + y * client->width + x,
+                           client->width, buffer, w, h, CPIXEL_SHIFT);
+#elif REALBPP != BPP
         int i, j;
 
         for (j = y * client->width; j < (y + h) * client->width;
@@ -135,17 +170,31 @@ static rfbBool HandleTRLE(rfbClient *client, int rx, int ry, int rw, int rh) {
             last_type = last_type & 0x7f;
 
             bpp = (last_type > 4 ? (last_type > 16 ? 8 : 4)
-                                 : (last_type > 2 ? 2 : 1)),
-            mask = (1 << bpp) - 1, divider = (8 / bpp);
+                                 : (last_type > 2 ? 2 : 1));
+            divider = (8 / bpp);
+#if BPP != 32
+            mask = (1 << bpp) - 1;
+#endif
           }
           if (last_type <= 16) {
+#if BPP == 32
+            int i;
+#else
             int i, j, shift;
+#endif
 
             if (!ReadFromRFBServer(client, (char*)buffer,
                                    (w + divider - 1) / divider * h))
               return FALSE;
 
             /* read palettized pixels */
+#if BPP == 32
+            for (i = last_type; i < 16; i++)
+              palette[i] = 0;
+            ops->unpackPalette((CARDBPP *)client->frameBuffer + y * client->width + x,
+                               client->width, buffer, w, h, bpp, palette);
+            type = last_type;
+#else
             for (j = y * client->width; j < (y + h) * client->width;
                  j += client->width) {
               for (i = x, shift = 8 - bpp; i < x + w; i++) {
@@ -162,6 +211,7 @@ static rfbBool HandleTRLE(rfbClient *client, int rx, int ry, int rw, int rh) {
 
               type = last_type;
             }
+#endif
           } else
             return FALSE;
         }
@@ -188,10 +238,12 @@ static rfbBool HandleTRLE(rfbClient *client, int rx, int ry, int rw, int rh) {
           length += *buffer;
           buffer++;
           while (j < h && length > 0) {
-            ((CARDBPP *)client->frameBuffer)[(y + j) * client->width + x + i] =
-                color;
-            length--;
-            i++;
+            CARDBPP *dst =
+                (CARDBPP *)client->frameBuffer + (y + j) * client->width + x + i;
+            int n = w - i < length ? w - i : length;
+            FillRun(dst, n, color);
+            length -= n;
+            i += n;
             if (i >= w) {
               i = 0;
               j++;
@@ -234,10 +286,12 @@ static rfbBool HandleTRLE(rfbClient *client, int rx, int ry, int rw, int rh) {
           }
           buffer++;
           while (j < h && length > 0) {
-            ((CARDBPP *)client->frameBuffer)[(y + j) * client->width + x + i] =
-                color;
-            length--;
-            i++;
+            CARDBPP *dst =
+                (CARDBPP *)client->frameBuffer + (y + j) * client->width + x + i;
+            int n = w - i < length ? w - i : length;
+            FillRun(dst, n, color);
+            length -= n;
+            i += n;
             if (i >= w) {
               i = 0;
               j++;
@@ -257,8 +311,11 @@ static rfbBool HandleTRLE(rfbClient *client, int rx, int ry, int rw, int rh) {
         if (type <= 16) {
           int i;
 
-          bpp = (type > 4 ? 4 : (type > 2 ? 2 : 1)),
-          mask = (1 << bpp) - 1, divider = (8 / bpp);
+          bpp = (type > 4 ? 4 : (type > 2 ? 2 : 1));
+          divider = (8 / bpp);
+#if BPP != 32
+          mask = (1 << bpp) - 1;
+#endif
 
           if (!ReadFromRFBServer(client, (char *)buffer, type * REALBPP / 8))
             return FALSE;
@@ -295,5 +352,7 @@ static rfbBool HandleTRLE(rfbClient *client, int rx, int ry, int rw, int rh) {
 #undef CARDREALBPP
 #undef HandleTRLE
 #undef UncompressCPixel
+#undef CPIXEL_SHIFT
+#undef FillRun
 #undef REALBPP
 #undef UNCOMP
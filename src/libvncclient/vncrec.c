@@ -0,0 +1,944 @@
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/*
+ * vncrec.c - write and play seekable session recordings.
+ *
+ * Besides the vncLog0.0 files of vncrec, a copy of everything the server
+ * sent with a timestamp in front of every message, libvncclient plays and
+ * writes vncLog1.0 recordings. After the magic, these are a sequence of
+ * chunks, each starting with
+ *
+ *   uint8_t type, 3 bytes padding, uint32_t time, uint32_t size,
+ *   uint32_t uncompressed size
+ *
+ * in network byte order, time being milliseconds since the start of the
+ * recording. The payload is zlib compressed unless both sizes are equal.
+ *
+ * 'S' chunks hold server messages, each prefixed with its time and length
+ * as two uint32_t, and carry the time of their last message. The first one
+ * starts with a made up handshake and a full Raw update. Rectangles of the
+ * encodings that depend on earlier updates are recorded as the Raw pixels
+ * they decoded to, so playback can pick up at any chunk.
+ *
+ * 'K' chunks are keyframes: uint16_t width and height, followed by the
+ * framebuffer. One is written after every change of the framebuffer size,
+ * so the largest keyframe bounds what a message may hold: playback trusts
+ * no chunk size beyond that. The 'I' chunk at the end indexes them with their time and
+ * the high and low word of their file offset, as three uint32_t each, and
+ * carries the length of the recording. The file ends with the offset of
+ * the index and "vncIndex". Recordings that were not finished properly get
+ * indexed by scanning the chunk headers.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef WIN32
+#include <unistd.h>
+#endif
+#include <rfb/rfbclient.h>
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+#include <zlib.h>
+#endif
+#include "jpeg.h"
+#include "vncrec.h"
+
+#ifdef WIN32
+#define fseeko _fseeki64
+#define ftello _ftelli64
+#endif
+
+#define CHUNK_HEADER_SIZE 16
+#define RECORD_HEADER_SIZE 8
+#define INDEX_ENTRY_SIZE 12
+#define TRAILER_SIZE 16
+#define TRAILER_MAGIC "vncIndex"
+
+#define CHUNK_STREAM 'S'
+#define CHUNK_KEYFRAME 'K'
+#define CHUNK_INDEX 'I'
+
+/* stream chunks are written once they hold this many bytes */
+#define STREAM_CHUNK_SIZE (1024 * 1024)
+/* the largest message recorded for a framebuffer of frameBytes bytes */
+#define MAX_MESSAGE_SIZE(frameBytes) (4 * (uint64_t)(frameBytes) + STREAM_CHUNK_SIZE)
+/* zlib does not compress by more than this */
+#define MAX_ZLIB_RATIO 1032
+
+typedef struct {
+  uint32_t time;
+  uint64_t offset;
+} rfbVNCRecKeyframe;
+
+typedef struct {
+  rfbVNCRecKeyframe *entries;
+  int len, size;
+} rfbVNCRecIndex;
+
+typedef struct {
+  FILE *file;
+  struct timeval start;
+  uint32_t keyframeInterval;
+  uint32_t lastKeyframe;
+  uint32_t lastTime;       /* of the last message */
+  char *chunk;             /* the stream chunk being filled */
+  size_t chunkLen, chunkSize;
+  size_t record;           /* where the current message starts in chunk */
+  rfbBool inMessage;
+  rfbBool timed;           /* lastTime is the one of the current message */
+  rfbBool paused;          /* a rectangle gets replaced with a Raw one */
+  int frameWidth, frameHeight; /* of the last keyframe */
+  size_t maxFrameBytes;    /* of the largest keyframe */
+  rfbVNCRecIndex index;
+} rfbVNCRecWriter;
+
+typedef struct {
+  rfbVNCRecIndex index;
+  uint64_t fileSize;
+  size_t maxFrameBytes;    /* of the largest keyframe */
+  uint32_t duration;
+  char *chunk;             /* the stream chunk being played */
+  size_t chunkLen, chunkSize, chunkPos;
+  size_t recordLeft;       /* bytes of the current message not read yet */
+  uint32_t recordTime;
+  rfbBool recordPaced;
+  rfbBool fastForward;
+  rfbBool clockSet;
+  struct timeval clock;    /* when playback was at clockTime */
+  uint32_t clockTime;
+} rfbVNCRecReader;
+
+static void Put16(char *p, uint16_t v)
+{
+  p[0] = (char)(v >> 8);
+  p[1] = (char)v;
+}
+
+static void Put32(char *p, uint32_t v)
+{
+  p[0] = (char)(v >> 24);
+  p[1] = (char)(v >> 16);
+  p[2] = (char)(v >> 8);
+  p[3] = (char)v;
+}
+
+static uint16_t Get16(const char *p)
+{
+  const uint8_t *q = (const uint8_t *)p;
+  return (uint16_t)(q[0] << 8 | q[1]);
+}
+
+static uint32_t Get32(const char *p)
+{
+  const uint8_t *q = (const uint8_t *)p;
+  return (uint32_t)q[0] << 24 | (uint32_t)q[1] << 16 | (uint32_t)q[2] << 8 | q[3];
+}
+
+static rfbBool AddKeyframe(rfbVNCRecIndex *index, uint32_t time, uint64_t offset)
+{
+  if (index->len == index->size) {
+    int size = index->size ? 2 * index->size : 64;
+    rfbVNCRecKeyframe *entries = realloc(index->entries, size * sizeof(*entries));
+    if (!entries)
+      return FALSE;
+    index->entries = entries;
+    index->size = size;
+  }
+  index->entries[index->len].time = time;
+  index->entries[index->len].offset = offset;
+  index->len++;
+  return TRUE;
+}
+
+static rfbBool WriteChunk(FILE *file, char type, uint32_t time, const char *data, size_t len)
+{
+  char header[CHUNK_HEADER_SIZE];
+  const char *payload = data;
+  size_t size = len;
+  rfbBool ok;
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+  uLongf compressedLen = compressBound(len);
+  char *compressed = malloc(compressedLen);
+
+  /* favour speed, this runs on the thread decoding the session */
+  if (compressed && compress2((Bytef *)compressed, &compressedLen, (const Bytef *)data,
+                              len, Z_BEST_SPEED) == Z_OK && compressedLen < len) {
+    payload = compressed;
+    size = compressedLen;
+  }
+#endif
+
+  memset(header, 0, sizeof(header));
+  header[0] = type;
+  Put32(header + 4, time);
+  Put32(header + 8, (uint32_t)size);
+  Put32(header + 12, (uint32_t)len);
+  ok = fwrite(header, sizeof(header), 1, file) == 1 &&
+    (size == 0 || fwrite(payload, size, 1, file) == 1);
+
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+  free(compressed);
+#endif
+  return ok;
+}
+
+static rfbBool ReadChunkHeader(FILE *file, char *type, uint32_t *time, uint32_t *size, uint32_t *len)
+{
+  char header[CHUNK_HEADER_SIZE];
+
+  if (fread(header, sizeof(header), 1, file) != 1)
+    return FALSE;
+  *type = header[0];
+  *time = Get32(header + 4);
+  *size = Get32(header + 8);
+  *len = Get32(header + 12);
+  return TRUE;
+}
+
+static size_t FrameBytes(rfbClient* client, int width, int height)
+{
+  return (size_t)width * height * (client->format.bitsPerPixel / 8);
+}
+
+/*
+ * Read a chunk of size bytes in the file and len bytes uncompressed into
+ * buffer. len is not trusted beyond maxLen, nor beyond what size bytes can
+ * hold.
+ */
+static rfbBool ReadChunk(FILE *file, uint32_t size, uint32_t len, uint64_t maxLen,
+                         char **buffer, size_t *bufferSize)
+{
+  if (len > maxLen || size > len || (uint64_t)size * MAX_ZLIB_RATIO < len) {
+    rfbClientLog("Corrupt recording: chunk of %u bytes\n", (unsigned int)len);
+    return FALSE;
+  }
+
+  if (len > *bufferSize) {
+    char *b = realloc(*buffer, len);
+    if (!b) {
+      rfbClientLog("Could not allocate %u bytes for a recording chunk\n", (unsigned int)len);
+      return FALSE;
+    }
+    *buffer = b;
+    *bufferSize = len;
+  }
+
+  if (size == len)
+    return size == 0 || fread(*buffer, size, 1, file) == 1;
+
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+  {
+    char *compressed = malloc(size);
+    uLongf uncompressedLen = len;
+    rfbBool ok = compressed && fread(compressed, size, 1, file) == 1 &&
+      uncompress((Bytef *)*buffer, &uncompressedLen, (Bytef *)compressed, size) == Z_OK &&
+      uncompressedLen == len;
+
+    free(compressed);
+    return ok;
+  }
+#else
+  rfbClientLog("Playing compressed recordings needs zlib\n");
+  return FALSE;
+#endif
+}
+
+/*
+ * Writing
+ */
+
+static uint32_t
+MillisecondsSince(struct timeval *start)
+{
+  struct timeval now;
+
+  gettimeofday(&now, NULL);
+  return (uint32_t)((now.tv_sec - start->tv_sec) * 1000 + (now.tv_usec - start->tv_usec) / 1000);
+}
+
+static rfbBool Append(rfbVNCRecWriter *w, const char *data, size_t n)
+{
+  if (w->chunkLen + n > w->chunkSize) {
+    size_t size = w->chunkSize ? w->chunkSize : STREAM_CHUNK_SIZE;
+    char *chunk;
+
+    while (size < w->chunkLen + n)
+      size *= 2;
+    chunk = realloc(w->chunk, size);
+    if (!chunk)
+      return FALSE;
+    w->chunk = chunk;
+    w->chunkSize = size;
+  }
+  memcpy(w->chunk + w->chunkLen, data, n);
+  w->chunkLen += n;
+  return TRUE;
+}
+
+static rfbBool BeginRecord(rfbVNCRecWriter *w)
+{
+  char header[RECORD_HEADER_SIZE];
+
+  w->record = w->chunkLen;
+  memset(header, 0, sizeof(header));
+  return Append(w, header, sizeof(header));
+}
+
+static void EndRecord(rfbVNCRecWriter *w)
+{
+  Put32(w->chunk + w->record, w->lastTime);
+  Put32(w->chunk + w->record + 4, (uint32_t)(w->chunkLen - w->record - RECORD_HEADER_SIZE));
+}
+
+/* the pixels of a rectangle of the framebuffer, as a Raw one */
+static rfbBool AppendRawRect(rfbClient* client, rfbVNCRecWriter *w, int x, int y, int width, int height)
+{
+  char header[sz_rfbFramebufferUpdateRectHeader];
+  int bpp = client->format.bitsPerPixel / 8;
+  int i;
+
+  if (x + width > client->width)
+    width = x < client->width ? client->width - x : 0;
+  if (y + height > client->height)
+    height = y < client->height ? client->height - y : 0;
+
+  Put16(header, (uint16_t)x);
+  Put16(header + 2, (uint16_t)y);
+  Put16(header + 4, (uint16_t)width);
+  Put16(header + 6, (uint16_t)height);
+  Put32(header + 8, rfbEncodingRaw);
+  if (!Append(w, header, sizeof(header)))
+    return FALSE;
+
+  for (i = 0; i < height; i++)
+    if (!Append(w, (char *)client->frameBuffer + ((size_t)(y + i) * client->width + x) * bpp,
+                (size_t)width * bpp))
+      return FALSE;
+  return TRUE;
+}
+
+static rfbBool FlushStream(rfbVNCRecWriter *w)
+{
+  if (w->chunkLen == 0)
+    return TRUE;
+  if (!WriteChunk(w->file, CHUNK_STREAM, w->lastTime, w->chunk, w->chunkLen))
+    return FALSE;
+  w->chunkLen = 0;
+  return TRUE;
+}
+
+static rfbBool WriteKeyframe(rfbClient* client, rfbVNCRecWriter *w, uint32_t time)
+{
+  size_t len = (size_t)client->width * client->height * (client->format.bitsPerPixel / 8);
+  char *keyframe;
+  int64_t offset;
+  rfbBool ok;
+
+  if (!FlushStream(w) || (offset = ftello(w->file)) < 0)
+    return FALSE;
+
+  keyframe = malloc(4 + len);
+  if (!keyframe)
+    return FALSE;
+  Put16(keyframe, (uint16_t)client->width);
+  Put16(keyframe + 2, (uint16_t)client->height);
+  memcpy(keyframe + 4, client->frameBuffer, len);
+  ok = WriteChunk(w->file, CHUNK_KEYFRAME, time, keyframe, 4 + len) &&
+    AddKeyframe(&w->index, time, (uint64_t)offset);
+  free(keyframe);
+
+  w->lastKeyframe = time;
+  w->frameWidth = client->width;
+  w->frameHeight = client->height;
+  if (len > w->maxFrameBytes)
+    w->maxFrameBytes = len;
+  return ok;
+}
+
+/*
+ * What a client connecting to this session would have read up to the first
+ * update, claiming the pixel format of the client as the server's.
+ */
+static rfbBool WriteHandshake(rfbClient* client, rfbVNCRecWriter *w)
+{
+  static const char version[] = "RFB 003.008\n";
+  static const char security[] = { 1, rfbNoAuth, 0, 0, 0, 0 };
+  const char *name = client->desktopName ? client->desktopName : "";
+  rfbServerInitMsg si;
+  char update[sz_rfbFramebufferUpdateMsg];
+
+  si.framebufferWidth = rfbClientSwap16IfLE(client->width);
+  si.framebufferHeight = rfbClientSwap16IfLE(client->height);
+  si.format = client->format;
+  si.format.redMax = rfbClientSwap16IfLE(si.format.redMax);
+  si.format.greenMax = rfbClientSwap16IfLE(si.format.greenMax);
+  si.format.blueMax = rfbClientSwap16IfLE(si.format.blueMax);
+  si.nameLength = rfbClientSwap32IfLE((uint32_t)strlen(name));
+
+  if (!BeginRecord(w) ||
+      !Append(w, version, strlen(version)) ||
+      !Append(w, security, sizeof(security)) ||
+      !Append(w, (char *)&si, sz_rfbServerInitMsg) ||
+      !Append(w, name, strlen(name)))
+    return FALSE;
+  EndRecord(w);
+
+  memset(update, 0, sizeof(update));
+  update[0] = rfbFramebufferUpdate;
+  Put16(update + 2, 1);
+  if (!BeginRecord(w) ||
+      !Append(w, update, sizeof(update)) ||
+      !AppendRawRect(client, w, 0, 0, client->width, client->height))
+    return FALSE;
+  EndRecord(w);
+
+  return TRUE;
+}
+
+static rfbBool WriteIndex(rfbVNCRecWriter *w)
+{
+  char *index = malloc(w->index.len * INDEX_ENTRY_SIZE + 1);
+  char trailer[TRAILER_SIZE];
+  int64_t offset = ftello(w->file);
+  uint32_t duration = w->lastTime > w->lastKeyframe ? w->lastTime : w->lastKeyframe;
+  rfbBool ok;
+  int i;
+
+  if (!index || offset < 0) {
+    free(index);
+    return FALSE;
+  }
+  for (i = 0; i < w->index.len; i++) {
+    Put32(index + i * INDEX_ENTRY_SIZE, w->index.entries[i].time);
+    Put32(index + i * INDEX_ENTRY_SIZE + 4, (uint32_t)(w->index.entries[i].offset >> 32));
+    Put32(index + i * INDEX_ENTRY_SIZE + 8, (uint32_t)w->index.entries[i].offset);
+  }
+  Put32(trailer, (uint32_t)((uint64_t)offset >> 32));
+  Put32(trailer + 4, (uint32_t)offset);
+  memcpy(trailer + 8, TRAILER_MAGIC, 8);
+
+  ok = WriteChunk(w->file, CHUNK_INDEX, duration, index, w->index.len * INDEX_ENTRY_SIZE) &&
+    fwrite(trailer, sizeof(trailer), 1, w->file) == 1;
+  free(index);
+  return ok;
+}
+
+static void RecordingFailed(rfbClient* client)
+{
+  rfbClientLog("Could not write the recording, stopping it\n");
+  rfbVNCRecStop(client);
+}
+
+rfbBool
+rfbVNCRecStart(rfbClient* client, const char *filename, int keyframeInterval)
+{
+  rfbVNCRecWriter *w;
+
+  if (!client->frameBuffer) {
+    rfbClientLog("Recording needs the framebuffer\n");
+    return FALSE;
+  }
+
+  rfbVNCRecStop(client);
+
+  w = calloc(1, sizeof(rfbVNCRecWriter));
+  if (!w) {
+    rfbClientLog("Could not allocate recording memory\n");
+    return FALSE;
+  }
+  w->file = fopen(filename, "wb");
+  if (!w->file) {
+    rfbClientLog("Could not open %s.\n", filename);
+    free(w);
+    return FALSE;
+  }
+  gettimeofday(&w->start, NULL);
+  w->keyframeInterval = keyframeInterval > 0 ? (uint32_t)keyframeInterval * 1000 : 0;
+  client->vncRecWriter = w;
+
+  if (fwrite(VNCREC_INDEXED_MAGIC, VNCREC_MAGIC_SIZE, 1, w->file) != 1 ||
+      !WriteHandshake(client, w) || !WriteKeyframe(client, w, 0)) {
+    rfbClientLog("Could not write %s.\n", filename);
+    rfbVNCRecStop(client);
+    return FALSE;
+  }
+  return TRUE;
+}
+
+void
+rfbVNCRecStop(rfbClient* client)
+{
+  rfbVNCRecWriter *w = client->vncRecWriter;
+
+  if (!w)
+    return;
+  client->vncRecWriter = NULL;
+
+  /* a message cut short is dropped */
+  if (w->inMessage)
+    w->chunkLen = w->record;
+  if (!FlushStream(w) || !WriteIndex(w))
+    rfbClientLog("Could not finish the recording\n");
+  if (fclose(w->file) != 0)
+    rfbClientLog("Could not close the recording\n");
+
+  free(w->chunk);
+  free(w->index.entries);
+  free(w);
+}
+
+void
+RecordMessageStart(rfbClient* client)
+{
+  rfbVNCRecWriter *w = client->vncRecWriter;
+
+  if (!w)
+    return;
+
+  /* the previous message failed */
+  if (w->inMessage)
+    w->chunkLen = w->record;
+
+  if (!BeginRecord(w)) {
+    RecordingFailed(client);
+    return;
+  }
+  w->inMessage = TRUE;
+  w->timed = FALSE;
+  w->paused = FALSE;
+}
+
+void
+RecordBytes(rfbClient* client, const char *data, unsigned int n)
+{
+  rfbVNCRecWriter *w = client->vncRecWriter;
+
+  if (!w || !w->inMessage || w->paused)
+    return;
+
+  /* the time the message arrived, not the one we started waiting for it */
+  if (!w->timed) {
+    w->lastTime = MillisecondsSince(&w->start);
+    w->timed = TRUE;
+  }
+  if (!Append(w, data, n))
+    RecordingFailed(client);
+}
+
+void
+RecordMessageEnd(rfbClient* client)
+{
+  rfbVNCRecWriter *w = client->vncRecWriter;
+  rfbBool resized;
+  size_t frameBytes;
+  uint32_t now;
+
+  if (!w || !w->inMessage)
+    return;
+  w->inMessage = FALSE;
+  EndRecord(w);
+
+  /* playback takes no more than this, see ReadChunk() */
+  resized = client->width != w->frameWidth || client->height != w->frameHeight;
+  frameBytes = FrameBytes(client, client->width, client->height);
+  if (frameBytes < w->maxFrameBytes)
+    frameBytes = w->maxFrameBytes;
+  if (w->chunkLen - w->record - RECORD_HEADER_SIZE > MAX_MESSAGE_SIZE(frameBytes)) {
+    rfbClientLog("Message too large to record\n");
+    w->chunkLen = w->record;
+    RecordingFailed(client);
+    return;
+  }
+
+  now = MillisecondsSince(&w->start);
+  if (resized || (w->keyframeInterval && now - w->lastKeyframe >= w->keyframeInterval)) {
+    if (!WriteKeyframe(client, w, now))
+      RecordingFailed(client);
+  } else if (w->chunkLen >= STREAM_CHUNK_SIZE && !FlushStream(w))
+    RecordingFailed(client);
+}
+
+void
+RecordRectStart(rfbClient* client, rfbFramebufferUpdateRectHeader* rect)
+{
+  rfbVNCRecWriter *w = client->vncRecWriter;
+
+  if (!w || !w->inMessage)
+    return;
+
+  switch (rect->encoding) {
+  case rfbEncodingZlib:
+  case rfbEncodingTight:
+  case rfbEncodingZRLE:
+  case rfbEncodingZYWRLE:
+  case rfbEncodingH264:
+    /* drop the header already recorded, RecordRectEnd() writes a Raw one */
+    w->chunkLen -= sz_rfbFramebufferUpdateRectHeader;
+    w->paused = TRUE;
+    break;
+  }
+}
+
+rfbBool
+RecordRectEnd(rfbClient* client, rfbFramebufferUpdateRectHeader* rect)
+{
+  rfbVNCRecWriter *w = client->vncRecWriter;
+
+  if (!w || !w->paused)
+    return TRUE;
+  w->paused = FALSE;
+
+  /* the pixels have to be there to be recorded */
+  if (QueuedJpegRects(client) && !FlushJpegRects(client))
+    return FALSE;
+
+  if (!AppendRawRect(client, w, rect->r.x, rect->r.y, rect->r.w, rect->r.h))
+    RecordingFailed(client);
+  return TRUE;
+}
+
+/*
+ * Playing
+ */
+
+static rfbBool ReadIndex(FILE *file, rfbVNCRecReader *r)
+{
+  char trailer[TRAILER_SIZE];
+  char *index = NULL;
+  size_t indexSize = 0;
+  char type;
+  uint32_t time, size, len, i;
+
+  if (fseeko(file, -TRAILER_SIZE, SEEK_END) != 0 ||
+      fread(trailer, sizeof(trailer), 1, file) != 1 ||
+      memcmp(trailer + 8, TRAILER_MAGIC, 8) != 0 ||
+      fseeko(file, (int64_t)((uint64_t)Get32(trailer) << 32 | Get32(trailer + 4)), SEEK_SET) != 0 ||
+      !ReadChunkHeader(file, &type, &time, &size, &len) || type != CHUNK_INDEX ||
+      /* every keyframe takes at least a chunk header */
+      !ReadChunk(file, size, len, r->fileSize / CHUNK_HEADER_SIZE * INDEX_ENTRY_SIZE,
+                 &index, &indexSize))
+    goto failed;
+
+  for (i = 0; i + INDEX_ENTRY_SIZE <= len; i += INDEX_ENTRY_SIZE)
+    if (!AddKeyframe(&r->index, Get32(index + i),
+                     (uint64_t)Get32(index + i + 4) << 32 | Get32(index + i + 8)))
+      goto failed;
+  r->duration = time;
+  free(index);
+  return TRUE;
+
+failed:
+  free(index);
+  r->index.len = 0;
+  return FALSE;
+}
+
+static rfbBool ScanIndex(FILE *file, rfbVNCRecReader *r)
+{
+  char type;
+  uint32_t time, size, len;
+  int64_t offset;
+
+  if (fseeko(file, VNCREC_MAGIC_SIZE, SEEK_SET) != 0)
+    return FALSE;
+
+  while ((offset = ftello(file)) >= 0 &&
+         ReadChunkHeader(file, &type, &time, &size, &len)) {
+    if (type == CHUNK_KEYFRAME && !AddKeyframe(&r->index, time, (uint64_t)offset))
+      return FALSE;
+    if (time > r->duration)
+      r->duration = time;
+    if (fseeko(file, size, SEEK_CUR) != 0)
+      break;
+  }
+  return TRUE;
+}
+
+/* the size of the keyframe at offset, from the start of its payload */
+static rfbBool ReadKeyframeSize(FILE *file, uint64_t offset, int *width, int *height)
+{
+  char type, start[1024], size4[4];
+  uint32_t time, size, len;
+
+  if (fseeko(file, (int64_t)offset, SEEK_SET) != 0 ||
+      !ReadChunkHeader(file, &type, &time, &size, &len) ||
+      type != CHUNK_KEYFRAME || len < 4 || size > len)
+    return FALSE;
+  if (size > sizeof(start))
+    size = sizeof(start);
+  if (fread(start, size, 1, file) != 1)
+    return FALSE;
+
+  if (size == len) {
+    memcpy(size4, start, 4);
+  } else {
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+    z_stream zs;
+    int err;
+
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit(&zs) != Z_OK)
+      return FALSE;
+    zs.next_in = (Bytef *)start;
+    zs.avail_in = size;
+    zs.next_out = (Bytef *)size4;
+    zs.avail_out = sizeof(size4);
+    err = inflate(&zs, Z_SYNC_FLUSH);
+    inflateEnd(&zs);
+    if ((err != Z_OK && err != Z_STREAM_END) || zs.avail_out != 0)
+      return FALSE;
+#else
+    return FALSE;
+#endif
+  }
+  *width = Get16(size4);
+  *height = Get16(size4 + 2);
+  return TRUE;
+}
+
+rfbBool
+OpenIndexedRecording(rfbClient* client)
+{
+  rfbVNCRec* rec = client->vncRec;
+  rfbVNCRecReader *r = calloc(1, sizeof(rfbVNCRecReader));
+  int64_t fileSize;
+  int i;
+
+  if (!r) {
+    rfbClientLog("Could not allocate recording memory\n");
+    return FALSE;
+  }
+  rec->indexed = r;
+
+  if (fseeko(rec->file, 0, SEEK_END) != 0 || (fileSize = ftello(rec->file)) < 0)
+    return FALSE;
+  r->fileSize = (uint64_t)fileSize;
+
+  if (!ReadIndex(rec->file, r)) {
+    rfbClientLog("%s has no index, scanning it\n", client->serverHost);
+    if (!ScanIndex(rec->file, r))
+      return FALSE;
+  }
+
+  /* the largest framebuffer, which chunks are checked against; a
+     keyframe cut short ends a recording that was not finished */
+  for (i = 0; i < r->index.len; i++) {
+    int width, height;
+    size_t frameBytes;
+
+    if (!ReadKeyframeSize(rec->file, r->index.entries[i].offset, &width, &height)) {
+      r->index.len = i;
+      break;
+    }
+    frameBytes = FrameBytes(client, width, height);
+    if (frameBytes > r->maxFrameBytes)
+      r->maxFrameBytes = frameBytes;
+  }
+  if (r->index.len == 0) {
+    rfbClientLog("%s has no keyframes\n", client->serverHost);
+    return FALSE;
+  }
+
+  return fseeko(rec->file, VNCREC_MAGIC_SIZE, SEEK_SET) == 0;
+}
+
+/* make the next message the current one */
+static rfbBool NextRecord(rfbClient* client)
+{
+  rfbVNCRecReader *r = client->vncRec->indexed;
+  FILE *file = client->vncRec->file;
+  char type;
+  uint32_t time, size, len;
+
+  /* whatever was not read of the current one */
+  r->chunkPos += r->recordLeft;
+  r->recordLeft = 0;
+
+  while (r->chunkLen - r->chunkPos < RECORD_HEADER_SIZE) {
+    if (!ReadChunkHeader(file, &type, &time, &size, &len) || type == CHUNK_INDEX)
+      return FALSE;
+    if (type != CHUNK_STREAM) {
+      if (fseeko(file, size, SEEK_CUR) != 0)
+        return FALSE;
+      continue;
+    }
+    /* what is left of a full chunk, and one more message */
+    if (!ReadChunk(file, size, len,
+                   STREAM_CHUNK_SIZE + RECORD_HEADER_SIZE + MAX_MESSAGE_SIZE(r->maxFrameBytes),
+                   &r->chunk, &r->chunkSize))
+      return FALSE;
+    r->chunkLen = len;
+    r->chunkPos = 0;
+  }
+
+  r->recordTime = Get32(r->chunk + r->chunkPos);
+  r->recordLeft = Get32(r->chunk + r->chunkPos + 4);
+  r->chunkPos += RECORD_HEADER_SIZE;
+  r->recordPaced = FALSE;
+  if (r->recordLeft > r->chunkLen - r->chunkPos) {
+    rfbClientLog("Corrupt recording\n");
+    return FALSE;
+  }
+  return TRUE;
+}
+
+/* sleep until it is time for a message */
+static void WaitFor(rfbVNCRecReader *r, uint32_t time)
+{
+  struct timeval now;
+  int64_t wait;
+
+  gettimeofday(&now, NULL);
+  if (!r->clockSet || time < r->clockTime) {
+    r->clock = now;
+    r->clockTime = time;
+    r->clockSet = TRUE;
+    return;
+  }
+
+  wait = (int64_t)(time - r->clockTime) * 1000 -
+    ((int64_t)(now.tv_sec - r->clock.tv_sec) * 1000000 + (now.tv_usec - r->clock.tv_usec));
+  if (wait <= 0)
+    return;
+#ifndef WIN32
+  sleep((unsigned int)(wait / 1000000));
+  usleep((useconds_t)(wait % 1000000));
+#else
+  Sleep((DWORD)(wait / 1000));
+#endif
+}
+
+rfbBool
+ReadFromIndexedRecording(rfbClient* client, char *out, unsigned int n)
+{
+  rfbVNCRec* rec = client->vncRec;
+  rfbVNCRecReader *r = rec->indexed;
+
+  while (n > 0) {
+    unsigned int len;
+
+    if (r->recordLeft == 0 && !NextRecord(client))
+      return FALSE;
+
+    if (!r->recordPaced) {
+      r->recordPaced = TRUE;
+      if (r->fastForward || rec->doNotSleep)
+        r->clockSet = FALSE;
+      else
+        WaitFor(r, r->recordTime);
+    }
+
+    len = n < r->recordLeft ? n : (unsigned int)r->recordLeft;
+    memcpy(out, r->chunk + r->chunkPos, len);
+    r->chunkPos += len;
+    r->recordLeft -= len;
+    out += len;
+    n -= len;
+  }
+  return TRUE;
+}
+
+unsigned int
+rfbVNCRecDuration(rfbClient* client)
+{
+  rfbVNCRecReader *r = client->serverPort == -1 && client->vncRec ? client->vncRec->indexed : NULL;
+
+  return r ? r->duration : 0;
+}
+
+rfbBool
+rfbVNCRecSeek(rfbClient* client, unsigned int time)
+{
+  rfbVNCRec* rec = client->vncRec;
+  rfbVNCRecReader *r = client->serverPort == -1 && rec ? rec->indexed : NULL;
+  int lo, hi, width, height;
+  size_t len;
+  char type;
+  uint32_t keyframeTime, size, chunkLen;
+
+  if (!r || r->index.len == 0) {
+    rfbClientLog("Can only seek in indexed recordings\n");
+    return FALSE;
+  }
+
+  /* the last keyframe not after time */
+  lo = 0;
+  hi = r->index.len - 1;
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (r->index.entries[mid].time <= time)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+
+  r->chunkLen = r->chunkPos = r->recordLeft = 0;
+  if (fseeko(rec->file, (int64_t)r->index.entries[lo].offset, SEEK_SET) != 0 ||
+      !ReadChunkHeader(rec->file, &type, &keyframeTime, &size, &chunkLen) ||
+      type != CHUNK_KEYFRAME || chunkLen < 4 ||
+      !ReadChunk(rec->file, size, chunkLen, 4 + (uint64_t)r->maxFrameBytes, &r->chunk, &r->chunkSize)) {
+    rfbClientLog("Could not read the keyframe at %u ms\n", (unsigned int)r->index.entries[lo].time);
+    return FALSE;
+  }
+
+  width = Get16(r->chunk);
+  height = Get16(r->chunk + 2);
+  len = (size_t)width * height * (client->format.bitsPerPixel / 8);
+  if (len != chunkLen - 4) {
+    rfbClientLog("Keyframe at %u ms does not match the pixel format\n", (unsigned int)keyframeTime);
+    return FALSE;
+  }
+  if ((width != client->width || height != client->height) &&
+      !ResizeClientBuffer(client, width, height))
+    return FALSE;
+  memcpy(client->frameBuffer, r->chunk + 4, len);
+  client->GotFrameBufferUpdate(client, 0, 0, width, height);
+
+  /* the messages between the keyframe and time, as fast as possible */
+  r->fastForward = TRUE;
+  while (NextRecord(client) && r->recordTime < time)
+    if (!HandleRFBServerMessage(client)) {
+      r->fastForward = FALSE;
+      return FALSE;
+    }
+  r->fastForward = FALSE;
+  r->clockSet = FALSE;
+
+  return TRUE;
+}
+
+void
+FreeVNCRec(rfbClient* client)
+{
+  rfbVNCRec* rec = client->vncRec;
+  rfbVNCRecReader *r;
+
+  if (!rec)
+    return;
+
+  r = rec->indexed;
+  if (r) {
+    free(r->index.entries);
+    free(r->chunk);
+    free(r);
+  }
+  if (rec->file)
+    fclose(rec->file);
+  free(rec);
+  client->vncRec = NULL;
+}
@@ -0,0 +1,64 @@
+#ifndef RFBVNCREC_H
+#define RFBVNCREC_H
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <rfb/rfbclient.h>
+
+#define VNCREC_MAGIC "vncLog0.0"
+#define VNCREC_INDEXED_MAGIC "vncLog1.0"
+#define VNCREC_MAGIC_SIZE 9
+
+/*
+ * Set up playback of an indexed recording, once its magic has been read
+ * from client->vncRec->file.
+ */
+rfbBool OpenIndexedRecording(rfbClient* client);
+
+/*
+ * Read n bytes of server messages from an indexed recording, waiting for
+ * the time they were received at unless client->vncRec->doNotSleep is set.
+ */
+rfbBool ReadFromIndexedRecording(rfbClient* client, char *out, unsigned int n);
+
+/*
+ * Close the recording played by client and free client->vncRec.
+ */
+void FreeVNCRec(rfbClient* client);
+
+/*
+ * Hooks of the recording writer, doing nothing unless rfbVNCRecStart() was
+ * called. HandleRFBServerMessage() brackets every message with
+ * RecordMessageStart() and RecordMessageEnd(), and every rectangle that
+ * changes pixels with RecordRectStart() and RecordRectEnd().
+ * ReadFromRFBServer() hands everything read to RecordBytes().
+ */
+void RecordMessageStart(rfbClient* client);
+void RecordMessageEnd(rfbClient* client);
+void RecordRectStart(rfbClient* client, rfbFramebufferUpdateRectHeader* rect);
+rfbBool RecordRectEnd(rfbClient* client, rfbFramebufferUpdateRectHeader* rect);
+void RecordBytes(rfbClient* client, const char *data, unsigned int n);
+
+/* rfbclient.c */
+rfbBool ResizeClientBuffer(rfbClient* client, int width, int height);
+#if !defined LIBVNCSERVER_HAVE_GETTIMEOFDAY && defined WIN32
+#define gettimeofday rfbClientGetTimeOfDay
+void gettimeofday(struct timeval* tv, char* dummy);
+#endif
+
+#endif /* RFBVNCREC_H */
@@ -39,6 +39,12 @@
 #include <time.h>
 #include <rfb/rfbclient.h>
 #include "tls.h"
+#include "h264.h"
+#include "jpeg.h"
+#include "simd.h"
+#include "vncrec.h"
+#include "clientloop.h"
+#include "sockets.h"
 #if defined(LIBVNCSERVER_HAVE_LIBZ) && defined(LIBVNCSERVER_HAVE_LIBJPEG)
 #include "turbojpeg.h"
 #endif
@@ -136,13 +142,20 @@ static void FillRectangle(rfbClient* client, int x, int y, int w, int h, uint32_
   switch(client->format.bitsPerPixel) {
   case  8: FILL_RECT(8);  break;
   case 16: FILL_RECT(16); break;
-  case 32: FILL_RECT(32); break;
+  case 32:
+    {
+      const rfbPixelOps* ops = PixelOps();
+      for(j=y*client->width;j<(y+h)*client->width;j+=client->width)
+	ops->fill((uint32_t*)client->frameBuffer+j+x, w, colour);
+    }
+    break;
   default:
     rfbClientLog("Unsupported bitsPerPixel: %d\n",client->format.bitsPerPixel);
   }
 }
 
-static void CopyRectangle(rfbClient* client, const uint8_t* buffer, int x, int y, int w, int h) {
+/* the default GotBitmap, rfbclient.c reads Raw rectangles in place instead */
+void rfbClientCopyRectangle(rfbClient* client, const uint8_t* buffer, int x, int y, int w, int h) {
   int j;
 
   if (client->frameBuffer == NULL) {
@@ -375,7 +388,7 @@ rfbClient* rfbGetClient(int bitsPerSample,int samplesPerPixel,
   client->GotFrameBufferUpdate = DummyRect;
   client->GotCopyRect = CopyRectangleFromRectangle;
   client->GotFillRect = FillRectangle;
-  client->GotBitmap = CopyRectangle;
+  client->GotBitmap = rfbClientCopyRectangle;
   client->FinishedFrameBufferUpdate = NULL;
   client->GetPassword = ReadPassword;
   client->MallocFrameBuffer = MallocFrameBuffer;
@@ -443,6 +456,9 @@ rfbBool rfbClientInitialise(rfbClient* client) {
   if (!SetFormatAndEncodings(client))
     return FALSE;
 
+  if (!StartReceiveThread(client))
+    return FALSE;
+
   if (client->updateRect.x < 0) {
     client->updateRect.x = client->updateRect.y = 0;
     client->updateRect.w = client->width;
@@ -542,8 +558,16 @@ rfbBool rfbInitClient(rfbClient* client,int* argc,char** argv) {
 void rfbClientCleanup(rfbClient* client) {
 #ifdef LIBVNCSERVER_HAVE_LIBZ
   int i;
+#endif
 
-  for ( i = 0; i < 4; i++ ) {
+  /* this may finish a message first, so before freeing any decoding state */
+#ifdef LIBVNCSERVER_WITH_CLIENT_LOOP
+  LeaveClientLoop(client);
+#endif
+  StopReceiveThread(client);
+
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+  for ( i = 0; i < 4 && client->zlibStream; i++ ) {
     if (client->zlibStreamActive[i] == TRUE ) {
       if (inflateEnd (&client->zlibStream[i]) != Z_OK &&
 	  client->zlibStream[i].msg != NULL)
@@ -563,20 +587,36 @@ void rfbClientCleanup(rfbClient* client) {
     client->tjhnd = NULL;
   }
 #endif /* LIBVNCSERVER_HAVE_LIBJPEG */
+
+  free(client->zlibStream);
+  free(client->zlib_buffer);
+  free(client->tightPalette);
+  free(client->tightPrevRow);
 #endif
 
   free(client->ultra_buffer);
   free(client->raw_buffer);
+  free(client->buffer);
+  free(client->buf);
 
   FreeTLS(client);
 
+#ifdef LIBVNCSERVER_HAVE_LIBAVCODEC
+  FreeH264(client);
+#endif
+
+#ifdef LIBVNCSERVER_HAVE_LIBJPEG
+  FreeJpeg(client);
+#endif
+
   while (client->clientData) {
     rfbClientData* next = client->clientData->next;
     free(client->clientData);
     client->clientData = next;
   }
 
-  free(client->vncRec);
+  rfbVNCRecStop(client);
+  FreeVNCRec(client);
 
   if (client->sock != RFB_INVALID_SOCKET)
     rfbCloseSocket(client->sock);
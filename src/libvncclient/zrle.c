@@ -233,12 +233,42 @@ return TRUE;
 #define UncompressCPixel(pointer) (*(CARDBPP*)pointer)
 #endif
 
+#if defined(UNCOMP)
+#define CPIXEL_SHIFT UNCOMP
+#else
+#define CPIXEL_SHIFT 0
+#endif
+
+/* set n pixels from dst on; longer runs of 32 bit pixels are vectorized */
+#if BPP==32
+#define FillRun(dst,n,colour) \
+	do { \
+		if((n)>=8) \
+			ops->fill((dst),(n),(colour)); \
+		else { \
+			int k; \
+			for(k=0; k<(n); k++) \
+				(dst)[k]=(colour); \
+		} \
+	} while(0)
+#else
+#define FillRun(dst,n,colour) \
+	do { \
+		int k; \
+		for(k=0; k<(n); k++) \
+			(dst)[k]=(colour); \
+	} while(0)
+#endif
+
 static int HandleZRLETile(rfbClient* client,
 		uint8_t* buffer,size_t buffer_length,
 		int x,int y,int w,int h) {
 	uint8_t* buffer_copy = buffer;
 	uint8_t* buffer_end = buffer+buffer_length;
 	uint8_t type;
+#if BPP==32
+	const rfbPixelOps* ops = PixelOps();
+#endif
 #if BPP!=8
 	uint8_t zywrle_level = (client->appData.qualityLevel & 0x80) ?
 		0 : (3 - client->appData.qualityLevel / 3);
@@ -267,16 +297,24 @@ static int HandleZRLETile(rfbClient* client,
 #endif
 		{
 #if REALBPP!=BPP
+#if BPP!=32 || REALBPP!=24
 			int i,j;
 
+#endif
 			if(1+w*h*REALBPP/8>buffer_length) {
 				rfbClientLog("expected %d bytes, got only %d (%dx%d)\n",1+w*h*REALBPP/8,buffer_length,w,h);
 				return -3;
 			}
 
+#if BPP==32 && REALBPP==24
+			ops->expandCPixels((CARDBPP*)client->frameBuffer+y*client->width+x,
+					client->width, buffer, w, h, CPIXEL_SHIFT);
+			buffer+=w*h*REALBPP/8;
+#else
 			for(j=y*client->width; j<(y+h)*client->width; j+=client->width)
 				for(i=x; i<x+w; i++,buffer+=REALBPP/8)
 					((CARDBPP*)client->frameBuffer)[j+i] = UncompressCPixel(buffer);
+#endif
 #else
 			client->GotBitmap(client, buffer, x, y, w, h);
 			buffer+=w*h*REALBPP/8;
@@ -310,6 +348,15 @@ static int HandleZRLETile(rfbClient* client,
 				palette[i] = UncompressCPixel(buffer);
 
 			/* read palettized pixels */
+#if BPP==32
+			if(bpp<8) {
+				for(i=type; i<16; i++)
+					palette[i] = 0;
+				ops->unpackPalette((CARDBPP*)client->frameBuffer+y*client->width+x,
+						client->width, buffer, w, h, bpp, palette);
+				buffer+=((w+divider-1)/divider)*h;
+			} else
+#endif
 			for(j=y*client->width; j<(y+h)*client->width; j+=client->width) {
 				for(i=x,shift=8-bpp; i<x+w; i++) {
 					((CARDBPP*)client->frameBuffer)[j+i] = palette[((*buffer)>>shift)&mask];
@@ -346,9 +393,11 @@ static int HandleZRLETile(rfbClient* client,
 				length+=*buffer;
 				buffer++;
 				while(j<h && length>0) {
-					((CARDBPP*)client->frameBuffer)[(y+j)*client->width+x+i] = color;
-					length--;
-					i++;
+					CARDBPP* dst = (CARDBPP*)client->frameBuffer+(y+j)*client->width+x+i;
+					int n = w-i<length ? w-i : length;
+					FillRun(dst,n,color);
+					length-=n;
+					i+=n;
 					if(i>=w) {
 						i=0;
 						j++;
@@ -398,9 +447,11 @@ static int HandleZRLETile(rfbClient* client,
 				}
 				buffer++;
 				while(j<h && length>0) {
-					((CARDBPP*)client->frameBuffer)[(y+j)*client->width+x+i] = color;
-					length--;
-					i++;
+					CARDBPP* dst = (CARDBPP*)client->frameBuffer+(y+j)*client->width+x+i;
+					int n = w-i<length ? w-i : length;
+					FillRun(dst,n,color);
+					length-=n;
+					i+=n;
 					if(i>=w) {
 						i=0;
 						j++;
@@ -420,6 +471,8 @@ static int HandleZRLETile(rfbClient* client,
 #undef HandleZRLE
 #undef HandleZRLETile
 #undef UncompressCPixel
+#undef CPIXEL_SHIFT
+#undef FillRun
 
 #endif
 
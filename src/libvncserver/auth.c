@@ -28,6 +28,8 @@
  */
 
 #include <rfb/rfb.h>
+#include <errno.h>
+#include "private.h"
 
 /* RFB 3.8 clients are well informed */
 void rfbClientSendString(rfbClientPtr cl, const char *reason);
@@ -419,8 +421,10 @@ rfbProcessClientSecurityType(rfbClientPtr cl)
     rfbSecurityHandler* handlerListHead;
     
     /* Read the security type. */
-    n = rfbReadExact(cl, (char *)&chosenType, 1);
+    n = rfbReadHandshake(cl, (char *)&chosenType, 1);
     if (n <= 0) {
+	if (n < 0 && errno == EAGAIN)
+	    return;
 	if (n == 0)
 	    rfbLog("rfbProcessClientSecurityType: client gone\n");
 	else
@@ -436,6 +440,10 @@ rfbProcessClientSecurityType(rfbClientPtr cl)
     case RFB_SECURITY_TYPE:
         handlerListHead = securityHandlers;
         break;
+    default:
+        /* not called in any other state, the type is turned down below */
+        handlerListHead = NULL;
+        break;
     }
 
     /* Make sure it was present in the list sent by the server. */
@@ -465,7 +473,9 @@ rfbAuthProcessClientMessage(rfbClientPtr cl)
     uint8_t response[CHALLENGESIZE];
     uint32_t authResult;
 
-    if ((n = rfbReadExact(cl, (char *)response, CHALLENGESIZE)) <= 0) {
+    if ((n = rfbReadHandshake(cl, (char *)response, CHALLENGESIZE)) <= 0) {
+        if (n < 0 && errno == EAGAIN)
+            return;
         if (n != 0)
             rfbLogPerror("rfbAuthProcessClientMessage: read");
         rfbCloseClient(cl);
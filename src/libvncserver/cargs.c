@@ -36,6 +36,11 @@ rfbUsage(void)
                                                              "(default 40)\n");
     fprintf(stderr, "-deferptrupdate time   time in ms to defer pointer updates"
                                                            " (default none)\n");
+    fprintf(stderr, "-adaptive              send text losslessly and video with a lossy\n"
+                    "                       encoding where the client supports it\n");
+    fprintf(stderr, "-detectcopies          send scrolled and moved areas as CopyRect\n");
+    fprintf(stderr, "-losslessrefresh time  time in ms after which areas sent with a lossy\n"
+                    "                       encoding are resent losslessly (default off)\n");
     fprintf(stderr, "-desktop name          VNC desktop name (default \"LibVNCServer\")\n");
     fprintf(stderr, "-alwaysshared          always treat new clients as shared\n");
     fprintf(stderr, "-nevershared           never treat new clients as shared\n");
@@ -46,7 +51,18 @@ rfbUsage(void)
 #ifdef LIBVNCSERVER_WITH_WEBSOCKETS
     fprintf(stderr, "-sslkeyfile path       set path to private key file for encrypted WebSockets connections\n");
     fprintf(stderr, "-sslcertfile path      set path to certificate file for encrypted WebSockets connections\n");
+    fprintf(stderr, "-wsdeflate level       zlib level for WebSockets permessage-deflate,\n"
+                    "                       0 to turn it off (default 0)\n");
+    fprintf(stderr, "-wshttponly            accept WebSockets connections on the http port only,\n"
+                    "                       so RFB connections don't wait for a handshake\n");
 #endif
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+    fprintf(stderr, "-listenthreads n       accept connections in n threads with a SO_REUSEPORT\n"
+                    "                       socket each when running in the background\n");
+#endif
+    fprintf(stderr, "-nocork                don't cork the socket while writing an update\n");
+    fprintf(stderr, "-tunesndbuf            size the send buffer from the bandwidth-delay product\n");
+    fprintf(stderr, "-notsentlowat bytes    limit the unsent data queued on the socket\n");
     fprintf(stderr, "-httpdir dir-path      enable http server using dir-path home\n");
     fprintf(stderr, "-httpport portnum      use portnum for http connection\n");
 #ifdef LIBVNCSERVER_IPv6
@@ -140,6 +156,16 @@ rfbProcessArguments(rfbScreenInfoPtr rfbScreen,int* argc, char *argv[])
 		return FALSE;
 	    }
             rfbScreen->deferUpdateTime = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-adaptive") == 0) {
+            rfbScreen->adaptiveEncoding = TRUE;
+        } else if (strcmp(argv[i], "-detectcopies") == 0) {
+            rfbScreen->detectCopies = TRUE;
+        } else if (strcmp(argv[i], "-losslessrefresh") == 0) {  /* -losslessrefresh milliseconds */
+            if (i + 1 >= *argc) {
+		rfbUsage();
+		return FALSE;
+	    }
+            rfbScreen->losslessRefreshDelay = atoi(argv[++i]);
         } else if (strcmp(argv[i], "-deferptrupdate") == 0) {  /* -deferptrupdate milliseconds */
             if (i + 1 >= *argc) {
 		rfbUsage();
@@ -158,6 +184,24 @@ rfbProcessArguments(rfbScreenInfoPtr rfbScreen,int* argc, char *argv[])
             rfbScreen->neverShared = TRUE;
         } else if (strcmp(argv[i], "-dontdisconnect") == 0) {
             rfbScreen->dontDisconnect = TRUE;
+        } else if (strcmp(argv[i], "-nocork") == 0) {
+            rfbScreen->corkUpdates = FALSE;
+        } else if (strcmp(argv[i], "-tunesndbuf") == 0) {
+            rfbScreen->tuneSendBuffer = TRUE;
+        } else if (strcmp(argv[i], "-notsentlowat") == 0) {  /* -notsentlowat bytes */
+            if (i + 1 >= *argc) {
+		rfbUsage();
+		return FALSE;
+	    }
+            rfbScreen->notSentLowWater = atoi(argv[++i]);
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+        } else if (strcmp(argv[i], "-listenthreads") == 0) {  /* -listenthreads n */
+            if (i + 1 >= *argc) {
+		rfbUsage();
+		return FALSE;
+	    }
+            rfbScreen->listenerThreads = atoi(argv[++i]);
+#endif
         } else if (strcmp(argv[i], "-httpdir") == 0) {  /* -httpdir directory-path */
             if (i + 1 >= *argc) {
 		rfbUsage();
@@ -215,6 +259,14 @@ rfbProcessArguments(rfbScreenInfoPtr rfbScreen,int* argc, char *argv[])
 		return FALSE;
 	    }
             rfbScreen->sslcertfile = argv[++i];
+        } else if (strcmp(argv[i], "-wsdeflate") == 0) {  /* -wsdeflate level */
+            if (i + 1 >= *argc) {
+		rfbUsage();
+		return FALSE;
+	    }
+            rfbScreen->webSocketsDeflateLevel = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-wshttponly") == 0) {
+            rfbScreen->webSocketsOnRfbPort = FALSE;
 #endif
         } else {
 	    rfbProtocolExtension* extension;
@@ -0,0 +1,289 @@
+/*
+ * classify.c - classify screen tiles by how they change, for adaptive
+ * encoding.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/*
+ * The screen is divided into tiles of TILE_SIZE x TILE_SIZE pixels.  For
+ * every tile we keep an activity count which grows with the area marked
+ * as modified and halves every ACTIVITY_HALF_LIFE milliseconds, and a
+ * colour count sampled from the framebuffer.  Together they tell
+ *
+ *  - text and other UI: few colours,
+ *  - scrolling: few colours, changing a lot,
+ *  - video: many colours, changing a lot,
+ *
+ * apart from tiles which are simply static.  Only marked tiles are
+ * sampled, and each at most once per half-life.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <rfb/rfb.h>
+#include <rfb/rfbregion.h>
+#include "private.h"
+
+#define TILE_SIZE 64
+
+/* activity added by a change covering a whole tile */
+#define ACTIVITY_FULL_UPDATE 16
+/* a tile changing this much within about a second counts as busy */
+#define ACTIVITY_HIGH 160
+#define ACTIVITY_MAX (1 << 20)
+#define ACTIVITY_HALF_LIFE 1000
+
+/* colours are sampled on a grid with this spacing */
+#define SAMPLE_STEP 8
+/* a tile with at least this many sampled colours looks like natural images */
+#define COMPLEXITY_VIDEO 24
+
+typedef struct {
+    unsigned int activity;
+    int colours;                /* -1 if not sampled yet */
+    unsigned int generation;    /* decay generation the sample is from */
+    int tileClass;
+} rfbTileState;
+
+typedef struct {
+    int width, height;          /* framebuffer size the tiles belong to */
+    int tilesX, tilesY;
+    rfbTileState *tiles;
+    unsigned long lastDecay;
+    unsigned int generation;
+    MUTEX(lock);
+} rfbTileClassifier;
+
+static int
+rfbClassifyTile(const rfbTileState *t)
+{
+    /* leave the video class only at half the activity, to avoid flapping */
+    unsigned int high = t->tileClass == rfbTileVideo ? ACTIVITY_HIGH / 2 : ACTIVITY_HIGH;
+
+    if (t->colours < 0)
+        return rfbTileStatic;
+    if (t->colours >= COMPLEXITY_VIDEO)
+        return t->activity >= high ? rfbTileVideo : rfbTileStatic;
+    return t->activity >= ACTIVITY_HIGH ? rfbTileScroll : rfbTileText;
+}
+
+static void
+rfbClassifierDecay(rfbTileClassifier *c)
+{
+    unsigned long now = rfbCurrentTimeMs();
+    unsigned long halvings = (now - c->lastDecay) / ACTIVITY_HALF_LIFE;
+    int i;
+
+    if (halvings == 0)
+        return;
+    c->lastDecay += halvings * ACTIVITY_HALF_LIFE;
+    c->generation++;
+    if (halvings > 31)
+        halvings = 31;
+    for (i = 0; i < c->tilesX * c->tilesY; i++) {
+        c->tiles[i].activity >>= halvings;
+        c->tiles[i].tileClass = rfbClassifyTile(&c->tiles[i]);
+    }
+}
+
+static void
+rfbClassifierResize(rfbTileClassifier *c, int width, int height)
+{
+    int i;
+
+    free(c->tiles);
+    c->width = width;
+    c->height = height;
+    c->tilesX = (width + TILE_SIZE - 1) / TILE_SIZE;
+    c->tilesY = (height + TILE_SIZE - 1) / TILE_SIZE;
+    c->tiles = (rfbTileState *)calloc(c->tilesX * c->tilesY, sizeof(rfbTileState));
+    if (!c->tiles) {
+        c->tilesX = c->tilesY = 0;
+        return;
+    }
+    for (i = 0; i < c->tilesX * c->tilesY; i++)
+        c->tiles[i].colours = -1;
+    c->lastDecay = rfbCurrentTimeMs();
+}
+
+/*
+ * Count the distinct colours on a sampling grid over a tile, stopping at
+ * COMPLEXITY_VIDEO.
+ */
+
+static int
+rfbSampleTileColours(rfbScreenInfoPtr screen, int x1, int y1, int x2, int y2)
+{
+    uint32_t colours[COMPLEXITY_VIDEO];
+    int bpp = screen->bitsPerPixel / 8;
+    int n = 0, x, y, i;
+
+    for (y = y1 + SAMPLE_STEP / 2; y < y2; y += SAMPLE_STEP) {
+        const char *row = screen->frameBuffer + y * screen->paddedWidthInBytes;
+        for (x = x1 + SAMPLE_STEP / 2; x < x2; x += SAMPLE_STEP) {
+            uint32_t pixel = 0;
+            memcpy(&pixel, row + x * bpp, bpp);
+            for (i = 0; i < n; i++)
+                if (colours[i] == pixel)
+                    break;
+            if (i == n) {
+                colours[n++] = pixel;
+                if (n == COMPLEXITY_VIDEO)
+                    return n;
+            }
+        }
+    }
+    return n;
+}
+
+/*
+ * Called from rfbGetScreen(), before any client thread runs; the tiles
+ * follow the framebuffer size once something is marked.
+ */
+
+void
+rfbClassifierInit(rfbScreenInfoPtr screen)
+{
+    rfbTileClassifier *c;
+
+    if (screen->tileClassifier)
+        return;
+    c = (rfbTileClassifier *)calloc(1, sizeof(rfbTileClassifier));
+    if (!c)
+        return;
+    INIT_MUTEX(c->lock);
+    screen->tileClassifier = c;
+}
+
+void
+rfbClassifierMarkModified(rfbScreenInfoPtr screen, sraRegionPtr modRegion)
+{
+    rfbTileClassifier *c = (rfbTileClassifier *)screen->tileClassifier;
+    sraRectangleIterator *i;
+    sraRect rect;
+    int tx, ty;
+
+    if (!c)
+        return;
+    LOCK(c->lock);
+    if (c->width != screen->width || c->height != screen->height)
+        rfbClassifierResize(c, screen->width, screen->height);
+
+    rfbClassifierDecay(c);
+
+    i = sraRgnGetIterator(modRegion);
+    while (sraRgnIteratorNext(i, &rect)) {
+        if (rect.x1 < 0) rect.x1 = 0;
+        if (rect.y1 < 0) rect.y1 = 0;
+        if (rect.x2 > c->width) rect.x2 = c->width;
+        if (rect.y2 > c->height) rect.y2 = c->height;
+        if (rect.x1 >= rect.x2 || rect.y1 >= rect.y2)
+            continue;
+
+        for (ty = rect.y1 / TILE_SIZE; ty <= (rect.y2 - 1) / TILE_SIZE; ty++) {
+            for (tx = rect.x1 / TILE_SIZE; tx <= (rect.x2 - 1) / TILE_SIZE; tx++) {
+                rfbTileState *t = &c->tiles[ty * c->tilesX + tx];
+                int tileX1 = tx * TILE_SIZE, tileY1 = ty * TILE_SIZE;
+                int tileX2 = tileX1 + TILE_SIZE, tileY2 = tileY1 + TILE_SIZE;
+                int w, h;
+
+                if (tileX2 > c->width) tileX2 = c->width;
+                if (tileY2 > c->height) tileY2 = c->height;
+                w = (rect.x2 < tileX2 ? rect.x2 : tileX2) - (rect.x1 > tileX1 ? rect.x1 : tileX1);
+                h = (rect.y2 < tileY2 ? rect.y2 : tileY2) - (rect.y1 > tileY1 ? rect.y1 : tileY1);
+
+                t->activity += ACTIVITY_FULL_UPDATE * w * h
+                    / ((tileX2 - tileX1) * (tileY2 - tileY1)) + 1;
+                if (t->activity > ACTIVITY_MAX)
+                    t->activity = ACTIVITY_MAX;
+                if (t->colours < 0 || t->generation != c->generation) {
+                    t->colours = rfbSampleTileColours(screen, tileX1, tileY1, tileX2, tileY2);
+                    t->generation = c->generation;
+                }
+                t->tileClass = rfbClassifyTile(t);
+            }
+        }
+    }
+    sraRgnReleaseIterator(i);
+
+    UNLOCK(c->lock);
+}
+
+/*
+ * Return the region covered by tiles whose class is in classMask, and in
+ * *updateRate roughly how many times per second the busiest of them
+ * changes completely.
+ */
+
+sraRegionPtr
+rfbClassifierGetRegion(rfbScreenInfoPtr screen, int classMask, int *updateRate)
+{
+    rfbTileClassifier *c = (rfbTileClassifier *)screen->tileClassifier;
+    sraRegionPtr region = sraRgnCreate();
+    unsigned int maxActivity = 0;
+    int tx, ty, runStart;
+
+    if (c) {
+        LOCK(c->lock);
+        rfbClassifierDecay(c);
+        for (ty = 0; ty < c->tilesY; ty++) {
+            /* add each horizontal run of matching tiles as one rectangle */
+            runStart = -1;
+            for (tx = 0; tx <= c->tilesX; tx++) {
+                rfbTileState *t = tx < c->tilesX ? &c->tiles[ty * c->tilesX + tx] : NULL;
+                if (t && (t->tileClass & classMask)) {
+                    if (runStart < 0)
+                        runStart = tx;
+                    if (t->activity > maxActivity)
+                        maxActivity = t->activity;
+                } else if (runStart >= 0) {
+                    sraRegionPtr run = sraRgnCreateRect(runStart * TILE_SIZE, ty * TILE_SIZE,
+                                                        tx * TILE_SIZE, (ty + 1) * TILE_SIZE);
+                    sraRgnOr(region, run);
+                    sraRgnDestroy(run);
+                    runStart = -1;
+                }
+            }
+        }
+        if (c->tilesX > 0) {
+            sraRegionPtr screenRect = sraRgnCreateRect(0, 0, c->width, c->height);
+            sraRgnAnd(region, screenRect);
+            sraRgnDestroy(screenRect);
+        }
+        UNLOCK(c->lock);
+    }
+
+    /* with steady updates the activity settles at rate * half-life / ln 2 */
+    if (updateRate)
+        *updateRate = (int)(maxActivity / ACTIVITY_FULL_UPDATE * 7 * 100 / ACTIVITY_HALF_LIFE);
+    return region;
+}
+
+void
+rfbClassifierFree(rfbScreenInfoPtr screen)
+{
+    rfbTileClassifier *c = (rfbTileClassifier *)screen->tileClassifier;
+
+    if (!c)
+        return;
+    TINI_MUTEX(c->lock);
+    free(c->tiles);
+    free(c);
+    screen->tileClassifier = NULL;
+}
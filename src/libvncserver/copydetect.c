@@ -0,0 +1,384 @@
+/*
+ * copydetect.c - find scrolled and moved areas in modified regions, to
+ * send them as CopyRect.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/*
+ * We keep a copy of the framebuffer as it was before the latest
+ * modifications.  When a rectangle is marked as modified, every row and
+ * every column of it is hashed, both in the framebuffer and in the copy.
+ * A row whose hash is found in the copy some rows up or down votes for a
+ * vertical move by that distance, and likewise for columns.  The winning
+ * move is then checked pixel by pixel, and what matches is scheduled as
+ * a copy instead of being marked as modified.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <rfb/rfb.h>
+#include <rfb/rfbregion.h>
+#include "private.h"
+
+/* rectangles smaller than this in both directions are not searched */
+#define MIN_SEARCH_SIZE 32
+/* moved areas have to be at least this many rows or columns wide */
+#define MIN_RUN 4
+/* moves found in one call before we stop looking */
+#define MAX_MOVES 8
+
+#define HASH_SEED 2166136261U
+#define HASH_PRIME 16777619U
+
+typedef struct {
+    char *frameBuffer;          /* the framebuffer before the latest changes */
+    const char *source;         /* the screen->frameBuffer it is a copy of */
+    int width, height, bytesPerPixel, paddedWidthInBytes;
+    MUTEX(lock);
+} rfbCopyDetector;
+
+typedef struct {
+    sraRegionPtr region;
+    int dx, dy;
+} rfbDetectedMove;
+
+static rfbBool
+rfbCopyDetectorMatches(rfbScreenInfoPtr screen, rfbCopyDetector *d)
+{
+    return d->frameBuffer && d->source == screen->frameBuffer &&
+        d->width == screen->width && d->height == screen->height &&
+        d->bytesPerPixel == screen->bitsPerPixel / 8 &&
+        d->paddedWidthInBytes == screen->paddedWidthInBytes;
+}
+
+static void
+rfbCopyDetectorReset(rfbScreenInfoPtr screen, rfbCopyDetector *d)
+{
+    size_t size = (size_t)screen->height * screen->paddedWidthInBytes;
+
+    free(d->frameBuffer);
+    d->frameBuffer = screen->frameBuffer ? (char *)malloc(size) : NULL;
+    if (d->frameBuffer)
+        memcpy(d->frameBuffer, screen->frameBuffer, size);
+    d->source = screen->frameBuffer;
+    d->width = screen->width;
+    d->height = screen->height;
+    d->bytesPerPixel = screen->bitsPerPixel / 8;
+    d->paddedWidthInBytes = screen->paddedWidthInBytes;
+}
+
+static void
+rfbCopyDetectorSync(rfbScreenInfoPtr screen, rfbCopyDetector *d, sraRegionPtr region)
+{
+    sraRectangleIterator *i;
+    sraRect rect;
+    int y;
+
+    if (!rfbCopyDetectorMatches(screen, d)) {
+        rfbCopyDetectorReset(screen, d);
+        return;
+    }
+
+    i = sraRgnGetIterator(region);
+    while (sraRgnIteratorNext(i, &rect)) {
+        if (rect.x1 < 0) rect.x1 = 0;
+        if (rect.y1 < 0) rect.y1 = 0;
+        if (rect.x2 > d->width) rect.x2 = d->width;
+        if (rect.y2 > d->height) rect.y2 = d->height;
+        for (y = rect.y1; y < rect.y2; y++) {
+            size_t offset = (size_t)y * d->paddedWidthInBytes + rect.x1 * d->bytesPerPixel;
+            memcpy(d->frameBuffer + offset, screen->frameBuffer + offset,
+                   (rect.x2 - rect.x1) * d->bytesPerPixel);
+        }
+    }
+    sraRgnReleaseIterator(i);
+}
+
+/*
+ * Find the shift s for which the most changed entries of cur[] are found
+ * s places earlier in prev[].  Entries occurring more than once in prev[]
+ * are ambiguous and do not vote.
+ */
+
+static int
+rfbFindShift(const uint32_t *cur, const uint32_t *prev, int n, int *votes)
+{
+    int size = 1, i, s, best = 0, bestVotes = 0;
+    int *table, *count;
+    char *dup;
+
+    while (size < 2 * n)
+        size <<= 1;
+    table = (int *)malloc(size * sizeof(int));
+    dup = (char *)calloc(size, 1);
+    count = (int *)calloc(2 * n + 1, sizeof(int));
+    if (!table || !dup || !count) {
+        free(table);
+        free(dup);
+        free(count);
+        *votes = 0;
+        return 0;
+    }
+
+    for (i = 0; i < size; i++)
+        table[i] = -1;
+    for (i = 0; i < n; i++) {
+        unsigned int slot = prev[i] & (size - 1);
+        while (table[slot] >= 0 && prev[table[slot]] != prev[i])
+            slot = (slot + 1) & (size - 1);
+        if (table[slot] < 0)
+            table[slot] = i;
+        else
+            dup[slot] = 1;
+    }
+
+    for (i = 0; i < n; i++) {
+        unsigned int slot = cur[i] & (size - 1);
+        if (cur[i] == prev[i])
+            continue;
+        while (table[slot] >= 0 && prev[table[slot]] != cur[i])
+            slot = (slot + 1) & (size - 1);
+        if (table[slot] < 0 || dup[slot])
+            continue;
+        s = i - table[slot];
+        if (++count[s + n] > bestVotes) {
+            bestVotes = count[s + n];
+            best = s;
+        }
+    }
+
+    free(table);
+    free(dup);
+    free(count);
+    *votes = bestVotes;
+    return best;
+}
+
+/*
+ * Look for a move within the rectangle.  Returns the region it moved to
+ * and the translation, or NULL.
+ */
+
+static sraRegionPtr
+rfbFindMove(rfbScreenInfoPtr screen, rfbCopyDetector *d,
+            int x1, int y1, int x2, int y2, int *dxp, int *dyp)
+{
+    int w = x2 - x1, h = y2 - y1, bpp = d->bytesPerPixel;
+    int stride = d->paddedWidthInBytes;
+    const char *cur = screen->frameBuffer + (size_t)y1 * stride + x1 * bpp;
+    const char *prev = d->frameBuffer + (size_t)y1 * stride + x1 * bpp;
+    uint32_t *rowCur, *rowPrev, *colCur, *colPrev;
+    int votesX, votesY, dx, dy, x, y, start;
+    sraRegionPtr moved = NULL, rect;
+
+    rowCur = (uint32_t *)malloc((2 * h + 2 * w) * sizeof(uint32_t));
+    if (!rowCur)
+        return NULL;
+    rowPrev = rowCur + h;
+    colCur = rowPrev + h;
+    colPrev = colCur + w;
+
+    for (x = 0; x < w; x++)
+        colCur[x] = colPrev[x] = HASH_SEED;
+    for (y = 0; y < h; y++) {
+        const char *c = cur + (size_t)y * stride, *p = prev + (size_t)y * stride;
+        uint32_t hc = HASH_SEED, hp = HASH_SEED;
+        for (x = 0; x < w; x++) {
+            uint32_t pc = 0, pp = 0;
+            memcpy(&pc, c + x * bpp, bpp);
+            memcpy(&pp, p + x * bpp, bpp);
+            hc = (hc ^ pc) * HASH_PRIME;
+            hp = (hp ^ pp) * HASH_PRIME;
+            colCur[x] = (colCur[x] ^ pc) * HASH_PRIME;
+            colPrev[x] = (colPrev[x] ^ pp) * HASH_PRIME;
+        }
+        rowCur[y] = hc;
+        rowPrev[y] = hp;
+    }
+
+    dy = rfbFindShift(rowCur, rowPrev, h, &votesY);
+    dx = rfbFindShift(colCur, colPrev, w, &votesX);
+
+    if (votesY >= MIN_RUN && (double)votesY * w >= (double)votesX * h) {
+        /* vertical: compare whole rows */
+        dx = 0;
+        start = -1;
+        for (y = 0; y <= h; y++) {
+            rfbBool match = y < h && y - dy >= 0 && y - dy < h &&
+                rowCur[y] == rowPrev[y - dy] &&
+                memcmp(cur + (size_t)y * stride, prev + (size_t)(y - dy) * stride, w * bpp) == 0;
+            if (match && start < 0)
+                start = y;
+            if (!match && start >= 0) {
+                if (y - start >= MIN_RUN) {
+                    rect = sraRgnCreateRect(x1, y1 + start, x2, y1 + y);
+                    if (moved) {
+                        sraRgnOr(moved, rect);
+                        sraRgnDestroy(rect);
+                    } else
+                        moved = rect;
+                }
+                start = -1;
+            }
+        }
+    } else if (votesX >= MIN_RUN) {
+        /* horizontal: find runs of matching columns, then compare them */
+        dy = 0;
+        start = -1;
+        for (x = 0; x <= w; x++) {
+            rfbBool match = x < w && x - dx >= 0 && x - dx < w &&
+                colCur[x] == colPrev[x - dx];
+            if (match && start < 0)
+                start = x;
+            if (!match && start >= 0) {
+                for (y = 0; y < h && x - start >= MIN_RUN; y++)
+                    if (memcmp(cur + (size_t)y * stride + start * bpp,
+                               prev + (size_t)y * stride + (start - dx) * bpp,
+                               (x - start) * bpp) != 0)
+                        break;
+                if (x - start >= MIN_RUN && y == h) {
+                    rect = sraRgnCreateRect(x1 + start, y1, x1 + x, y2);
+                    if (moved) {
+                        sraRgnOr(moved, rect);
+                        sraRgnDestroy(rect);
+                    } else
+                        moved = rect;
+                }
+                start = -1;
+            }
+        }
+    }
+
+    free(rowCur);
+    *dxp = dx;
+    *dyp = dy;
+    return moved;
+}
+
+/*
+ * Schedule the moves found in modRegion as copies and return the rest of
+ * it, which is to be marked as modified as usual.
+ */
+
+sraRegionPtr
+rfbDetectCopies(rfbScreenInfoPtr screen, sraRegionPtr modRegion)
+{
+    rfbCopyDetector *d = (rfbCopyDetector *)screen->copyDetector;
+    sraRegionPtr remaining = sraRgnCreateRgn(modRegion);
+    rfbDetectedMove moves[MAX_MOVES];
+    int nMoves = 0, n;
+    sraRectangleIterator *i;
+    sraRect rect;
+
+    if (!d)
+        return remaining;
+
+    LOCK(d->lock);
+    /* if not, there is nothing to compare with yet */
+    if (rfbCopyDetectorMatches(screen, d)) {
+        i = sraRgnGetIterator(modRegion);
+        while (nMoves < MAX_MOVES && sraRgnIteratorNext(i, &rect)) {
+            if (rect.x1 < 0) rect.x1 = 0;
+            if (rect.y1 < 0) rect.y1 = 0;
+            if (rect.x2 > d->width) rect.x2 = d->width;
+            if (rect.y2 > d->height) rect.y2 = d->height;
+            if (rect.x2 - rect.x1 < MIN_SEARCH_SIZE && rect.y2 - rect.y1 < MIN_SEARCH_SIZE)
+                continue;
+            if (rect.x1 >= rect.x2 || rect.y1 >= rect.y2)
+                continue;
+            moves[nMoves].region = rfbFindMove(screen, d, rect.x1, rect.y1, rect.x2, rect.y2,
+                                               &moves[nMoves].dx, &moves[nMoves].dy);
+            if (moves[nMoves].region) {
+                sraRgnSubtract(remaining, moves[nMoves].region);
+                nMoves++;
+            }
+        }
+        sraRgnReleaseIterator(i);
+    }
+    rfbCopyDetectorSync(screen, d, modRegion);
+    UNLOCK(d->lock);
+
+    for (n = 0; n < nMoves; n++) {
+        rfbScheduleCopyRegion(screen, moves[n].region, moves[n].dx, moves[n].dy);
+        sraRgnDestroy(moves[n].region);
+    }
+
+    return remaining;
+}
+
+/*
+ * Called from rfbGetScreen(), before any client thread runs; the copy of
+ * the framebuffer is taken when something is first marked.
+ */
+
+void
+rfbCopyDetectorInit(rfbScreenInfoPtr screen)
+{
+    rfbCopyDetector *d;
+
+    if (screen->copyDetector)
+        return;
+    d = (rfbCopyDetector *)calloc(1, sizeof(rfbCopyDetector));
+    if (!d)
+        return;
+    INIT_MUTEX(d->lock);
+    screen->copyDetector = d;
+}
+
+/* Bring the copy up to date for a region changed by other means. */
+
+void
+rfbCopyDetectorUpdate(rfbScreenInfoPtr screen, sraRegionPtr region)
+{
+    rfbCopyDetector *d = (rfbCopyDetector *)screen->copyDetector;
+
+    if (!d)
+        return;
+    LOCK(d->lock);
+    rfbCopyDetectorSync(screen, d, region);
+    UNLOCK(d->lock);
+}
+
+/* Forget the copy, the framebuffer was replaced. */
+
+void
+rfbCopyDetectorClear(rfbScreenInfoPtr screen)
+{
+    rfbCopyDetector *d = (rfbCopyDetector *)screen->copyDetector;
+
+    if (!d)
+        return;
+    LOCK(d->lock);
+    free(d->frameBuffer);
+    d->frameBuffer = NULL;
+    UNLOCK(d->lock);
+}
+
+void
+rfbCopyDetectorFree(rfbScreenInfoPtr screen)
+{
+    rfbCopyDetector *d = (rfbCopyDetector *)screen->copyDetector;
+
+    if (!d)
+        return;
+    TINI_MUTEX(d->lock);
+    free(d->frameBuffer);
+    free(d);
+    screen->copyDetector = NULL;
+}
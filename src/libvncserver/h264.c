@@ -0,0 +1,406 @@
+/*
+ * h264.c
+ *
+ * Routines to implement H.264 encoding using a software encoder
+ * (x264 or OpenH264) via FFmpeg's libavcodec.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <rfb/rfb.h>
+#include "private.h"
+
+#include <libavcodec/avcodec.h>
+#include <libavutil/opt.h>
+#include <libswscale/swscale.h>
+
+/*
+ * There is no periodic intra refresh; keyframes are sent when a client
+ * connects, when it asks for a full update, or when the encoder has to
+ * be set up again, so the GOP can be very long.
+ */
+#define H264_GOP_SIZE 600
+#define H264_FRAME_RATE 30
+#define H264_DEFAULT_CRF 23
+
+/* per-client encoder state, kept in cl->h264Data */
+typedef struct rfbH264Data {
+    AVCodecContext *ctx;
+    AVFrame *frame;
+    AVPacket *pkt;
+    struct SwsContext *sws;
+    int x, y, w, h;    /* rectangle the encoder context belongs to */
+    int crf;           /* rate factor the encoder was opened with */
+    int64_t pts;
+    char *buf;         /* encoded bitstream of the current frame */
+    int bufSize;
+} rfbH264Data;
+
+/* maps tight quality levels 0..9 to x264 constant rate factors */
+static const int tight2crf[10] = {
+    40, 37, 34, 31, 28, 26, 24, 22, 20, 18
+};
+
+/*
+ * Find the libswscale pixel format describing the server's framebuffer
+ * memory layout, AV_PIX_FMT_NONE if there is none.
+ */
+
+static enum AVPixelFormat
+rfbH264SourceFormat(const rfbPixelFormat *pf)
+{
+    if (!pf->trueColour)
+        return AV_PIX_FMT_NONE;
+
+    if (pf->bitsPerPixel == 32 && pf->redMax == 255 &&
+        pf->greenMax == 255 && pf->blueMax == 255 &&
+        pf->redShift % 8 == 0 && pf->greenShift % 8 == 0 &&
+        pf->blueShift % 8 == 0) {
+        /* byte offset of each component in memory */
+        int r = pf->bigEndian ? 3 - pf->redShift / 8 : pf->redShift / 8;
+        int g = pf->bigEndian ? 3 - pf->greenShift / 8 : pf->greenShift / 8;
+        int b = pf->bigEndian ? 3 - pf->blueShift / 8 : pf->blueShift / 8;
+
+        if (r == 0 && g == 1 && b == 2)
+            return AV_PIX_FMT_RGB0;
+        if (b == 0 && g == 1 && r == 2)
+            return AV_PIX_FMT_BGR0;
+        if (r == 1 && g == 2 && b == 3)
+            return AV_PIX_FMT_0RGB;
+        if (b == 1 && g == 2 && r == 3)
+            return AV_PIX_FMT_0BGR;
+        return AV_PIX_FMT_NONE;
+    }
+
+    if (pf->bitsPerPixel == 16 && pf->redMax == 31 && pf->blueMax == 31) {
+        if (pf->greenMax == 63 && pf->greenShift == 5) {
+            if (pf->redShift == 11 && pf->blueShift == 0)
+                return pf->bigEndian ? AV_PIX_FMT_RGB565BE : AV_PIX_FMT_RGB565LE;
+            if (pf->redShift == 0 && pf->blueShift == 11)
+                return pf->bigEndian ? AV_PIX_FMT_BGR565BE : AV_PIX_FMT_BGR565LE;
+        }
+        if (pf->greenMax == 31 && pf->greenShift == 5) {
+            if (pf->redShift == 10 && pf->blueShift == 0)
+                return pf->bigEndian ? AV_PIX_FMT_RGB555BE : AV_PIX_FMT_RGB555LE;
+            if (pf->redShift == 0 && pf->blueShift == 10)
+                return pf->bigEndian ? AV_PIX_FMT_BGR555BE : AV_PIX_FMT_BGR555LE;
+        }
+    }
+
+    return AV_PIX_FMT_NONE;
+}
+
+static const AVCodec *
+rfbH264FindEncoder(void)
+{
+    static const char *names[] = { "libx264", "libopenh264", NULL };
+    const AVCodec *codec = NULL;
+    int i;
+
+    for (i = 0; names[i] && !codec; i++)
+        codec = avcodec_find_encoder_by_name(names[i]);
+    if (!codec)
+        codec = avcodec_find_encoder(AV_CODEC_ID_H264);
+    return codec;
+}
+
+/*
+ * Returns TRUE if H.264 can be offered to this client, i.e. an encoder is
+ * available and the server's pixel format can be converted. Why not is
+ * logged once per client.
+ */
+
+rfbBool
+rfbH264CanEncode(rfbClientPtr cl)
+{
+    const char *reason = NULL;
+
+    if (rfbH264SourceFormat(&cl->screen->serverFormat) == AV_PIX_FMT_NONE)
+        reason = "unsupported server pixel format";
+    else if (!rfbH264FindEncoder())
+        reason = "no encoder available";
+    if (!reason)
+        return TRUE;
+
+    if (!cl->h264Logged) {
+        rfbLog("H.264: %s, not using H.264 for client %s\n", reason, cl->host);
+        cl->h264Logged = TRUE;
+    }
+    return FALSE;
+}
+
+static void
+rfbH264CloseEncoder(rfbH264Data *d)
+{
+    avcodec_free_context(&d->ctx);
+    av_frame_free(&d->frame);
+    av_packet_free(&d->pkt);
+    if (d->sws) {
+        sws_freeContext(d->sws);
+        d->sws = NULL;
+    }
+}
+
+void
+rfbFreeH264Data(rfbClientPtr cl)
+{
+    rfbH264Data *d = (rfbH264Data *)cl->h264Data;
+
+    if (!d)
+        return;
+    rfbH264CloseEncoder(d);
+    free(d->buf);
+    free(d);
+    cl->h264Data = NULL;
+}
+
+/*
+ * (Re-)create the encoder for a rectangle of the given geometry.  H.264
+ * needs even dimensions, so odd sizes are padded; the client crops.
+ */
+
+static rfbBool
+rfbH264OpenEncoder(rfbClientPtr cl, rfbH264Data *d, int x, int y, int w, int h, int crf)
+{
+    const AVCodec *codec;
+    enum AVPixelFormat srcFormat;
+
+    rfbH264CloseEncoder(d);
+
+    srcFormat = rfbH264SourceFormat(&cl->screen->serverFormat);
+    codec = rfbH264FindEncoder();
+    if (srcFormat == AV_PIX_FMT_NONE || !codec) {
+        rfbErr("H.264: cannot encode for client %s\n", cl->host);
+        return FALSE;
+    }
+
+    d->ctx = avcodec_alloc_context3(codec);
+    if (!d->ctx) {
+        rfbErr("H.264: could not allocate encoder context\n");
+        return FALSE;
+    }
+    d->ctx->width = (w + 1) & ~1;
+    d->ctx->height = (h + 1) & ~1;
+    d->ctx->pix_fmt = AV_PIX_FMT_YUV420P;
+    d->ctx->time_base.num = 1;
+    d->ctx->time_base.den = H264_FRAME_RATE;
+    d->ctx->framerate.num = H264_FRAME_RATE;
+    d->ctx->framerate.den = 1;
+    d->ctx->gop_size = H264_GOP_SIZE;
+    d->ctx->max_b_frames = 0;
+    d->ctx->flags |= AV_CODEC_FLAG_LOW_DELAY;
+
+    /* these are x264 options; other encoders simply ignore them */
+    av_opt_set(d->ctx->priv_data, "preset", "ultrafast", 0);
+    av_opt_set(d->ctx->priv_data, "tune", "zerolatency", 0);
+    av_opt_set(d->ctx->priv_data, "forced-idr", "1", 0);
+    av_opt_set_int(d->ctx->priv_data, "crf", crf, 0);
+
+    if (avcodec_open2(d->ctx, codec, NULL) < 0) {
+        rfbErr("H.264: could not open encoder %s\n", codec->name);
+        rfbH264CloseEncoder(d);
+        return FALSE;
+    }
+
+    d->frame = av_frame_alloc();
+    d->pkt = av_packet_alloc();
+    if (!d->frame || !d->pkt) {
+        rfbErr("H.264: could not allocate frame\n");
+        rfbH264CloseEncoder(d);
+        return FALSE;
+    }
+    d->frame->format = d->ctx->pix_fmt;
+    d->frame->width = d->ctx->width;
+    d->frame->height = d->ctx->height;
+    if (av_frame_get_buffer(d->frame, 32) < 0) {
+        rfbErr("H.264: could not allocate frame buffer\n");
+        rfbH264CloseEncoder(d);
+        return FALSE;
+    }
+
+    d->sws = sws_getContext(w, h, srcFormat, w, h, AV_PIX_FMT_YUV420P,
+                            SWS_POINT, NULL, NULL, NULL);
+    if (!d->sws) {
+        rfbErr("H.264: could not set up colour conversion\n");
+        rfbH264CloseEncoder(d);
+        return FALSE;
+    }
+
+    d->x = x;
+    d->y = y;
+    d->w = w;
+    d->h = h;
+    d->crf = crf;
+    d->pts = 0;
+
+    rfbLog("H.264: using encoder %s for %dx%d+%d+%d, client %s\n",
+           codec->name, w, h, x, y, cl->host);
+    return TRUE;
+}
+
+/*
+ * Append the packets the encoder has ready to d->buf; returns the number
+ * of bytes collected or -1 on error.
+ */
+
+static int
+rfbH264Collect(rfbH264Data *d)
+{
+    int len = 0, ret;
+
+    for (;;) {
+        ret = avcodec_receive_packet(d->ctx, d->pkt);
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+            break;
+        if (ret < 0)
+            return -1;
+        if (len + d->pkt->size > d->bufSize) {
+            char *newBuf = realloc(d->buf, len + d->pkt->size);
+            if (!newBuf) {
+                av_packet_unref(d->pkt);
+                return -1;
+            }
+            d->buf = newBuf;
+            d->bufSize = len + d->pkt->size;
+        }
+        memcpy(d->buf + len, d->pkt->data, d->pkt->size);
+        len += d->pkt->size;
+        av_packet_unref(d->pkt);
+    }
+    return len;
+}
+
+/*
+ * rfbSendRectEncodingH264 - send a given rectangle as one H.264 frame.
+ * The encoder context follows the rectangle: if position or size change,
+ * a new context is created and the client is told to reset its decoder.
+ */
+
+rfbBool
+rfbSendRectEncodingH264(rfbClientPtr cl,
+                        int x,
+                        int y,
+                        int w,
+                        int h)
+{
+    rfbFramebufferUpdateRectHeader rect;
+    rfbH264Header hdr;
+    rfbH264Data *d = (rfbH264Data *)cl->h264Data;
+    uint32_t flags = 0;
+    const uint8_t *src[4] = { NULL, NULL, NULL, NULL };
+    int srcStride[4] = { 0, 0, 0, 0 };
+    int crf = H264_DEFAULT_CRF;
+    int len, i, portionLen;
+
+#if defined(LIBVNCSERVER_HAVE_LIBZ) || defined(LIBVNCSERVER_HAVE_LIBPNG)
+    if (cl->tightQualityLevel >= 0 && cl->tightQualityLevel <= 9)
+        crf = tight2crf[cl->tightQualityLevel];
+#endif
+
+    if (!d) {
+        d = (rfbH264Data *)calloc(1, sizeof(rfbH264Data));
+        if (!d) {
+            rfbErr("rfbSendRectEncodingH264: out of memory\n");
+            return FALSE;
+        }
+        cl->h264Data = d;
+    }
+
+    if (!d->ctx || d->x != x || d->y != y || d->w != w || d->h != h ||
+        d->crf != crf) {
+        if (!rfbH264OpenEncoder(cl, d, x, y, w, h, crf))
+            return FALSE;
+        flags |= rfbH264FlagResetContext;
+        cl->h264ForceKeyframe = TRUE;
+    }
+
+    if (av_frame_make_writable(d->frame) < 0) {
+        rfbErr("rfbSendRectEncodingH264: frame not writable\n");
+        return FALSE;
+    }
+
+    src[0] = (const uint8_t *)(cl->scaledScreen->frameBuffer
+                               + (cl->scaledScreen->paddedWidthInBytes * y)
+                               + (x * (cl->scaledScreen->bitsPerPixel / 8)));
+    srcStride[0] = cl->scaledScreen->paddedWidthInBytes;
+    sws_scale(d->sws, src, srcStride, 0, h, d->frame->data, d->frame->linesize);
+
+    d->frame->pts = d->pts++;
+    if (cl->h264ForceKeyframe) {
+        d->frame->pict_type = AV_PICTURE_TYPE_I;
+        cl->h264ForceKeyframe = FALSE;
+    } else {
+        d->frame->pict_type = AV_PICTURE_TYPE_NONE;
+    }
+
+    if (avcodec_send_frame(d->ctx, d->frame) < 0 ||
+        (len = rfbH264Collect(d)) < 0) {
+        rfbErr("rfbSendRectEncodingH264: encoding failed\n");
+        return FALSE;
+    }
+
+    if (len == 0) {
+        /* the encoder held the picture back; with LastRect the update
+         * simply ends without it, otherwise the announced rectangle
+         * carries the pixels raw */
+        if (cl->enableLastRectEncoding)
+            return TRUE;
+        return rfbSendRectEncodingRaw(cl, x, y, w, h);
+    }
+
+    if (cl->ublen + sz_rfbFramebufferUpdateRectHeader
+        + sz_rfbH264Header > UPDATE_BUF_SIZE) {
+        if (!rfbSendUpdateBuf(cl))
+            return FALSE;
+    }
+
+    rect.r.x = Swap16IfLE(x);
+    rect.r.y = Swap16IfLE(y);
+    rect.r.w = Swap16IfLE(w);
+    rect.r.h = Swap16IfLE(h);
+    rect.encoding = Swap32IfLE(rfbEncodingH264);
+
+    memcpy(&cl->updateBuf[cl->ublen], (char *)&rect,
+           sz_rfbFramebufferUpdateRectHeader);
+    cl->ublen += sz_rfbFramebufferUpdateRectHeader;
+
+    hdr.length = Swap32IfLE(len);
+    hdr.flags = Swap32IfLE(flags);
+
+    memcpy(&cl->updateBuf[cl->ublen], (char *)&hdr, sz_rfbH264Header);
+    cl->ublen += sz_rfbH264Header;
+
+    rfbStatRecordEncodingSent(cl, rfbEncodingH264,
+                              sz_rfbFramebufferUpdateRectHeader + sz_rfbH264Header + len,
+                              w * h * (cl->format.bitsPerPixel / 8));
+
+    portionLen = UPDATE_BUF_SIZE;
+    for (i = 0; i < len; i += portionLen) {
+        if (i + portionLen > len) {
+            portionLen = len - i;
+        }
+        if (cl->ublen + portionLen > UPDATE_BUF_SIZE) {
+            if (!rfbSendUpdateBuf(cl))
+                return FALSE;
+        }
+        memcpy(&cl->updateBuf[cl->ublen], &d->buf[i], portionLen);
+        cl->ublen += portionLen;
+    }
+
+    return TRUE;
+}
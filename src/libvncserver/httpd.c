@@ -44,10 +44,17 @@
 #ifdef LIBVNCSERVER_HAVE_SYS_TIME_H
 #include <sys/time.h>
 #endif
+#ifdef LIBVNCSERVER_HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+#ifdef LIBVNCSERVER_HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
 
 #ifdef WIN32
 #include <io.h>
 #define strcasecmp _stricmp
+#define strncasecmp _strnicmp
 #if defined(_MSC_VER)
 #include <BaseTsd.h> /* For the missing ssize_t */
 #define ssize_t SSIZE_T
@@ -58,6 +65,7 @@
 #endif
 
 #include "sockets.h"
+#include "private.h"
 
 #ifdef USE_LIBWRAP
 #include <tcpd.h>
@@ -72,18 +80,86 @@
     "<HEAD><TITLE>Invalid Request</TITLE></HEAD>\n" \
     "<BODY><H1>Invalid request</H1></BODY>\n"
 
-#define OK_STR "HTTP/1.0 200 OK\r\nConnection: close\r\n"
+#define OK_STR "HTTP/1.1 200 OK\r\n%sContent-Length: %lu\r\n%sConnection: %s\r\n\r\n"
 
+#define NOT_MODIFIED_STR "HTTP/1.1 304 Not Modified\r\nETag: %s\r\nConnection: %s\r\n\r\n"
 
-static void httpProcessInput(rfbScreenInfoPtr screen);
-static rfbBool compareAndSkip(char **ptr, const char *str);
-static rfbBool parseParams(const char *request, char *result, int max_bytes);
-static rfbBool validateString(char *str);
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+/* tell the kernel more data follows the response header */
+#ifdef MSG_MORE
+#define HTTP_MSG_MORE MSG_MORE
+#else
+#define HTTP_MSG_MORE 0
+#endif
 
 #define BUF_SIZE 32768
 
-static char buf[BUF_SIZE];
-static size_t buf_filled=0;
+/* a request including its headers may not be longer than this */
+#define HTTP_REQUEST_SIZE 8192
+#define HTTP_MAX_CONNECTIONS 256
+/* keep-alive connections idle for this long are closed */
+#define HTTP_IDLE_TIMEOUT_MS 30000
+/* how often cached file information is checked against the file system */
+#define HTTP_CACHE_CHECK_MS 1000
+#define HTTP_CACHE_MAX_FILES 256
+/* .vnc files get substitutions and are sent from memory */
+#define HTTP_MAX_VNC_FILE_SIZE (1024 * 1024)
+
+/*
+ * One HTTP connection.  Requests are read into request, and each response
+ * is sent from out, followed by the contents of file if that is open.
+ */
+
+typedef struct rfbHttpConn {
+    rfbSocket sock;
+    char request[HTTP_REQUEST_SIZE];
+    size_t filled;
+    char *out;
+    size_t outLen, outSent;
+    int file;                   /* -1 if none */
+    off_t fileOffset, fileEnd;
+    rfbBool keepAlive;          /* keep the connection after the response */
+    unsigned long lastActive;
+    struct rfbHttpConn *next;
+} rfbHttpConn;
+
+/*
+ * What we know about a file below httpDir, checked against the file system
+ * at most every HTTP_CACHE_CHECK_MS.  The contents are not cached, they
+ * are sent from the page cache with sendfile().
+ */
+
+typedef struct rfbHttpFile {
+    char *name;
+    off_t size;
+    char etag[48];
+    rfbBool hasGz;              /* a precompressed name.gz is up to date */
+    unsigned long checked;
+    struct rfbHttpFile *next;
+} rfbHttpFile;
+
+typedef struct {
+    rfbHttpConn *conns;
+    int nConns;
+    rfbHttpFile *files;
+    int nFiles;
+} rfbHttpState;
+
+typedef struct {
+    char *data;
+    size_t len, size;
+} rfbHttpBuf;
+
+static rfbBool httpRead(rfbScreenInfoPtr rfbScreen, rfbHttpConn *c);
+static rfbBool httpSend(rfbHttpConn *c);
+static rfbBool httpProcessRequests(rfbScreenInfoPtr rfbScreen, rfbHttpConn *c);
+static rfbBool httpProcessRequest(rfbScreenInfoPtr rfbScreen, rfbHttpConn *c, char *request);
+static rfbBool compareAndSkip(char **ptr, const char *str);
+static rfbBool parseParams(const char *request, char *result, int max_bytes);
+static rfbBool validateString(char *str);
 
 /*
  * httpInitSockets sets up the TCP socket to listen for HTTP connections.
@@ -111,6 +187,8 @@ rfbHttpInitSockets(rfbScreenInfoPtr rfbScreen)
 	rfbLogPerror("ListenOnTCPPort");
 	return;
     }
+    /* connections are accepted until there are no more pending */
+    rfbSetNonBlocking(rfbScreen->httpListenSock);
     rfbLog("Listening for HTTP connections on TCP port %d\n", rfbScreen->httpPort);
     rfbLog("  URL http://%s:%d\n",rfbScreen->thisHost,rfbScreen->httpPort);
 
@@ -124,6 +202,7 @@ rfbHttpInitSockets(rfbScreenInfoPtr rfbScreen)
       /* ListenOnTCP6Port has its own detailed error printout */
       return;
     }
+    rfbSetNonBlocking(rfbScreen->httpListen6Sock);
     rfbLog("Listening for HTTP connections on TCP6 port %d\n", rfbScreen->http6Port);
     rfbLog("  URL http://%s:%d\n",rfbScreen->thisHost,rfbScreen->http6Port);
 #endif
@@ -136,13 +215,50 @@ rfbHttpInitSockets(rfbScreenInfoPtr rfbScreen)
     cl.writeToSocket = rfbDefaultWriteToSocket;
 }
 
+static void
+httpCloseConn(rfbHttpConn *c)
+{
+    if (c->sock != RFB_INVALID_SOCKET)
+	rfbCloseSocket(c->sock);
+    if (c->file != -1)
+	close(c->file);
+    free(c->out);
+    free(c);
+}
+
+static void
+httpFreeFiles(rfbHttpState *state)
+{
+    rfbHttpFile *f;
+
+    while ((f = state->files) != NULL) {
+	state->files = f->next;
+	free(f->name);
+	free(f);
+    }
+    state->nFiles = 0;
+}
+
 void rfbHttpShutdownSockets(rfbScreenInfoPtr rfbScreen) {
+    rfbHttpState *state = (rfbHttpState *)rfbScreen->httpState;
+    rfbHttpConn *c;
+
     if(rfbScreen->httpSock>-1) {
 	FD_CLR(rfbScreen->httpSock,&rfbScreen->allFds);
 	rfbCloseSocket(rfbScreen->httpSock);
 	rfbScreen->httpSock=RFB_INVALID_SOCKET;
     }
 
+    if (state) {
+	while ((c = state->conns) != NULL) {
+	    state->conns = c->next;
+	    httpCloseConn(c);
+	}
+	httpFreeFiles(state);
+	free(state);
+	rfbScreen->httpState = NULL;
+    }
+
     if(rfbScreen->httpListenSock>-1) {
 	FD_CLR(rfbScreen->httpListenSock,&rfbScreen->allFds);
 	rfbCloseSocket(rfbScreen->httpListenSock);
@@ -169,66 +285,61 @@ void rfbHttpShutdownSockets(rfbScreenInfoPtr rfbScreen) {
     memset(&cl, 0, sizeof(rfbClientRec));
 }
 
+static rfbBool
+httpSending(rfbHttpConn *c)
+{
+    return c->outLen > 0 || c->file != -1;
+}
+
 /*
- * httpCheckFds is called from ProcessInputEvents to check for input on the
- * HTTP socket(s).  If there is input to process, httpProcessInput is called.
- * TODO When a new client connects, the active HTTP connection is abruptly
- * terminated, the ongoing download or data transfer for the active client will
- * be cut off because the server closes the socket without waiting for the
- * transfer to complete. The new client then takes over the single httpSock, and
- * the previous client loses its connection.
+ * Add the HTTP sockets to the sets to select() on: the listening sockets
+ * and the connections, for writing while they have a response to send and
+ * for reading otherwise.  Returns the highest socket added, or -1.
  */
 
-void
-rfbHttpCheckFds(rfbScreenInfoPtr rfbScreen)
+int
+rfbHttpSetFds(rfbScreenInfoPtr rfbScreen, fd_set *readFds, fd_set *writeFds)
+{
+    rfbHttpState *state = (rfbHttpState *)rfbScreen->httpState;
+    rfbHttpConn *c;
+    int maxFd = -1;
+
+    if (!rfbScreen->httpDir || rfbScreen->httpListenSock == RFB_INVALID_SOCKET)
+	return -1;
+
+    if (!state || state->nConns < HTTP_MAX_CONNECTIONS) {
+	FD_SET(rfbScreen->httpListenSock, readFds);
+	maxFd = rfbScreen->httpListenSock;
+	if (rfbScreen->httpListen6Sock != RFB_INVALID_SOCKET) {
+	    FD_SET(rfbScreen->httpListen6Sock, readFds);
+	    maxFd = rfbMax(maxFd, rfbScreen->httpListen6Sock);
+	}
+    }
+    for (c = state ? state->conns : NULL; c; c = c->next) {
+	FD_SET(c->sock, httpSending(c) ? writeFds : readFds);
+	maxFd = rfbMax(maxFd, c->sock);
+    }
+    return maxFd;
+}
+
+/*
+ * Accept the connections pending on a listening socket.
+ */
+
+static void
+httpAccept(rfbScreenInfoPtr rfbScreen, rfbHttpState *state, rfbSocket listenSock)
 {
-    int nfds;
-    fd_set fds;
-    struct timeval tv;
 #ifdef LIBVNCSERVER_IPv6
     struct sockaddr_storage addr;
 #else
     struct sockaddr_in addr;
 #endif
-    socklen_t addrlen = sizeof(addr);
-
-    if (!rfbScreen->httpDir)
-	return;
-
-    if (rfbScreen->httpListenSock == RFB_INVALID_SOCKET)
-	return;
-
-    FD_ZERO(&fds);
-    FD_SET(rfbScreen->httpListenSock, &fds);
-    if (rfbScreen->httpListen6Sock != RFB_INVALID_SOCKET) {
-	FD_SET(rfbScreen->httpListen6Sock, &fds);
-    }
-    if (rfbScreen->httpSock != RFB_INVALID_SOCKET) {
-	FD_SET(rfbScreen->httpSock, &fds);
-    }
-    tv.tv_sec = 0;
-    tv.tv_usec = 0;
-    nfds = select(rfbMax(rfbScreen->httpListen6Sock, rfbMax(rfbScreen->httpSock,rfbScreen->httpListenSock)) + 1, &fds, NULL, NULL, &tv);
-    if (nfds == 0) {
-	return;
-    }
-    if (nfds < 0) {
-#ifdef WIN32
-		errno = WSAGetLastError();
-#endif
-	if (errno != EINTR)
-		rfbLogPerror("httpCheckFds: select");
-	return;
-    }
-
-    if ((rfbScreen->httpSock != RFB_INVALID_SOCKET) && FD_ISSET(rfbScreen->httpSock, &fds)) {
-	httpProcessInput(rfbScreen);
-    }
-
-    if ((rfbScreen->httpListenSock != RFB_INVALID_SOCKET && FD_ISSET(rfbScreen->httpListenSock, &fds))
-        || (rfbScreen->httpListen6Sock != RFB_INVALID_SOCKET && FD_ISSET(rfbScreen->httpListen6Sock, &fds))) {
-	if (rfbScreen->httpSock != RFB_INVALID_SOCKET) rfbCloseSocket(rfbScreen->httpSock);
+    socklen_t addrlen;
+    rfbSocket sock;
+    rfbHttpConn *c;
 
+    while (state->nConns < HTTP_MAX_CONNECTIONS) {
+	addrlen = sizeof(addr);
 	/*
 	 * Mirror the RFB listener in listenerRun(): on a failed accept() just bail and
 	 * keep the listening socket. While the bound interface's address is gone the
@@ -236,16 +347,8 @@ rfbHttpCheckFds(rfbScreenInfoPtr rfbScreen)
 	 * the address returns. Logging every failure here would flood the log for the
 	 * whole down period, so stay silent like the RFB path does.
 	 */
-	if(FD_ISSET(rfbScreen->httpListenSock, &fds)) {
-	    if ((rfbScreen->httpSock = accept(rfbScreen->httpListenSock, (struct sockaddr *)&addr, &addrlen)) == RFB_INVALID_SOCKET) {
-	      return;
-	    }
-	}
-	else if(FD_ISSET(rfbScreen->httpListen6Sock, &fds)) {
-	    if ((rfbScreen->httpSock = accept(rfbScreen->httpListen6Sock, (struct sockaddr *)&addr, &addrlen)) == RFB_INVALID_SOCKET) {
-	      return;
-	    }
-	}
+	if ((sock = accept(listenSock, (struct sockaddr *)&addr, &addrlen)) == RFB_INVALID_SOCKET)
+	    return;
 
 #ifdef USE_LIBWRAP
 	char host[1024];
@@ -261,167 +364,598 @@ rfbHttpCheckFds(rfbScreenInfoPtr rfbScreen)
 		      STRING_UNKNOWN)) {
 	  rfbLog("Rejected HTTP connection from client %s\n",
 		 host);
-	  rfbCloseSocket(rfbScreen->httpSock);
-	  rfbScreen->httpSock=RFB_INVALID_SOCKET;
-	  return;
+	  rfbCloseSocket(sock);
+	  continue;
 	}
 #endif
-        if(!rfbSetNonBlocking(rfbScreen->httpSock)) {
-	    rfbCloseSocket(rfbScreen->httpSock);
-	    rfbScreen->httpSock=RFB_INVALID_SOCKET;
+	if (!rfbSetNonBlocking(sock)
+#ifndef WIN32
+	    || sock >= FD_SETSIZE
+#endif
+	    ) {
+	    rfbCloseSocket(sock);
+	    continue;
+	}
+
+	c = (rfbHttpConn *)calloc(1, sizeof(rfbHttpConn));
+	if (!c) {
+	    rfbCloseSocket(sock);
 	    return;
 	}
-	/*AddEnabledDevice(httpSock);*/
+	c->sock = sock;
+	c->file = -1;
+	c->lastActive = rfbCurrentTimeMs();
+	c->next = state->conns;
+	state->conns = c;
+	state->nConns++;
     }
 }
 
+/*
+ * httpCheckFds is called from ProcessInputEvents to check for input on the
+ * HTTP sockets.  It accepts new connections, reads requests and sends
+ * responses as far as this is possible without blocking, and closes
+ * connections which have been idle for too long.
+ */
 
-static void
-httpCloseSock(rfbScreenInfoPtr rfbScreen)
+void
+rfbHttpCheckFds(rfbScreenInfoPtr rfbScreen)
 {
-    rfbCloseSocket(rfbScreen->httpSock);
-    rfbScreen->httpSock = RFB_INVALID_SOCKET;
-    buf_filled = 0;
+    rfbHttpState *state;
+    rfbHttpConn **cp, *c;
+    int nfds, maxFd;
+    fd_set readFds, writeFds;
+    struct timeval tv;
+    unsigned long now;
+    rfbBool keep;
+
+    if (!rfbScreen->httpDir)
+	return;
+
+    if (rfbScreen->httpListenSock == RFB_INVALID_SOCKET)
+	return;
+
+    if (!rfbScreen->httpState) {
+	rfbScreen->httpState = calloc(1, sizeof(rfbHttpState));
+	if (!rfbScreen->httpState)
+	    return;
+    }
+    state = (rfbHttpState *)rfbScreen->httpState;
+
+    FD_ZERO(&readFds);
+    FD_ZERO(&writeFds);
+    maxFd = rfbHttpSetFds(rfbScreen, &readFds, &writeFds);
+    tv.tv_sec = 0;
+    tv.tv_usec = 0;
+    nfds = select(maxFd + 1, &readFds, &writeFds, NULL, &tv);
+    if (nfds < 0) {
+#ifdef WIN32
+		errno = WSAGetLastError();
+#endif
+	if (errno != EINTR)
+		rfbLogPerror("httpCheckFds: select");
+	return;
+    }
+
+    now = rfbCurrentTimeMs();
+    cp = &state->conns;
+    while ((c = *cp) != NULL) {
+	if (nfds > 0 && FD_ISSET(c->sock, &writeFds))
+	    /* a finished response may leave pipelined requests behind */
+	    keep = httpSend(c) && (httpSending(c) || httpProcessRequests(rfbScreen, c));
+	else if (nfds > 0 && FD_ISSET(c->sock, &readFds))
+	    keep = httpRead(rfbScreen, c);
+	else
+	    keep = now - c->lastActive < HTTP_IDLE_TIMEOUT_MS;
+
+	if (keep) {
+	    cp = &c->next;
+	} else {
+	    *cp = c->next;
+	    httpCloseConn(c);
+	    state->nConns--;
+	}
+    }
+
+    /* new connections are read from on the next call */
+    if (nfds > 0 && FD_ISSET(rfbScreen->httpListenSock, &readFds))
+	httpAccept(rfbScreen, state, rfbScreen->httpListenSock);
+    if (nfds > 0 && rfbScreen->httpListen6Sock != RFB_INVALID_SOCKET
+	&& FD_ISSET(rfbScreen->httpListen6Sock, &readFds))
+	httpAccept(rfbScreen, state, rfbScreen->httpListen6Sock);
 }
 
 /*
- * httpProcessInput is called when input is received on the HTTP socket.
+ * Read from a connection and answer the complete requests.  Returns FALSE
+ * if the connection is to be closed.
  */
 
-static void
-httpProcessInput(rfbScreenInfoPtr rfbScreen)
+static rfbBool
+httpRead(rfbScreenInfoPtr rfbScreen, rfbHttpConn *c)
 {
-#ifdef LIBVNCSERVER_IPv6
-    struct sockaddr_storage addr;
-#else
-    struct sockaddr_in addr;
-#endif
-    socklen_t addrlen = sizeof(addr);
-    char fullFname[512];
-    char params[1024];
-    char *ptr;
-    char *fname;
-    unsigned int maxFnameLen;
-    FILE* fd;
-    rfbBool performSubstitutions = FALSE;
-    char str[256+32];
-#ifndef WIN32
-    char* user=getenv("USER");
-#endif
-   
-    cl.sock=rfbScreen->httpSock;
+    ssize_t got;
 
-    if (strlen(rfbScreen->httpDir) > 255) {
-	rfbErr("-httpd directory too long\n");
-	httpCloseSock(rfbScreen);
-	return;
+    got = recv(c->sock, c->request + c->filled, sizeof(c->request) - c->filled - 1, 0);
+    if (got <= 0) {
+	if (got == 0) {
+	    /* the client is done with a keep-alive connection */
+	    if (c->filled > 0)
+		rfbErr("httpd: premature connection close\n");
+	    return FALSE;
+	}
+#ifdef WIN32
+	errno=WSAGetLastError();
+#endif
+	if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+	    return TRUE;
+	rfbLogPerror("httpProcessInput: read");
+	return FALSE;
     }
-    strcpy(fullFname, rfbScreen->httpDir);
-    fname = &fullFname[strlen(fullFname)];
-    maxFnameLen = 511 - strlen(fullFname);
 
-    buf_filled=0;
+    c->filled += got;
+    c->lastActive = rfbCurrentTimeMs();
+    return httpProcessRequests(rfbScreen, c);
+}
 
-    /* Read data from the HTTP client until we get a complete request. */
-    while (1) {
-	ssize_t got;
+/*
+ * Answer the complete requests read from a connection, one at a time so
+ * that responses go out in order.  Returns FALSE if the connection is to be
+ * closed.
+ */
 
-        if (buf_filled > sizeof (buf)) {
-	    rfbErr("httpProcessInput: HTTP request is too long\n");
-	    httpCloseSock(rfbScreen);
-	    return;
+static rfbBool
+httpProcessRequests(rfbScreenInfoPtr rfbScreen, rfbHttpConn *c)
+{
+    char request[HTTP_REQUEST_SIZE];
+    char *end;
+    size_t len;
+
+    while (!httpSending(c)) {
+	c->request[c->filled] = '\0';
+
+	/* Is it complete yet (is there a blank line)? */
+	if ((end = strstr(c->request, "\r\n\r\n")) != NULL) {
+	    len = end + 4 - c->request;
+	} else if ((end = strstr(c->request, "\n\n")) != NULL) {
+	    len = end + 2 - c->request;
+	} else {
+	    if (c->filled >= sizeof(c->request) - 1) {
+		rfbErr("httpProcessInput: HTTP request is too long\n");
+		return FALSE;
+	    }
+	    return TRUE;
 	}
 
-	got = read (rfbScreen->httpSock, buf + buf_filled,
-			    sizeof (buf) - buf_filled - 1);
+	memcpy(request, c->request, len);
+	request[len] = '\0';
+	c->filled -= len;
+	memmove(c->request, c->request + len, c->filled);
 
-	if (got <= 0) {
-	    if (got == 0) {
-		rfbErr("httpd: premature connection close\n");
-	    } else {
+	if (!httpProcessRequest(rfbScreen, c, request) || !httpSend(c))
+	    return FALSE;
+    }
+    return TRUE;
+}
+
+/*
+ * Send as much of the response as possible.  Returns FALSE if the
+ * connection is to be closed, either because of an error or because the
+ * response is complete and the connection is not kept alive.
+ */
+
+static rfbBool
+httpSend(rfbHttpConn *c)
+{
+    ssize_t n;
+
+    while (c->outSent < c->outLen) {
+	n = send(c->sock, c->out + c->outSent, c->outLen - c->outSent,
+		 c->file != -1 ? HTTP_MSG_MORE : 0);
+	if (n < 0) {
 #ifdef WIN32
-	        errno=WSAGetLastError();
+	    errno=WSAGetLastError();
 #endif
-		if (errno == EAGAIN) {
-		    return;
-		}
-		rfbLogPerror("httpProcessInput: read");
+	    if (errno == EINTR)
+		continue;
+	    if (errno == EAGAIN || errno == EWOULDBLOCK)
+		return TRUE;
+	    rfbLogPerror("httpSend: write");
+	    return FALSE;
+	}
+	c->outSent += n;
+	c->lastActive = rfbCurrentTimeMs();
+    }
+
+    while (c->file != -1 && c->fileOffset < c->fileEnd) {
+	size_t count = c->fileEnd - c->fileOffset > BUF_SIZE * 32 ? BUF_SIZE * 32 : c->fileEnd - c->fileOffset;
+#ifdef LIBVNCSERVER_HAVE_SYS_SENDFILE_H
+	n = sendfile(c->sock, c->file, &c->fileOffset, count);
+#else
+	{
+	    char buf[BUF_SIZE];
+	    if (count > sizeof(buf))
+		count = sizeof(buf);
+	    if (lseek(c->file, c->fileOffset, SEEK_SET) == (off_t)-1
+		|| (n = read(c->file, buf, count)) < 0) {
+		rfbLogPerror("httpSend: read");
+		return FALSE;
 	    }
-	    httpCloseSock(rfbScreen);
-	    return;
+	    if (n > 0 && (n = send(c->sock, buf, n, 0)) > 0)
+		c->fileOffset += n;
+	}
+#endif
+	if (n < 0) {
+#ifdef WIN32
+	    errno=WSAGetLastError();
+#endif
+	    if (errno == EINTR)
+		continue;
+	    if (errno == EAGAIN || errno == EWOULDBLOCK)
+		return TRUE;
+	    rfbLogPerror("httpSend: sendfile");
+	    return FALSE;
 	}
+	if (n == 0) {
+	    rfbErr("httpSend: file got shorter while sending it\n");
+	    return FALSE;
+	}
+	c->lastActive = rfbCurrentTimeMs();
+    }
 
-	buf_filled += got;
-	buf[buf_filled] = '\0';
+    /* the response is complete */
+    free(c->out);
+    c->out = NULL;
+    c->outLen = c->outSent = 0;
+    if (c->file != -1) {
+	close(c->file);
+	c->file = -1;
+    }
+    return c->keepAlive;
+}
 
-	/* Is it complete yet (is there a blank line)? */
-	if (strstr (buf, "\r\r") || strstr (buf, "\n\n") ||
-	    strstr (buf, "\r\n\r\n") || strstr (buf, "\n\r\n\r"))
+static rfbBool
+httpBufAppend(rfbHttpBuf *b, const char *data, size_t len)
+{
+    if (b->len + len > b->size) {
+	size_t size = rfbMax(b->size * 2, b->len + len);
+	char *newData = (char *)realloc(b->data, size);
+	if (!newData)
+	    return FALSE;
+	b->data = newData;
+	b->size = size;
+    }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+    return TRUE;
+}
+
+/*
+ * Queue a response consisting of a header and an optional body in memory.
+ */
+
+static rfbBool
+httpRespond(rfbHttpConn *c, const char *header, size_t headerLen, const char *body, size_t bodyLen)
+{
+    rfbHttpBuf out = { NULL, 0, 0 };
+
+    if (!httpBufAppend(&out, header, headerLen) || !httpBufAppend(&out, body, bodyLen)) {
+	free(out.data);
+	return FALSE;
+    }
+    c->out = out.data;
+    c->outLen = out.len;
+    c->outSent = 0;
+    return TRUE;
+}
+
+static rfbBool
+httpRespondError(rfbHttpConn *c, const char *response)
+{
+    c->keepAlive = FALSE;
+    return httpRespond(c, response, strlen(response), NULL, 0);
+}
+
+/*
+ * Find the value of a header in a request, NULL if it is not there.  The
+ * value ends with its line.
+ */
+
+static const char *
+httpFindHeader(const char *request, const char *name)
+{
+    size_t len = strlen(name);
+    const char *line = strchr(request, '\n');
+
+    while (line) {
+	line++;
+	if (strncasecmp(line, name, len) == 0 && line[len] == ':')
+	    return line + len + 1 + strspn(line + len + 1, " \t");
+	line = strchr(line, '\n');
+    }
+    return NULL;
+}
+
+static rfbBool
+httpHeaderContains(const char *request, const char *name, const char *token)
+{
+    const char *value = httpFindHeader(request, name);
+    size_t len, tokenLen = strlen(token);
+
+    if (!value)
+	return FALSE;
+    for (len = strcspn(value, "\r\n"); len >= tokenLen; value++, len--)
+	if (strncasecmp(value, token, tokenLen) == 0)
+	    return TRUE;
+    return FALSE;
+}
+
+static const char *
+httpContentType(const char *fname)
+{
+    static const struct {
+	const char *ext;
+	const char *header;
+    } types[] = {
+	{ ".vnc",   "Content-Type: text/html\r\n" },
+	{ ".html",  "Content-Type: text/html\r\n" },
+	{ ".css",   "Content-Type: text/css\r\n" },
+	{ ".svg",   "Content-Type: image/svg+xml\r\n" },
+	{ ".js",    "Content-Type: application/javascript\r\n" },
+	{ ".json",  "Content-Type: application/json\r\n" },
+	{ ".png",   "Content-Type: image/png\r\n" },
+	{ ".ico",   "Content-Type: image/x-icon\r\n" },
+	{ ".woff",  "Content-Type: font/woff\r\n" },
+	{ ".woff2", "Content-Type: font/woff2\r\n" },
+	{ ".wasm",  "Content-Type: application/wasm\r\n" }
+    };
+    const char *ext = strrchr(fname, '.');
+    size_t i;
+
+    for (i = 0; ext && i < sizeof(types) / sizeof(types[0]); i++)
+	if (strcasecmp(ext, types[i].ext) == 0)
+	    return types[i].header;
+    return "";
+}
+
+/*
+ * Look up what we know about the file name below httpDir, found at path,
+ * refreshing it if it was last checked too long ago.  Returns NULL if the
+ * file is not there or not a regular file.
+ */
+
+static rfbHttpFile *
+httpLookupFile(rfbHttpState *state, const char *name, const char *path)
+{
+    rfbHttpFile **fp, *f;
+    unsigned long now = rfbCurrentTimeMs();
+    char gzPath[512 + 3];
+    struct stat st, gzSt;
+
+    for (fp = &state->files; (f = *fp) != NULL; fp = &f->next)
+	if (strcmp(f->name, name) == 0)
 	    break;
+    if (f && now - f->checked < HTTP_CACHE_CHECK_MS)
+	return f;
+
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+	if (f) {
+	    *fp = f->next;
+	    free(f->name);
+	    free(f);
+	    state->nFiles--;
+	}
+	return NULL;
     }
 
+    if (!f) {
+	if (state->nFiles >= HTTP_CACHE_MAX_FILES)
+	    httpFreeFiles(state);
+	f = (rfbHttpFile *)calloc(1, sizeof(rfbHttpFile));
+	if (!f || !(f->name = strdup(name))) {
+	    free(f);
+	    return NULL;
+	}
+	f->next = state->files;
+	state->files = f;
+	state->nFiles++;
+    }
+
+    f->size = st.st_size;
+    snprintf(f->etag, sizeof(f->etag), "\"%lx-%lx\"",
+	     (unsigned long)st.st_mtime, (unsigned long)st.st_size);
+    snprintf(gzPath, sizeof(gzPath), "%s.gz", path);
+    f->hasGz = stat(gzPath, &gzSt) == 0 && S_ISREG(gzSt.st_mode) && gzSt.st_mtime >= st.st_mtime;
+    f->checked = now;
+    return f;
+}
+
+/*
+ * Read a whole .vnc file and substitute $WIDTH, $HEIGHT, etc with the
+ * appropriate values.
+ */
+
+static rfbBool
+httpSubstitute(rfbScreenInfoPtr rfbScreen, const char *path, const char *params, rfbHttpBuf *body)
+{
+    rfbHttpBuf file = { NULL, 0, 0 };
+    char chunk[BUF_SIZE];
+    char str[256+32];
+    char *ptr, *dollar;
+    FILE *fd;
+    size_t n;
+    rfbBool ok = TRUE;
+#ifndef WIN32
+    char* user=getenv("USER");
+#endif
+
+    if ((fd = fopen(path, "r")) == NULL)
+	return FALSE;
+    while (ok && (n = fread(chunk, 1, sizeof(chunk), fd)) > 0)
+	ok = file.len + n <= HTTP_MAX_VNC_FILE_SIZE && httpBufAppend(&file, chunk, n);
+    fclose(fd);
+    if (!ok || !httpBufAppend(&file, "", 1)) {
+	rfbErr("httpd: could not read %s\n", path);
+	free(file.data);
+	return FALSE;
+    }
+
+    ptr = file.data;
+    while (ok && (dollar = strchr(ptr, '$'))!=NULL) {
+	ok = httpBufAppend(body, ptr, dollar - ptr);
+	ptr = dollar;
+	str[0] = '\0';
+
+	if (compareAndSkip(&ptr, "$WIDTH")) {
+	    sprintf(str, "%d", rfbScreen->width);
+	} else if (compareAndSkip(&ptr, "$HEIGHT")) {
+	    sprintf(str, "%d", rfbScreen->height);
+	} else if (compareAndSkip(&ptr, "$APPLETWIDTH")) {
+	    sprintf(str, "%d", rfbScreen->width);
+	} else if (compareAndSkip(&ptr, "$APPLETHEIGHT")) {
+	    sprintf(str, "%d", rfbScreen->height + 32);
+	} else if (compareAndSkip(&ptr, "$PORT")) {
+	    sprintf(str, "%d", rfbScreen->port);
+	} else if (compareAndSkip(&ptr, "$DESKTOP")) {
+	    ok = ok && httpBufAppend(body, rfbScreen->desktopName, strlen(rfbScreen->desktopName));
+	} else if (compareAndSkip(&ptr, "$DISPLAY")) {
+	    sprintf(str, "%s:%d", rfbScreen->thisHost, rfbScreen->port-5900);
+	} else if (compareAndSkip(&ptr, "$USER")) {
+#ifndef WIN32
+	    if (user) {
+		ok = ok && httpBufAppend(body, user, strlen(user));
+	    } else
+#endif
+		strcpy(str, "?");
+	} else if (compareAndSkip(&ptr, "$PARAMS")) {
+	    ok = ok && httpBufAppend(body, params, strlen(params));
+	} else {
+	    if (!compareAndSkip(&ptr, "$$"))
+		ptr++;
+	    strcpy(str, "$");
+	}
+	ok = ok && httpBufAppend(body, str, strlen(str));
+    }
+    ok = ok && httpBufAppend(body, ptr, strlen(ptr));
+
+    free(file.data);
+    return ok;
+}
+
+/*
+ * Answer one request, queueing the response on the connection.  Returns
+ * FALSE if the connection is to be closed without a response.
+ */
+
+static rfbBool
+httpProcessRequest(rfbScreenInfoPtr rfbScreen, rfbHttpConn *c, char *request)
+{
+#ifdef LIBVNCSERVER_IPv6
+    struct sockaddr_storage addr;
+#else
+    struct sockaddr_in addr;
+#endif
+    socklen_t addrlen = sizeof(addr);
+    char fullFname[512];
+    char gzFname[512 + 3];
+    char params[1024];
+    char header[512];
+    char *ptr;
+    char *fname;
+    unsigned int maxFnameLen;
+    rfbHttpFile *f;
+    rfbBool head, gzip;
+    int minor = 0, len;
+    struct stat st;
 
     /* Process the request. */
-if(rfbScreen->httpEnableProxyConnect) {
+    if(rfbScreen->httpEnableProxyConnect) {
 	const static char* PROXY_OK_STR = "HTTP/1.0 200 OK\r\nContent-Type: octet-stream\r\nPragma: no-cache\r\n\r\n";
-	if(!strncmp(buf, "CONNECT ", 8)) {
-	    char *colon = strchr(buf, ':');
+	cl.sock = c->sock;
+	if(!strncmp(request, "CONNECT ", 8)) {
+	    char *colon = strchr(request, ':');
 	    if(colon == NULL || atoi(colon+1)!=rfbScreen->port) {
 		rfbErr("httpd: CONNECT format invalid.\n");
-		rfbWriteExact(&cl,INVALID_REQUEST_STR, strlen(INVALID_REQUEST_STR));
-		httpCloseSock(rfbScreen);
-		return;
+		return httpRespondError(c, INVALID_REQUEST_STR);
 	    }
 	    /* proxy connection */
 	    rfbLog("httpd: client asked for CONNECT\n");
 	    rfbWriteExact(&cl,PROXY_OK_STR,strlen(PROXY_OK_STR));
-	    rfbNewClientConnection(rfbScreen,rfbScreen->httpSock);
-	    rfbScreen->httpSock = RFB_INVALID_SOCKET;
-	    return;
+	    rfbNewClientConnection(rfbScreen,c->sock);
+	    c->sock = RFB_INVALID_SOCKET;
+	    return FALSE;
 	}
-	if (!strncmp(buf, "GET ",4)) {
-	    char *slash = strchr(buf, '/');
+	if (!strncmp(request, "GET ",4)) {
+	    char *slash = strchr(request, '/');
 	    if (slash != NULL && !strncmp(slash,"/proxied.connection HTTP/1.", 27)) {
 		/* proxy connection */
 		rfbLog("httpd: client asked for /proxied.connection\n");
 		rfbWriteExact(&cl,PROXY_OK_STR,strlen(PROXY_OK_STR));
-		rfbNewClientConnection(rfbScreen,rfbScreen->httpSock);
-		rfbScreen->httpSock = RFB_INVALID_SOCKET;
-		return;
+		rfbNewClientConnection(rfbScreen,c->sock);
+		c->sock = RFB_INVALID_SOCKET;
+		return FALSE;
 	    }
 	}
     }
 
-    if (strncmp(buf, "GET ", 4)) {
-	rfbErr("httpd: no GET line\n");
-	httpCloseSock(rfbScreen);
-	return;
+    if (strlen(rfbScreen->httpDir) > 255) {
+	rfbErr("-httpd directory too long\n");
+	return FALSE;
+    }
+    strcpy(fullFname, rfbScreen->httpDir);
+    fname = &fullFname[strlen(fullFname)];
+    maxFnameLen = 511 - strlen(fullFname);
+
+    if (!strncmp(request, "GET ", 4)) {
+	head = FALSE;
+    } else if (!strncmp(request, "HEAD ", 5)) {
+	head = TRUE;
     } else {
-	/* Only use the first line. */
-	buf[strcspn(buf, "\n\r")] = '\0';
+	rfbErr("httpd: no GET line\n");
+	return FALSE;
     }
 
-    if (strlen(buf) > maxFnameLen) {
+    /* Only use the first line for the file name. */
+    len = strcspn(request, "\n\r");
+    if (len > maxFnameLen) {
 	rfbErr("httpd: GET line too long\n");
-	httpCloseSock(rfbScreen);
-	return;
+	return FALSE;
     }
-
-    if (sscanf(buf, "GET %s HTTP/1.", fname) != 1) {
+    if (sscanf(request, head ? "HEAD %s HTTP/1.%d" : "GET %s HTTP/1.%d", fname, &minor) < 1) {
 	rfbErr("httpd: couldn't parse GET line\n");
-	httpCloseSock(rfbScreen);
-	return;
+	return FALSE;
     }
 
+    /* HTTP/1.1 connections persist unless the client says otherwise */
+    if (minor >= 1)
+	c->keepAlive = !httpHeaderContains(request, "Connection", "close");
+    else
+	c->keepAlive = httpHeaderContains(request, "Connection", "keep-alive");
+
+#ifdef LIBVNCSERVER_WITH_WEBSOCKETS
+    /* WebSockets clients go to the RFB code along with their handshake */
+    if (!head && httpHeaderContains(request, "Upgrade", "websocket")) {
+	const int one = 1;
+	rfbClientPtr wsClient;
+
+	rfbLog("httpd: WebSockets upgrade for '%s'\n", fname);
+	if (setsockopt(c->sock, IPPROTO_TCP, TCP_NODELAY,
+		       (const char *)&one, sizeof(one)) < 0)
+	    rfbLogPerror("httpd: setsockopt failed: can't set TCP_NODELAY flag");
+	wsClient = rfbNewWebSocketsClient(rfbScreen, c->sock, request);
+	c->sock = RFB_INVALID_SOCKET;
+	if (wsClient && !wsClient->onHold)
+	    rfbStartOnHoldClient(wsClient);
+	return FALSE;
+    }
+#endif
+
     if (fname[0] != '/') {
 	rfbErr("httpd: filename didn't begin with '/'\n");
-	rfbWriteExact(&cl, NOT_FOUND_STR, strlen(NOT_FOUND_STR));
-	httpCloseSock(rfbScreen);
-	return;
+	return httpRespondError(c, NOT_FOUND_STR);
     }
 
 
-    getpeername(rfbScreen->httpSock, (struct sockaddr *)&addr, &addrlen);
+    getpeername(c->sock, (struct sockaddr *)&addr, &addrlen);
 #ifdef LIBVNCSERVER_IPv6
     {
         char host[1024];
@@ -451,9 +985,7 @@ if(rfbScreen->httpEnableProxyConnect) {
 
     if (strstr(fname, "..")) {
         rfbErr("httpd: URL should not contain '..'\n");
-        rfbWriteExact(&cl, NOT_FOUND_STR, strlen(NOT_FOUND_STR));
-        httpCloseSock(rfbScreen);
-        return;
+        return httpRespondError(c, NOT_FOUND_STR);
     }
 
     /* If we were asked for '/', actually read the file index.vnc */
@@ -466,131 +998,63 @@ if(rfbScreen->httpEnableProxyConnect) {
     /* Substitutions are performed on files ending .vnc */
 
     if (strlen(fname) >= 4 && strcmp(&fname[strlen(fname)-4], ".vnc") == 0) {
-	performSubstitutions = TRUE;
-    }
+	rfbHttpBuf body = { NULL, 0, 0 };
+	rfbBool ok;
 
-    /* Open the file */
-
-    if ((fd = fopen(fullFname, "r")) == 0) {
-        rfbLogPerror("httpProcessInput: open");
-        rfbWriteExact(&cl, NOT_FOUND_STR, strlen(NOT_FOUND_STR));
-        httpCloseSock(rfbScreen);
-        return;
-    }
-
-    rfbWriteExact(&cl, OK_STR, strlen(OK_STR));
-    char *ext = strrchr(fname, '.');
-    char *contentType = "";
-    if(ext && strcasecmp(ext, ".vnc") == 0)
-	contentType = "Content-Type: text/html\r\n";
-    else if(ext && strcasecmp(ext, ".css") == 0)
-	contentType = "Content-Type: text/css\r\n";
-    else if(ext && strcasecmp(ext, ".svg") == 0)
-	contentType = "Content-Type: image/svg+xml\r\n";
-    else if(ext && strcasecmp(ext, ".js") == 0)
-	contentType = "Content-Type: application/javascript\r\n";
-    rfbWriteExact(&cl, contentType, strlen(contentType));
-    /* end the header */
-    rfbWriteExact(&cl, "\r\n", 2);
-
-    while (1) {
-	int n = fread(buf, 1, BUF_SIZE-1, fd);
-	if (n < 0) {
-	    rfbLogPerror("httpProcessInput: read");
-	    fclose(fd);
-	    httpCloseSock(rfbScreen);
-	    return;
+	if (!httpSubstitute(rfbScreen, fullFname, params, &body)) {
+	    rfbLogPerror("httpProcessInput: open");
+	    free(body.data);
+	    return httpRespondError(c, NOT_FOUND_STR);
 	}
+	len = snprintf(header, sizeof(header), OK_STR, httpContentType(fname),
+		       (unsigned long)body.len, "Cache-Control: no-cache\r\n",
+		       c->keepAlive ? "keep-alive" : "close");
+	ok = httpRespond(c, header, len, body.data, head ? 0 : body.len);
+	free(body.data);
+	return ok;
+    }
 
-	if (n == 0)
-	    break;
-
-	if (performSubstitutions) {
-
-	    /* Substitute $WIDTH, $HEIGHT, etc with the appropriate values.
-	       This won't quite work properly if the .vnc file is longer than
-	       BUF_SIZE, but it's reasonable to assume that .vnc files will
-	       always be short. */
-
-	    char *ptr = buf;
-	    char *dollar;
-	    buf[n] = 0; /* make sure it's null-terminated */
-
-	    while ((dollar = strchr(ptr, '$'))!=NULL) {
-		rfbWriteExact(&cl, ptr, (dollar - ptr));
-
-		ptr = dollar;
-
-		if (compareAndSkip(&ptr, "$WIDTH")) {
-
-		    sprintf(str, "%d", rfbScreen->width);
-		    rfbWriteExact(&cl, str, strlen(str));
-
-		} else if (compareAndSkip(&ptr, "$HEIGHT")) {
-
-		    sprintf(str, "%d", rfbScreen->height);
-		    rfbWriteExact(&cl, str, strlen(str));
-
-		} else if (compareAndSkip(&ptr, "$APPLETWIDTH")) {
-
-		    sprintf(str, "%d", rfbScreen->width);
-		    rfbWriteExact(&cl, str, strlen(str));
-
-		} else if (compareAndSkip(&ptr, "$APPLETHEIGHT")) {
-
-		    sprintf(str, "%d", rfbScreen->height + 32);
-		    rfbWriteExact(&cl, str, strlen(str));
-
-		} else if (compareAndSkip(&ptr, "$PORT")) {
-
-		    sprintf(str, "%d", rfbScreen->port);
-		    rfbWriteExact(&cl, str, strlen(str));
-
-		} else if (compareAndSkip(&ptr, "$DESKTOP")) {
-
-		    rfbWriteExact(&cl, rfbScreen->desktopName, strlen(rfbScreen->desktopName));
-
-		} else if (compareAndSkip(&ptr, "$DISPLAY")) {
-
-		    sprintf(str, "%s:%d", rfbScreen->thisHost, rfbScreen->port-5900);
-		    rfbWriteExact(&cl, str, strlen(str));
-
-		} else if (compareAndSkip(&ptr, "$USER")) {
-#ifndef WIN32
-		    if (user) {
-			rfbWriteExact(&cl, user,
-				   strlen(user));
-		    } else
-#endif
-			rfbWriteExact(&cl, "?", 1);
-		} else if (compareAndSkip(&ptr, "$PARAMS")) {
-		    if (params[0] != '\0')
-			rfbWriteExact(&cl, params, strlen(params));
-		} else {
-		    if (!compareAndSkip(&ptr, "$$"))
-			ptr++;
-
-		    if (rfbWriteExact(&cl, "$", 1) < 0) {
-			fclose(fd);
-			httpCloseSock(rfbScreen);
-			return;
-		    }
-		}
-	    }
-	    if (rfbWriteExact(&cl, ptr, (&buf[n] - ptr)) < 0)
-		break;
+    /* Everything else is sent straight from the file, or its precompressed
+       version if there is one and the client takes it */
 
-	} else {
+    if (!(f = httpLookupFile((rfbHttpState *)rfbScreen->httpState, fname, fullFname))) {
+        rfbLogPerror("httpProcessInput: open");
+        return httpRespondError(c, NOT_FOUND_STR);
+    }
 
-	    /* For files not ending .vnc, just write out the buffer */
+    if (httpHeaderContains(request, "If-None-Match", f->etag)) {
+	len = snprintf(header, sizeof(header), NOT_MODIFIED_STR, f->etag,
+		       c->keepAlive ? "keep-alive" : "close");
+	return httpRespond(c, header, len, NULL, 0);
+    }
 
-	    if (rfbWriteExact(&cl, buf, n) < 0)
-		break;
+    gzip = f->hasGz && httpHeaderContains(request, "Accept-Encoding", "gzip");
+    snprintf(gzFname, sizeof(gzFname), "%s.gz", fullFname);
+    if ((c->file = open(gzip ? gzFname : fullFname, O_RDONLY | O_BINARY)) == -1
+	|| fstat(c->file, &st) != 0) {
+        rfbLogPerror("httpProcessInput: open");
+	if (c->file != -1) {
+	    close(c->file);
+	    c->file = -1;
 	}
+        return httpRespondError(c, NOT_FOUND_STR);
     }
-
-    fclose(fd);
-    httpCloseSock(rfbScreen);
+    c->fileOffset = 0;
+    c->fileEnd = head ? 0 : st.st_size;
+
+    len = snprintf(header, sizeof(header), OK_STR, httpContentType(fname),
+		   (unsigned long)st.st_size, "", c->keepAlive ? "keep-alive" : "close");
+    /* add the ETag and encoding headers in front of the final empty line */
+    len -= 2;
+    len += snprintf(header + len, sizeof(header) - len, "ETag: %s\r\n%s%s\r\n", f->etag,
+		    f->hasGz ? "Vary: Accept-Encoding\r\n" : "",
+		    gzip ? "Content-Encoding: gzip\r\n" : "");
+    if (!httpRespond(c, header, len, NULL, 0)) {
+	close(c->file);
+	c->file = -1;
+	return FALSE;
+    }
+    return TRUE;
 }
 
 
@@ -16,6 +16,7 @@
 #include <rfb/rfb.h>
 #include <rfb/rfbregion.h>
 #include "private.h"
+#include "rfbssl.h"
 
 #include <stdarg.h>
 #include <errno.h>
@@ -282,43 +283,58 @@ void rfbScheduleCopyRegion(rfbScreenInfoPtr rfbScreen,sraRegionPtr copyRegion,in
    rfbClientIteratorPtr iterator;
    rfbClientPtr cl;
 
+   if(rfbScreen->detectCopies)
+     rfbCopyDetectorUpdate(rfbScreen,copyRegion);
+
    iterator=rfbGetClientIterator(rfbScreen);
    while((cl=rfbClientIteratorNext(iterator))) {
      LOCK(cl->updateMutex);
      if(cl->useCopyRect) {
-       sraRegionPtr modifiedRegionBackup;
-       if(!sraRgnEmpty(cl->copyRegion)) {
-	  if(cl->copyDX!=dx || cl->copyDY!=dy) {
-	     /* if a copyRegion was not yet executed, treat it as a
-	      * modifiedRegion. The idea: in this case it could be
-	      * source of the new copyRect or modified anyway. */
-	     sraRgnOr(cl->modifiedRegion,cl->copyRegion);
-	     sraRgnMakeEmpty(cl->copyRegion);
-	  } else {
-	     /* we have to set the intersection of the source of the copy
-	      * and the old copy to modified. */
-	     modifiedRegionBackup=sraRgnCreateRgn(copyRegion);
-	     sraRgnOffset(modifiedRegionBackup,-dx,-dy);
-	     sraRgnAnd(modifiedRegionBackup,cl->copyRegion);
-	     sraRgnOr(cl->modifiedRegion,modifiedRegionBackup);
-	     sraRgnDestroy(modifiedRegionBackup);
-	  }
+       sraRegionPtr modifiedRegionBackup,destRegion;
+       int n,last=cl->nExtraCopies;
+
+       /* Where the new copy would take pixels from the destination of a
+	* pending copy, treat it as modified: this way every copy works on
+	* what the client had before the update.  What the new copy
+	* overwrites is no longer the destination of the older ones. */
+       for(n=0;n<=last;n++) {
+	  modifiedRegionBackup=sraRgnCreateRgn(CLIENT_COPY_REGION(cl,n));
+	  sraRgnOffset(modifiedRegionBackup,dx,dy);
+	  sraRgnAnd(modifiedRegionBackup,copyRegion);
+	  sraRgnOr(cl->modifiedRegion,modifiedRegionBackup);
+	  sraRgnDestroy(modifiedRegionBackup);
+	  sraRgnSubtract(CLIENT_COPY_REGION(cl,n),copyRegion);
+       }
+
+       /* join the newest copy if the translation is the same */
+       if(sraRgnEmpty(CLIENT_COPY_REGION(cl,last)) ||
+	  (CLIENT_COPY_DX(cl,last)==dx && CLIENT_COPY_DY(cl,last)==dy))
+	  n=last;
+       else if(last<RFB_MAX_EXTRA_COPIES)
+	  n=++cl->nExtraCopies;
+       else {
+	  /* too many different copies pending, send this one as pixels */
+	  sraRgnOr(cl->modifiedRegion,copyRegion);
+	  TSIGNAL(cl->updateCond);
+	  UNLOCK(cl->updateMutex);
+	  continue;
        }
-	  
-       sraRgnOr(cl->copyRegion,copyRegion);
-       cl->copyDX = dx;
-       cl->copyDY = dy;
+
+       destRegion=CLIENT_COPY_REGION(cl,n);
+       sraRgnOr(destRegion,copyRegion);
+       CLIENT_COPY_DX(cl,n) = dx;
+       CLIENT_COPY_DY(cl,n) = dy;
 
        /* if there were modified regions, which are now copied,
 	* mark them as modified, because the source of these can be overlapped
 	* either by new modified or now copied regions. */
        modifiedRegionBackup=sraRgnCreateRgn(cl->modifiedRegion);
        sraRgnOffset(modifiedRegionBackup,dx,dy);
-       sraRgnAnd(modifiedRegionBackup,cl->copyRegion);
+       sraRgnAnd(modifiedRegionBackup,destRegion);
        sraRgnOr(cl->modifiedRegion,modifiedRegionBackup);
        sraRgnDestroy(modifiedRegionBackup);
 
-       if(!cl->enableCursorShapeUpdates) {
+       if(!cl->enableCursorShapeUpdates && cl->screen->cursor) {
           /*
            * n.b. (dx, dy) is the vector pointing in the direction the
            * copyrect displacement will take place.  copyRegion is the
@@ -331,7 +347,7 @@ void rfbScheduleCopyRegion(rfbScreenInfoPtr rfbScreen,sraRegionPtr copyRegion,in
           int h = cl->screen->cursor->height;
 
           cursorRegion = sraRgnCreateRect(x, y, x + w, y + h);
-          sraRgnAnd(cursorRegion, cl->copyRegion);
+          sraRgnAnd(cursorRegion, destRegion);
           if(!sraRgnEmpty(cursorRegion)) {
              /*
               * current cursor rect overlaps with the copy region *dest*,
@@ -344,7 +360,7 @@ void rfbScheduleCopyRegion(rfbScreenInfoPtr rfbScreen,sraRegionPtr copyRegion,in
           cursorRegion = sraRgnCreateRect(x, y, x + w, y + h);
           /* displace it to check for overlap with copy region source: */
           sraRgnOffset(cursorRegion, dx, dy);
-          sraRgnAnd(cursorRegion, cl->copyRegion);
+          sraRgnAnd(cursorRegion, destRegion);
           if(!sraRgnEmpty(cursorRegion)) {
              /*
               * current cursor rect overlaps with the copy region *source*,
@@ -366,6 +382,47 @@ void rfbScheduleCopyRegion(rfbScreenInfoPtr rfbScreen,sraRegionPtr copyRegion,in
    rfbReleaseClientIterator(iterator);
 }
 
+/* forget all copies pending for a client, with its updateMutex held */
+void rfbClientClearCopies(rfbClientPtr cl)
+{
+   int n;
+
+   for(n=0;n<=cl->nExtraCopies;n++) {
+     sraRgnMakeEmpty(CLIENT_COPY_REGION(cl,n));
+     CLIENT_COPY_DX(cl,n) = 0;
+     CLIENT_COPY_DY(cl,n) = 0;
+   }
+   cl->nExtraCopies = 0;
+}
+
+/*
+ * For losslessRefreshDelay: once nothing was sent lossily for that long
+ * and the client waits for an update with nothing else pending, schedule
+ * what it only has in lossy form to be resent losslessly.  Called with
+ * the client's updateMutex held.
+ */
+void rfbScheduleLosslessRefresh(rfbClientPtr cl)
+{
+   sraRegionPtr pending;
+   rfbBool idle;
+
+   if(cl->screen->losslessRefreshDelay<=0 || sraRgnEmpty(cl->lossyRegion) ||
+      sraRgnEmpty(cl->requestedRegion) ||
+      !sraRgnEmpty(cl->copyRegion) || cl->nExtraCopies>0 ||
+      rfbCurrentTimeMs()-cl->lastLossyUpdate<(unsigned long)cl->screen->losslessRefreshDelay)
+     return;
+
+   pending=sraRgnCreateRgn(cl->modifiedRegion);
+   idle=!sraRgnAnd(pending,cl->requestedRegion);
+   sraRgnDestroy(pending);
+   if(!idle)
+     return;
+
+   sraRgnOr(cl->refreshRegion,cl->lossyRegion);
+   sraRgnOr(cl->modifiedRegion,cl->lossyRegion);
+   sraRgnMakeEmpty(cl->lossyRegion);
+}
+
 void rfbDoCopyRegion(rfbScreenInfoPtr screen,sraRegionPtr copyRegion,int dx,int dy)
 {
    sraRectangleIterator* i;
@@ -413,6 +470,14 @@ void rfbMarkRegionAsModified(rfbScreenInfoPtr screen,sraRegionPtr modRegion)
 {
    rfbClientIteratorPtr iterator;
    rfbClientPtr cl;
+   sraRegionPtr remaining=NULL;
+
+   if(screen->adaptiveEncoding)
+     rfbClassifierMarkModified(screen,modRegion);
+
+   /* send what was only moved as copies */
+   if(screen->detectCopies)
+     modRegion=remaining=rfbDetectCopies(screen,modRegion);
 
    iterator=rfbGetClientIterator(screen);
    while((cl=rfbClientIteratorNext(iterator))) {
@@ -423,6 +488,8 @@ void rfbMarkRegionAsModified(rfbScreenInfoPtr screen,sraRegionPtr modRegion)
    }
 
    rfbReleaseClientIterator(iterator);
+   if(remaining)
+     sraRgnDestroy(remaining);
 }
 
 void rfbScaledScreenUpdate(rfbScreenInfoPtr screen, int x1, int y1, int x2, int y2);
@@ -451,31 +518,63 @@ void rfbMarkRectAsModified(rfbScreenInfoPtr screen,int x1,int y1,int x2,int y2)
 
 #if defined(LIBVNCSERVER_HAVE_LIBPTHREAD) || defined(LIBVNCSERVER_HAVE_WIN32THREADS)
 
+/*
+ * Wait for the client's updateCond, with its updateMutex held, but no longer
+ * than ms.
+ */
+static void
+waitForUpdate(rfbClientPtr cl, unsigned long ms)
+{
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+    struct timeval now;
+    struct timespec until;
+
+    gettimeofday(&now, NULL);
+    until.tv_sec = now.tv_sec + ms / 1000;
+    until.tv_nsec = (now.tv_usec + (ms % 1000) * 1000) * 1000;
+    if (until.tv_nsec >= 1000000000) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&cl->updateCond, &cl->updateMutex, &until);
+#else
+    SleepConditionVariableCS(&cl->updateCond, &cl->updateMutex, ms);
+#endif
+}
+
 static THREAD_ROUTINE_RETURN_TYPE
 clientOutput(void *data)
 {
     rfbClientPtr cl = (rfbClientPtr)data;
     rfbBool haveUpdate;
     sraRegion* updateRegion;
+    unsigned long sinceLossy;
 
     while (1) {
         haveUpdate = false;
         while (!haveUpdate) {
+		LOCK(cl->updateMutex);
+
+		/* checked with the lock held, so that the wakeup clientInput()
+		   sends on its way out cannot come before we wait for it */
 		if (cl->sock == RFB_INVALID_SOCKET || cl->state == RFB_SHUTDOWN) {
 			/* Client has disconnected. */
+			UNLOCK(cl->updateMutex);
 			return THREAD_ROUTINE_RETURN_VALUE;
 		}
+
 		if (cl->state != RFB_NORMAL || cl->onHold) {
-			/* just sleep until things get normal */
-		        THREAD_SLEEP_MS(cl->screen->deferUpdateTime);
+			/* nothing to send before the first update request,
+			   which wakes us up like closing the client does */
+			WAIT(cl->updateCond, cl->updateMutex);
+			UNLOCK(cl->updateMutex);
 			continue;
 		}
 
-		LOCK(cl->updateMutex);
-
 		if (sraRgnEmpty(cl->requestedRegion)) {
 			; /* always require a FB Update Request (otherwise can crash.) */
 		} else {
+			rfbScheduleLosslessRefresh(cl);
 			haveUpdate = FB_UPDATE_PENDING(cl);
 			if(!haveUpdate) {
 				updateRegion = sraRgnCreateRgn(cl->modifiedRegion);
@@ -484,7 +583,14 @@ clientOutput(void *data)
 			}
 		}
 
-		if (!haveUpdate) {
+		if (!haveUpdate && cl->screen->losslessRefreshDelay > 0 &&
+		    !sraRgnEmpty(cl->lossyRegion) && !sraRgnEmpty(cl->requestedRegion)) {
+			/* sleep until the lossless refresh is due, unless
+			   something else comes up before */
+			sinceLossy = rfbCurrentTimeMs() - cl->lastLossyUpdate;
+			if (sinceLossy < (unsigned long)cl->screen->losslessRefreshDelay)
+				waitForUpdate(cl, cl->screen->losslessRefreshDelay - sinceLossy);
+		} else if (!haveUpdate) {
 			WAIT(cl->updateCond, cl->updateMutex);
 		}
 
@@ -493,7 +599,8 @@ clientOutput(void *data)
         
         /* OK, now, to save bandwidth, wait a little while for more
            updates to come along. */
-	THREAD_SLEEP_MS(cl->screen->deferUpdateTime);
+	if (cl->screen->deferUpdateTime > 0)
+	    THREAD_SLEEP_MS(cl->screen->deferUpdateTime);
 
         /* Now, get the region we're going to update, and remove
            it from cl->modifiedRegion _before_ we send the update.
@@ -531,13 +638,19 @@ clientInput(void *data)
     while (cl->state != RFB_SHUTDOWN) {
 	fd_set rfds, wfds, efds;
 	struct timeval tv;
-	int n;
+	int n, wait = -1;
 
 	if (cl->sock == RFB_INVALID_SOCKET) {
 	  /* Client has disconnected. */
             break;
         }
 
+	if (cl->state != RFB_NORMAL) {
+	    wait = rfbCheckClientHandshake(cl);
+	    if (cl->state == RFB_SHUTDOWN || cl->sock == RFB_INVALID_SOCKET)
+		break;
+	}
+
 	FD_ZERO(&rfds);
 	FD_SET(cl->sock, &rfds);
 #ifndef WIN32
@@ -550,6 +663,11 @@ clientInput(void *data)
 	FD_ZERO(&wfds);
 	if ((cl->fileTransfer.fd!=-1) && (cl->fileTransfer.sending==1))
 	    FD_SET(cl->sock, &wfds);
+#ifdef LIBVNCSERVER_WITH_WEBSOCKETS
+	/* a TLS handshake may be stuck on a full socket */
+	if (cl->state == RFB_TLS_HANDSHAKE && rfbssl_want_write(cl))
+	    FD_SET(cl->sock, &wfds);
+#endif
 
 #ifndef WIN32
 	int nfds = cl->pipe_notify_client_thread[0] > cl->sock ? cl->pipe_notify_client_thread[0] : cl->sock;
@@ -557,8 +675,14 @@ clientInput(void *data)
 	int nfds = cl->sock;
 #endif
 
-	tv.tv_sec = 60; /* 1 minute */
-	tv.tv_usec = 0;
+	if (wait < 0) {
+	    tv.tv_sec = 60; /* 1 minute */
+	    tv.tv_usec = 0;
+	} else {
+	    /* wake up for the next handshake deadline */
+	    tv.tv_sec = wait / 1000;
+	    tv.tv_usec = (wait % 1000) * 1000;
+	}
 
 	n = select(nfds + 1, &rfds, &wfds, &efds, &tv);
 
@@ -583,8 +707,15 @@ clientInput(void *data)
 #endif
 
         /* We have some space on the transmit queue, send some data */
-        if (FD_ISSET(cl->sock, &wfds))
+        if (FD_ISSET(cl->sock, &wfds)) {
+#ifdef LIBVNCSERVER_WITH_WEBSOCKETS
+            if (cl->state == RFB_TLS_HANDSHAKE) {
+                rfbProcessClientMessage(cl);
+                continue;
+            }
+#endif
             rfbSendFileTransferChunk(cl);
+        }
 
         if (FD_ISSET(cl->sock, &rfds) || FD_ISSET(cl->sock, &efds))
         {
@@ -598,8 +729,9 @@ clientInput(void *data)
         }
     }
 
-    /* Get rid of the output thread. */
+    /* Get rid of the output thread, whichever way we got here. */
     LOCK(cl->updateMutex);
+    cl->state = RFB_SHUTDOWN;
     TSIGNAL(cl->updateCond);
     UNLOCK(cl->updateMutex);
     THREAD_JOIN(output_thread);
@@ -623,6 +755,8 @@ listenerRun(void *data)
     rfbClientPtr cl = NULL;
     socklen_t len;
     fd_set listen_fds;  /* temp file descriptor list for select() */
+    fd_set http_write_fds;
+    int maxFd;
     struct timeval tv;
 
     /*
@@ -647,10 +781,13 @@ listenerRun(void *data)
 	FD_SET(screen->pipe_notify_listener_thread[0], &listen_fds);
 	screen->maxFd = rfbMax(screen->maxFd, screen->pipe_notify_listener_thread[0]);
 #endif
+	/* wake up for HTTP connections and requests, too */
+	FD_ZERO(&http_write_fds);
+	maxFd = rfbMax(screen->maxFd, rfbHttpSetFds(screen, &listen_fds, &http_write_fds));
 
         tv.tv_sec = 0;
 	tv.tv_usec = screen->select_timeout_usec;
-        if (select(screen->maxFd+1, &listen_fds, NULL, NULL, &tv) == -1) {
+        if (select(maxFd+1, &listen_fds, &http_write_fds, NULL, &tv) == -1) {
             rfbLogPerror("listenerRun: error in select");
             return THREAD_ROUTINE_RETURN_VALUE;
         }
@@ -692,6 +829,131 @@ listenerRun(void *data)
 
 #endif
 
+#if defined(LIBVNCSERVER_HAVE_LIBPTHREAD) && !defined(WIN32)
+/*
+ * The additional listener threads of screen->listenerThreads, each with its
+ * own SO_REUSEPORT sockets on the RFB ports. They only accept, the clients
+ * get their own threads like those from listenerRun().
+ */
+
+typedef struct {
+    rfbScreenInfoPtr screen;    /* NULL at the end of the array */
+    rfbSocket listenSock;
+    rfbSocket listen6Sock;
+    int pipe_notify[2];
+    pthread_t thread;
+} rfbSharedListener;
+
+static void *
+sharedListenerRun(void *data)
+{
+    rfbSharedListener *listener = (rfbSharedListener *)data;
+    rfbScreenInfoPtr screen = listener->screen;
+    rfbSocket client_fd;
+    rfbClientPtr cl;
+    fd_set listen_fds;
+    int maxFd;
+
+    while (screen->socketState != RFB_SOCKET_SHUTDOWN) {
+	FD_ZERO(&listen_fds);
+	FD_SET(listener->pipe_notify[0], &listen_fds);
+	maxFd = listener->pipe_notify[0];
+	if (listener->listenSock != RFB_INVALID_SOCKET) {
+	    FD_SET(listener->listenSock, &listen_fds);
+	    maxFd = rfbMax(maxFd, listener->listenSock);
+	}
+	if (listener->listen6Sock != RFB_INVALID_SOCKET) {
+	    FD_SET(listener->listen6Sock, &listen_fds);
+	    maxFd = rfbMax(maxFd, listener->listen6Sock);
+	}
+
+	if (select(maxFd+1, &listen_fds, NULL, NULL, NULL) == -1) {
+	    if (errno == EINTR)
+		continue;
+	    rfbLogPerror("sharedListenerRun: error in select");
+	    break;
+	}
+
+	/* woken up to stop, for the shutdown or a rebind */
+	if (FD_ISSET(listener->pipe_notify[0], &listen_fds))
+	    break;
+
+	client_fd = RFB_INVALID_SOCKET;
+	if (listener->listenSock != RFB_INVALID_SOCKET && FD_ISSET(listener->listenSock, &listen_fds))
+	    client_fd = accept(listener->listenSock, NULL, NULL);
+	else if (listener->listen6Sock != RFB_INVALID_SOCKET && FD_ISSET(listener->listen6Sock, &listen_fds))
+	    client_fd = accept(listener->listen6Sock, NULL, NULL);
+	if (client_fd == RFB_INVALID_SOCKET)
+	    continue;
+
+	cl = rfbNewClient(screen, client_fd);
+	if (cl && !cl->onHold)
+	    rfbStartOnHoldClient(cl);
+    }
+    return NULL;
+}
+
+void
+rfbStartSharedListeners(rfbScreenInfoPtr screen)
+{
+    rfbSharedListener *listeners, *l;
+    int i, n = screen->listenerThreads - 1;
+
+    if (n <= 0 || (screen->listenSock == RFB_INVALID_SOCKET && screen->listen6Sock == RFB_INVALID_SOCKET))
+	return;
+
+    if (!(listeners = (rfbSharedListener *)calloc(n + 1, sizeof(rfbSharedListener))))
+	return;
+
+    for (i = 0; i < n; i++) {
+	l = &listeners[i];
+	l->listenSock = RFB_INVALID_SOCKET;
+	l->listen6Sock = RFB_INVALID_SOCKET;
+	if (screen->listenSock != RFB_INVALID_SOCKET)
+	    l->listenSock = rfbListenOnSharedTCPPort(screen->port, screen->listenInterface);
+#ifdef LIBVNCSERVER_IPv6
+	if (screen->listen6Sock != RFB_INVALID_SOCKET)
+	    l->listen6Sock = rfbListenOnSharedTCP6Port(screen->ipv6port, screen->listen6Interface);
+#endif
+	if ((l->listenSock == RFB_INVALID_SOCKET && l->listen6Sock == RFB_INVALID_SOCKET)
+	    || pipe(l->pipe_notify) == -1) {
+	    rfbLogPerror("rfbStartSharedListeners: can't share the RFB port");
+	    if (l->listenSock != RFB_INVALID_SOCKET)
+		rfbCloseSocket(l->listenSock);
+	    if (l->listen6Sock != RFB_INVALID_SOCKET)
+		rfbCloseSocket(l->listen6Sock);
+	    break;
+	}
+	l->screen = screen;
+	pthread_create(&l->thread, NULL, sharedListenerRun, l);
+    }
+    rfbLog("Accepting connections in %d threads\n", i + 1);
+    screen->sharedListeners = listeners;
+}
+
+void
+rfbStopSharedListeners(rfbScreenInfoPtr screen)
+{
+    rfbSharedListener *l;
+
+    if (!screen->sharedListeners)
+	return;
+
+    for (l = (rfbSharedListener *)screen->sharedListeners; l->screen; l++) {
+	write(l->pipe_notify[1], "\x00", 1);
+	pthread_join(l->thread, NULL);
+	close(l->pipe_notify[0]);
+	close(l->pipe_notify[1]);
+	if (l->listenSock != RFB_INVALID_SOCKET)
+	    rfbCloseSocket(l->listenSock);
+	if (l->listen6Sock != RFB_INVALID_SOCKET)
+	    rfbCloseSocket(l->listen6Sock);
+    }
+    free(screen->sharedListeners);
+    screen->sharedListeners = NULL;
+}
+#endif
+
 void
 rfbRequestListenRebind(rfbScreenInfoPtr screen)
 {
@@ -1024,6 +1286,23 @@ rfbScreenInfoPtr rfbGetScreen(int* argc,char** argv,
 
    screen->handleEventsEagerly = FALSE;
 
+   /* adaptive per-region encoding is opt-in */
+   screen->adaptiveEncoding = FALSE;
+   screen->tileClassifier = NULL;
+   screen->detectCopies = FALSE;
+   screen->copyDetector = NULL;
+   screen->losslessRefreshDelay = 0;
+
+   screen->sslServerCtx = NULL;
+   screen->webSocketsDeflateLevel = 0;
+   screen->httpState = NULL;
+   screen->webSocketsOnRfbPort = TRUE;
+   screen->listenerThreads = 1;
+   screen->sharedListeners = NULL;
+   screen->corkUpdates = TRUE;
+   screen->tuneSendBuffer = FALSE;
+   screen->notSentLowWater = 0;
+
    screen->protocolMajorVersion = rfbProtocolMajorVersion;
    screen->protocolMinorVersion = rfbProtocolMinorVersion;
 
@@ -1056,6 +1335,8 @@ rfbScreenInfoPtr rfbGetScreen(int* argc,char** argv,
    screen->dontConvertRichCursorToXCursor = FALSE;
    screen->cursor = &myCursor;
    INIT_MUTEX(screen->cursorMutex);
+   INIT_MUTEX(screen->sslMutex);
+   INIT_MUTEX(screen->newClientMutex);
 
 #if defined(LIBVNCSERVER_HAVE_LIBPTHREAD) || defined(LIBVNCSERVER_HAVE_WIN32THREADS)
    screen->backgroundLoop = FALSE;
@@ -1084,6 +1365,10 @@ rfbScreenInfoPtr rfbGetScreen(int* argc,char** argv,
    /* initialize client list and iterator mutex */
    rfbClientListInit(screen);
 
+   /* before any client thread can mark tiles or detect copies */
+   rfbClassifierInit(screen);
+   rfbCopyDetectorInit(screen);
+
    return(screen);
 }
 
@@ -1136,6 +1421,9 @@ void rfbNewFramebuffer(rfbScreenInfoPtr screen, char *framebuffer,
 
   screen->frameBuffer = framebuffer;
 
+  /* the new contents are sent in full, start comparing afresh */
+  rfbCopyDetectorClear(screen);
+
   /* Adjust pointer position if necessary */
 
   if (screen->cursorX >= width)
@@ -1158,9 +1446,9 @@ void rfbNewFramebuffer(rfbScreenInfoPtr screen, char *framebuffer,
     LOCK(cl->updateMutex);
     sraRgnDestroy(cl->modifiedRegion);
     cl->modifiedRegion = sraRgnCreateRect(0, 0, width, height);
-    sraRgnMakeEmpty(cl->copyRegion);
-    cl->copyDX = 0;
-    cl->copyDY = 0;
+    rfbClientClearCopies(cl);
+    sraRgnMakeEmpty(cl->lossyRegion);
+    sraRgnMakeEmpty(cl->refreshRegion);
 
     if (cl->useNewFBSize)
       cl->newFBSizePending = TRUE;
@@ -1194,6 +1482,11 @@ void rfbScreenCleanup(rfbScreenInfoPtr screen)
   FREE_SCREEN_MEMBER(colourMap.data.bytes);
   FREE_SCREEN_MEMBER(underCursorBuffer);
   TINI_MUTEX(screen->cursorMutex);
+  rfbClassifierFree(screen);
+  rfbCopyDetectorFree(screen);
+  rfbssl_cleanup(screen);
+  TINI_MUTEX(screen->sslMutex);
+  TINI_MUTEX(screen->newClientMutex);
 
   if(screen->cursor != &myCursor)
       rfbFreeCursor(screen->cursor);
@@ -1272,6 +1565,9 @@ void rfbShutdownServer(rfbScreenInfoPtr screen,rfbBool disconnectClients) {
       /* Now we can close the pipe */
       close(screen->pipe_notify_listener_thread[0]);
       close(screen->pipe_notify_listener_thread[1]);
+#ifndef WIN32
+      rfbStopSharedListeners(screen);
+#endif
   }
 #endif
 }
@@ -1290,6 +1586,15 @@ static void gettimeofday(struct timeval* tv,char* dummy)
 }
 #endif
 
+/* a millisecond clock for measuring intervals */
+unsigned long rfbCurrentTimeMs(void)
+{
+  struct timeval tv;
+
+  gettimeofday(&tv,NULL);
+  return (unsigned long)tv.tv_sec*1000+tv.tv_usec/1000;
+}
+
 rfbBool
 rfbProcessEvents(rfbScreenInfoPtr screen,long usec)
 {
@@ -1328,6 +1633,12 @@ rfbUpdateClient(rfbClientPtr cl)
   rfbBool result=FALSE;
   rfbScreenInfoPtr screen = cl->screen;
 
+  if (screen->losslessRefreshDelay > 0) {
+      LOCK(cl->updateMutex);
+      rfbScheduleLosslessRefresh(cl);
+      UNLOCK(cl->updateMutex);
+  }
+
   if (cl->sock != RFB_INVALID_SOCKET && !cl->onHold && FB_UPDATE_PENDING(cl) &&
         !sraRgnEmpty(cl->requestedRegion)) {
       result=TRUE;
@@ -1393,6 +1704,7 @@ void rfbRunEventLoop(rfbScreenInfoPtr screen, long usec, rfbBool runInBackground
             screen->pipe_notify_listener_thread[1] = -1;
         }
         fcntl(screen->pipe_notify_listener_thread[0], F_SETFL, O_NONBLOCK);
+        rfbStartSharedListeners(screen);
 #endif
        pthread_create(&screen->listener_thread, NULL, listenerRun, screen);
     return;
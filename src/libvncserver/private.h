@@ -10,6 +10,66 @@ void rfbRedrawAfterHideCursor(rfbClientPtr cl,sraRegionPtr updateRegion);
 /* from main.c */
 
 rfbClientPtr rfbClientIteratorHead(rfbClientIteratorPtr i);
+unsigned long rfbCurrentTimeMs(void);
+void rfbClientClearCopies(rfbClientPtr cl);
+void rfbScheduleLosslessRefresh(rfbClientPtr cl);
+#if defined(LIBVNCSERVER_HAVE_LIBPTHREAD) && !defined(WIN32)
+void rfbStartSharedListeners(rfbScreenInfoPtr screen);
+void rfbStopSharedListeners(rfbScreenInfoPtr screen);
+#endif
+
+/* the n-th pending copy of a client, 0 being copyRegion */
+#define CLIENT_COPY_REGION(cl,n) (*((n) == 0 ? &(cl)->copyRegion : &(cl)->extraCopyRegion[(n)-1]))
+#define CLIENT_COPY_DX(cl,n) (*((n) == 0 ? &(cl)->copyDX : &(cl)->extraCopyDX[(n)-1]))
+#define CLIENT_COPY_DY(cl,n) (*((n) == 0 ? &(cl)->copyDY : &(cl)->extraCopyDY[(n)-1]))
+
+/* from rfbserver.c */
+
+int rfbCheckClientHandshake(rfbClientPtr cl);
+
+/* from sockets.c */
+
+int rfbReadHandshake(rfbClientPtr cl, char *buf, int len);
+int rfbPeekAtSocket(rfbClientPtr cl, char *buf, int len);
+rfbSocket rfbListenOnSharedTCPPort(int port, in_addr_t iface);
+rfbSocket rfbListenOnSharedTCP6Port(int port, const char* iface);
+void rfbSetSocketProfile(rfbClientPtr cl);
+void rfbCorkClient(rfbClientPtr cl, rfbBool cork);
+
+/* from websockets.c */
+
+#ifdef LIBVNCSERVER_WITH_WEBSOCKETS
+/* how long to wait for a new client's first bytes to tell WebSockets from RFB */
+#define WEBSOCKETS_CLIENT_CONNECT_WAIT_MS 100
+
+int webSocketsCheckNoWait(rfbClientPtr cl, unsigned long waited);
+int webSocketsTlsHandshakeNoWait(rfbClientPtr cl);
+int webSocketsHandshakeNoWait(rfbClientPtr cl);
+#endif
+
+/* from httpd.c */
+
+int rfbHttpSetFds(rfbScreenInfoPtr rfbScreen, fd_set *readFds, fd_set *writeFds);
+
+/* from copydetect.c */
+
+void rfbCopyDetectorInit(rfbScreenInfoPtr screen);
+sraRegionPtr rfbDetectCopies(rfbScreenInfoPtr screen, sraRegionPtr modRegion);
+void rfbCopyDetectorUpdate(rfbScreenInfoPtr screen, sraRegionPtr region);
+void rfbCopyDetectorClear(rfbScreenInfoPtr screen);
+void rfbCopyDetectorFree(rfbScreenInfoPtr screen);
+
+/* from classify.c */
+
+#define rfbTileStatic 0
+#define rfbTileText   1
+#define rfbTileScroll 2
+#define rfbTileVideo  4
+
+void rfbClassifierInit(rfbScreenInfoPtr screen);
+void rfbClassifierMarkModified(rfbScreenInfoPtr screen, sraRegionPtr modRegion);
+sraRegionPtr rfbClassifierGetRegion(rfbScreenInfoPtr screen, int classMask, int *updateRate);
+void rfbClassifierFree(rfbScreenInfoPtr screen);
 
 /* from tight.c */
 
@@ -20,6 +80,7 @@ extern void rfbFreeTightData(rfbClientPtr cl);
 
 /* from zrle.c */
 void rfbFreeZrleData(rfbClientPtr cl);
+rfbBool rfbSendRectEncodingZRLEAs(rfbClientPtr cl, int encoding, int x, int y, int w, int h);
 
 #endif
 
@@ -28,5 +89,12 @@ void rfbFreeZrleData(rfbClientPtr cl);
 
 extern void rfbFreeUltraData(rfbClientPtr cl);
 
+/* from h264.c */
+
+#ifdef LIBVNCSERVER_HAVE_LIBAVCODEC
+extern rfbBool rfbH264CanEncode(rfbClientPtr cl);
+extern void rfbFreeH264Data(rfbClientPtr cl);
+#endif
+
 #endif
 
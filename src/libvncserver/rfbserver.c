@@ -349,17 +349,36 @@ rfbSetProtocolVersion(rfbScreenInfoPtr rfbScreen, int major_, int minor_)
         rfbLog("rfbSetProtocolVersion(%d,%d) set to invalid values\n", major_, minor_);
 }
 
+/*
+ * rfbSendProtocolVersion starts the handshake with a new client.
+ */
+
+static rfbBool
+rfbSendProtocolVersion(rfbClientPtr cl)
+{
+    rfbProtocolVersionMsg pv;
+
+    sprintf(pv,rfbProtocolVersionFormat,cl->screen->protocolMajorVersion,
+            cl->screen->protocolMinorVersion);
+
+    if (rfbWriteExact(cl, pv, sz_rfbProtocolVersionMsg) < 0) {
+        rfbLogPerror("rfbNewClient: write");
+        return FALSE;
+    }
+    return TRUE;
+}
+
 /*
  * rfbNewClient is called when a new connection has been made by whatever
  * means.
  */
 
 static rfbClientPtr
-rfbNewTCPOrUDPClient(rfbScreenInfoPtr rfbScreen,
-                     rfbSocket sock,
-                     rfbBool isUDP)
+rfbNewTCPOrUDPClientLocked(rfbScreenInfoPtr rfbScreen,
+                           rfbSocket sock,
+                           rfbBool isUDP,
+                           const char *wsRequest)
 {
-    rfbProtocolVersionMsg pv;
     rfbClientIteratorPtr iterator;
     rfbClientPtr cl,cl_;
 #ifdef LIBVNCSERVER_IPv6
@@ -369,6 +388,7 @@ rfbNewTCPOrUDPClient(rfbScreenInfoPtr rfbScreen,
 #endif
     socklen_t addrlen = sizeof(addr);
     rfbProtocolExtension* extension;
+    int i;
 
     cl = (rfbClientPtr)calloc(sizeof(rfbClientRec),1);
 
@@ -431,6 +451,8 @@ rfbNewTCPOrUDPClient(rfbScreenInfoPtr rfbScreen,
 	rfbLogPerror("setsockopt failed: can't set TCP_NODELAY flag, non TCP socket?");
       }
 
+      rfbSetSocketProfile(cl);
+
       FD_SET(sock,&(rfbScreen->allFds));
 		rfbScreen->maxFd = rfbMax(sock,rfbScreen->maxFd);
 #endif
@@ -446,15 +468,26 @@ rfbNewTCPOrUDPClient(rfbScreenInfoPtr rfbScreen,
       cl->readyForSetColourMapEntries = FALSE;
       cl->useCopyRect = FALSE;
       cl->preferredEncoding = -1;
+      cl->sendingEncoding = -1;
       cl->correMaxWidth = 48;
       cl->correMaxHeight = 48;
 #ifdef LIBVNCSERVER_HAVE_LIBZ
       cl->zrleData = NULL;
 #endif
+      cl->h264Data = NULL;
+      cl->h264ForceKeyframe = TRUE;
+      cl->h264Logged = FALSE;
 
       cl->copyRegion = sraRgnCreate();
       cl->copyDX = 0;
       cl->copyDY = 0;
+      for (i = 0; i < RFB_MAX_EXTRA_COPIES; i++)
+          cl->extraCopyRegion[i] = sraRgnCreate();
+      cl->nExtraCopies = 0;
+
+      cl->lossyRegion = sraRgnCreate();
+      cl->lastLossyUpdate = 0;
+      cl->refreshRegion = sraRgnCreate();
    
       cl->modifiedRegion =
 	sraRgnCreateRect(0,0,rfbScreen->width,rfbScreen->height);
@@ -536,14 +569,19 @@ rfbNewTCPOrUDPClient(rfbScreenInfoPtr rfbScreen,
 #ifndef FUZZING_BUILD_MODE_UNSAFE_FOR_PRODUCTION
 #ifdef LIBVNCSERVER_WITH_WEBSOCKETS
       /*
-       * Wait a few ms for the client to send WebSockets connection (TLS/SSL or plain)
+       * The HTTP server already got the handshake of the clients it hands
+       * over. Others get a few ms to send a WebSockets connection (TLS/SSL
+       * or plain), which is waited for by the event loop, see
+       * rfbProcessClientWebSocketsCheck().
        */
-      if (!webSocketsCheck(cl)) {
+      if (wsRequest && !webSocketsUpgrade(cl, wsRequest)) {
         /* Error reporting handled in webSocketsHandshake */
         rfbCloseClient(cl);
         rfbClientConnectionGone(cl);
         return NULL;
       }
+      if (!wsRequest && rfbScreen->webSocketsOnRfbPort)
+        cl->state = RFB_WEBSOCKETS_CHECK;
 #endif
 #endif
 
@@ -555,11 +593,7 @@ rfbNewTCPOrUDPClient(rfbScreenInfoPtr rfbScreen,
       cl->extClipboardDataSize = 0;
 #endif
 
-      sprintf(pv,rfbProtocolVersionFormat,rfbScreen->protocolMajorVersion, 
-              rfbScreen->protocolMinorVersion);
-
-      if (rfbWriteExact(cl, pv, sz_rfbProtocolVersionMsg) < 0) {
-        rfbLogPerror("rfbNewClient: write");
+      if (cl->state == RFB_PROTOCOL_VERSION && !rfbSendProtocolVersion(cl)) {
         rfbCloseClient(cl);
 	rfbClientConnectionGone(cl);
         return NULL;
@@ -592,18 +626,54 @@ rfbNewTCPOrUDPClient(rfbScreenInfoPtr rfbScreen,
     return cl;
 }
 
+/*
+ * With listenerThreads several threads accept clients at once, so they take
+ * turns setting them up: besides the client list, this changes the screen's
+ * allFds, maxFd and the scaled screen's reference count, and calls the
+ * newClientHook.
+ */
+
+static rfbClientPtr
+rfbNewTCPOrUDPClient(rfbScreenInfoPtr rfbScreen,
+                     rfbSocket sock,
+                     rfbBool isUDP,
+                     const char *wsRequest)
+{
+    rfbClientPtr cl;
+
+    LOCK(rfbScreen->newClientMutex);
+    cl = rfbNewTCPOrUDPClientLocked(rfbScreen, sock, isUDP, wsRequest);
+    UNLOCK(rfbScreen->newClientMutex);
+    return cl;
+}
+
 rfbClientPtr
 rfbNewClient(rfbScreenInfoPtr rfbScreen,
              rfbSocket sock)
 {
-  return(rfbNewTCPOrUDPClient(rfbScreen,sock,FALSE));
+  return(rfbNewTCPOrUDPClient(rfbScreen,sock,FALSE,NULL));
 }
 
+#ifdef LIBVNCSERVER_WITH_WEBSOCKETS
+/*
+ * rfbNewWebSocketsClient is called from httpd.c for a connection which
+ * asked to be upgraded to WebSockets, request being its handshake.
+ */
+
+rfbClientPtr
+rfbNewWebSocketsClient(rfbScreenInfoPtr rfbScreen,
+                       rfbSocket sock,
+                       const char *request)
+{
+  return(rfbNewTCPOrUDPClient(rfbScreen,sock,FALSE,request));
+}
+#endif
+
 rfbClientPtr
 rfbNewUDPClient(rfbScreenInfoPtr rfbScreen)
 {
   return((rfbScreen->udpClient=
-	  rfbNewTCPOrUDPClient(rfbScreen,rfbScreen->udpSock,TRUE)));
+	  rfbNewTCPOrUDPClient(rfbScreen,rfbScreen->udpSock,TRUE,NULL)));
 }
 
 /*
@@ -614,9 +684,7 @@ rfbNewUDPClient(rfbScreenInfoPtr rfbScreen)
 void
 rfbClientConnectionGone(rfbClientPtr cl)
 {
-#if defined(LIBVNCSERVER_HAVE_LIBZ) && defined(LIBVNCSERVER_HAVE_LIBJPEG)
     int i;
-#endif
 
     LOCK(rfbClientListMutex);
 
@@ -664,6 +732,10 @@ rfbClientConnectionGone(rfbClientPtr cl)
 
     rfbFreeUltraData(cl);
 
+#ifdef LIBVNCSERVER_HAVE_LIBAVCODEC
+    rfbFreeH264Data(cl);
+#endif
+
     /* free buffers holding pixel data before and after encoding */
     free(cl->beforeEncBuf);
     free(cl->afterEncBuf);
@@ -677,10 +749,9 @@ rfbClientConnectionGone(rfbClientPtr cl)
     free(cl->host);
     free(cl->repeaterId);
 
-    if (cl->wsctx != NULL){
-        free(cl->wsctx);
-        cl->wsctx = NULL;
-    }
+#ifdef LIBVNCSERVER_WITH_WEBSOCKETS
+    webSocketsFree(cl);
+#endif
 
 #ifdef LIBVNCSERVER_HAVE_LIBZ
     /* Release the compression state structures if any. */
@@ -704,6 +775,10 @@ rfbClientConnectionGone(rfbClientPtr cl)
     sraRgnDestroy(cl->modifiedRegion);
     sraRgnDestroy(cl->requestedRegion);
     sraRgnDestroy(cl->copyRegion);
+    for (i = 0; i < RFB_MAX_EXTRA_COPIES; i++)
+        sraRgnDestroy(cl->extraCopyRegion[i]);
+    sraRgnDestroy(cl->lossyRegion);
+    sraRgnDestroy(cl->refreshRegion);
 
     free(cl->translateLookupTable);
 
@@ -733,6 +808,103 @@ rfbClientConnectionGone(rfbClientPtr cl)
 }
 
 
+#ifdef LIBVNCSERVER_WITH_WEBSOCKETS
+/*
+ * rfbProcessClientWebSocketsCheck is called for a new client which may still
+ * send a WebSockets handshake, or is in the middle of the TLS or HTTP part of
+ * one, when it sent something and regularly from rfbCheckClientHandshake().
+ * Once it is clear what kind of client it is and its WebSockets handshake
+ * is done, the RFB handshake starts.
+ */
+
+static void
+rfbProcessClientWebSocketsCheck(rfbClientPtr cl)
+{
+    int ret;
+
+    if (!cl->handshakeStart)
+        cl->handshakeStart = rfbCurrentTimeMs();
+
+    do {
+        switch (cl->state) {
+        case RFB_WEBSOCKETS_CHECK:
+            ret = webSocketsCheckNoWait(cl, rfbCurrentTimeMs() - cl->handshakeStart);
+            break;
+        case RFB_TLS_HANDSHAKE:
+            ret = webSocketsTlsHandshakeNoWait(cl);
+            break;
+        default:
+            ret = webSocketsHandshakeNoWait(cl);
+            break;
+        }
+        switch (ret) {
+        case -1:
+            /* too early to tell, or waiting for the socket */
+            return;
+        case 0:
+            /* Error reporting handled in webSocketsHandshake */
+            rfbCloseClient(cl);
+            return;
+        }
+    } while (cl->state != RFB_PROTOCOL_VERSION);
+
+    if (!rfbSendProtocolVersion(cl))
+        rfbCloseClient(cl);
+}
+#endif
+
+/*
+ * rfbCheckClientHandshake is called regularly from the event loops for
+ * clients which are not on hold.  It closes clients which take longer than
+ * maxClientWait (or rfbMaxClientWait) ms for the handshake, or for a message
+ * of it once they are authenticating, since that can take a human.  It also
+ * stops waiting for a WebSockets handshake after a while, and retries TLS
+ * handshakes which waited for room to write.  It returns how many ms the
+ * client may be left alone until it has to be checked again, or -1 if there
+ * is no hurry.
+ */
+
+int
+rfbCheckClientHandshake(rfbClientPtr cl)
+{
+    int wait = cl->screen->maxClientWait ? cl->screen->maxClientWait : rfbMaxClientWait;
+    unsigned long now;
+
+    if (cl->state == RFB_NORMAL || cl->state == RFB_SHUTDOWN || cl->sock == RFB_INVALID_SOCKET)
+        return -1;
+
+    if (cl->state == RFB_AUTHENTICATION && cl->handshakeLen == 0) {
+        /* the deadline starts afresh with the next message */
+        cl->handshakeStart = 0;
+        return -1;
+    }
+
+    now = rfbCurrentTimeMs();
+    if (!cl->handshakeStart)
+        cl->handshakeStart = now;
+    if (now - cl->handshakeStart > (unsigned long)wait) {
+        rfbErr("rfbCheckClientHandshake: no handshake from client %s within %d ms\n",
+               cl->host, wait);
+        rfbCloseClient(cl);
+        return -1;
+    }
+
+#ifdef LIBVNCSERVER_WITH_WEBSOCKETS
+    if (cl->state == RFB_WEBSOCKETS_CHECK || cl->state == RFB_TLS_HANDSHAKE ||
+        cl->state == RFB_WEBSOCKETS_HANDSHAKE)
+        rfbProcessClientWebSocketsCheck(cl);
+    if (cl->sock == RFB_INVALID_SOCKET)
+        return -1;
+
+    now = rfbCurrentTimeMs();
+    if (cl->state == RFB_WEBSOCKETS_CHECK && now - cl->handshakeStart < WEBSOCKETS_CLIENT_CONNECT_WAIT_MS)
+        return WEBSOCKETS_CLIENT_CONNECT_WAIT_MS - (now - cl->handshakeStart);
+#endif
+    if (now - cl->handshakeStart > (unsigned long)wait)
+        return 0;
+    return wait - (now - cl->handshakeStart) + 1;
+}
+
 /*
  * rfbProcessClientMessage is called when there is data to read from a client.
  */
@@ -741,6 +913,13 @@ void
 rfbProcessClientMessage(rfbClientPtr cl)
 {
     switch (cl->state) {
+#ifdef LIBVNCSERVER_WITH_WEBSOCKETS
+    case RFB_WEBSOCKETS_CHECK:
+    case RFB_TLS_HANDSHAKE:
+    case RFB_WEBSOCKETS_HANDSHAKE:
+        rfbProcessClientWebSocketsCheck(cl);
+        return;
+#endif
     case RFB_PROTOCOL_VERSION:
         rfbProcessClientProtocolVersion(cl);
         return;
@@ -773,7 +952,9 @@ rfbProcessClientProtocolVersion(rfbClientPtr cl)
     rfbProtocolVersionMsg pv;
     int n, major_, minor_;
 
-    if ((n = rfbReadExact(cl, pv, sz_rfbProtocolVersionMsg)) <= 0) {
+    if ((n = rfbReadHandshake(cl, pv, sz_rfbProtocolVersionMsg)) <= 0) {
+        if (n < 0 && errno == EAGAIN)
+            return;
         if (n == 0)
             rfbLog("rfbProcessClientProtocolVersion: client gone\n");
         else
@@ -892,7 +1073,9 @@ rfbProcessClientInitMessage(rfbClientPtr cl)
          * state to calling software. */
         cl->state = RFB_INITIALISATION;
     } else {
-        if ((n = rfbReadExact(cl, (char *)&ci,sz_rfbClientInitMsg)) <= 0) {
+        if ((n = rfbReadHandshake(cl, (char *)&ci,sz_rfbClientInitMsg)) <= 0) {
+            if (n < 0 && errno == EAGAIN)
+                return;
             if (n == 0)
                 rfbLog("rfbProcessClientInitMessage: client gone\n");
             else
@@ -1121,6 +1304,9 @@ rfbSendSupportedEncodings(rfbClientPtr cl)
 #endif
 #ifdef LIBVNCSERVER_HAVE_LIBPNG
 	rfbEncodingTightPng,
+#endif
+#ifdef LIBVNCSERVER_HAVE_LIBAVCODEC
+	rfbEncodingH264,
 #endif
 	rfbEncodingUltra,
 	rfbEncodingUltraZip,
@@ -2401,6 +2587,7 @@ rfbProcessClientNormalMessage(rfbClientPtr cl)
         cl->enableSupportedMessages  = FALSE;
         cl->enableSupportedEncodings = FALSE;
         cl->enableServerIdentity     = FALSE;
+        cl->nFrameEncodings          = 0;
 #if defined(LIBVNCSERVER_HAVE_LIBZ) || defined(LIBVNCSERVER_HAVE_LIBPNG)
         cl->tightQualityLevel        = -1;
 #ifdef LIBVNCSERVER_HAVE_LIBJPEG
@@ -2444,9 +2631,22 @@ rfbProcessClientNormalMessage(rfbClientPtr cl)
             /* The first supported encoding is the 'preferred' encoding */
                 if (cl->preferredEncoding == -1)
                     cl->preferredEncoding = enc;
+                if (cl->nFrameEncodings < RFB_MAX_FRAME_ENCODINGS)
+                    cl->frameEncodings[cl->nFrameEncodings++] = enc;
 
-
                 break;
+#ifdef LIBVNCSERVER_HAVE_LIBAVCODEC
+            case rfbEncodingH264:
+                /* only preferred if we can encode for this server format */
+                if (cl->preferredEncoding == -1 && rfbH264CanEncode(cl)) {
+                    cl->preferredEncoding = enc;
+                    /* the client may have dropped its decoder meanwhile */
+                    cl->h264ForceKeyframe = TRUE;
+                }
+                if (rfbH264CanEncode(cl) && cl->nFrameEncodings < RFB_MAX_FRAME_ENCODINGS)
+                    cl->frameEncodings[cl->nFrameEncodings++] = enc;
+                break;
+#endif
 	    case rfbEncodingXCursor:
 		if(!cl->screen->dontConvertRichCursorToXCursor) {
 		    rfbLog("Enabling X-style cursor updates for client %s\n",
@@ -2718,9 +2918,11 @@ rfbProcessClientNormalMessage(rfbClientPtr cl)
 
        if (!msg.fur.incremental) {
 	    sraRgnOr(cl->modifiedRegion,tmpRegion);
-	    sraRgnSubtract(cl->copyRegion,tmpRegion);
+	    for (i = 0; i <= cl->nExtraCopies; i++)
+		sraRgnSubtract(CLIENT_COPY_REGION(cl,i),tmpRegion);
             if (cl->useExtDesktopSize)
                 cl->newFBSizePending = TRUE;
+            cl->h264ForceKeyframe = TRUE;
        }
        TSIGNAL(cl->updateCond);
        UNLOCK(cl->updateMutex);
@@ -3180,6 +3382,420 @@ rfbProcessClientNormalMessage(rfbClientPtr cl)
 
 
 
+/*
+ * Count the rectangles a region will be sent as with the given encoding,
+ * 0xFFFF if that is not known in advance and the update has to be ended
+ * with a LastRect marker.
+ */
+
+static int
+rfbNumCodedRects(rfbClientPtr cl, int encoding, sraRegionPtr region)
+{
+    sraRectangleIterator* i=NULL;
+    sraRect rect;
+    int nRects;
+
+    if (encoding == rfbEncodingCoRRE) {
+        nRects = 0;
+
+        for(i = sraRgnGetIterator(region); sraRgnIteratorNext(i,&rect);){
+            int x = rect.x1;
+            int y = rect.y1;
+            int w = rect.x2 - x;
+            int h = rect.y2 - y;
+	    int rectsPerRow, rows;
+            /* We need to count the number of rects in the scaled screen */
+            if (cl->screen!=cl->scaledScreen)
+                rfbScaledCorrection(cl->screen, cl->scaledScreen, &x, &y, &w, &h, "rfbNumCodedRects");
+	    rectsPerRow = (w-1)/cl->correMaxWidth+1;
+	    rows = (h-1)/cl->correMaxHeight+1;
+	    nRects += rectsPerRow*rows;
+        }
+	sraRgnReleaseIterator(i); i=NULL;
+    } else if (encoding == rfbEncodingUltra) {
+        nRects = 0;
+        
+        for(i = sraRgnGetIterator(region); sraRgnIteratorNext(i,&rect);){
+            int x = rect.x1;
+            int y = rect.y1;
+            int w = rect.x2 - x;
+            int h = rect.y2 - y;
+            /* We need to count the number of rects in the scaled screen */
+            if (cl->screen!=cl->scaledScreen)
+                rfbScaledCorrection(cl->screen, cl->scaledScreen, &x, &y, &w, &h, "rfbNumCodedRects");
+            nRects += (((h-1) / (ULTRA_MAX_SIZE( w ) / w)) + 1);
+          }
+        sraRgnReleaseIterator(i); i=NULL;
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+    } else if (encoding == rfbEncodingZlib) {
+	nRects = 0;
+
+        for(i = sraRgnGetIterator(region); sraRgnIteratorNext(i,&rect);){
+            int x = rect.x1;
+            int y = rect.y1;
+            int w = rect.x2 - x;
+            int h = rect.y2 - y;
+            /* We need to count the number of rects in the scaled screen */
+            if (cl->screen!=cl->scaledScreen)
+                rfbScaledCorrection(cl->screen, cl->scaledScreen, &x, &y, &w, &h, "rfbNumCodedRects");
+	    nRects += (((h-1) / (ZLIB_MAX_SIZE( w ) / w)) + 1);
+	}
+	sraRgnReleaseIterator(i); i=NULL;
+#ifdef LIBVNCSERVER_HAVE_LIBJPEG
+    } else if (encoding == rfbEncodingTight) {
+	nRects = 0;
+
+        for(i = sraRgnGetIterator(region); sraRgnIteratorNext(i,&rect);){
+            int x = rect.x1;
+            int y = rect.y1;
+            int w = rect.x2 - x;
+            int h = rect.y2 - y;
+            int n;
+            /* We need to count the number of rects in the scaled screen */
+            if (cl->screen!=cl->scaledScreen)
+                rfbScaledCorrection(cl->screen, cl->scaledScreen, &x, &y, &w, &h, "rfbNumCodedRects");
+	    n = rfbNumCodedRectsTight(cl, x, y, w, h);
+	    if (n == 0) {
+		nRects = 0xFFFF;
+		break;
+	    }
+	    nRects += n;
+	}
+	sraRgnReleaseIterator(i); i=NULL;
+#endif
+#endif
+#if defined(LIBVNCSERVER_HAVE_LIBJPEG) && defined(LIBVNCSERVER_HAVE_LIBPNG)
+    } else if (encoding == rfbEncodingTightPng) {
+	nRects = 0;
+
+        for(i = sraRgnGetIterator(region); sraRgnIteratorNext(i,&rect);){
+            int x = rect.x1;
+            int y = rect.y1;
+            int w = rect.x2 - x;
+            int h = rect.y2 - y;
+            int n;
+            /* We need to count the number of rects in the scaled screen */
+            if (cl->screen!=cl->scaledScreen)
+                rfbScaledCorrection(cl->screen, cl->scaledScreen, &x, &y, &w, &h, "rfbNumCodedRects");
+	    n = rfbNumCodedRectsTight(cl, x, y, w, h);
+	    if (n == 0) {
+		nRects = 0xFFFF;
+		break;
+	    }
+	    nRects += n;
+	}
+	sraRgnReleaseIterator(i); i=NULL;
+#endif
+#ifdef LIBVNCSERVER_HAVE_LIBAVCODEC
+    } else if (encoding == rfbEncodingH264) {
+	/* the encoder may hold a picture back, which is then left out
+	   if LastRect can end the update and sent raw otherwise */
+	nRects = cl->enableLastRectEncoding ? 0xFFFF : sraRgnCountRects(region);
+#endif
+    } else {
+        nRects = sraRgnCountRects(region);
+    }
+
+    return nRects;
+}
+
+static rfbBool
+rfbSendRectEncoding(rfbClientPtr cl, int encoding, int x, int y, int w, int h)
+{
+    cl->sendingEncoding = encoding;
+    switch (encoding) {
+    case -1:
+    case rfbEncodingRaw:
+        if (!rfbSendRectEncodingRaw(cl, x, y, w, h))
+            return FALSE;
+        break;
+    case rfbEncodingRRE:
+        if (!rfbSendRectEncodingRRE(cl, x, y, w, h))
+            return FALSE;
+        break;
+    case rfbEncodingCoRRE:
+        if (!rfbSendRectEncodingCoRRE(cl, x, y, w, h))
+            return FALSE;
+        break;
+    case rfbEncodingHextile:
+        if (!rfbSendRectEncodingHextile(cl, x, y, w, h))
+            return FALSE;
+        break;
+    case rfbEncodingUltra:
+        if (!rfbSendRectEncodingUltra(cl, x, y, w, h))
+            return FALSE;
+        break;
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+    case rfbEncodingZlib:
+        if (!rfbSendRectEncodingZlib(cl, x, y, w, h))
+            return FALSE;
+        break;
+    case rfbEncodingZRLE:
+    case rfbEncodingZYWRLE:
+        if (!rfbSendRectEncodingZRLEAs(cl, encoding, x, y, w, h))
+            return FALSE;
+        break;
+#endif
+#if defined(LIBVNCSERVER_HAVE_LIBJPEG) && (defined(LIBVNCSERVER_HAVE_LIBZ) || defined(LIBVNCSERVER_HAVE_LIBPNG))
+    case rfbEncodingTight:
+        if (!rfbSendRectEncodingTight(cl, x, y, w, h))
+            return FALSE;
+        break;
+#ifdef LIBVNCSERVER_HAVE_LIBPNG
+    case rfbEncodingTightPng:
+        if (!rfbSendRectEncodingTightPng(cl, x, y, w, h))
+            return FALSE;
+        break;
+#endif
+#endif
+#ifdef LIBVNCSERVER_HAVE_LIBAVCODEC
+    case rfbEncodingH264:
+        if (!rfbSendRectEncodingH264(cl, x, y, w, h))
+            return FALSE;
+        break;
+#endif
+    }
+    return TRUE;
+}
+
+/* for rfbSendRegionEncoding(): use the quality level the client asked for */
+#define QUALITY_AS_REQUESTED (-2)
+
+/* Whether sending with an encoding, as currently set up, loses detail */
+
+static rfbBool
+rfbEncodingIsLossy(rfbClientPtr cl, int encoding)
+{
+    if (encoding == rfbEncodingH264 || encoding == rfbEncodingZYWRLE)
+        return TRUE;
+#if defined(LIBVNCSERVER_HAVE_LIBJPEG) && (defined(LIBVNCSERVER_HAVE_LIBZ) || defined(LIBVNCSERVER_HAVE_LIBPNG))
+    if (encoding == rfbEncodingTight || encoding == rfbEncodingTightPng)
+        return cl->turboQualityLevel != -1;
+#endif
+    return FALSE;
+}
+
+/*
+ * Send a region with the given encoding.  For Tight, quality overrides the
+ * client's JPEG quality level: -1 sends losslessly, 0-9 with JPEG at that
+ * level.  For losslessRefreshDelay, the region is recorded as lossy or
+ * not.
+ */
+
+static rfbBool
+rfbSendRegionEncoding(rfbClientPtr cl, sraRegionPtr region, int encoding, int quality)
+{
+    sraRectangleIterator* i;
+    sraRect rect;
+    rfbBool result = TRUE, lossy;
+#if defined(LIBVNCSERVER_HAVE_LIBJPEG) && (defined(LIBVNCSERVER_HAVE_LIBZ) || defined(LIBVNCSERVER_HAVE_LIBPNG))
+    int turboQualityLevel = cl->turboQualityLevel;
+    int turboSubsampLevel = cl->turboSubsampLevel;
+    int tightCompressLevel = cl->tightCompressLevel;
+
+    if (quality != QUALITY_AS_REQUESTED &&
+        (encoding == rfbEncodingTight || encoding == rfbEncodingTightPng)) {
+        if (quality < 0) {
+            cl->turboQualityLevel = -1;
+        } else {
+            cl->turboQualityLevel = tight2turbo_qual[quality];
+            cl->turboSubsampLevel = tight2turbo_subsamp[quality];
+        }
+    }
+#endif
+    lossy = rfbEncodingIsLossy(cl, encoding);
+
+    for(i = sraRgnGetIterator(region); sraRgnIteratorNext(i,&rect);){
+        int x = rect.x1;
+        int y = rect.y1;
+        int w = rect.x2 - x;
+        int h = rect.y2 - y;
+
+        /* We need to count the number of rects in the scaled screen */
+        if (cl->screen!=cl->scaledScreen)
+            rfbScaledCorrection(cl->screen, cl->scaledScreen, &x, &y, &w, &h, "rfbSendRegionEncoding");
+
+        if (!rfbSendRectEncoding(cl, encoding, x, y, w, h)) {
+            result = FALSE;
+            break;
+        }
+    }
+    sraRgnReleaseIterator(i);
+
+    if (result && cl->screen->losslessRefreshDelay > 0) {
+        LOCK(cl->updateMutex);
+        if (lossy) {
+            sraRgnOr(cl->lossyRegion, region);
+            cl->lastLossyUpdate = rfbCurrentTimeMs();
+        } else {
+            sraRgnSubtract(cl->lossyRegion, region);
+        }
+        UNLOCK(cl->updateMutex);
+    }
+
+#if defined(LIBVNCSERVER_HAVE_LIBJPEG) && (defined(LIBVNCSERVER_HAVE_LIBZ) || defined(LIBVNCSERVER_HAVE_LIBPNG))
+    /* Tight adjusts the compression level to the JPEG setting */
+    cl->turboQualityLevel = turboQualityLevel;
+    cl->turboSubsampLevel = turboSubsampLevel;
+    cl->tightCompressLevel = tightCompressLevel;
+#endif
+    return result;
+}
+
+#ifdef LIBVNCSERVER_HAVE_LIBAVCODEC
+/*
+ * Send the whole framebuffer as one H.264 picture. It goes out in the
+ * client's coordinates, so no rounding of the scaling can make it differ
+ * from the size of the scaled framebuffer.
+ */
+
+static rfbBool
+rfbSendH264Frame(rfbClientPtr cl)
+{
+    if (!rfbSendRectEncoding(cl, rfbEncodingH264, 0, 0,
+                             cl->scaledScreen->width, cl->scaledScreen->height))
+        return FALSE;
+
+    if (cl->screen->losslessRefreshDelay > 0) {
+        LOCK(cl->updateMutex);
+        sraRgnDestroy(cl->lossyRegion);
+        cl->lossyRegion = sraRgnCreateRect(0, 0, cl->screen->width, cl->screen->height);
+        cl->lastLossyUpdate = rfbCurrentTimeMs();
+        UNLOCK(cl->updateMutex);
+    }
+    return TRUE;
+}
+#endif
+
+static rfbBool
+rfbClientListedEncoding(rfbClientPtr cl, int encoding)
+{
+    int i;
+
+    for (i = 0; i < cl->nFrameEncodings; i++)
+        if ((int)cl->frameEncodings[i] == encoding)
+            return TRUE;
+    return FALSE;
+}
+
+/* Whether the client's preferred encoding is Tight with JPEG */
+
+static rfbBool
+rfbPreferredEncodingUsesJpeg(rfbClientPtr cl)
+{
+#if defined(LIBVNCSERVER_HAVE_LIBJPEG) && (defined(LIBVNCSERVER_HAVE_LIBZ) || defined(LIBVNCSERVER_HAVE_LIBPNG))
+    if (cl->preferredEncoding == rfbEncodingTight ||
+        cl->preferredEncoding == rfbEncodingTightPng)
+        return cl->turboQualityLevel != -1;
+#endif
+    return FALSE;
+}
+
+/*
+ * The encoding to send text and UI with: the preferred one, which
+ * rfbSendRegionEncoding() can make lossless for Tight, unless that is
+ * H.264 or ZYWRLE.  Then the next one the client listed, Raw if there is
+ * none.
+ */
+
+static int
+rfbLosslessEncoding(rfbClientPtr cl)
+{
+    int i;
+
+    if (cl->preferredEncoding != rfbEncodingH264 &&
+        cl->preferredEncoding != rfbEncodingZYWRLE)
+        return cl->preferredEncoding;
+    for (i = 0; i < cl->nFrameEncodings; i++)
+        if (cl->frameEncodings[i] != rfbEncodingH264 &&
+            cl->frameEncodings[i] != rfbEncodingZYWRLE)
+            return cl->frameEncodings[i];
+    return rfbEncodingRaw;
+}
+
+/*
+ * Split an update for adaptive encoding.  Areas the classifier sees as
+ * video are moved to *videoRegion, to be sent with H.264 or Tight JPEG
+ * if the client can take either; the busier, the lower the JPEG quality.
+ * If the client gets JPEG otherwise, text, UI and scrolling areas are
+ * moved to *textRegion, to be sent losslessly.  The rest stays in
+ * updateRegion and is sent as the client asked for.
+ */
+
+static void
+rfbSplitAdaptiveRegions(rfbClientPtr cl, sraRegionPtr updateRegion,
+                        sraRegionPtr *videoRegion, int *videoEncoding, int *videoQuality,
+                        sraRegionPtr *textRegion, int *textEncoding)
+{
+    sraRegionPtr video;
+    int updateRate = 0;
+
+    *videoRegion = NULL;
+    *textRegion = NULL;
+
+    video = rfbClassifierGetRegion(cl->screen, rfbTileVideo, &updateRate);
+#ifdef LIBVNCSERVER_HAVE_LIBAVCODEC
+    if (!sraRgnEmpty(video) && rfbClientListedEncoding(cl, rfbEncodingH264) &&
+        rfbH264CanEncode(cl)) {
+        /*
+         * H.264 predicts from earlier pictures of the same geometry, so
+         * the video's bounding box is sent as a whole whenever part of it
+         * changes.
+         */
+        sraRegionPtr bbox = sraRgnBBox(video);
+        sraRgnAnd(video, updateRegion);
+        if (!sraRgnEmpty(video)) {
+            sraRgnSubtract(updateRegion, bbox);
+            *videoRegion = bbox;
+            *videoEncoding = rfbEncodingH264;
+            *videoQuality = QUALITY_AS_REQUESTED;
+        } else {
+            sraRgnDestroy(bbox);
+        }
+        sraRgnMakeEmpty(video);
+    }
+#endif
+#if defined(LIBVNCSERVER_HAVE_LIBJPEG) && (defined(LIBVNCSERVER_HAVE_LIBZ) || defined(LIBVNCSERVER_HAVE_LIBPNG))
+    /* JPEG is only for clients which sent a quality level */
+    if (!sraRgnEmpty(video) && cl->tightQualityLevel >= 0 &&
+        (rfbClientListedEncoding(cl, rfbEncodingTight) ||
+         rfbClientListedEncoding(cl, rfbEncodingTightPng))) {
+        int level = 7, rate;
+
+        for (rate = updateRate; rate > 10 && level > 3; rate /= 2)
+            level--;
+        if (level > cl->tightQualityLevel)
+            level = cl->tightQualityLevel;
+
+        sraRgnAnd(video, updateRegion);
+        if (!sraRgnEmpty(video)) {
+            sraRgnSubtract(updateRegion, video);
+            *videoRegion = video;
+            video = NULL;
+            *videoEncoding = rfbClientListedEncoding(cl, rfbEncodingTight) ?
+                rfbEncodingTight : rfbEncodingTightPng;
+            *videoQuality = level;
+        }
+    }
+#endif
+    if (video)
+        sraRgnDestroy(video);
+
+    if (rfbPreferredEncodingUsesJpeg(cl)) {
+        sraRegionPtr text = rfbClassifierGetRegion(cl->screen,
+                                                   rfbTileText | rfbTileScroll, NULL);
+        sraRgnAnd(text, updateRegion);
+        if (!sraRgnEmpty(text)) {
+            sraRgnSubtract(updateRegion, text);
+            *textRegion = text;
+            *textEncoding = rfbLosslessEncoding(cl);
+        } else {
+            sraRgnDestroy(text);
+        }
+    }
+}
+
+
 /*
  * rfbSendFramebufferUpdate - send the currently pending framebuffer update to
  * the RFB client.
@@ -3190,18 +3806,22 @@ rfbBool
 rfbSendFramebufferUpdate(rfbClientPtr cl,
                          sraRegionPtr givenUpdateRegion)
 {
-    sraRectangleIterator* i=NULL;
-    sraRect rect;
-    int nUpdateRegionRects;
+    int nUpdateRegionRects, n;
     rfbFramebufferUpdateMsg *fu = (rfbFramebufferUpdateMsg *)cl->updateBuf;
-    sraRegionPtr updateRegion,updateCopyRegion,tmpRegion;
-    int dx, dy;
+    sraRegionPtr updateRegion,tmpRegion;
+    sraRegionPtr updateCopyRegion[RFB_MAX_EXTRA_COPIES+1];
+    int copyDX[RFB_MAX_EXTRA_COPIES+1], copyDY[RFB_MAX_EXTRA_COPIES+1];
+    int nCopies, nCopyRects = 0, c;
+    sraRegionPtr videoRegion = NULL, textRegion = NULL, refreshRegion = NULL;
+    int encoding = cl->preferredEncoding;
+    int videoEncoding = -1, videoQuality = QUALITY_AS_REQUESTED, textEncoding = -1;
     rfbBool sendCursorShape = FALSE;
     rfbBool sendCursorPos = FALSE;
     rfbBool sendKeyboardLedState = FALSE;
     rfbBool sendSupportedMessages = FALSE;
     rfbBool sendSupportedEncodings = FALSE;
     rfbBool sendServerIdentity = FALSE;
+    rfbBool sendH264Frame = FALSE;
     rfbBool result = TRUE;
     
 
@@ -3310,10 +3930,11 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
     /*
      * The modifiedRegion may overlap the destination copyRegion.  We remove
      * any overlapping bits from the copyRegion (since they'd only be
-     * overwritten anyway).
+     * overwritten anyway).  The same goes for the extra copies.
      */
     
-    sraRgnSubtract(cl->copyRegion,cl->modifiedRegion);
+    for (c = 0; c <= cl->nExtraCopies; c++)
+	sraRgnSubtract(CLIENT_COPY_REGION(cl,c),cl->modifiedRegion);
 
     /*
      * The client is interested in the region requestedRegion.  The region
@@ -3343,7 +3964,8 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
 	    cl->progressiveSliceY=y;
     }
 
-    sraRgnOr(updateRegion,cl->copyRegion);
+    for (c = 0; c <= cl->nExtraCopies; c++)
+	sraRgnOr(updateRegion,CLIENT_COPY_REGION(cl,c));
     if(!sraRgnAnd(updateRegion,cl->requestedRegion) &&
        sraRgnEmpty(updateRegion) &&
        (cl->enableCursorShapeUpdates ||
@@ -3363,17 +3985,20 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
      * copy must lie within requestedRegion.  So the region we can send as a
      * copy is the intersection of the copyRegion with both the requestedRegion
      * and the requestedRegion translated by the amount of the copy.  We set
-     * updateCopyRegion to this.
+     * updateCopyRegion to this, for each of the pending copies.
      */
 
-    updateCopyRegion = sraRgnCreateRgn(cl->copyRegion);
-    sraRgnAnd(updateCopyRegion,cl->requestedRegion);
-    tmpRegion = sraRgnCreateRgn(cl->requestedRegion);
-    sraRgnOffset(tmpRegion,cl->copyDX,cl->copyDY);
-    sraRgnAnd(updateCopyRegion,tmpRegion);
-    sraRgnDestroy(tmpRegion);
-    dx = cl->copyDX;
-    dy = cl->copyDY;
+    nCopies = cl->nExtraCopies + 1;
+    for (c = 0; c < nCopies; c++) {
+	copyDX[c] = CLIENT_COPY_DX(cl,c);
+	copyDY[c] = CLIENT_COPY_DY(cl,c);
+	updateCopyRegion[c] = sraRgnCreateRgn(CLIENT_COPY_REGION(cl,c));
+	sraRgnAnd(updateCopyRegion[c],cl->requestedRegion);
+	tmpRegion = sraRgnCreateRgn(cl->requestedRegion);
+	sraRgnOffset(tmpRegion,copyDX[c],copyDY[c]);
+	sraRgnAnd(updateCopyRegion[c],tmpRegion);
+	sraRgnDestroy(tmpRegion);
+    }
 
     /*
      * Next we remove updateCopyRegion from updateRegion so that updateRegion
@@ -3381,7 +4006,8 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
      * a copy).
      */
 
-    sraRgnSubtract(updateRegion,updateCopyRegion);
+    for (c = 0; c < nCopies; c++)
+	sraRgnSubtract(updateRegion,updateCopyRegion[c]);
 
     /*
      * Finally we leave modifiedRegion to be the remainder (if any) of parts of
@@ -3390,14 +4016,44 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
      * carry over a copyRegion for a future update.
      */
 
-     sraRgnOr(cl->modifiedRegion,cl->copyRegion);
+     for (c = 0; c < nCopies; c++)
+	 sraRgnOr(cl->modifiedRegion,CLIENT_COPY_REGION(cl,c));
      sraRgnSubtract(cl->modifiedRegion,updateRegion);
-     sraRgnSubtract(cl->modifiedRegion,updateCopyRegion);
+     for (c = 0; c < nCopies; c++)
+	 sraRgnSubtract(cl->modifiedRegion,updateCopyRegion[c]);
+
+    /*
+     * For losslessRefreshDelay, the parts of this update due for a lossless
+     * refresh are taken out to be sent losslessly, and copies carry what
+     * the client has in lossy form along to their destinations.
+     */
+
+     if (!sraRgnEmpty(cl->refreshRegion)) {
+	 refreshRegion = sraRgnCreateRgn(cl->refreshRegion);
+	 if (sraRgnAnd(refreshRegion,updateRegion)) {
+	     sraRgnSubtract(cl->refreshRegion,refreshRegion);
+	     sraRgnSubtract(updateRegion,refreshRegion);
+	 } else {
+	     sraRgnDestroy(refreshRegion);
+	     refreshRegion = NULL;
+	 }
+     }
+     if (cl->screen->losslessRefreshDelay > 0) {
+	 for (c = 0; c < nCopies; c++) {
+	     if (sraRgnEmpty(updateCopyRegion[c]))
+		 continue;
+	     tmpRegion = sraRgnCreateRgn(cl->lossyRegion);
+	     sraRgnOr(tmpRegion,cl->refreshRegion);
+	     sraRgnOffset(tmpRegion,copyDX[c],copyDY[c]);
+	     sraRgnAnd(tmpRegion,updateCopyRegion[c]);
+	     sraRgnSubtract(cl->lossyRegion,updateCopyRegion[c]);
+	     sraRgnOr(cl->lossyRegion,tmpRegion);
+	     sraRgnDestroy(tmpRegion);
+	 }
+     }
 
      sraRgnMakeEmpty(cl->requestedRegion);
-     sraRgnMakeEmpty(cl->copyRegion);
-     cl->copyDX = 0;
-     cl->copyDY = 0;
+     rfbClientClearCopies(cl);
    
      UNLOCK(cl->updateMutex);
    
@@ -3413,132 +4069,104 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
       rfbShowCursor(cl);
     }
 
+#ifdef LIBVNCSERVER_HAVE_LIBAVCODEC
     /*
-     * Now send the update.
+     * H.264 codes whole pictures against its own reference frames, so
+     * any change, including copies, is sent as one rectangle the size of
+     * the client's, possibly scaled, framebuffer.
      */
-    
-    rfbStatRecordMessageSent(cl, rfbFramebufferUpdate, 0, 0);
-    if (cl->preferredEncoding == rfbEncodingCoRRE) {
-        nUpdateRegionRects = 0;
-
-        for(i = sraRgnGetIterator(updateRegion); sraRgnIteratorNext(i,&rect);){
-            int x = rect.x1;
-            int y = rect.y1;
-            int w = rect.x2 - x;
-            int h = rect.y2 - y;
-	    int rectsPerRow, rows;
-            /* We need to count the number of rects in the scaled screen */
-            if (cl->screen!=cl->scaledScreen)
-                rfbScaledCorrection(cl->screen, cl->scaledScreen, &x, &y, &w, &h, "rfbSendFramebufferUpdate");
-	    rectsPerRow = (w-1)/cl->correMaxWidth+1;
-	    rows = (h-1)/cl->correMaxHeight+1;
-	    nUpdateRegionRects += rectsPerRow*rows;
-        }
-	sraRgnReleaseIterator(i); i=NULL;
-    } else if (cl->preferredEncoding == rfbEncodingUltra) {
-        nUpdateRegionRects = 0;
-        
-        for(i = sraRgnGetIterator(updateRegion); sraRgnIteratorNext(i,&rect);){
-            int x = rect.x1;
-            int y = rect.y1;
-            int w = rect.x2 - x;
-            int h = rect.y2 - y;
-            /* We need to count the number of rects in the scaled screen */
-            if (cl->screen!=cl->scaledScreen)
-                rfbScaledCorrection(cl->screen, cl->scaledScreen, &x, &y, &w, &h, "rfbSendFramebufferUpdate");
-            nUpdateRegionRects += (((h-1) / (ULTRA_MAX_SIZE( w ) / w)) + 1);
-          }
-        sraRgnReleaseIterator(i); i=NULL;
-#ifdef LIBVNCSERVER_HAVE_LIBZ
-    } else if (cl->preferredEncoding == rfbEncodingZlib) {
-	nUpdateRegionRects = 0;
-
-        for(i = sraRgnGetIterator(updateRegion); sraRgnIteratorNext(i,&rect);){
-            int x = rect.x1;
-            int y = rect.y1;
-            int w = rect.x2 - x;
-            int h = rect.y2 - y;
-            /* We need to count the number of rects in the scaled screen */
-            if (cl->screen!=cl->scaledScreen)
-                rfbScaledCorrection(cl->screen, cl->scaledScreen, &x, &y, &w, &h, "rfbSendFramebufferUpdate");
-	    nUpdateRegionRects += (((h-1) / (ZLIB_MAX_SIZE( w ) / w)) + 1);
+    if (cl->preferredEncoding == rfbEncodingH264 && !cl->screen->adaptiveEncoding) {
+	sendH264Frame = !sraRgnEmpty(updateRegion);
+	for (c = 0; c < nCopies; c++) {
+	    if (!sraRgnEmpty(updateCopyRegion[c]))
+		sendH264Frame = TRUE;
+	    sraRgnMakeEmpty(updateCopyRegion[c]);
 	}
-	sraRgnReleaseIterator(i); i=NULL;
-#ifdef LIBVNCSERVER_HAVE_LIBJPEG
-    } else if (cl->preferredEncoding == rfbEncodingTight) {
-	nUpdateRegionRects = 0;
-
-        for(i = sraRgnGetIterator(updateRegion); sraRgnIteratorNext(i,&rect);){
-            int x = rect.x1;
-            int y = rect.y1;
-            int w = rect.x2 - x;
-            int h = rect.y2 - y;
-            int n;
-            /* We need to count the number of rects in the scaled screen */
-            if (cl->screen!=cl->scaledScreen)
-                rfbScaledCorrection(cl->screen, cl->scaledScreen, &x, &y, &w, &h, "rfbSendFramebufferUpdate");
-	    n = rfbNumCodedRectsTight(cl, x, y, w, h);
-	    if (n == 0) {
-		nUpdateRegionRects = 0xFFFF;
-		break;
-	    }
-	    nUpdateRegionRects += n;
-	}
-	sraRgnReleaseIterator(i); i=NULL;
-#endif
+	sraRgnMakeEmpty(updateRegion);
+    }
 #endif
-#if defined(LIBVNCSERVER_HAVE_LIBJPEG) && defined(LIBVNCSERVER_HAVE_LIBPNG)
-    } else if (cl->preferredEncoding == rfbEncodingTightPng) {
-	nUpdateRegionRects = 0;
 
-        for(i = sraRgnGetIterator(updateRegion); sraRgnIteratorNext(i,&rect);){
-            int x = rect.x1;
-            int y = rect.y1;
-            int w = rect.x2 - x;
-            int h = rect.y2 - y;
-            int n;
-            /* We need to count the number of rects in the scaled screen */
-            if (cl->screen!=cl->scaledScreen)
-                rfbScaledCorrection(cl->screen, cl->scaledScreen, &x, &y, &w, &h, "rfbSendFramebufferUpdate");
-	    n = rfbNumCodedRectsTight(cl, x, y, w, h);
-	    if (n == 0) {
-		nUpdateRegionRects = 0xFFFF;
-		break;
-	    }
-	    nUpdateRegionRects += n;
+    /*
+     * With adaptive encoding, video and text are split off the update to be
+     * sent with encodings suiting them.  H.264 is only used for video then,
+     * the rest is sent losslessly.
+     */
+
+    if (cl->screen->adaptiveEncoding) {
+	rfbSplitAdaptiveRegions(cl, updateRegion, &videoRegion, &videoEncoding, &videoQuality,
+				&textRegion, &textEncoding);
+	encoding = rfbLosslessEncoding(cl);
+    }
+
+    /* a lossless refresh is sent along with the text */
+    if (refreshRegion) {
+	if (textRegion) {
+	    sraRgnOr(textRegion, refreshRegion);
+	    sraRgnDestroy(refreshRegion);
+	} else {
+	    textRegion = refreshRegion;
+	    textEncoding = rfbLosslessEncoding(cl);
 	}
-	sraRgnReleaseIterator(i); i=NULL;
-#endif
-    } else {
-        nUpdateRegionRects = sraRgnCountRects(updateRegion);
+	refreshRegion = NULL;
     }
 
+    /*
+     * Now send the update.
+     */
+    
+    rfbStatRecordMessageSent(cl, rfbFramebufferUpdate, 0, 0);
+    nUpdateRegionRects = rfbNumCodedRects(cl, encoding, updateRegion);
+
+    /* hold back partial segments until the whole update is written */
+    rfbCorkClient(cl, TRUE);
+
     fu->type = rfbFramebufferUpdate;
     if (nUpdateRegionRects != 0xFFFF) {
 	if(cl->screen->maxRectsPerUpdate>0
 	   /* CoRRE splits the screen into smaller squares */
-	   && cl->preferredEncoding != rfbEncodingCoRRE
+	   && encoding != rfbEncodingCoRRE
 	   /* Ultra encoding splits rectangles up into smaller chunks */
-           && cl->preferredEncoding != rfbEncodingUltra
+           && encoding != rfbEncodingUltra
 #ifdef LIBVNCSERVER_HAVE_LIBZ
 	   /* Zlib encoding splits rectangles up into smaller chunks */
-	   && cl->preferredEncoding != rfbEncodingZlib
+	   && encoding != rfbEncodingZlib
 #ifdef LIBVNCSERVER_HAVE_LIBJPEG
 	   /* Tight encoding counts the rectangles differently */
-	   && cl->preferredEncoding != rfbEncodingTight
+	   && encoding != rfbEncodingTight
 #endif
 #endif
 #ifdef LIBVNCSERVER_HAVE_LIBPNG
 	   /* Tight encoding counts the rectangles differently */
-	   && cl->preferredEncoding != rfbEncodingTightPng
+	   && encoding != rfbEncodingTightPng
 #endif
 	   && nUpdateRegionRects>cl->screen->maxRectsPerUpdate) {
 	    sraRegion* newUpdateRegion = sraRgnBBox(updateRegion);
 	    sraRgnDestroy(updateRegion);
 	    updateRegion = newUpdateRegion;
+	    /* the bounding box may cover parts split off for adaptive encoding */
+	    if (videoRegion)
+		sraRgnSubtract(updateRegion, videoRegion);
+	    if (textRegion)
+		sraRgnSubtract(updateRegion, textRegion);
 	    nUpdateRegionRects = sraRgnCountRects(updateRegion);
 	}
-	fu->nRects = Swap16IfLE((uint16_t)(sraRgnCountRects(updateCopyRegion) +
+    }
+    if (videoRegion && nUpdateRegionRects != 0xFFFF) {
+	n = rfbNumCodedRects(cl, videoEncoding, videoRegion);
+	nUpdateRegionRects = n == 0xFFFF ? 0xFFFF : nUpdateRegionRects + n;
+    }
+    if (textRegion && nUpdateRegionRects != 0xFFFF) {
+	n = rfbNumCodedRects(cl, textEncoding, textRegion);
+	nUpdateRegionRects = n == 0xFFFF ? 0xFFFF : nUpdateRegionRects + n;
+    }
+    /* the encoder may hold a picture back, which is then left out */
+    if (sendH264Frame && nUpdateRegionRects != 0xFFFF)
+	nUpdateRegionRects = cl->enableLastRectEncoding ? 0xFFFF : nUpdateRegionRects + 1;
+
+    if (nUpdateRegionRects != 0xFFFF) {
+	for (c = 0; c < nCopies; c++)
+	    nCopyRects += sraRgnCountRects(updateCopyRegion[c]);
+	fu->nRects = Swap16IfLE((uint16_t)(nCopyRects +
 					   nUpdateRegionRects +
 					   !!sendCursorShape + !!sendCursorPos + !!sendKeyboardLedState +
 					   !!sendSupportedMessages + !!sendSupportedEncodings + !!sendServerIdentity));
@@ -3577,72 +4205,27 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
            goto updateFailed;
    }
 
-    if (!sraRgnEmpty(updateCopyRegion)) {
-	if (!rfbSendCopyRegion(cl,updateCopyRegion,dx,dy))
+    for (c = 0; c < nCopies; c++) {
+	if (!sraRgnEmpty(updateCopyRegion[c]) &&
+	    !rfbSendCopyRegion(cl,updateCopyRegion[c],copyDX[c],copyDY[c]))
 	        goto updateFailed;
     }
 
-    for(i = sraRgnGetIterator(updateRegion); sraRgnIteratorNext(i,&rect);){
-        int x = rect.x1;
-        int y = rect.y1;
-        int w = rect.x2 - x;
-        int h = rect.y2 - y;
+#ifdef LIBVNCSERVER_HAVE_LIBAVCODEC
+    if (sendH264Frame && !rfbSendH264Frame(cl))
+	goto updateFailed;
+#endif
 
-        /* We need to count the number of rects in the scaled screen */
-        if (cl->screen!=cl->scaledScreen)
-            rfbScaledCorrection(cl->screen, cl->scaledScreen, &x, &y, &w, &h, "rfbSendFramebufferUpdate");
+    if (videoRegion &&
+        !rfbSendRegionEncoding(cl, videoRegion, videoEncoding, videoQuality))
+	goto updateFailed;
 
-        switch (cl->preferredEncoding) {
-	case -1:
-        case rfbEncodingRaw:
-            if (!rfbSendRectEncodingRaw(cl, x, y, w, h))
-	        goto updateFailed;
-            break;
-        case rfbEncodingRRE:
-            if (!rfbSendRectEncodingRRE(cl, x, y, w, h))
-	        goto updateFailed;
-            break;
-        case rfbEncodingCoRRE:
-            if (!rfbSendRectEncodingCoRRE(cl, x, y, w, h))
-	        goto updateFailed;
-	    break;
-        case rfbEncodingHextile:
-            if (!rfbSendRectEncodingHextile(cl, x, y, w, h))
-	        goto updateFailed;
-            break;
-        case rfbEncodingUltra:
-            if (!rfbSendRectEncodingUltra(cl, x, y, w, h))
-                goto updateFailed;
-            break;
-#ifdef LIBVNCSERVER_HAVE_LIBZ
-	case rfbEncodingZlib:
-	    if (!rfbSendRectEncodingZlib(cl, x, y, w, h))
-	        goto updateFailed;
-	    break;
-       case rfbEncodingZRLE:
-       case rfbEncodingZYWRLE:
-           if (!rfbSendRectEncodingZRLE(cl, x, y, w, h))
-	       goto updateFailed;
-           break;
-#endif
-#if defined(LIBVNCSERVER_HAVE_LIBJPEG) && (defined(LIBVNCSERVER_HAVE_LIBZ) || defined(LIBVNCSERVER_HAVE_LIBPNG))
-	case rfbEncodingTight:
-	    if (!rfbSendRectEncodingTight(cl, x, y, w, h))
-	        goto updateFailed;
-	    break;
-#ifdef LIBVNCSERVER_HAVE_LIBPNG
-	case rfbEncodingTightPng:
-	    if (!rfbSendRectEncodingTightPng(cl, x, y, w, h))
-	        goto updateFailed;
-	    break;
-#endif
-#endif
-        }
-    }
-    if (i) {
-        sraRgnReleaseIterator(i);
-        i = NULL;
-    }
+    if (textRegion &&
+        !rfbSendRegionEncoding(cl, textRegion, textEncoding, -1))
+	goto updateFailed;
+
+    if (!rfbSendRegionEncoding(cl, updateRegion, encoding, QUALITY_AS_REQUESTED))
+	goto updateFailed;
 
     if ( nUpdateRegionRects == 0xFFFF &&
 	 !rfbSendLastRectMarker(cl) )
@@ -3652,15 +4235,20 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
 updateFailed:
 	result = FALSE;
     }
+    cl->sendingEncoding = -1;
+    rfbCorkClient(cl, FALSE);
 
     if (!cl->enableCursorShapeUpdates) {
       rfbHideCursor(cl);
     }
 
-    if(i)
-        sraRgnReleaseIterator(i);
     sraRgnDestroy(updateRegion);
-    sraRgnDestroy(updateCopyRegion);
+    for (c = 0; c < nCopies; c++)
+	sraRgnDestroy(updateCopyRegion[c]);
+    if (videoRegion)
+        sraRgnDestroy(videoRegion);
+    if (textRegion)
+        sraRgnDestroy(textRegion);
 
     if(cl->screen->displayFinishedHook)
       cl->screen->displayFinishedHook(cl, result);
@@ -4,12 +4,21 @@
 #include "rfb/rfb.h"
 #include "rfb/rfbconfig.h"
 
+/* results of rfbssl_handshake() besides 1 (done) and -1 (failed) */
+#define RFBSSL_WANT_READ  2
+#define RFBSSL_WANT_WRITE 3
+
 int rfbssl_init(rfbClientPtr cl);
+int rfbssl_handshake(rfbClientPtr cl);
+int rfbssl_want_write(rfbClientPtr cl);
 int rfbssl_pending(rfbClientPtr cl);
 int rfbssl_peek(rfbClientPtr cl, char *buf, int bufsize);
 int rfbssl_read(rfbClientPtr cl, char *buf, int bufsize);
 int rfbssl_write(rfbClientPtr cl, const char *buf, int bufsize);
+/* hdr followed by buf; returns what rfbssl_write() would, hdr counting first */
+int rfbssl_write2(rfbClientPtr cl, const char *hdr, int hdrLen, const char *buf, int bufsize);
 void rfbssl_destroy(rfbClientPtr cl);
+void rfbssl_cleanup(rfbScreenInfoPtr screen);
 
 
 #endif /* _VNCSSL_H */
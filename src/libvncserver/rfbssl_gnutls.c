@@ -23,18 +23,48 @@
 
 #include "rfbssl.h"
 #include <gnutls/gnutls.h>
+#if GNUTLS_VERSION_NUMBER >= 0x030703
+#include <gnutls/socket.h>
+#endif
 #include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+#ifdef LIBVNCSERVER_HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
 
-struct rfbssl_ctx {
-    char peekbuf[2048];
-    int peeklen;
-    int peekstart;
-    gnutls_session_t session;
+/*
+ * The credentials are shared by all clients of a screen, so the key and
+ * certificate are only read once, and again when one of the files
+ * changes.  Sessions keep a reference, as the credentials must outlive
+ * them.  It is taken while screen->sslMutex is held, which guards
+ * screen->sslServerCtx and so the screen's own reference.
+ */
+
+struct rfbssl_server_ctx {
     gnutls_certificate_credentials_t x509_cred;
     gnutls_dh_params_t dh_params;
 #ifdef I_LIKE_RSA_PARAMS_THAT_MUCH
     gnutls_rsa_params_t rsa_params;
 #endif
+    gnutls_datum_t ticket_key;
+    char *keyfile;
+    char *certfile;
+    time_t key_mtime;
+    time_t cert_mtime;
+    int refcount;
+    MUTEX(lock);
+};
+
+/* the largest plain text a TLS record carries */
+#define RFBSSL_RECORD_SIZE 16384
+
+struct rfbssl_ctx {
+    char peekbuf[2048];
+    int peeklen;
+    int peekstart;
+    gnutls_session_t session;
+    struct rfbssl_server_ctx *server;
 };
 
 void rfbssl_log_func(int level, const char *msg)
@@ -47,17 +77,25 @@ static void rfbssl_error(const char *msg, int e)
     rfbErr("%s: %s (%ld)\n", msg, gnutls_strerror(e), e);
 }
 
+static time_t rfbssl_mtime(const char *path)
+{
+    struct stat st;
+    return stat(path, &st) == 0 ? st.st_mtime : 0;
+}
+
 static int rfbssl_init_session(struct rfbssl_ctx *ctx, int fd)
 {
     gnutls_session_t session;
     int ret;
 
-    if (GNUTLS_E_SUCCESS != (ret = gnutls_init(&session, GNUTLS_SERVER))) {
+    if (GNUTLS_E_SUCCESS != (ret = gnutls_init(&session, GNUTLS_SERVER | GNUTLS_NONBLOCK))) {
       /* */
     } else if (GNUTLS_E_SUCCESS != (ret = gnutls_set_default_priority(session))) {
-      /* */
-    } else if (GNUTLS_E_SUCCESS != (ret = gnutls_credentials_set(session, GNUTLS_CRD_CERTIFICATE, ctx->x509_cred))) {
-      /* */
+      gnutls_deinit(session);
+    } else if (GNUTLS_E_SUCCESS != (ret = gnutls_credentials_set(session, GNUTLS_CRD_CERTIFICATE, ctx->server->x509_cred))) {
+      gnutls_deinit(session);
+    } else if (GNUTLS_E_SUCCESS != (ret = gnutls_session_ticket_enable_server(session, &ctx->server->ticket_key))) {
+      gnutls_deinit(session);
     } else {
       gnutls_session_enable_compatibility_mode(session);
       gnutls_transport_set_ptr(session, (gnutls_transport_ptr_t)(uintptr_t)fd);
@@ -66,7 +104,7 @@ static int rfbssl_init_session(struct rfbssl_ctx *ctx, int fd)
     return ret;
 }
 
-static int generate_dh_params(struct rfbssl_ctx *ctx)
+static int generate_dh_params(struct rfbssl_server_ctx *ctx)
 {
     int ret;
     if (GNUTLS_E_SUCCESS == (ret = gnutls_dh_params_init(&ctx->dh_params)))
@@ -75,7 +113,7 @@ static int generate_dh_params(struct rfbssl_ctx *ctx)
 }
 
 #ifdef I_LIKE_RSA_PARAMS_THAT_MUCH
-static int generate_rsa_params(struct rfbssl_ctx *ctx)
+static int generate_rsa_params(struct rfbssl_server_ctx *ctx)
 {
     int ret;
     if (GNUTLS_E_SUCCESS == (ret = gnutls_rsa_params_init(&ctx->rsa_params)))
@@ -84,15 +122,49 @@ static int generate_rsa_params(struct rfbssl_ctx *ctx)
 }
 #endif
 
-struct rfbssl_ctx *rfbssl_init_global(char *key, char *cert)
+static void rfbssl_release_server_ctx(struct rfbssl_server_ctx *ctx)
+{
+    int refcount;
+
+    LOCK(ctx->lock);
+    refcount = --ctx->refcount;
+    UNLOCK(ctx->lock);
+    if (refcount > 0)
+	return;
+
+    TINI_MUTEX(ctx->lock);
+    if (ctx->x509_cred)
+	gnutls_certificate_free_credentials(ctx->x509_cred);
+    if (ctx->dh_params)
+	gnutls_dh_params_deinit(ctx->dh_params);
+#ifdef I_LIKE_RSA_PARAMS_THAT_MUCH
+    if (ctx->rsa_params)
+	gnutls_rsa_params_deinit(ctx->rsa_params);
+#endif
+    if (ctx->ticket_key.data)
+	gnutls_free(ctx->ticket_key.data);
+    free(ctx->keyfile);
+    free(ctx->certfile);
+    free(ctx);
+    gnutls_global_deinit();
+}
+
+static struct rfbssl_server_ctx *rfbssl_init_global(const char *key, const char *cert)
 {
     int ret = GNUTLS_E_SUCCESS;
-    struct rfbssl_ctx *ctx = NULL;
+    struct rfbssl_server_ctx *ctx = NULL;
 
-    if (NULL == (ctx = malloc(sizeof(struct rfbssl_ctx)))) {
+    if (NULL == (ctx = calloc(1, sizeof(struct rfbssl_server_ctx)))) {
+	return NULL;
+    }
+    INIT_MUTEX(ctx->lock);
+    ctx->refcount = 1;
+
+    if (GNUTLS_E_SUCCESS != (ret = gnutls_global_init())) {
+	TINI_MUTEX(ctx->lock);
+	free(ctx);
+	rfbssl_error(__func__, ret);
 	return NULL;
-    } else if (GNUTLS_E_SUCCESS != (ret = gnutls_global_init())) {
-	/* */
     } else if (GNUTLS_E_SUCCESS != (ret = gnutls_certificate_allocate_credentials(&ctx->x509_cred))) {
 	/* */
     } else if ((ret = gnutls_certificate_set_x509_trust_file(ctx->x509_cred, cert, GNUTLS_X509_FMT_PEM)) < 0) {
@@ -105,72 +177,173 @@ struct rfbssl_ctx *rfbssl_init_global(char *key, char *cert)
     } else if (GNUTLS_E_SUCCESS != (ret = generate_rsa_params(ctx))) {
 	/* */
 #endif
+    } else if (GNUTLS_E_SUCCESS != (ret = gnutls_session_ticket_key_generate(&ctx->ticket_key))) {
+	/* */
+    } else if (NULL == (ctx->keyfile = strdup(key)) || NULL == (ctx->certfile = strdup(cert))) {
+	ret = GNUTLS_E_MEMORY_ERROR;
     } else {
 	gnutls_global_set_log_function(rfbssl_log_func);
 	gnutls_global_set_log_level(1);
 	gnutls_certificate_set_dh_params(ctx->x509_cred, ctx->dh_params);
-	/* newly allocated memory should be initialized, at least where it is important */
-	ctx->peekstart = ctx->peeklen = 0;
 	return ctx;
     }
 
-    free(ctx);
+    rfbssl_error(__func__, ret);
+    rfbssl_release_server_ctx(ctx);
     return NULL;
 }
 
+/*
+ * Get the screen's credentials, setting them up on first use and whenever
+ * the key or certificate file changed since.  If reloading fails, the old
+ * ones are kept until the files change again.  Called with
+ * screen->sslMutex held.
+ */
+
+static struct rfbssl_server_ctx *rfbssl_screen_ctx(rfbScreenInfoPtr screen)
+{
+    struct rfbssl_server_ctx *sctx = (struct rfbssl_server_ctx *)screen->sslServerCtx, *newctx;
+    const char *keyfile, *certfile = screen->sslcertfile;
+    time_t key_mtime, cert_mtime;
+
+    if (!certfile || !certfile[0]) {
+	rfbErr("SSL connection but no cert specified\n");
+	return NULL;
+    }
+    if (!(keyfile = screen->sslkeyfile))
+	keyfile = certfile;
+    key_mtime = rfbssl_mtime(keyfile);
+    cert_mtime = rfbssl_mtime(certfile);
+
+    if (sctx && strcmp(sctx->keyfile, keyfile) == 0 && strcmp(sctx->certfile, certfile) == 0 &&
+	sctx->key_mtime == key_mtime && sctx->cert_mtime == cert_mtime)
+	return sctx;
+
+    if (NULL == (newctx = rfbssl_init_global(keyfile, certfile))) {
+	if (!sctx)
+	    return NULL;
+	rfbErr("Keeping the previously loaded certificate\n");
+	sctx->key_mtime = key_mtime;
+	sctx->cert_mtime = cert_mtime;
+	return sctx;
+    }
+    newctx->key_mtime = key_mtime;
+    newctx->cert_mtime = cert_mtime;
+
+    if (sctx) {
+	rfbLog("Reloaded certificate %s\n", certfile);
+	rfbssl_release_server_ctx(sctx);
+    }
+    screen->sslServerCtx = newctx;
+    return newctx;
+}
+
+/*
+ * Set up TLS on the client's socket.  The handshake is then driven by
+ * rfbssl_handshake().
+ */
+
 int rfbssl_init(rfbClientPtr cl)
 {
-    int ret = -1;
+    int ret;
+    struct rfbssl_server_ctx *sctx;
     struct rfbssl_ctx *ctx;
-    char *keyfile;
-    if (!(keyfile = cl->screen->sslkeyfile))
-	keyfile = cl->screen->sslcertfile;
 
-    if (!cl->screen->sslcertfile || !cl->screen->sslcertfile[0]) {
-	rfbErr("SSL connection but no cert specified\n");
-    } else if (NULL == (ctx = rfbssl_init_global(keyfile,  cl->screen->sslcertfile))) {
-	/* */
-    } else if (GNUTLS_E_SUCCESS != (ret = rfbssl_init_session(ctx, cl->sock))) {
-	/* */
-    } else {
-	while (GNUTLS_E_SUCCESS != (ret = gnutls_handshake(ctx->session))) {
-	    if (ret == GNUTLS_E_AGAIN)
-		continue;
-	    break;
-	}
+    if (NULL == (ctx = calloc(1, sizeof(struct rfbssl_ctx)))) {
+	rfbErr("OOM\n");
+	return -1;
+    }
+
+    LOCK(cl->screen->sslMutex);
+    if (NULL != (sctx = rfbssl_screen_ctx(cl->screen))) {
+	LOCK(sctx->lock);
+	sctx->refcount++;
+	UNLOCK(sctx->lock);
+    }
+    UNLOCK(cl->screen->sslMutex);
+    if (NULL == sctx) {
+	free(ctx);
+	return -1;
     }
+    ctx->server = sctx;
 
-    if (ret != GNUTLS_E_SUCCESS) {
+    if (GNUTLS_E_SUCCESS != (ret = rfbssl_init_session(ctx, cl->sock))) {
 	rfbssl_error(__func__, ret);
-    } else {
-	cl->sslctx = (rfbSslCtx *)ctx;
-	rfbLog("%s protocol initialized\n", gnutls_protocol_get_name(gnutls_protocol_get_version(ctx->session)));
+	rfbssl_release_server_ctx(sctx);
+	free(ctx);
+	return -1;
     }
-    return ret;
+    cl->sslctx = (rfbSslCtx *)ctx;
+    return 0;
+}
+
+/*
+ * Take the handshake as far as the socket allows without blocking.
+ */
+
+int rfbssl_handshake(rfbClientPtr cl)
+{
+    struct rfbssl_ctx *ctx = (struct rfbssl_ctx *)cl->sslctx;
+    int ret = gnutls_handshake(ctx->session);
+
+    if (ret == GNUTLS_E_SUCCESS) {
+#if GNUTLS_VERSION_NUMBER >= 0x030703
+	/* GnuTLS uses kTLS where its configuration enables it */
+	cl->sslKernelSend = (gnutls_transport_is_ktls_enabled(ctx->session) & GNUTLS_KTLS_SEND) ? TRUE : FALSE;
+	cl->sslKernelRecv = (gnutls_transport_is_ktls_enabled(ctx->session) & GNUTLS_KTLS_RECV) ? TRUE : FALSE;
+	if (cl->sslKernelSend || cl->sslKernelRecv)
+	    rfbLog("Kernel TLS enabled for%s%s\n", cl->sslKernelSend ? " sending" : "",
+		   cl->sslKernelRecv ? " receiving" : "");
+#endif
+	rfbLog("%s protocol initialized%s\n",
+	       gnutls_protocol_get_name(gnutls_protocol_get_version(ctx->session)),
+	       gnutls_session_is_resumed(ctx->session) ? " (resumed)" : "");
+	return 1;
+    }
+    if (ret == GNUTLS_E_AGAIN || ret == GNUTLS_E_INTERRUPTED)
+	return gnutls_record_get_direction(ctx->session) ? RFBSSL_WANT_WRITE : RFBSSL_WANT_READ;
+
+    rfbssl_error(__func__, ret);
+    return -1;
+}
+
+/*
+ * Whether the unfinished handshake waits for room to write rather than for
+ * data to read.
+ */
+
+int rfbssl_want_write(rfbClientPtr cl)
+{
+    struct rfbssl_ctx *ctx = (struct rfbssl_ctx *)cl->sslctx;
+    return gnutls_record_get_direction(ctx->session) == 1;
 }
 
+/*
+ * Like recv() on a non-blocking socket, reading fails with EAGAIN if no
+ * complete record arrived yet, so the caller can wait for the socket.
+ */
+
 static int rfbssl_do_read(rfbClientPtr cl, char *buf, int bufsize)
 {
     struct rfbssl_ctx *ctx = (struct rfbssl_ctx *)cl->sslctx;
     int ret;
 
-    while ((ret = gnutls_record_recv(ctx->session, buf, bufsize)) < 0) {
-	if (ret == GNUTLS_E_AGAIN) {
-	    /* continue */
-	} else if (ret == GNUTLS_E_INTERRUPTED) {
-	    /* continue */
-	} else {
-	    break;
-	}
-    }
+    while ((ret = gnutls_record_recv(ctx->session, buf, bufsize)) == GNUTLS_E_INTERRUPTED)
+	;
 
-    if (ret < 0) {
+    if (ret == GNUTLS_E_AGAIN) {
+	errno = EAGAIN;
+	ret = -1;
+    } else if (ret == GNUTLS_E_PREMATURE_TERMINATION) {
+	/* the peer closed the socket without saying goodbye first */
+	ret = 0;
+    } else if (ret < 0) {
 	rfbssl_error(__func__, ret);
 	errno = EIO;
 	ret = -1;
     }
 
-    return ret < 0 ? -1 : ret;
+    return ret;
 }
 
 int rfbssl_write(rfbClientPtr cl, const char *buf, int bufsize)
@@ -190,6 +363,51 @@ int rfbssl_write(rfbClientPtr cl, const char *buf, int bufsize)
 
     if (ret < 0)
 	rfbssl_error(__func__, ret);
+    else if (cl->sslKernelSend)
+	cl->sslKernelBytesSent += ret;
+
+    return ret;
+}
+
+int rfbssl_write2(rfbClientPtr cl, const char *hdr, int hdrLen, const char *buf, int bufsize)
+{
+    struct rfbssl_ctx *ctx = (struct rfbssl_ctx *)cl->sslctx;
+    int n, ret;
+
+#if GNUTLS_VERSION_NUMBER >= 0x030703 && defined LIBVNCSERVER_HAVE_SYS_UIO_H
+    /*
+     * With kTLS GnuTLS hands the plain text to the kernel as well, so
+     * write both straight to the socket in one writev().
+     */
+    if (cl->sslKernelSend) {
+	struct iovec iov[2];
+
+	iov[0].iov_base = (void *)hdr;
+	iov[0].iov_len = hdrLen;
+	iov[1].iov_base = (void *)buf;
+	iov[1].iov_len = bufsize;
+	ret = writev(cl->sock, iov, 2);
+	if (ret > 0)
+	    cl->sslKernelBytesSent += ret;
+	return ret;
+    }
+#endif
+
+    /* hdr and the start of buf in one record, rather than hdr on its own */
+    n = bufsize < RFBSSL_RECORD_SIZE - hdrLen ? bufsize : RFBSSL_RECORD_SIZE - hdrLen;
+    if (n < 0)
+	n = 0;
+    gnutls_record_cork(ctx->session);
+    if ((ret = gnutls_record_send(ctx->session, hdr, hdrLen)) >= 0 &&
+	(n == 0 || (ret = gnutls_record_send(ctx->session, buf, n)) >= 0))
+	ret = gnutls_record_uncork(ctx->session, GNUTLS_RECORD_WAIT);
+    else
+	gnutls_record_uncork(ctx->session, GNUTLS_RECORD_WAIT);
+
+    if (ret < 0)
+	rfbssl_error(__func__, ret);
+    else if (cl->sslKernelSend)
+	cl->sslKernelBytesSent += ret;
 
     return ret;
 }
@@ -229,7 +447,11 @@ static int __rfbssl_read(rfbClientPtr cl, char *buf, int bufsize, int peek)
 	int n;
 	/* read the remaining data */
 	if ((n = rfbssl_do_read(cl, buf + ret, bufsize - ret)) <= 0) {
-	    rfbErr("rfbssl_%s: %s error\n", __func__, peek ? "peek" : "read");
+	    /* what came from peekbuf is not to be lost */
+	    if (ret > 0 && n < 0 && errno == EAGAIN)
+		return ret;
+	    if (n < 0 && errno != EAGAIN)
+		rfbErr("rfbssl_%s: %s error\n", __func__, peek ? "peek" : "read");
 	    return n;
 	}
 	if (peek) {
@@ -268,5 +490,17 @@ void rfbssl_destroy(rfbClientPtr cl)
     struct rfbssl_ctx *ctx = (struct rfbssl_ctx *)cl->sslctx;
     gnutls_bye(ctx->session, GNUTLS_SHUT_WR);
     gnutls_deinit(ctx->session);
-    gnutls_certificate_free_credentials(ctx->x509_cred);
+    rfbssl_release_server_ctx(ctx->server);
+    free(ctx);
+    cl->sslctx = NULL;
+}
+
+void rfbssl_cleanup(rfbScreenInfoPtr screen)
+{
+    LOCK(screen->sslMutex);
+    if (screen->sslServerCtx) {
+	rfbssl_release_server_ctx((struct rfbssl_server_ctx *)screen->sslServerCtx);
+	screen->sslServerCtx = NULL;
+    }
+    UNLOCK(screen->sslMutex);
 }
@@ -33,11 +33,26 @@ int rfbssl_init(rfbClientPtr cl)
     return -1;
 }
 
+int rfbssl_handshake(rfbClientPtr cl)
+{
+    return -1;
+}
+
+int rfbssl_want_write(rfbClientPtr cl)
+{
+    return 0;
+}
+
 int rfbssl_write(rfbClientPtr cl, const char *buf, int bufsize)
 {
     return -1;
 }
 
+int rfbssl_write2(rfbClientPtr cl, const char *hdr, int hdrLen, const char *buf, int bufsize)
+{
+    return -1;
+}
+
 int rfbssl_peek(rfbClientPtr cl, char *buf, int bufsize)
 {
     return -1;
@@ -56,3 +71,7 @@ int rfbssl_pending(rfbClientPtr cl)
 void rfbssl_destroy(rfbClientPtr cl)
 {
 }
+
+void rfbssl_cleanup(rfbScreenInfoPtr screen)
+{
+}
@@ -22,12 +22,40 @@
  */
 
 #include "rfbssl.h"
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+#ifdef LIBVNCSERVER_HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef LIBVNCSERVER_HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 
-struct rfbssl_ctx {
+/*
+ * The SSL_CTX is shared by all clients of a screen, so the key and
+ * certificate are only read once, and again when one of the files
+ * changes.  Each SSL holds a reference to the SSL_CTX it was made from,
+ * taken by SSL_new() while screen->sslMutex is held, so a reload only
+ * frees it once the last session using it is gone.
+ */
+
+struct rfbssl_server_ctx {
     SSL_CTX *ssl_ctx;
+    char    *keyfile;
+    char    *certfile;
+    time_t   key_mtime;
+    time_t   cert_mtime;
+};
+
+/* the largest plain text a TLS record carries */
+#define RFBSSL_RECORD_SIZE 16384
+
+struct rfbssl_ctx {
     SSL     *ssl;
+    char    recordbuf[RFBSSL_RECORD_SIZE]; /* for rfbssl_write2() */
 };
 
 static void rfbssl_error(void)
@@ -37,50 +65,192 @@ static void rfbssl_error(void)
     rfbErr("%s (%ld)\n", ERR_error_string(e, buf), e);
 }
 
-int rfbssl_init(rfbClientPtr cl)
+static time_t rfbssl_mtime(const char *path)
 {
-    char *keyfile;
-    int r, ret = -1;
-    struct rfbssl_ctx *ctx;
+    struct stat st;
+    return stat(path, &st) == 0 ? st.st_mtime : 0;
+}
+
+static SSL_CTX *rfbssl_new_ssl_ctx(const char *keyfile, const char *certfile)
+{
+    SSL_CTX *ssl_ctx;
+
+    if (NULL == (ssl_ctx = SSL_CTX_new(SSLv23_server_method()))) {
+	rfbssl_error();
+	return NULL;
+    } else if (SSL_CTX_use_PrivateKey_file(ssl_ctx, keyfile, SSL_FILETYPE_PEM) <= 0) {
+	rfbErr("Unable to load private key file %s\n", keyfile);
+    } else if (SSL_CTX_use_certificate_file(ssl_ctx, certfile, SSL_FILETYPE_PEM) <= 0) {
+	rfbErr("Unable to load certificate file %s\n", certfile);
+    } else if (!SSL_CTX_check_private_key(ssl_ctx)) {
+	rfbErr("Private key %s does not match certificate %s\n", keyfile, certfile);
+    } else {
+	/* let reconnecting clients resume their sessions */
+	SSL_CTX_set_session_id_context(ssl_ctx, (const unsigned char *)"LibVNCServer", 12);
+	SSL_CTX_set_session_cache_mode(ssl_ctx, SSL_SESS_CACHE_SERVER);
+	SSL_CTX_clear_options(ssl_ctx, SSL_OP_NO_TICKET);
+#ifdef SSL_OP_ENABLE_KTLS
+	/* used where the kernel and cipher allow it, user space TLS otherwise */
+	SSL_CTX_set_options(ssl_ctx, SSL_OP_ENABLE_KTLS);
+#endif
+	return ssl_ctx;
+    }
+    SSL_CTX_free(ssl_ctx);
+    return NULL;
+}
+
+static void rfbssl_free_server_ctx(struct rfbssl_server_ctx *sctx)
+{
+    SSL_CTX_free(sctx->ssl_ctx);
+    free(sctx->keyfile);
+    free(sctx->certfile);
+    free(sctx);
+}
+
+/*
+ * Get the screen's SSL_CTX, setting it up on first use and whenever the
+ * key or certificate file changed since.  If reloading fails, the old
+ * one is kept until the files change again.  Called with
+ * screen->sslMutex held.
+ */
+
+static SSL_CTX *rfbssl_screen_ssl_ctx(rfbScreenInfoPtr screen)
+{
+    struct rfbssl_server_ctx *sctx = (struct rfbssl_server_ctx *)screen->sslServerCtx;
+    const char *keyfile, *certfile = screen->sslcertfile;
+    time_t key_mtime, cert_mtime;
+    SSL_CTX *ssl_ctx;
+
+    if (!certfile || !certfile[0]) {
+	rfbErr("SSL connection but no cert specified\n");
+	return NULL;
+    }
+    if (screen->sslkeyfile && *screen->sslkeyfile) {
+	keyfile = screen->sslkeyfile;
+    } else {
+	keyfile = certfile;
+    }
+    key_mtime = rfbssl_mtime(keyfile);
+    cert_mtime = rfbssl_mtime(certfile);
+
+    if (sctx && strcmp(sctx->keyfile, keyfile) == 0 && strcmp(sctx->certfile, certfile) == 0 &&
+	sctx->key_mtime == key_mtime && sctx->cert_mtime == cert_mtime)
+	return sctx->ssl_ctx;
 
     SSL_library_init();
     SSL_load_error_strings();
 
-    if (cl->screen->sslkeyfile && *cl->screen->sslkeyfile) {
-      keyfile = cl->screen->sslkeyfile;
-    } else {
-      keyfile = cl->screen->sslcertfile;
+    if (NULL == (ssl_ctx = rfbssl_new_ssl_ctx(keyfile, certfile))) {
+	if (!sctx)
+	    return NULL;
+	rfbErr("Keeping the previously loaded certificate\n");
+	sctx->key_mtime = key_mtime;
+	sctx->cert_mtime = cert_mtime;
+	return sctx->ssl_ctx;
     }
 
-    if (NULL == (ctx = malloc(sizeof(struct rfbssl_ctx)))) {
+    if (sctx) {
+	rfbLog("Reloaded certificate %s\n", certfile);
+	rfbssl_free_server_ctx(sctx);
+    }
+    if (NULL == (sctx = calloc(1, sizeof(struct rfbssl_server_ctx))) ||
+	NULL == (sctx->keyfile = strdup(keyfile)) ||
+	NULL == (sctx->certfile = strdup(certfile))) {
 	rfbErr("OOM\n");
-    } else if (!cl->screen->sslcertfile || !cl->screen->sslcertfile[0]) {
-	rfbErr("SSL connection but no cert specified\n");
-    } else if (NULL == (ctx->ssl_ctx = SSL_CTX_new(SSLv23_server_method()))) {
-	rfbssl_error();
-    } else if (SSL_CTX_use_PrivateKey_file(ctx->ssl_ctx, keyfile, SSL_FILETYPE_PEM) <= 0) {
-	rfbErr("Unable to load private key file %s\n", keyfile);
-    } else if (SSL_CTX_use_certificate_file(ctx->ssl_ctx, cl->screen->sslcertfile, SSL_FILETYPE_PEM) <= 0) {
-	rfbErr("Unable to load certificate file %s\n", cl->screen->sslcertfile);
-    } else if (NULL == (ctx->ssl = SSL_new(ctx->ssl_ctx))) {
+	if (sctx) {
+	    free(sctx->keyfile);
+	    free(sctx);
+	}
+	SSL_CTX_free(ssl_ctx);
+	screen->sslServerCtx = NULL;
+	return NULL;
+    }
+    sctx->ssl_ctx = ssl_ctx;
+    sctx->key_mtime = key_mtime;
+    sctx->cert_mtime = cert_mtime;
+    screen->sslServerCtx = sctx;
+    return ssl_ctx;
+}
+
+/*
+ * Set up TLS on the client's socket.  The handshake is then driven by
+ * rfbssl_handshake().
+ */
+
+int rfbssl_init(rfbClientPtr cl)
+{
+    SSL_CTX *ssl_ctx;
+    struct rfbssl_ctx *ctx;
+
+    if (NULL == (ctx = calloc(1, sizeof(struct rfbssl_ctx)))) {
+	rfbErr("OOM\n");
+	return -1;
+    }
+    LOCK(cl->screen->sslMutex);
+    if (NULL != (ssl_ctx = rfbssl_screen_ssl_ctx(cl->screen)))
+	ctx->ssl = SSL_new(ssl_ctx);
+    UNLOCK(cl->screen->sslMutex);
+
+    if (NULL == ssl_ctx) {
+	/* already reported */
+    } else if (NULL == ctx->ssl) {
 	rfbErr("SSL_new failed\n");
 	rfbssl_error();
     } else if (!(SSL_set_fd(ctx->ssl, cl->sock))) {
 	rfbErr("SSL_set_fd failed\n");
 	rfbssl_error();
     } else {
-	while ((r = SSL_accept(ctx->ssl)) < 0) {
-	    if (SSL_get_error(ctx->ssl, r) != SSL_ERROR_WANT_READ)
-		break;
-	}
-	if (r < 0) {
-	    rfbErr("SSL_accept failed %d\n", SSL_get_error(ctx->ssl, r));
-	} else {
-	    cl->sslctx = (rfbSslCtx *)ctx;
-	    ret = 0;
-	}
+	SSL_set_accept_state(ctx->ssl);
+	cl->sslctx = (rfbSslCtx *)ctx;
+	return 0;
     }
-    return ret;
+    if (ctx->ssl)
+	SSL_free(ctx->ssl);
+    free(ctx);
+    return -1;
+}
+
+/*
+ * Take the handshake as far as the socket allows without blocking.
+ */
+
+int rfbssl_handshake(rfbClientPtr cl)
+{
+    struct rfbssl_ctx *ctx = (struct rfbssl_ctx *)cl->sslctx;
+    int r;
+
+    if ((r = SSL_do_handshake(ctx->ssl)) == 1) {
+#ifdef SSL_OP_ENABLE_KTLS
+	cl->sslKernelSend = BIO_get_ktls_send(SSL_get_wbio(ctx->ssl)) ? TRUE : FALSE;
+	cl->sslKernelRecv = BIO_get_ktls_recv(SSL_get_rbio(ctx->ssl)) ? TRUE : FALSE;
+	if (cl->sslKernelSend || cl->sslKernelRecv)
+	    rfbLog("Kernel TLS enabled for%s%s\n", cl->sslKernelSend ? " sending" : "",
+		   cl->sslKernelRecv ? " receiving" : "");
+#endif
+	return 1;
+    }
+
+    switch (SSL_get_error(ctx->ssl, r)) {
+    case SSL_ERROR_WANT_READ:
+	return RFBSSL_WANT_READ;
+    case SSL_ERROR_WANT_WRITE:
+	return RFBSSL_WANT_WRITE;
+    default:
+	rfbErr("SSL_accept failed %d\n", SSL_get_error(ctx->ssl, r));
+	rfbssl_error();
+	return -1;
+    }
+}
+
+/*
+ * Whether the unfinished handshake waits for room to write rather than for
+ * data to read.
+ */
+
+int rfbssl_want_write(rfbClientPtr cl)
+{
+    struct rfbssl_ctx *ctx = (struct rfbssl_ctx *)cl->sslctx;
+    return SSL_want_write(ctx->ssl);
 }
 
 int rfbssl_write(rfbClientPtr cl, const char *buf, int bufsize)
@@ -88,6 +258,20 @@ int rfbssl_write(rfbClientPtr cl, const char *buf, int bufsize)
     int ret;
     struct rfbssl_ctx *ctx = (struct rfbssl_ctx *)cl->sslctx;
 
+    /*
+     * With kTLS the kernel frames and encrypts whatever is written to the
+     * socket, so skip the copy SSL_write() makes, unless OpenSSL still has
+     * a key update to send first.
+     */
+#ifdef SSL_OP_ENABLE_KTLS
+    if (cl->sslKernelSend && SSL_get_key_update_type(ctx->ssl) == SSL_KEY_UPDATE_NONE) {
+	ret = write(cl->sock, buf, bufsize);
+	if (ret > 0)
+	    cl->sslKernelBytesSent += ret;
+	return ret;
+    }
+#endif
+
     while ((ret = SSL_write(ctx->ssl, buf, bufsize)) <= 0) {
 	if (SSL_get_error(ctx->ssl, ret) != SSL_ERROR_WANT_WRITE)
 	    break;
@@ -95,28 +279,70 @@ int rfbssl_write(rfbClientPtr cl, const char *buf, int bufsize)
     return ret;
 }
 
-int rfbssl_peek(rfbClientPtr cl, char *buf, int bufsize)
+int rfbssl_write2(rfbClientPtr cl, const char *hdr, int hdrLen, const char *buf, int bufsize)
 {
-    int ret;
     struct rfbssl_ctx *ctx = (struct rfbssl_ctx *)cl->sslctx;
+    int n;
 
-    while ((ret = SSL_peek(ctx->ssl, buf, bufsize)) <= 0) {
-	if (SSL_get_error(ctx->ssl, ret) != SSL_ERROR_WANT_READ)
-	    break;
+#if defined SSL_OP_ENABLE_KTLS && defined LIBVNCSERVER_HAVE_SYS_UIO_H
+    /* as in rfbssl_write(), in one writev() */
+    if (cl->sslKernelSend && SSL_get_key_update_type(ctx->ssl) == SSL_KEY_UPDATE_NONE) {
+	struct iovec iov[2];
+	int ret;
+
+	iov[0].iov_base = (void *)hdr;
+	iov[0].iov_len = hdrLen;
+	iov[1].iov_base = (void *)buf;
+	iov[1].iov_len = bufsize;
+	ret = writev(cl->sock, iov, 2);
+	if (ret > 0)
+	    cl->sslKernelBytesSent += ret;
+	return ret;
+    }
+#endif
+
+    /* hdr and the start of buf in one record, rather than hdr on its own */
+    if (hdrLen > RFBSSL_RECORD_SIZE)
+	return rfbssl_write(cl, hdr, hdrLen);
+    n = bufsize < RFBSSL_RECORD_SIZE - hdrLen ? bufsize : RFBSSL_RECORD_SIZE - hdrLen;
+    memcpy(ctx->recordbuf, hdr, hdrLen);
+    memcpy(ctx->recordbuf + hdrLen, buf, n);
+    return rfbssl_write(cl, ctx->recordbuf, hdrLen + n);
+}
+
+/*
+ * Like recv() on a non-blocking socket, reading fails with EAGAIN if no
+ * complete record arrived yet, so the caller can wait for the socket.
+ */
+
+static int rfbssl_read_result(struct rfbssl_ctx *ctx, int ret)
+{
+    if (ret > 0)
+	return ret;
+    switch (SSL_get_error(ctx->ssl, ret)) {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+	errno = EAGAIN;
+	return -1;
+    case SSL_ERROR_ZERO_RETURN:
+	return 0;
+    default:
+	return ret;
     }
-    return ret;
+}
+
+int rfbssl_peek(rfbClientPtr cl, char *buf, int bufsize)
+{
+    struct rfbssl_ctx *ctx = (struct rfbssl_ctx *)cl->sslctx;
+
+    return rfbssl_read_result(ctx, SSL_peek(ctx->ssl, buf, bufsize));
 }
 
 int rfbssl_read(rfbClientPtr cl, char *buf, int bufsize)
 {
-    int ret;
     struct rfbssl_ctx *ctx = (struct rfbssl_ctx *)cl->sslctx;
 
-    while ((ret = SSL_read(ctx->ssl, buf, bufsize)) <= 0) {
-	if (SSL_get_error(ctx->ssl, ret) != SSL_ERROR_WANT_READ)
-	    break;
-    }
-    return ret;
+    return rfbssl_read_result(ctx, SSL_read(ctx->ssl, buf, bufsize));
 }
 
 int rfbssl_pending(rfbClientPtr cl)
@@ -130,6 +356,16 @@ void rfbssl_destroy(rfbClientPtr cl)
     struct rfbssl_ctx *ctx = (struct rfbssl_ctx *)cl->sslctx;
     if (ctx->ssl)
 	SSL_free(ctx->ssl);
-    if (ctx->ssl_ctx)
-	SSL_CTX_free(ctx->ssl_ctx);
+    free(ctx);
+    cl->sslctx = NULL;
+}
+
+void rfbssl_cleanup(rfbScreenInfoPtr screen)
+{
+    LOCK(screen->sslMutex);
+    if (screen->sslServerCtx) {
+	rfbssl_free_server_ctx((struct rfbssl_server_ctx *)screen->sslServerCtx);
+	screen->sslServerCtx = NULL;
+    }
+    UNLOCK(screen->sslMutex);
 }
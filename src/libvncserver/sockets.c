@@ -66,9 +66,13 @@
 #ifdef LIBVNCSERVER_HAVE_UNISTD_H
 #include <unistd.h>
 #endif
+#ifdef LIBVNCSERVER_HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
 
 #ifdef LIBVNCSERVER_WITH_WEBSOCKETS
 #include "rfbssl.h"
+#include "ws_decode.h"
 #endif
 
 #ifdef LIBVNCSERVER_WITH_SYSTEMD
@@ -97,12 +101,17 @@ int deny_severity=LOG_WARNING;
 #endif
 
 #include "sockets.h"
+#include "private.h"
 
 int rfbMaxClientWait = 20000;   /* time (ms) after which we decide client has
                                    gone away - needed to stop us hanging */
 
 static rfbBool
 rfbHasPendingOnSocket(rfbClientPtr cl);
+static rfbSocket
+listenOnTCPPort(int port, in_addr_t iface, rfbBool reusePort);
+static rfbSocket
+listenOnTCP6Port(int port, const char* iface, rfbBool reusePort);
 
 static rfbBool
 rfbNewConnectionFromSock(rfbScreenInfoPtr rfbScreen, rfbSocket sock)
@@ -217,7 +226,7 @@ rfbInitSockets(rfbScreenInfoPtr rfbScreen)
         int i;
         rfbLog("Autoprobing TCP port \n");
         for (i = 5900; i < 6000; i++) {
-            if ((rfbScreen->listenSock = rfbListenOnTCPPort(i, iface)) != RFB_INVALID_SOCKET) {
+            if ((rfbScreen->listenSock = listenOnTCPPort(i, iface, rfbScreen->listenerThreads > 1)) != RFB_INVALID_SOCKET) {
 		rfbScreen->port = i;
 		break;
 	    }
@@ -238,7 +247,7 @@ rfbInitSockets(rfbScreenInfoPtr rfbScreen)
         int i;
         rfbLog("Autoprobing TCP6 port \n");
 	for (i = 5900; i < 6000; i++) {
-            if ((rfbScreen->listen6Sock = rfbListenOnTCP6Port(i, rfbScreen->listen6Interface)) != RFB_INVALID_SOCKET) {
+            if ((rfbScreen->listen6Sock = listenOnTCP6Port(i, rfbScreen->listen6Interface, rfbScreen->listenerThreads > 1)) != RFB_INVALID_SOCKET) {
 		rfbScreen->ipv6port = i;
 		break;
 	    }
@@ -258,7 +267,7 @@ rfbInitSockets(rfbScreenInfoPtr rfbScreen)
     if(!rfbScreen->autoPort) {
 	    if(rfbScreen->port>0) {
 
-      if ((rfbScreen->listenSock = rfbListenOnTCPPort(rfbScreen->port, iface)) == RFB_INVALID_SOCKET) {
+      if ((rfbScreen->listenSock = listenOnTCPPort(rfbScreen->port, iface, rfbScreen->listenerThreads > 1)) == RFB_INVALID_SOCKET) {
 	rfbLogPerror("ListenOnTCPPort");
 	return;
       }
@@ -270,7 +279,7 @@ rfbInitSockets(rfbScreenInfoPtr rfbScreen)
 
 #ifdef LIBVNCSERVER_IPv6
 	    if (rfbScreen->ipv6port>0) {
-      if ((rfbScreen->listen6Sock = rfbListenOnTCP6Port(rfbScreen->ipv6port, rfbScreen->listen6Interface)) == RFB_INVALID_SOCKET) {
+      if ((rfbScreen->listen6Sock = listenOnTCP6Port(rfbScreen->ipv6port, rfbScreen->listen6Interface, rfbScreen->listenerThreads > 1)) == RFB_INVALID_SOCKET) {
 	/* ListenOnTCP6Port has its own detailed error printout */
 	return;
       }
@@ -353,12 +362,20 @@ rfbBool
 rfbRebindListenSockets(rfbScreenInfoPtr rfbScreen)
 {
     in_addr_t iface = rfbScreen->listenInterface;
+#if defined(LIBVNCSERVER_HAVE_LIBPTHREAD) && !defined(WIN32)
+    rfbBool sharedListeners = rfbScreen->sharedListeners != NULL;
+#endif
 
     /* This deliberately only handles the plain TCP/TCP6 listeners; inetd and
        autoPort setups have no stable address to rebind to. */
     if (rfbScreen->inetdSock != RFB_INVALID_SOCKET || rfbScreen->autoPort)
         return FALSE;
 
+#if defined(LIBVNCSERVER_HAVE_LIBPTHREAD) && !defined(WIN32)
+    /* the sockets of the other listener threads are bound the same way */
+    rfbStopSharedListeners(rfbScreen);
+#endif
+
     /* tear down the existing listeners; rfbCloseSocket() also resets the fd to
        RFB_INVALID_SOCKET, the outer if only skips the FD_CLR when there is none */
     if (rfbScreen->listenSock != RFB_INVALID_SOCKET) {
@@ -374,7 +391,7 @@ rfbRebindListenSockets(rfbScreenInfoPtr rfbScreen)
 
     /* re-create from the current interface addresses */
     if (rfbScreen->port > 0) {
-        if ((rfbScreen->listenSock = rfbListenOnTCPPort(rfbScreen->port, iface)) == RFB_INVALID_SOCKET) {
+        if ((rfbScreen->listenSock = listenOnTCPPort(rfbScreen->port, iface, rfbScreen->listenerThreads > 1)) == RFB_INVALID_SOCKET) {
             rfbLogPerror("rfbRebindListenSockets: ListenOnTCPPort");
         } else {
             rfbLog("rfbRebindListenSockets: listening for VNC connections on TCP port %d\n", rfbScreen->port);
@@ -385,7 +402,7 @@ rfbRebindListenSockets(rfbScreenInfoPtr rfbScreen)
 
 #ifdef LIBVNCSERVER_IPv6
     if (rfbScreen->ipv6port > 0) {
-        if ((rfbScreen->listen6Sock = rfbListenOnTCP6Port(rfbScreen->ipv6port, rfbScreen->listen6Interface)) == RFB_INVALID_SOCKET) {
+        if ((rfbScreen->listen6Sock = listenOnTCP6Port(rfbScreen->ipv6port, rfbScreen->listen6Interface, rfbScreen->listenerThreads > 1)) == RFB_INVALID_SOCKET) {
             /* rfbListenOnTCP6Port has its own detailed error printout */
         } else {
             rfbLog("rfbRebindListenSockets: listening for VNC connections on TCP6 port %d\n", rfbScreen->ipv6port);
@@ -406,6 +423,11 @@ rfbRebindListenSockets(rfbScreenInfoPtr rfbScreen)
         rfbHttpInitSockets(rfbScreen);
     }
 
+#if defined(LIBVNCSERVER_HAVE_LIBPTHREAD) && !defined(WIN32)
+    if (sharedListeners)
+        rfbStartSharedListeners(rfbScreen);
+#endif
+
     return (rfbScreen->listenSock != RFB_INVALID_SOCKET
 #ifdef LIBVNCSERVER_IPv6
             || rfbScreen->listen6Sock != RFB_INVALID_SOCKET
@@ -451,6 +473,9 @@ rfbCheckFds(rfbScreenInfoPtr rfbScreen,long usec)
             while((cl = rfbClientIteratorNext(i))) {
                 if (cl->onHold)
                     continue;
+                rfbCheckClientHandshake(cl);
+                if (cl->sock == RFB_INVALID_SOCKET)
+                    continue;
                 hasPendingData |= rfbHasPendingOnSocket(cl);
                 if (FD_ISSET(cl->sock, &(rfbScreen->allFds)))
                     rfbSendFileTransferChunk(cl);
@@ -533,6 +558,10 @@ rfbCheckFds(rfbScreenInfoPtr rfbScreen,long usec)
 	    if (cl->onHold)
 		continue;
 
+            rfbCheckClientHandshake(cl);
+            if (cl->sock == RFB_INVALID_SOCKET)
+                continue;
+
             if (rfbHasPendingOnSocket (cl) ||
                 FD_ISSET(cl->sock, &(rfbScreen->allFds)))
             {
@@ -556,67 +585,96 @@ rfbCheckFds(rfbScreenInfoPtr rfbScreen,long usec)
     return result;
 }
 
+/* how many connections may wait to be accepted, so that bursts of them
+   don't get dropped and have to be retried after a second */
+#ifdef SOMAXCONN
+#define RFB_LISTEN_BACKLOG SOMAXCONN
+#else
+#define RFB_LISTEN_BACKLOG 128
+#endif
+
+/* how many pending connections rfbProcessNewConnection accepts at once */
+#define MAX_ACCEPTS_PER_CALL 32
+
 rfbBool
 rfbProcessNewConnection(rfbScreenInfoPtr rfbScreen)
 {
     rfbSocket sock = RFB_INVALID_SOCKET;
     fd_set listen_fds; 
-    rfbSocket chosen_listen_sock = RFB_INVALID_SOCKET;
+    rfbSocket chosen_listen_sock;
+    struct timeval tv;
+    int accepted;
 #if defined LIBVNCSERVER_HAVE_SYS_RESOURCE_H && defined LIBVNCSERVER_HAVE_FCNTL_H
     struct rlimit rlim;
     size_t maxfds, curfds, i;
-#endif
-    /* Do another select() call to find out which listen socket
-       has an incoming connection pending. We know that at least 
-       one of them has, so this should not block for too long! */
-    FD_ZERO(&listen_fds);  
-    if(rfbScreen->listenSock != RFB_INVALID_SOCKET)
-      FD_SET(rfbScreen->listenSock, &listen_fds);
-    if(rfbScreen->listen6Sock != RFB_INVALID_SOCKET)
-      FD_SET(rfbScreen->listen6Sock, &listen_fds);
-    if (select(rfbScreen->maxFd+1, &listen_fds, NULL, NULL, NULL) == -1) {
-      rfbLogPerror("rfbProcessNewConnection: error in select");
-      return FALSE;
-    }
-    if (rfbScreen->listenSock != RFB_INVALID_SOCKET && FD_ISSET(rfbScreen->listenSock, &listen_fds))
-      chosen_listen_sock = rfbScreen->listenSock;
-    if (rfbScreen->listen6Sock != RFB_INVALID_SOCKET && FD_ISSET(rfbScreen->listen6Sock, &listen_fds))
-      chosen_listen_sock = rfbScreen->listen6Sock;
 
-
-    /*
-      Avoid accept() giving EMFILE, i.e. running out of file descriptors, a situation that's hard to recover from.
-      https://stackoverflow.com/questions/47179793/how-to-gracefully-handle-accept-giving-emfile-and-close-the-connection
-      describes the problem nicely.
-      Our approach is to deny new clients when we have reached a certain fraction of the per-process limit of file descriptors.
-      TODO: add Windows support.
-     */
-#if defined LIBVNCSERVER_HAVE_SYS_RESOURCE_H && defined LIBVNCSERVER_HAVE_FCNTL_H
     if(getrlimit(RLIMIT_NOFILE, &rlim) < 0)
 	maxfds = 100;  /* use a sane default if getting the limit fails */
     else
 	maxfds = rlim.rlim_cur;
 
-    /* get the number of currently open fds as per https://stackoverflow.com/a/7976880/361413 */
+    /* get the number of currently open fds as per https://stackoverflow.com/a/7976880/361413,
+       once per call, the connections accepted below are added as they come */
     curfds = 0;
     for(i = 0; i < maxfds; ++i)
 	if(fcntl(i, F_GETFD) != -1)
 	    ++curfds;
+#endif
 
-    if(curfds > maxfds * rfbScreen->fdQuota) {
-	rfbErr("rfbProcessNewconnection: open fd count of %lu exceeds quota %.1f of limit %lu, denying connection\n", curfds, rfbScreen->fdQuota, maxfds);
-	sock = accept(chosen_listen_sock, NULL, NULL);
-	rfbCloseSocket(sock);
-	return FALSE;
-    }
+    /* Accept what is pending now, so a burst of connections does not
+       take one trip through the event loop each. The handshakes then go
+       on without blocking. */
+    for (accepted = 0; accepted < MAX_ACCEPTS_PER_CALL; accepted++) {
+	/* Do another select() call to find out which listen socket
+	   has an incoming connection pending, if any is left. */
+	FD_ZERO(&listen_fds);  
+	if(rfbScreen->listenSock != RFB_INVALID_SOCKET)
+	  FD_SET(rfbScreen->listenSock, &listen_fds);
+	if(rfbScreen->listen6Sock != RFB_INVALID_SOCKET)
+	  FD_SET(rfbScreen->listen6Sock, &listen_fds);
+	tv.tv_sec = 0;
+	tv.tv_usec = 0;
+	switch (select(rfbScreen->maxFd+1, &listen_fds, NULL, NULL, &tv)) {
+	case -1:
+	  rfbLogPerror("rfbProcessNewConnection: error in select");
+	  return FALSE;
+	case 0:
+	  return TRUE;
+	}
+	chosen_listen_sock = RFB_INVALID_SOCKET;
+	if (rfbScreen->listenSock != RFB_INVALID_SOCKET && FD_ISSET(rfbScreen->listenSock, &listen_fds))
+	  chosen_listen_sock = rfbScreen->listenSock;
+	if (rfbScreen->listen6Sock != RFB_INVALID_SOCKET && FD_ISSET(rfbScreen->listen6Sock, &listen_fds))
+	  chosen_listen_sock = rfbScreen->listen6Sock;
+
+	if ((sock = accept(chosen_listen_sock, NULL, NULL)) == RFB_INVALID_SOCKET) {
+	  /* a shared port's connection may have been reset meanwhile */
+	  if (errno == EAGAIN || errno == EWOULDBLOCK)
+	    return TRUE;
+	  rfbLogPerror("rfbProcessNewconnection: accept");
+	  return FALSE;
+	}
+
+	/*
+	  Avoid accept() giving EMFILE, i.e. running out of file descriptors, a situation that's hard to recover from.
+	  https://stackoverflow.com/questions/47179793/how-to-gracefully-handle-accept-giving-emfile-and-close-the-connection
+	  describes the problem nicely.
+	  Our approach is to deny new clients when we have reached a certain fraction of the per-process limit of file descriptors.
+	  TODO: add Windows support.
+	 */
+#if defined LIBVNCSERVER_HAVE_SYS_RESOURCE_H && defined LIBVNCSERVER_HAVE_FCNTL_H
+	if(curfds > maxfds * rfbScreen->fdQuota) {
+	    rfbErr("rfbProcessNewconnection: open fd count of %lu exceeds quota %.1f of limit %lu, denying connection\n", (unsigned long)curfds, rfbScreen->fdQuota, (unsigned long)maxfds);
+	    rfbCloseSocket(sock);
+	    return FALSE;
+	}
+	++curfds;
 #endif
 
-    if ((sock = accept(chosen_listen_sock, NULL, NULL)) == RFB_INVALID_SOCKET) {
-      rfbLogPerror("rfbProcessNewconnection: accept");
-      return FALSE;
+	if (!rfbNewConnectionFromSock(rfbScreen, sock))
+	    return FALSE;
     }
-
-    return rfbNewConnectionFromSock(rfbScreen, sock);
+    return TRUE;
 }
 
 
@@ -658,6 +716,8 @@ rfbCloseClient(rfbClientPtr cl)
 	if (cl->sslctx)
 	    rfbssl_destroy(cl);
 	free(cl->wspath);
+	free(cl->wsRequest);
+	cl->wsRequest = NULL;
 #endif
       }
     TSIGNAL(cl->updateCond);
@@ -867,6 +927,55 @@ int rfbReadExact(rfbClientPtr cl,char* buf,int len)
     return(rfbReadExactTimeout(cl,buf,len,rfbMaxClientWait));
 }
 
+/*
+ * rfbReadHandshake is rfbReadExact for the messages of the handshake, which
+ * does not wait for them to arrive completely, so that slow clients don't
+ * hold up the others.  The parts are collected in cl->handshakeBuf, and -1
+ * is returned with errno set to EAGAIN while it is incomplete.  For
+ * WebSockets clients the parts may come from several frames and TLS records,
+ * which are decoded as far as they arrived.
+ */
+
+int
+rfbReadHandshake(rfbClientPtr cl, char *buf, int len)
+{
+    int n;
+
+#ifndef FUZZING_BUILD_MODE_UNSAFE_FOR_PRODUCTION
+    if (len <= (int)sizeof(cl->handshakeBuf)) {
+	while (cl->handshakeLen < len) {
+#ifdef LIBVNCSERVER_WITH_WEBSOCKETS
+	    if (cl->wsctx)
+		n = webSocketsDecode(cl, cl->handshakeBuf + cl->handshakeLen, len - cl->handshakeLen);
+	    else if (cl->sslctx)
+		n = rfbssl_read(cl, cl->handshakeBuf + cl->handshakeLen, len - cl->handshakeLen);
+	    else
+#endif
+	    n = rfbReadFromSocket(cl, cl->handshakeBuf + cl->handshakeLen, len - cl->handshakeLen);
+	    if (n == 0)
+		return 0;
+	    if (n < 0) {
+#ifdef WIN32
+		errno = WSAGetLastError();
+		if (errno == WSAEWOULDBLOCK)
+		    errno = EAGAIN;
+#endif
+		if (errno == EINTR)
+		    continue;
+		if (errno == EWOULDBLOCK)
+		    errno = EAGAIN;
+		return -1;
+	    }
+	    cl->handshakeLen += n;
+	}
+	memcpy(buf, cl->handshakeBuf, len);
+	cl->handshakeLen = 0;
+	return 1;
+    }
+#endif
+    return rfbReadExact(cl, buf, len);
+}
+
 int
 rfbDefaultPeekAtSocket(rfbClientPtr cl, char *buf, int len)
 {
@@ -983,6 +1092,37 @@ rfbWriteToSocket(rfbClientPtr cl,
     return cl->writeToSocket(cl, buf, len);
 }
 
+#ifdef LIBVNCSERVER_WITH_WEBSOCKETS
+/*
+ * Write a WebSockets frame header followed by its payload, in one go with
+ * writev() where we talk to the socket directly, or the kernel does the
+ * TLS.  Returns what write() would, the header counting first.
+ */
+
+static int
+rfbWriteFrameToSocket(rfbClientPtr cl,
+		      const char *hdr,
+		      int hdrLen,
+		      const char *buf,
+		      int len)
+{
+#ifdef LIBVNCSERVER_HAVE_SYS_UIO_H
+    struct iovec iov[2];
+
+    if (!cl->sslctx && cl->writeToSocket == rfbDefaultWriteToSocket) {
+	iov[0].iov_base = (void *)hdr;
+	iov[0].iov_len = hdrLen;
+	iov[1].iov_base = (void *)buf;
+	iov[1].iov_len = len;
+	return writev(cl->sock, iov, 2);
+    }
+#endif
+    if (cl->sslctx)
+	return rfbssl_write2(cl, hdr, hdrLen, buf, len);
+    return rfbWriteToSocket(cl, hdr, hdrLen);
+}
+#endif
+
 /*
  * WriteExact writes an exact number of bytes to a client.  Returns 1 if
  * those bytes have been written, or -1 if an error occurred (errno is set to
@@ -1003,6 +1143,12 @@ rfbWriteExact(rfbClientPtr cl,
     struct timeval tv;
     int totalTimeWaited = 0;
     const int timeout = (cl->screen && cl->screen->maxClientWait) ? cl->screen->maxClientWait : rfbMaxClientWait;
+    /* WebSockets frame header still to be written before buf */
+    const char *hdr = NULL;
+    int hdrLen = 0;
+#ifdef LIBVNCSERVER_WITH_WEBSOCKETS
+    char wsHeader[WSHLENMAX];
+#endif
 
 #undef DEBUG_WRITE_EXACT
 #ifdef DEBUG_WRITE_EXACT
@@ -1013,9 +1159,15 @@ rfbWriteExact(rfbClientPtr cl,
 #endif
 
 #ifdef LIBVNCSERVER_WITH_WEBSOCKETS
-    if (cl->wsctx) {
+    if (cl->wsctx && len > 0 &&
+        (hdrLen = webSocketsEncodeHeader(cl, len, wsHeader)) > 0) {
+        /* binary frames are sent straight from buf, whatever their size */
+        hdr = wsHeader;
+        LOCK(cl->outputMutex);
+    } else if (cl->wsctx) {
         char *tmp = NULL;
 
+        hdrLen = 0;
         while (len > UPDATE_BUF_SIZE) {
             /* webSocketsEncode() can only handle data lengths up to UPDATE_BUF_SIZE
                so split large writes into multiple smaller writes/frames */
@@ -1028,22 +1180,29 @@ rfbWriteExact(rfbClientPtr cl,
             len -= UPDATE_BUF_SIZE;
         }
 
+        /* encode under the lock, the compressor's state has to follow
+           the order in which frames go out */
+        LOCK(cl->outputMutex);
         if ((len = webSocketsEncode(cl, buf, len, &tmp)) < 0) {
+            UNLOCK(cl->outputMutex);
             rfbErr("WriteExact: WebSockets encode error\n");
             return -1;
         }
         buf = tmp;
-    }
+    } else
 #endif
-
-    LOCK(cl->outputMutex);
-    while (len > 0) {
+    {
+        LOCK(cl->outputMutex);
+    }
+    while (hdrLen + len > 0) {
         if(sock == RFB_INVALID_SOCKET) {
             errno = EBADF;
             return -1;
         }
 #ifdef LIBVNCSERVER_WITH_WEBSOCKETS
-        if (cl->sslctx)
+        if (hdrLen > 0)
+	    n = rfbWriteFrameToSocket(cl, hdr, hdrLen, buf, len);
+        else if (cl->sslctx)
 	    n = rfbssl_write(cl, buf, len);
 	else
 #endif
@@ -1051,6 +1210,13 @@ rfbWriteExact(rfbClientPtr cl,
 
         if (n > 0) {
 
+            if (n < hdrLen) {
+                hdr += n;
+                hdrLen -= n;
+                continue;
+            }
+            n -= hdrLen;
+            hdrLen = 0;
             buf += n;
             len -= n;
 
@@ -1126,9 +1292,10 @@ rfbStringToAddr(char *str, in_addr_t *addr)  {
     return 1;
 }
 
-rfbSocket
-rfbListenOnTCPPort(int port,
-                   in_addr_t iface)
+static rfbSocket
+listenOnTCPPort(int port,
+                in_addr_t iface,
+                rfbBool reusePort)
 {
     struct sockaddr_in addr;
     rfbSocket sock;
@@ -1147,11 +1314,23 @@ rfbListenOnTCPPort(int port,
 	rfbCloseSocket(sock);
 	return RFB_INVALID_SOCKET;
     }
+#ifdef SO_REUSEPORT
+    if (reusePort && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT,
+				(const char *)&one, sizeof(one)) < 0) {
+	rfbCloseSocket(sock);
+	return RFB_INVALID_SOCKET;
+    }
+#endif
     if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
 	rfbCloseSocket(sock);
 	return RFB_INVALID_SOCKET;
     }
-    if (listen(sock, 32) < 0) {
+    if (listen(sock, RFB_LISTEN_BACKLOG) < 0) {
+	rfbCloseSocket(sock);
+	return RFB_INVALID_SOCKET;
+    }
+    /* several threads wait for the port, so accept() must not block */
+    if (reusePort && !rfbSetNonBlocking(sock)) {
 	rfbCloseSocket(sock);
 	return RFB_INVALID_SOCKET;
     }
@@ -1159,10 +1338,31 @@ rfbListenOnTCPPort(int port,
     return sock;
 }
 
+rfbSocket
+rfbListenOnTCPPort(int port,
+                   in_addr_t iface)
+{
+    return listenOnTCPPort(port, iface, FALSE);
+}
+
+/*
+ * rfbListenOnSharedTCPPort listens with SO_REUSEPORT, so that several
+ * sockets can listen on the port and the kernel spreads the connections
+ * over them.
+ */
 
 rfbSocket
-rfbListenOnTCP6Port(int port,
-                    const char* iface)
+rfbListenOnSharedTCPPort(int port,
+                         in_addr_t iface)
+{
+    return listenOnTCPPort(port, iface, TRUE);
+}
+
+
+static rfbSocket
+listenOnTCP6Port(int port,
+                 const char* iface,
+                 rfbBool reusePort)
 {
 #ifndef LIBVNCSERVER_IPv6
     rfbLogPerror("This LibVNCServer does not have IPv6 support");
@@ -1209,6 +1409,15 @@ rfbListenOnTCP6Port(int port,
 	  return RFB_INVALID_SOCKET;
 	}
 
+#ifdef SO_REUSEPORT
+	if (reusePort && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (const char *)&one, sizeof(one)) < 0) {
+	  rfbLogPerror("rfbListenOnTCP6Port: error in setsockopt SO_REUSEPORT");
+	  rfbCloseSocket(sock);
+	  freeaddrinfo(servinfo);
+	  return RFB_INVALID_SOCKET;
+	}
+#endif
+
 	if (bind(sock, p->ai_addr, p->ai_addrlen) < 0) {
 	  rfbCloseSocket(sock);
 	  continue;
@@ -1226,16 +1435,34 @@ rfbListenOnTCP6Port(int port,
     /* all done with this structure now */
     freeaddrinfo(servinfo);
 
-    if (listen(sock, 32) < 0) {
+    if (listen(sock, RFB_LISTEN_BACKLOG) < 0) {
         rfbLogPerror("rfbListenOnTCP6Port: error in listen on IPv6 socket");
 	rfbCloseSocket(sock);
 	return RFB_INVALID_SOCKET;
     }
+    if (reusePort && !rfbSetNonBlocking(sock)) {
+	rfbCloseSocket(sock);
+	return RFB_INVALID_SOCKET;
+    }
 
     return sock;
 #endif
 }
 
+rfbSocket
+rfbListenOnTCP6Port(int port,
+                    const char* iface)
+{
+    return listenOnTCP6Port(port, iface, FALSE);
+}
+
+rfbSocket
+rfbListenOnSharedTCP6Port(int port,
+                          const char* iface)
+{
+    return listenOnTCP6Port(port, iface, TRUE);
+}
+
 
 rfbSocket
 rfbConnectToTcpAddr(char *host,
@@ -1372,3 +1599,82 @@ rfbSetNonBlocking(rfbSocket sock)
 {
     return sock_set_nonblocking(sock, TRUE, rfbLog);
 }
+
+/*
+ * Socket tuning of client connections, see corkUpdates, tuneSendBuffer and
+ * notSentLowWater in rfbScreenInfo. All of it is best effort: options the
+ * platform doesn't know are skipped silently.
+ */
+
+#define SNDBUF_CHECK_MS 1000
+#define SNDBUF_MIN (64*1024)
+#define SNDBUF_MAX (8*1024*1024)
+
+void
+rfbSetSocketProfile(rfbClientPtr cl)
+{
+#ifdef TCP_NOTSENT_LOWAT
+    int lowat = cl->screen->notSentLowWater;
+
+    if (lowat > 0 && setsockopt(cl->sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+                                (const char *)&lowat, sizeof(lowat)) < 0)
+        rfbLogPerror("rfbSetSocketProfile: can't set TCP_NOTSENT_LOWAT");
+#endif
+    cl->sendBufferSize = 0;
+    cl->sendBufferChecked = 0;
+}
+
+/*
+ * With cork set, the pieces of a framebuffer update are held back until they
+ * fill a segment. Removing it flushes the rest at once; this is also when
+ * the send buffer is fitted to the bandwidth-delay product the kernel
+ * measured for the connection (congestion window times segment size).
+ */
+void
+rfbCorkClient(rfbClientPtr cl, rfbBool cork)
+{
+#ifdef TCP_INFO
+    struct tcp_info info;
+    socklen_t infoLen = sizeof(info);
+    unsigned long now;
+    int size;
+#endif
+
+    if (cl->sock == RFB_INVALID_SOCKET)
+        return;
+
+#ifdef TCP_CORK
+    if (cl->screen->corkUpdates) {
+        int on = cork ? 1 : 0;
+        setsockopt(cl->sock, IPPROTO_TCP, TCP_CORK, (const char *)&on, sizeof(on));
+    }
+#endif
+
+#ifdef TCP_INFO
+    if (cork || !cl->screen->tuneSendBuffer)
+        return;
+
+    now = rfbCurrentTimeMs();
+    if (cl->sendBufferChecked && now - cl->sendBufferChecked < SNDBUF_CHECK_MS)
+        return;
+    cl->sendBufferChecked = now;
+
+    if (getsockopt(cl->sock, IPPROTO_TCP, TCP_INFO, (char *)&info, &infoLen) < 0
+        || info.tcpi_snd_cwnd == 0 || info.tcpi_snd_mss == 0)
+        return;
+
+    /* twice the BDP, so a full window can be queued while the last one drains */
+    size = 2 * info.tcpi_snd_cwnd * info.tcpi_snd_mss;
+    if (size < SNDBUF_MIN)
+        size = SNDBUF_MIN;
+    if (size > SNDBUF_MAX)
+        size = SNDBUF_MAX;
+
+    /* only follow changes of more than a quarter */
+    if (cl->sendBufferSize && abs(size - cl->sendBufferSize) < cl->sendBufferSize / 4)
+        return;
+
+    if (setsockopt(cl->sock, SOL_SOCKET, SO_SNDBUF, (const char *)&size, sizeof(size)) == 0)
+        cl->sendBufferSize = size;
+#endif
+}
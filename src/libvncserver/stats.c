@@ -106,6 +106,7 @@ char *encodingName(uint32_t type, char *buf, int len) {
     case rfbEncodingUltra:              snprintf(buf, len, "ultra");       break;
     case rfbEncodingZRLE:               snprintf(buf, len, "ZRLE");        break;
     case rfbEncodingZYWRLE:             snprintf(buf, len, "ZYWRLE");      break;
+    case rfbEncodingH264:               snprintf(buf, len, "H264");        break;
     case rfbEncodingCache:              snprintf(buf, len, "cache");       break;
     case rfbEncodingCacheEnable:        snprintf(buf, len, "cacheEnable"); break;
     case rfbEncodingXOR_Zlib:           snprintf(buf, len, "xorZlib");     break;
@@ -124,6 +125,8 @@ char *encodingName(uint32_t type, char *buf, int len) {
     case rfbEncodingLastRect:           snprintf(buf, len, "LastRect");    break;
     case rfbEncodingNewFBSize:          snprintf(buf, len, "NewFBSize");   break;
     case rfbEncodingExtDesktopSize:     snprintf(buf, len, "ExtendedDesktopSize"); break;
+    case rfbEncodingFence:              snprintf(buf, len, "Fence");       break;
+    case rfbEncodingContinuousUpdates:  snprintf(buf, len, "ContinuousUpdates"); break;
     case rfbEncodingKeyboardLedState:   snprintf(buf, len, "LedState");    break;
     case rfbEncodingSupportedMessages:  snprintf(buf, len, "SupportedMessage");  break;
     case rfbEncodingSupportedEncodings: snprintf(buf, len, "SupportedEncoding"); break;
@@ -431,6 +434,10 @@ void rfbPrintStats(rfbClientPtr cl)
         savings = 100.0 - ((totalBytes/totalBytesIfRaw)*100.0);
     rfbLog(" %-20.20s: %6d | %9.0f/%9.0f (%5.1f%%)\n",
             "TOTALS", totalRects, totalBytes,totalBytesIfRaw, savings);
+    if (cl->sslKernelSend || cl->sslKernelRecv)
+        rfbLog(" %-20.20s: %s%s, %lu bytes sent\n", "Kernel TLS",
+                cl->sslKernelSend ? "send" : "", cl->sslKernelRecv ? " recv" : "",
+                cl->sslKernelBytesSent);
 
     totalRects=0.0;
     totalBytes=0.0;
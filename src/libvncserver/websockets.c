@@ -47,6 +47,7 @@
 #include "crypto.h"
 #include "ws_decode.h"
 #include "base64.h"
+#include "private.h"
 
 #if 0
 #include <sys/syscall.h>
@@ -66,17 +67,19 @@ Upgrade: websocket\r\n\
 Connection: Upgrade\r\n\
 Sec-WebSocket-Accept: %s\r\n\
 Sec-WebSocket-Protocol: %s\r\n\
-\r\n"
+%s\r\n"
 
 #define SERVER_HANDSHAKE_HYBI_NO_PROTOCOL "HTTP/1.1 101 Switching Protocols\r\n\
 Upgrade: websocket\r\n\
 Connection: Upgrade\r\n\
 Sec-WebSocket-Accept: %s\r\n\
-\r\n"
+%s\r\n"
 
-#define WEBSOCKETS_CLIENT_CONNECT_WAIT_MS 100
-#define WEBSOCKETS_CLIENT_SEND_WAIT_MS 100
 #define WEBSOCKETS_MAX_HANDSHAKE_LEN 4096
+/* the most of the upgrade request looked at at once, which fits the GnuTLS peek buffer */
+#define WEBSOCKETS_HANDSHAKE_CHUNK 1024
+/* messages shorter than this are not worth compressing */
+#define WEBSOCKETS_DEFLATE_MIN_LEN 64
 
 #if defined(__linux__) && defined(NEED_TIMEVAL)
 struct timeval
@@ -86,18 +89,13 @@ struct timeval
 ;
 #endif
 
-static rfbBool webSocketsHandshake(rfbClientPtr cl, char *scheme);
+static rfbBool webSocketsAnswerHandshake(rfbClientPtr cl, char *scheme, char *buf);
 
 static int webSocketsEncodeHybi(rfbClientPtr cl, const char *src, int len, char **dst);
 
 static int ws_read(void *cl, char *buf, size_t len);
 
 
-static int
-min (int a, int b) {
-    return a < b ? a : b;
-}
-
 static void webSocketsGenSha1Key(char *target, int size, char *key)
 {
     unsigned char hash[SHA1_HASH_SIZE];
@@ -109,183 +107,376 @@ static void webSocketsGenSha1Key(char *target, int size, char *key)
 	rfbErr("rfbBase64NtoP failed\n");
 }
 
+#ifdef LIBVNCSERVER_HAVE_LIBZ
 /*
- * rfbWebSocketsHandshake is called to handle new WebSockets connections
+ * Accept the first permessage-deflate offer in a Sec-WebSocket-Extensions
+ * header (RFC 7692) whose parameters we can honour, set wsctx up for it and
+ * write the response header to response.  extensions is modified.
+ */
+
+static rfbBool
+webSocketsNegotiateDeflate(ws_ctx_t *wsctx, char *extensions, char *response, int size)
+{
+    char *offer, *offerEnd, *param, *paramEnd, *value;
+    rfbBool ok;
+    int len;
+
+    for (offer = extensions; offer; offer = offerEnd) {
+        if ((offerEnd = strchr(offer, ',')) != NULL)
+            *offerEnd++ = '\0';
+
+        wsctx->serverNoContextTakeover = FALSE;
+        wsctx->clientNoContextTakeover = FALSE;
+        wsctx->serverMaxWindowBits = MAX_WBITS;
+        ok = TRUE;
+
+        for (param = offer; param && ok; param = paramEnd) {
+            if ((paramEnd = strchr(param, ';')) != NULL)
+                *paramEnd++ = '\0';
+            param += strspn(param, " \t");
+            len = strcspn(param, " \t=");
+            value = param + len + strspn(param + len, " \t");
+            value = *value == '=' ? value + 1 + strspn(value + 1, " \t\"") : NULL;
+
+            if (param == offer + strspn(offer, " \t")) {
+                ok = len == 18 && strncasecmp(param, "permessage-deflate", len) == 0;
+            } else if (len == 26 && strncasecmp(param, "server_no_context_takeover", len) == 0) {
+                wsctx->serverNoContextTakeover = TRUE;
+            } else if (len == 26 && strncasecmp(param, "client_no_context_takeover", len) == 0) {
+                wsctx->clientNoContextTakeover = TRUE;
+            } else if (len == 22 && strncasecmp(param, "server_max_window_bits", len) == 0) {
+                /* zlib cannot produce raw deflate data with a 256 byte window */
+                wsctx->serverMaxWindowBits = value ? atoi(value) : 0;
+                ok = wsctx->serverMaxWindowBits >= 9 && wsctx->serverMaxWindowBits <= MAX_WBITS;
+            } else if (len == 22 && strncasecmp(param, "client_max_window_bits", len) == 0) {
+                /* we inflate with the largest window, which handles any */
+            } else {
+                ok = FALSE;
+            }
+        }
+        if (!ok)
+            continue;
+
+        len = snprintf(response, size, "Sec-WebSocket-Extensions: permessage-deflate%s%s",
+                       wsctx->serverNoContextTakeover ? "; server_no_context_takeover" : "",
+                       wsctx->clientNoContextTakeover ? "; client_no_context_takeover" : "");
+        if (wsctx->serverMaxWindowBits != MAX_WBITS)
+            len += snprintf(response + len, size - len, "; server_max_window_bits=%d",
+                            wsctx->serverMaxWindowBits);
+        snprintf(response + len, size - len, "\r\n");
+        wsctx->permessageDeflate = TRUE;
+        return TRUE;
+    }
+    return FALSE;
+}
+#endif
+
+/*
+ * rfbWebSocketsHandshake is called to handle new WebSockets connections.  It
+ * runs the handshake of the event loop to its end, waiting for the socket in
+ * between, but no longer than maxClientWait (or rfbMaxClientWait) ms in all.
  */
 
 rfbBool
 webSocketsCheck (rfbClientPtr cl)
 {
-    char bbuf[4], *scheme;
-    int ret;
+    int timeout = cl->screen->maxClientWait ? cl->screen->maxClientWait : rfbMaxClientWait;
+    unsigned long start = rfbCurrentTimeMs(), waited = 0;
+    fd_set fds;
+    struct timeval tv;
+    int ret, wait;
+
+    cl->state = RFB_WEBSOCKETS_CHECK;
+    while (cl->state != RFB_PROTOCOL_VERSION) {
+        switch (cl->state) {
+        case RFB_WEBSOCKETS_CHECK:
+            ret = webSocketsCheckNoWait(cl, waited);
+            break;
+        case RFB_TLS_HANDSHAKE:
+            ret = webSocketsTlsHandshakeNoWait(cl);
+            break;
+        default:
+            ret = webSocketsHandshakeNoWait(cl);
+            break;
+        }
+        if (ret == 0)
+            return FALSE;
+        if (ret == 1)
+            continue;
+
+        waited = rfbCurrentTimeMs() - start;
+        if (waited >= (unsigned long)timeout) {
+            rfbErr("webSocketsHandshake: timed out\n");
+            return FALSE;
+        }
+        wait = timeout - waited;
+        if (cl->state == RFB_WEBSOCKETS_CHECK && waited < WEBSOCKETS_CLIENT_CONNECT_WAIT_MS)
+            wait = WEBSOCKETS_CLIENT_CONNECT_WAIT_MS - waited;
+
+        FD_ZERO(&fds);
+        FD_SET(cl->sock, &fds);
+        tv.tv_sec = wait / 1000;
+        tv.tv_usec = (wait % 1000) * 1000;
+        if (cl->state == RFB_TLS_HANDSHAKE && rfbssl_want_write(cl))
+            ret = select(cl->sock + 1, NULL, &fds, NULL, &tv);
+        else
+            ret = select(cl->sock + 1, &fds, NULL, NULL, &tv);
+        if (ret < 0 && errno != EINTR) {
+            rfbLogPerror("webSocketsHandshake: select");
+            return FALSE;
+        }
+        waited = rfbCurrentTimeMs() - start;
+    }
+    return TRUE;
+}
+
+/*
+ * webSocketsCheckNoWait is the first step of the WebSockets handshake in the
+ * event loop, waited being the time since the client connected.  It returns
+ * -1 instead of waiting if the client did not send enough yet to tell a
+ * WebSockets handshake from a plain RFB connection and
+ * WEBSOCKETS_CLIENT_CONNECT_WAIT_MS are not over, and 0 if the client has to
+ * be closed.  Otherwise it returns 1, with the client's state
+ * RFB_PROTOCOL_VERSION for a plain RFB client, RFB_TLS_HANDSHAKE for a
+ * secure WebSockets client and RFB_WEBSOCKETS_HANDSHAKE for any other.
+ */
+
+int
+webSocketsCheckNoWait(rfbClientPtr cl, unsigned long waited)
+{
+    char bbuf[4];
+    int n;
 
-    ret = rfbPeekExactTimeout(cl, bbuf, 4,
-                                   WEBSOCKETS_CLIENT_CONNECT_WAIT_MS);
-    if ((ret < 0) && (errno == ETIMEDOUT)) {
-      rfbLog("Normal socket connection\n");
-      return TRUE;
-    } else if (ret <= 0) {
-      rfbErr("webSocketsHandshake: unknown connection error\n");
-      return FALSE;
+    if ((n = rfbPeekAtSocket(cl, bbuf, 4)) == 0) {
+        rfbLog("webSocketsCheck: client gone\n");
+        return 0;
     }
+    if (n < 0) {
+#ifdef WIN32
+        errno = WSAGetLastError();
+        if (errno == WSAEWOULDBLOCK)
+            errno = EAGAIN;
+#endif
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            rfbLogPerror("webSocketsCheck: peek");
+            return 0;
+        }
+        n = 0;
+    }
+
+    /* the first byte is enough to spot TLS, the rest is on its way */
+    if (n < 4 && waited < WEBSOCKETS_CLIENT_CONNECT_WAIT_MS
+        && !(n > 0 && (bbuf[0] == '\x16' || bbuf[0] == '\x80')))
+        return -1;
 
-    if (strncmp(bbuf, "RFB ", 4) == 0) {
+    if (strncmp(bbuf, "RFB ", n) == 0) {
         rfbLog("Normal socket connection\n");
-        return TRUE;
-    } else if (strncmp(bbuf, "\x16", 1) == 0 || strncmp(bbuf, "\x80", 1) == 0) {
+        cl->state = RFB_PROTOCOL_VERSION;
+        return 1;
+    }
+    if (bbuf[0] == '\x16' || bbuf[0] == '\x80') {
         rfbLog("Got TLS/SSL WebSockets connection\n");
         if (-1 == rfbssl_init(cl)) {
-	  rfbErr("webSocketsHandshake: rfbssl_init failed\n");
-	  return FALSE;
-	}
-	ret = rfbPeekExactTimeout(cl, bbuf, 4, WEBSOCKETS_CLIENT_CONNECT_WAIT_MS);
-        scheme = "wss";
-    } else {
-        scheme = "ws";
+            rfbErr("webSocketsHandshake: rfbssl_init failed\n");
+            return 0;
+        }
+        cl->state = RFB_TLS_HANDSHAKE;
+        return 1;
+    }
+    cl->state = RFB_WEBSOCKETS_HANDSHAKE;
+    return 1;
+}
+
+/*
+ * webSocketsTlsHandshakeNoWait takes the TLS handshake of a client in the
+ * RFB_TLS_HANDSHAKE state as far as its socket allows.  It returns -1 if it
+ * has to wait for the socket, 0 if the client has to be closed and 1 once
+ * the TLS handshake is done and the client's state is
+ * RFB_WEBSOCKETS_HANDSHAKE.
+ */
+
+int
+webSocketsTlsHandshakeNoWait(rfbClientPtr cl)
+{
+    switch (rfbssl_handshake(cl)) {
+    case 1:
+        cl->state = RFB_WEBSOCKETS_HANDSHAKE;
+        return 1;
+    case RFBSSL_WANT_READ:
+    case RFBSSL_WANT_WRITE:
+        return -1;
+    default:
+        rfbErr("webSocketsHandshake: TLS handshake failed\n");
+        return 0;
     }
+}
+
+/*
+ * webSocketsHandshakeNoWait collects the upgrade request of a client in the
+ * RFB_WEBSOCKETS_HANDSHAKE state in cl->wsRequest as it arrives, and answers
+ * it once it is complete.  Nothing past the end of the request is read.  It
+ * returns -1 if it has to wait for the socket, 0 if the client has to be
+ * closed and 1 once the handshake is done and the client's state is
+ * RFB_PROTOCOL_VERSION.
+ */
+
+int
+webSocketsHandshakeNoWait(rfbClientPtr cl)
+{
+    char *buf, *end, *scheme = cl->sslctx ? "wss" : "ws";
+    int n, from, want;
+    rfbBool ret;
 
-    if (strncmp(bbuf, "GET ", 4) != 0) {
-      rfbErr("webSocketsHandshake: invalid client header\n");
-      return FALSE;
+    if (!cl->wsRequest && !(cl->wsRequest = malloc(WEBSOCKETS_MAX_HANDSHAKE_LEN))) {
+        rfbLogPerror("webSocketsHandshake: malloc");
+        return 0;
+    }
+    buf = cl->wsRequest;
+
+    want = WEBSOCKETS_MAX_HANDSHAKE_LEN - 1 - cl->wsRequestLen;
+    if (want > WEBSOCKETS_HANDSHAKE_CHUNK)
+        want = WEBSOCKETS_HANDSHAKE_CHUNK;
+    if (want <= 0) {
+        rfbErr("webSocketsHandshake: request too long\n");
+        return 0;
     }
 
+    if (cl->sslctx)
+        n = rfbssl_peek(cl, buf + cl->wsRequestLen, want);
+    else
+        n = rfbPeekAtSocket(cl, buf + cl->wsRequestLen, want);
+    if (n == 0) {
+        rfbLog("webSocketsHandshake: client gone\n");
+        return 0;
+    }
+    if (n < 0) {
+#ifdef WIN32
+        errno = WSAGetLastError();
+        if (errno == WSAEWOULDBLOCK)
+            errno = EAGAIN;
+#endif
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return -1;
+        rfbLogPerror("webSocketsHandshake: read");
+        return 0;
+    }
+
+    /* the end of the request may straddle what came before */
+    buf[cl->wsRequestLen + n] = '\0';
+    from = cl->wsRequestLen > 3 ? cl->wsRequestLen - 3 : 0;
+    if ((end = strstr(buf + from, "\r\n\r\n")) != NULL)
+        n = end + 4 - (buf + cl->wsRequestLen);
+
+    /* take what was peeked at off the socket */
+    if (rfbReadExact(cl, buf + cl->wsRequestLen, n) <= 0) {
+        rfbLogPerror("webSocketsHandshake: read");
+        return 0;
+    }
+    cl->wsRequestLen += n;
+
+    if (strncmp(buf, "GET ", cl->wsRequestLen < 4 ? cl->wsRequestLen : 4) != 0) {
+        rfbErr("webSocketsHandshake: invalid client header\n");
+        return 0;
+    }
+    if (!end)
+        return -1;
+    buf[cl->wsRequestLen] = '\0';
+
     rfbLog("Got '%s' WebSockets handshake\n", scheme);
+    ret = webSocketsAnswerHandshake(cl, scheme, buf);
+    free(cl->wsRequest);
+    cl->wsRequest = NULL;
+    cl->wsRequestLen = 0;
+    if (!ret)
+        return 0;
+    cl->state = RFB_PROTOCOL_VERSION;
+    return 1;
+}
+
+/*
+ * webSocketsUpgrade is called for connections which already sent their
+ * WebSockets handshake to the HTTP server, request holding the whole of it.
+ */
+
+rfbBool
+webSocketsUpgrade(rfbClientPtr cl, const char *request)
+{
+    char *buf;
+    rfbBool ret;
 
-    if (!webSocketsHandshake(cl, scheme)) {
+    if (!(buf = strdup(request))) {
+        rfbLogPerror("webSocketsUpgrade: strdup");
         return FALSE;
     }
-    /* Start WebSockets framing */
-    return TRUE;
+    rfbLog("Got 'ws' WebSockets handshake from HTTP server\n");
+    ret = webSocketsAnswerHandshake(cl, "ws", buf);
+    free(buf);
+    return ret;
 }
 
+/*
+ * Parse the handshake in buf, which is modified, and answer it.
+ */
+
 static rfbBool
-webSocketsHandshake(rfbClientPtr cl, char *scheme)
+webSocketsAnswerHandshake(rfbClientPtr cl, char *scheme, char *buf)
 {
-    char *buf, *response, *line;
-    int n, linestart = 0, len = 0, llen, base64 = FALSE;
+    char *response, *line, *end;
+    int len, llen, base64 = FALSE;
     char *path = NULL, *host = NULL, *origin = NULL, *protocol = NULL;
-    char *key1 = NULL, *key2 = NULL;
     char *sec_ws_origin = NULL;
     char *sec_ws_key = NULL;
+    char *sec_ws_extensions = NULL;
     char sec_ws_version = 0;
+    char extensionsHeader[128] = "";
     ws_ctx_t *wsctx = NULL;
 
-    buf = (char *) malloc(WEBSOCKETS_MAX_HANDSHAKE_LEN);
-    if (!buf) {
-        rfbLogPerror("webSocketsHandshake: malloc");
-        return FALSE;
-    }
-    response = (char *) malloc(WEBSOCKETS_MAX_HANDSHAKE_LEN);
-    if (!response) {
-        free(buf);
-        rfbLogPerror("webSocketsHandshake: malloc");
-        return FALSE;
-    }
-
-    while (len < WEBSOCKETS_MAX_HANDSHAKE_LEN-1) {
-        if ((n = rfbReadExactTimeout(cl, buf+len, 1,
-                                     WEBSOCKETS_CLIENT_SEND_WAIT_MS)) <= 0) {
-            if ((n < 0) && (errno == ETIMEDOUT)) {
-                break;
-            }
-            if (n == 0) {
-                rfbLog("webSocketsHandshake: client gone\n");
-            }
-            else {
-                rfbLogPerror("webSocketsHandshake: read");
-            }
-
-            free(response);
-            free(buf);
-            return FALSE;
-        }
-
-        len += 1;
-        llen = len - linestart;
-        if (((llen >= 2)) && (buf[len-1] == '\n')) {
-            line = buf+linestart;
-            if ((llen == 2) && (strncmp("\r\n", line, 2) == 0)) {
-                if (key1 && key2 && len+8 < WEBSOCKETS_MAX_HANDSHAKE_LEN) {
-                    if ((n = rfbReadExact(cl, buf+len, 8)) <= 0) {
-                        if ((n < 0) && (errno == ETIMEDOUT)) {
-                            break;
-                        }
-                        if (n == 0)
-                            rfbLog("webSocketsHandshake: client gone\n");
-                        else
-                            rfbLogPerror("webSocketsHandshake: read");
-                        free(response);
-                        free(buf);
-                        return FALSE;
-                    }
-                    len += 8;
-                } else {
-                    buf[len] = '\0';
-                }
-                break;
-            } else if ((llen >= 16) && ((strncmp("GET ", line, min(llen,4))) == 0)) {
-                /* 16 = 4 ("GET ") + 1 ("/.*") + 11 (" HTTP/1.1\r\n") */
-                path = line+4;
-                buf[len-11] = '\0'; /* Trim trailing " HTTP/1.1\r\n" */
-                cl->wspath = strdup(path);
-                /* rfbLog("Got path: %s\n", path); */
-            } else if ((strncasecmp("host: ", line, min(llen,6))) == 0) {
-                host = line+6;
-                buf[len-2] = '\0';
-                /* rfbLog("Got host: %s\n", host); */
-            } else if ((strncasecmp("origin: ", line, min(llen,8))) == 0) {
-                origin = line+8;
-                buf[len-2] = '\0';
-                /* rfbLog("Got origin: %s\n", origin); */
-            } else if ((strncasecmp("sec-websocket-key1: ", line, min(llen,20))) == 0) {
-                key1 = line+20;
-                buf[len-2] = '\0';
-                /* rfbLog("Got key1: %s\n", key1); */
-            } else if ((strncasecmp("sec-websocket-key2: ", line, min(llen,20))) == 0) {
-                key2 = line+20;
-                buf[len-2] = '\0';
-                /* rfbLog("Got key2: %s\n", key2); */
-            /* HyBI */
-
-            } else if ((strncasecmp("sec-websocket-protocol: ", line, min(llen,24))) == 0) {
-                protocol = line+24;
-                buf[len-2] = '\0';
-                rfbLog("Got protocol: %s\n", protocol);
-            } else if ((strncasecmp("sec-websocket-origin: ", line, min(llen,22))) == 0) {
-                sec_ws_origin = line+22;
-                buf[len-2] = '\0';
-            } else if ((strncasecmp("sec-websocket-key: ", line, min(llen,19))) == 0) {
-                sec_ws_key = line+19;
-                buf[len-2] = '\0';
-            } else if ((strncasecmp("sec-websocket-version: ", line, min(llen,23))) == 0) {
-                sec_ws_version = strtol(line+23, NULL, 10);
-                buf[len-2] = '\0';
-            }
-
-            linestart = len;
+    for (line = buf; (end = strstr(line, "\r\n")) != NULL && end != line; line = end + 2) {
+        *end = '\0';
+        llen = end - line;
+        if ((llen >= 14) && (strncmp("GET ", line, 4) == 0)) {
+            /* 14 = 4 ("GET ") + 1 ("/.*") + 9 (" HTTP/1.1") */
+            path = line+4;
+            line[llen-9] = '\0'; /* Trim trailing " HTTP/1.1" */
+            free(cl->wspath);
+            cl->wspath = strdup(path);
+            /* rfbLog("Got path: %s\n", path); */
+        } else if ((strncasecmp("host: ", line, 6)) == 0) {
+            host = line+6;
+            /* rfbLog("Got host: %s\n", host); */
+        } else if ((strncasecmp("origin: ", line, 8)) == 0) {
+            origin = line+8;
+            /* rfbLog("Got origin: %s\n", origin); */
+        /* HyBI */
+
+        } else if ((strncasecmp("sec-websocket-protocol: ", line, 24)) == 0) {
+            protocol = line+24;
+            rfbLog("Got protocol: %s\n", protocol);
+        } else if ((strncasecmp("sec-websocket-origin: ", line, 22)) == 0) {
+            sec_ws_origin = line+22;
+        } else if ((strncasecmp("sec-websocket-key: ", line, 19)) == 0) {
+            sec_ws_key = line+19;
+        } else if ((strncasecmp("sec-websocket-extensions: ", line, 26)) == 0) {
+            sec_ws_extensions = line+26;
+        } else if ((strncasecmp("sec-websocket-version: ", line, 23)) == 0) {
+            sec_ws_version = strtol(line+23, NULL, 10);
         }
     }
-    
+
     /* older hixie handshake, this could be removed if
      * a final standard is established -- removed now */
     if (!sec_ws_version) {
         rfbErr("Hixie no longer supported\n");
-        free(response);
-        free(buf);
         return FALSE;
     } 
 
     if (!sec_ws_key) {
         rfbErr("webSocketsHandshake: sec-websocket-key is missing\n");
-        free(response);
-        free(buf);
         return FALSE;
     }
 
     if (!(path && host && (origin || sec_ws_origin))) {
         rfbErr("webSocketsHandshake: incomplete client handshake\n");
-        free(response);
-        free(buf);
         return FALSE;
     }
 
@@ -302,6 +493,28 @@ webSocketsHandshake(rfbClientPtr cl, char *scheme)
         }
     }
 
+    response = (char *) malloc(WEBSOCKETS_MAX_HANDSHAKE_LEN);
+    if (!response) {
+        rfbLogPerror("webSocketsHandshake: malloc");
+        return FALSE;
+    }
+
+    wsctx = calloc(1, sizeof(ws_ctx_t));
+    if (!wsctx) {
+        rfbErr("webSocketsHandshake: could not allocate memory for context\n");
+        free(response);
+        return FALSE;
+    }
+
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+    /* compressed text frames would need base64 on top, so binary only */
+    if (sec_ws_extensions && !base64 && cl->screen->webSocketsDeflateLevel > 0 &&
+        webSocketsNegotiateDeflate(wsctx, sec_ws_extensions,
+                                   extensionsHeader, sizeof(extensionsHeader))) {
+        rfbLog("  - webSocketsHandshake: using permessage-deflate\n");
+    }
+#endif
+
     /*
      * Generate the WebSockets server response based on the the headers sent
      * by the client.
@@ -312,27 +525,21 @@ webSocketsHandshake(rfbClientPtr cl, char *scheme)
 
     if(strlen(protocol) > 0) {
         len = snprintf(response, WEBSOCKETS_MAX_HANDSHAKE_LEN,
-                 SERVER_HANDSHAKE_HYBI, accept, protocol);
+                 SERVER_HANDSHAKE_HYBI, accept, protocol, extensionsHeader);
     } else {
         len = snprintf(response, WEBSOCKETS_MAX_HANDSHAKE_LEN,
-                       SERVER_HANDSHAKE_HYBI_NO_PROTOCOL, accept);
+                       SERVER_HANDSHAKE_HYBI_NO_PROTOCOL, accept, extensionsHeader);
     }
 
     if (rfbWriteExact(cl, response, len) < 0) {
         rfbErr("webSocketsHandshake: failed sending WebSockets response\n");
+        free(wsctx);
         free(response);
-        free(buf);
         return FALSE;
     }
     /* rfbLog("webSocketsHandshake: %s\n", response); */
     free(response);
-    free(buf);
 
-    wsctx = calloc(1, sizeof(ws_ctx_t));
-    if (!wsctx) {
-        rfbErr("webSocketsHandshake: could not allocate memory for context\n");
-        return FALSE;
-    }
     wsctx->encode = webSocketsEncodeHybi;
     wsctx->decode = webSocketsDecodeHybi;
     wsctx->ctxInfo.readFunc = ws_read;
@@ -355,12 +562,130 @@ ws_read(void *ctxPtr, char *buf, size_t len)
     return n;
 }
 
+/*
+ * Fill in the header of an unmasked, final frame with the given opcode and
+ * payload length, returning the header's length.
+ */
+
+static int
+webSocketsFrameHeader(ws_header_t *header, unsigned char opcode, uint64_t len)
+{
+    header->b0 = 0x80 | (opcode & 0x0f);
+    if (len <= 125) {
+      header->b1 = (uint8_t)len;
+      return 2;
+    } else if (len <= 65535) {
+      header->b1 = 0x7e;
+      header->u.s16.l16 = WS_HTON16((uint16_t)len);
+      return 4;
+    } else {
+      header->b1 = 0x7f;
+      header->u.s64.l64 = WS_HTON64(len);
+      return 10;
+    }
+}
+
+/*
+ * Whether a message of len bytes should go out compressed: not if it is
+ * short, or carries a rectangle in an encoding that compresses already.
+ */
+
+static rfbBool
+webSocketsWantDeflate(rfbClientPtr cl, int len)
+{
+    ws_ctx_t *wsctx = (ws_ctx_t *)cl->wsctx;
+
+    if (!wsctx->permessageDeflate || len < WEBSOCKETS_DEFLATE_MIN_LEN)
+        return FALSE;
+
+    switch (cl->sendingEncoding) {
+    case rfbEncodingZlib:
+    case rfbEncodingZlibHex:
+    case rfbEncodingTight:
+    case rfbEncodingTightPng:
+    case rfbEncodingUltra:
+    case rfbEncodingZRLE:
+    case rfbEncodingZYWRLE:
+    case rfbEncodingH264:
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/*
+ * For binary mode: write the header of a frame carrying len bytes to dst,
+ * which must have room for WSHLENMAX bytes, so that the payload can be
+ * sent from where it is.  Returns the header's length, or -1 in base64
+ * mode or if the message gets compressed, where the payload has to go
+ * through webSocketsEncode().
+ */
+
+int
+webSocketsEncodeHeader(rfbClientPtr cl, int len, char *dst)
+{
+    ws_ctx_t *wsctx = (ws_ctx_t *)cl->wsctx;
+
+    if (wsctx->base64 || webSocketsWantDeflate(cl, len))
+        return -1;
+    return webSocketsFrameHeader((ws_header_t *)dst, WS_OPCODE_BINARY_FRAME, len);
+}
+
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+/*
+ * Compress a message into a binary frame with RSV1 set (RFC 7692 7.2.1).
+ * The compressed data goes to codeBufEncode after room for the largest
+ * frame header, which is then written right in front of it.
+ */
+
+static int
+webSocketsEncodeDeflate(rfbClientPtr cl, const char *src, int len, char **dst)
+{
+    ws_ctx_t *wsctx = (ws_ctx_t *)cl->wsctx;
+    z_stream *zs = &wsctx->deflateStream;
+    char *payload = wsctx->codeBufEncode + WSHLENMAX;
+    ws_header_t header;
+    int level, clen, hlen;
+
+    if (!wsctx->deflateInitialized) {
+        level = cl->screen->webSocketsDeflateLevel;
+        if (level > Z_BEST_COMPRESSION)
+            level = Z_BEST_COMPRESSION;
+        memset(zs, 0, sizeof(*zs));
+        if (deflateInit2(zs, level, Z_DEFLATED, -wsctx->serverMaxWindowBits,
+                         MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK) {
+            rfbErr("%s: deflateInit2 failed\n", __func__);
+            return -1;
+        }
+        wsctx->deflateInitialized = TRUE;
+    }
+
+    zs->next_in = (Bytef *)src;
+    zs->avail_in = len;
+    zs->next_out = (Bytef *)payload;
+    zs->avail_out = sizeof(wsctx->codeBufEncode) - WSHLENMAX;
+    if (deflate(zs, Z_SYNC_FLUSH) != Z_OK || zs->avail_in != 0 || zs->avail_out == 0) {
+        rfbErr("%s: deflate failed\n", __func__);
+        return -1;
+    }
+    /* the message ends with the empty stored block of the flush, which
+     * is left out on the wire */
+    clen = (char *)zs->next_out - payload - WS_DEFLATE_TAIL_LEN;
+    if (wsctx->serverNoContextTakeover)
+        deflateReset(zs);
+
+    hlen = webSocketsFrameHeader(&header, WS_OPCODE_BINARY_FRAME, clen);
+    header.b0 |= 0x40;
+    memcpy(payload - hlen, &header, hlen);
+    *dst = payload - hlen;
+    return hlen + clen;
+}
+#endif
+
 static int
 webSocketsEncodeHybi(rfbClientPtr cl, const char *src, int len, char **dst)
 {
     int blen, ret = -1, sz = 0;
     unsigned char opcode = '\0'; /* TODO: option! */
-    ws_header_t *header;
     ws_ctx_t *wsctx = (ws_ctx_t *)cl->wsctx;
 
 
@@ -381,7 +706,10 @@ webSocketsEncodeHybi(rfbClientPtr cl, const char *src, int len, char **dst)
       return -1;
     }
 
-    header = (ws_header_t *)wsctx->codeBufEncode;
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+    if (!wsctx->base64 && webSocketsWantDeflate(cl, len))
+        return webSocketsEncodeDeflate(cl, src, len, dst);
+#endif
 
     if (wsctx->base64) {
         opcode = WS_OPCODE_TEXT_FRAME;
@@ -392,19 +720,7 @@ webSocketsEncodeHybi(rfbClientPtr cl, const char *src, int len, char **dst)
         blen = len;
     }
 
-    header->b0 = 0x80 | (opcode & 0x0f);
-    if (blen <= 125) {
-      header->b1 = (uint8_t)blen;
-      sz = 2;
-    } else if (blen <= 65536) {
-      header->b1 = 0x7e;
-      header->u.s16.l16 = WS_HTON16((uint16_t)blen);
-      sz = 4;
-    } else {
-      header->b1 = 0x7f;
-      header->u.s64.l64 = WS_HTON64(blen);
-      sz = 10;
-    }
+    sz = webSocketsFrameHeader((ws_header_t *)wsctx->codeBufEncode, opcode, blen);
 
     if (wsctx->base64) {
         if (-1 == (ret = rfbBase64NtoP((unsigned char *)src, len, wsctx->codeBufEncode + sz, sizeof(wsctx->codeBufEncode) - sz))) {
@@ -438,6 +754,22 @@ webSocketsDecode(rfbClientPtr cl, char *dst, int len)
     return webSocketsDecodeHybi(wsctx, dst, len);
 }
 
+void
+webSocketsFree(rfbClientPtr cl)
+{
+    ws_ctx_t *wsctx = (ws_ctx_t *)cl->wsctx;
+
+    if (!wsctx)
+        return;
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+    if (wsctx->deflateInitialized)
+        deflateEnd(&wsctx->deflateStream);
+#endif
+    hybiDecodeFree(wsctx);
+    free(wsctx);
+    cl->wsctx = NULL;
+}
+
 /**
  * This is a stub function that was once used for Hixie-encoding.
  * We keep it for API compatibility.
@@ -1,9 +1,16 @@
 #include "ws_decode.h"
 #include "base64.h"
 
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
 #define WS_HYBI_MASK_LEN 4
 #define WS_HYBI_HEADER_LEN_SHORT 2 + WS_HYBI_MASK_LEN
 #define WS_HYBI_HEADER_LEN_EXTENDED 4 + WS_HYBI_MASK_LEN
@@ -32,6 +39,57 @@ hybiRemaining(ws_ctx_t *wsctx)
   return wsctx->header.payloadLen - wsctx->nReadPayload;
 }
 
+/**
+ * Unmask payload data in place.
+ *
+ * @param[in,out] data    payload bytes to unmask
+ * @param[in]     len     number of bytes
+ * @param[in]     mask    masking key of the frame
+ * @param[in]     offset  position of data[0] within the frame payload
+ */
+static void
+hybiUnmask(unsigned char *data, size_t len, ws_mask_t mask, uint64_t offset)
+{
+  unsigned char m[16];
+  uint64_t m64;
+  size_t i = 0;
+
+  /* rotate the key so that m[0] applies to data[0] */
+  for (i = 0; i < sizeof(m); i++) {
+    m[i] = mask.c[(offset + i) % WS_HYBI_MASK_LEN];
+  }
+  i = 0;
+
+#if defined(__SSE2__)
+  {
+    __m128i k = _mm_loadu_si128((const __m128i *)m);
+    for (; i + 16 <= len; i += 16) {
+      __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+      _mm_storeu_si128((__m128i *)(data + i), _mm_xor_si128(v, k));
+    }
+  }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+  {
+    uint8x16_t k = vld1q_u8(m);
+    for (; i + 16 <= len; i += 16) {
+      vst1q_u8(data + i, veorq_u8(vld1q_u8(data + i), k));
+    }
+  }
+#endif
+
+  /* i is a multiple of 16 here, so the rotated key still lines up */
+  memcpy(&m64, m, sizeof(m64));
+  for (; i + 8 <= len; i += 8) {
+    uint64_t tmp;
+    memcpy(&tmp, data + i, sizeof(tmp));
+    tmp ^= m64;
+    memcpy(data + i, &tmp, sizeof(tmp));
+  }
+  for (; i < len; i++) {
+    data[i] ^= m[i % WS_HYBI_MASK_LEN];
+  }
+}
+
 static void
 hybiDecodeCleanupBasics(ws_ctx_t *wsctx)
 {
@@ -62,9 +120,87 @@ hybiDecodeCleanupComplete(ws_ctx_t *wsctx)
 {
   hybiDecodeCleanupBasics(wsctx);
   wsctx->continuation_opcode = WS_OPCODE_INVALID;
+  wsctx->inflating = FALSE;
   ws_dbg("cleaned up wsctx completely\n");
 }
 
+/**
+ * Release the decompression state of a context.
+ */
+void
+hybiDecodeFree(ws_ctx_t *wsctx)
+{
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+  if (wsctx->inflateBuf) {
+    inflateEnd(&wsctx->inflateStream);
+    free(wsctx->inflateBuf);
+    wsctx->inflateBuf = NULL;
+  }
+#endif
+}
+
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+/**
+ * Inflate as much of the pending compressed input as fits into the
+ * inflate buffer and make it the data to return.
+ *
+ * @return number of bytes inflated, -1 on error
+ */
+static int
+hybiInflate(ws_ctx_t *wsctx)
+{
+  z_stream *zs = &wsctx->inflateStream;
+  int err;
+
+  zs->next_out = (Bytef *)wsctx->inflateBuf;
+  zs->avail_out = WS_INFLATE_BUF_SIZE;
+  err = inflate(zs, Z_SYNC_FLUSH);
+  if (err == Z_STREAM_END) {
+    /* the client closed the stream with a final block; start afresh */
+    inflateReset(zs);
+  } else if (err != Z_OK && err != Z_BUF_ERROR) {
+    rfbErr("%s: inflate error %d\n", __func__, err);
+    errno = EPROTO;
+    return -1;
+  }
+
+  wsctx->readPos = (unsigned char *)wsctx->inflateBuf;
+  wsctx->readlen = WS_INFLATE_BUF_SIZE - zs->avail_out;
+  return wsctx->readlen;
+}
+
+/**
+ * Start inflating len bytes of unmasked payload of a compressed message.
+ *
+ * @return number of bytes inflated, -1 on error
+ */
+static int
+hybiInflateStart(ws_ctx_t *wsctx, unsigned char *data, int len)
+{
+  z_stream *zs = &wsctx->inflateStream;
+
+  if (!wsctx->inflateBuf) {
+    wsctx->inflateBuf = malloc(WS_INFLATE_BUF_SIZE);
+    if (!wsctx->inflateBuf) {
+      errno = ENOMEM;
+      return -1;
+    }
+    memset(zs, 0, sizeof(*zs));
+    /* negative window bits: raw deflate data without zlib header */
+    if (inflateInit2(zs, -MAX_WBITS) != Z_OK) {
+      free(wsctx->inflateBuf);
+      wsctx->inflateBuf = NULL;
+      errno = ENOMEM;
+      return -1;
+    }
+  }
+
+  zs->next_in = data;
+  zs->avail_in = len;
+  return hybiInflate(wsctx);
+}
+#endif
+
 
 /**
  * Return payload data that has been decoded/unmasked from
@@ -81,6 +217,18 @@ hybiReturnData(char *dst, int len, ws_ctx_t *wsctx, int *nWritten)
 {
   int nextState = WS_HYBI_STATE_ERR;
 
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+  /* a compressed chunk may inflate to more than fits the buffer at once;
+   * the rest is inflated before anything is copied out, so that an error
+   * does not come with data */
+  if (wsctx->readlen == 0 && wsctx->inflating && wsctx->inflateStream.avail_out == 0) {
+    if (hybiInflate(wsctx) < 0) {
+      *nWritten = -1;
+      return WS_HYBI_STATE_ERR;
+    }
+  }
+#endif
+
   /* if we have something already decoded copy and return */
   if (wsctx->readlen > 0) {
     /* simply return what we have */
@@ -97,6 +245,12 @@ hybiReturnData(char *dst, int len, ws_ctx_t *wsctx, int *nWritten)
       *nWritten = wsctx->readlen;
       wsctx->readlen = 0;
       wsctx->readPos = NULL;
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+      /* the inflate buffer filled up, so there may be more */
+      if (wsctx->inflating && wsctx->inflateStream.avail_out == 0) {
+        nextState = WS_HYBI_STATE_DATA_AVAILABLE;
+      } else
+#endif
       if (hybiRemaining(wsctx) == 0) {
         nextState = WS_HYBI_STATE_FRAME_COMPLETE;
       } else {
@@ -108,6 +262,10 @@ hybiReturnData(char *dst, int len, ws_ctx_t *wsctx, int *nWritten)
     /* it may happen that we read some bytes but could not decode them,
      * in that case, set errno to EAGAIN and return -1 */
     nextState = wsctx->hybiDecodeState;
+    if (nextState == WS_HYBI_STATE_DATA_AVAILABLE) {
+      /* what looked like more inflated data was none */
+      nextState = hybiRemaining(wsctx) == 0 ? WS_HYBI_STATE_FRAME_COMPLETE : WS_HYBI_STATE_DATA_NEEDED;
+    }
     errno = EAGAIN;
     *nWritten = -1;
   }
@@ -133,12 +291,23 @@ hybiReadHeader(ws_ctx_t *wsctx, int *sockRet, int *nPayload)
   char *headerDst = wsctx->codeBufDecode + wsctx->header.nRead;
   int n = ((uint64_t)WS_HYBI_HEADER_LEN_SHORT) - wsctx->header.nRead;
 
+  /* a header that came in parts is continued up to its full length */
+  if (wsctx->header.nRead >= 2) {
+    if ((wsctx->codeBufDecode[1] & 0x7f) == 126) {
+      n = ((uint64_t)WS_HYBI_HEADER_LEN_EXTENDED) - wsctx->header.nRead;
+    } else if ((wsctx->codeBufDecode[1] & 0x7f) == 127) {
+      n = ((uint64_t)WS_HYBI_HEADER_LEN_LONG) - wsctx->header.nRead;
+    }
+  }
 
   ws_dbg("header_read to %p with len=%d\n", headerDst, n);
   ret = wsctx->ctxInfo.readFunc(wsctx->ctxInfo.ctxPtr, headerDst, n);
   ws_dbg("read %d bytes from socket\n", ret);
   if (ret <= 0) {
-    if (-1 == ret) {
+    if (-1 == ret && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      /* keep what was read so far for the next call */
+      goto ret_header_pending;
+    } else if (-1 == ret) {
       /* save errno because rfbErr() will tamper it */
       int olderrno = errno;
       rfbErr("%s: read; %s\n", __func__, strerror(errno));
@@ -200,6 +369,27 @@ hybiReadHeader(ws_ctx_t *wsctx, int *sockRet, int *nPayload)
     }
   }
 
+  /* RFC 7692 6.1: RSV1 marks the first frame of a compressed message */
+  if (wsctx->header.data->b0 & 0x40) {
+    if (!wsctx->permessageDeflate || isControlFrame(wsctx)
+        || (wsctx->header.data->b0 & 0x0f) == WS_OPCODE_CONTINUATION) {
+      rfbErr("%s: unexpected RSV1 bit set\n", __func__);
+      errno = EPROTO;
+      goto err_cleanup_state;
+    }
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+    if (wsctx->header.opcode != WS_OPCODE_BINARY_FRAME) {
+      rfbErr("%s: compressed text frames are not supported\n", __func__);
+      errno = EPROTO;
+      goto err_cleanup_state;
+    }
+    wsctx->inflating = TRUE;
+#endif
+  } else if (!isControlFrame(wsctx)
+      && (wsctx->header.data->b0 & 0x0f) != WS_OPCODE_CONTINUATION) {
+    wsctx->inflating = FALSE;
+  }
+
   wsctx->header.payloadLen = (uint64_t)(wsctx->header.data->b1 & 0x7f);
   ws_dbg("first header bytes received; opcode=%d lenbyte=%d fin=%d\n", wsctx->header.opcode, wsctx->header.payloadLen, wsctx->header.fin);
 
@@ -225,7 +415,9 @@ hybiReadHeader(ws_ctx_t *wsctx, int *sockRet, int *nPayload)
     }
     ret = wsctx->ctxInfo.readFunc(wsctx->ctxInfo.ctxPtr, headerDst, n);
     if (ret <= 0) {
-      if (-1 == ret) {
+      if (-1 == ret && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        goto ret_header_pending;
+      } else if (-1 == ret) {
         /* save errno because rfbErr() will tamper it */
         int olderrno = errno;
         rfbErr("%s: read; %s\n", __func__, strerror(errno));
@@ -315,6 +507,57 @@ hybiPayloadStart(ws_ctx_t *wsctx)
 }
 
 
+/**
+ * Read payload bytes of a binary frame directly into the caller's buffer
+ * and unmask them there.
+ *
+ * @param[in,out] wsctx internal state of decoding procedure
+ * @param[out]    dst  destination buffer
+ * @param[in]     len  size of destination buffer
+ * @param[out]    sockRet emulated recv return value
+ * @return next hybi decode state
+ */
+static int
+hybiReadDirect(ws_ctx_t *wsctx, char *dst, int len, int *sockRet)
+{
+  int n;
+  int nextRead = len;
+
+  if (hybiRemaining(wsctx) < (uint64_t)len) {
+    nextRead = hybiRemaining(wsctx);
+  }
+
+  if (nextRead == 0) {
+    /* empty frame, nothing to return */
+    errno = EAGAIN;
+    *sockRet = -1;
+    return WS_HYBI_STATE_FRAME_COMPLETE;
+  }
+
+  n = wsctx->ctxInfo.readFunc(wsctx->ctxInfo.ctxPtr, dst, nextRead);
+  if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    /* nothing lost, try again once there is more */
+    *sockRet = -1;
+    return wsctx->hybiDecodeState;
+  } else if (n == -1) {
+    int olderrno = errno;
+    rfbErr("%s: read; %s", __func__, strerror(errno));
+    errno = olderrno;
+    *sockRet = -1;
+    return WS_HYBI_STATE_ERR;
+  } else if (n == 0) {
+    *sockRet = 0;
+    return WS_HYBI_STATE_ERR;
+  }
+
+  hybiUnmask((unsigned char *)dst, n, wsctx->header.mask, wsctx->nReadPayload);
+  wsctx->nReadPayload += n;
+  *sockRet = n;
+
+  ws_dbg("read %d bytes directly to dst; nRead=%d\n", n, wsctx->nReadPayload);
+  return hybiRemaining(wsctx) == 0 ? WS_HYBI_STATE_FRAME_COMPLETE : WS_HYBI_STATE_DATA_NEEDED;
+}
+
 /**
  * Read the remaining payload bytes from associated raw socket.
  *
@@ -352,12 +595,23 @@ hybiReadAndDecode(ws_ctx_t *wsctx, char *dst, int len, int *sockRet, int nInBuf)
   int nextRead;
   unsigned char *data;
 
+  /* binary payload needs no decoding besides the mask, so unless bytes are
+   * already waiting in the decode buffer it is read straight into dst */
+  if (wsctx->header.opcode == WS_OPCODE_BINARY_FRAME && !wsctx->inflating
+      && wsctx->carrylen == 0 && nInBuf == 0 && len > 0) {
+    return hybiReadDirect(wsctx, dst, len, sockRet);
+  }
+
   /* if data was carried over, copy to start of buffer */
   memcpy(wsctx->writePos, wsctx->carryBuf, wsctx->carrylen);
   wsctx->writePos += wsctx->carrylen;
 
   /* -1 accounts for potential '\0' terminator for base64 decoding */
   bufsize = wsctx->codeBufDecode + ARRAYSIZE(wsctx->codeBufDecode) - wsctx->writePos - 1;
+  if (wsctx->inflating) {
+    /* leave room to append the tail of the compressed message */
+    bufsize -= WS_DEFLATE_TAIL_LEN;
+  }
   ws_dbg("bufsize=%d\n", bufsize);
   if (hybiRemaining(wsctx) > bufsize) {
     nextRead = bufsize;
@@ -369,7 +623,13 @@ hybiReadAndDecode(ws_ctx_t *wsctx, char *dst, int len, int *sockRet, int nInBuf)
 
   if (nextRead > 0) {
     /* decode more data */
-    if (-1 == (n = wsctx->ctxInfo.readFunc(wsctx->ctxInfo.ctxPtr, wsctx->writePos, nextRead))) {
+    n = wsctx->ctxInfo.readFunc(wsctx->ctxInfo.ctxPtr, wsctx->writePos, nextRead);
+    if (-1 == n && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      /* the carried over bytes are copied in again next time */
+      wsctx->writePos -= wsctx->carrylen;
+      *sockRet = -1;
+      return wsctx->hybiDecodeState;
+    } else if (-1 == n) {
       int olderrno = errno;
       rfbErr("%s: read; %s", __func__, strerror(errno));
       errno = olderrno;
@@ -407,23 +667,15 @@ hybiReadAndDecode(ws_ctx_t *wsctx, char *dst, int len, int *sockRet, int nInBuf)
    * the whole frame is received and carry over any remaining bytes in the carry buf*/
   data = (unsigned char *)(wsctx->writePos - toDecode);
 
-  for (i = 0; i < (toDecode >> 2); i++) {
-    uint32_t tmp;
-    memcpy(&tmp, data + i * sizeof(tmp), sizeof(tmp));
-    tmp ^= wsctx->header.mask.u;
-    memcpy(data + i * sizeof(tmp), &tmp, sizeof(tmp));
-  }
-  ws_dbg("mask decoding; i=%d toDecode=%d\n", i, toDecode);
-
+  i = toDecode >> 2;
   if (wsctx->hybiDecodeState == WS_HYBI_STATE_FRAME_COMPLETE) {
-    /* process the remaining bytes (if any) */
-    for (i*=4; i < toDecode; i++) {
-      data[i] ^= wsctx->header.mask.c[i % 4];
-    }
+    hybiUnmask(data, toDecode, wsctx->header.mask, wsctx->nReadPayload - toDecode);
 
     /* all data is here, no carrying */
     wsctx->carrylen = 0;
   } else {
+    hybiUnmask(data, i * 4, wsctx->header.mask, wsctx->nReadPayload - toDecode);
+
     /* carry over remaining, non-multiple-of-four bytes */
     wsctx->carrylen = toDecode - (i * 4);
     if (wsctx->carrylen < 0 || wsctx->carrylen > ARRAYSIZE(wsctx->carryBuf)) {
@@ -464,6 +716,21 @@ hybiReadAndDecode(ws_ctx_t *wsctx, char *dst, int len, int *sockRet, int nInBuf)
       wsctx->writePos = hybiPayloadStart(wsctx);
       break;
     case WS_OPCODE_BINARY_FRAME:
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+      if (wsctx->inflating) {
+        if (hybiWsFrameComplete(wsctx) && wsctx->header.fin) {
+          memcpy(data + toReturn, WS_DEFLATE_TAIL, WS_DEFLATE_TAIL_LEN);
+          toReturn += WS_DEFLATE_TAIL_LEN;
+        }
+        wsctx->writePos = hybiPayloadStart(wsctx);
+        if (hybiInflateStart(wsctx, data, toReturn) < 0) {
+          *sockRet = -1;
+          return WS_HYBI_STATE_ERR;
+        }
+        ws_dbg("inflated %d bytes to readlen=%d\n", toReturn, wsctx->readlen);
+        return hybiReturnData(dst, len, wsctx, sockRet);
+      }
+#endif
       wsctx->readlen = toReturn;
       wsctx->writePos = hybiPayloadStart(wsctx);
       ws_dbg("set readlen=%d writePos=%p\n", wsctx->readlen, wsctx->writePos);
@@ -557,6 +824,11 @@ spor:
     if (wsctx->hybiDecodeState == WS_HYBI_STATE_FRAME_COMPLETE) {
       ws_dbg("frame received successfully, cleaning up: read=%d hlen=%d plen=%d\n", wsctx->header.nRead, wsctx->header.headerLen, wsctx->header.payloadLen);
       if (wsctx->header.fin && !isControlFrame(wsctx)) {
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+        if (wsctx->inflating && wsctx->clientNoContextTakeover) {
+          inflateReset(&wsctx->inflateStream);
+        }
+#endif
         /* frame finished, cleanup state */
         hybiDecodeCleanupComplete(wsctx);
       } else {
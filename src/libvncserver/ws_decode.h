@@ -3,6 +3,9 @@
 
 #include <stdint.h>
 #include <rfb/rfb.h>
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+#include <zlib.h>
+#endif
 
 #if defined(__APPLE__)
 
@@ -32,6 +35,14 @@
 #define B64LEN(__x) (((__x + 2) / 3) * 12 / 3)
 #define WSHLENMAX 14LL  /* 2 + sizeof(uint64_t) + sizeof(uint32_t) */
 #define WS_HYBI_MASK_LEN 4
+/* payload bytes of text frames decoded at a time; binary frames are read
+ * directly into the caller's buffer */
+#define WS_DECODE_BUF_SIZE 16384
+/* bytes of a compressed message inflated at a time */
+#define WS_INFLATE_BUF_SIZE 16384
+/* RFC 7692 7.2.1: the empty stored block ending each compressed message */
+#define WS_DEFLATE_TAIL "\x00\x00\xff\xff"
+#define WS_DEFLATE_TAIL_LEN 4
 
 #define ARRAYSIZE(a) ((sizeof(a) / sizeof((a[0]))) / (size_t)(!(sizeof(a) % sizeof((a[0])))))
 
@@ -117,7 +128,7 @@ typedef struct ws_header_data_s {
 } ws_header_data_t;
 
 struct ws_ctx_s {
-    char codeBufDecode[2048 + WSHLENMAX]; /* base64 + maximum frame header length */
+    char codeBufDecode[WS_DECODE_BUF_SIZE + WSHLENMAX]; /* base64 + maximum frame header length */
     char codeBufEncode[B64LEN(UPDATE_BUF_SIZE) + WSHLENMAX]; /* base64 + maximum frame header length */
     char *writePos;
     unsigned char *readPos;
@@ -132,6 +143,18 @@ struct ws_ctx_s {
     wsEncodeFunc encode;
     wsDecodeFunc decode;
     ctxInfo_t ctxInfo;
+    /* permessage-deflate (RFC 7692) */
+    int permessageDeflate;                 /* negotiated in the handshake */
+    int serverNoContextTakeover;           /* reset compressor after each message */
+    int clientNoContextTakeover;           /* reset decompressor after each message */
+    int serverMaxWindowBits;
+    int inflating;                         /* incoming message is compressed */
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+    rfbBool deflateInitialized;
+    z_stream deflateStream;
+    z_stream inflateStream;
+    char *inflateBuf;                      /* NULL until a compressed message arrives */
+#endif
 };
 
 enum
@@ -148,4 +171,9 @@ enum
 int webSocketsDecodeHybi(ws_ctx_t *wsctx, char *dst, int len);
 
 void hybiDecodeCleanupComplete(ws_ctx_t *wsctx);
+
+void hybiDecodeFree(ws_ctx_t *wsctx);
+
+/* from websockets.c */
+int webSocketsEncodeHeader(rfbClientPtr cl, int len, char *dst);
 #endif
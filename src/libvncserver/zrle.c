@@ -98,10 +98,21 @@
 
 
 /*
- * rfbSendRectEncodingZRLE - send a given rectangle using ZRLE encoding.
+ * rfbSendRectEncodingZRLE - send a given rectangle using ZRLE encoding, or
+ * ZYWRLE if that is the client's preferred encoding.
  */
 
 rfbBool rfbSendRectEncodingZRLE(rfbClientPtr cl, int x, int y, int w, int h)
+{
+  return rfbSendRectEncodingZRLEAs(cl, cl->preferredEncoding, x, y, w, h);
+}
+
+/*
+ * rfbSendRectEncodingZRLEAs - send a given rectangle using encoding, which
+ * is rfbEncodingZYWRLE or else ZRLE.
+ */
+
+rfbBool rfbSendRectEncodingZRLEAs(rfbClientPtr cl, int encoding, int x, int y, int w, int h)
 {
   zrleOutStream* zos;
   rfbFramebufferUpdateRectHeader rect;
@@ -114,7 +125,10 @@ rfbBool rfbSendRectEncodingZRLE(rfbClientPtr cl, int x, int y, int w, int h)
   }
   zrleBeforeBuf = cl->zrleBeforeBuf;
 
-  if (cl->preferredEncoding == rfbEncodingZYWRLE) {
+  if (encoding != rfbEncodingZYWRLE)
+	  encoding = rfbEncodingZRLE;
+
+  if (encoding == rfbEncodingZYWRLE) {
 	  if (cl->tightQualityLevel < 0) {
 		  cl->zywrleLevel = 1;
 	  } else if (cl->tightQualityLevel < 3) {
@@ -201,7 +215,7 @@ rfbBool rfbSendRectEncodingZRLE(rfbClientPtr cl, int x, int y, int w, int h)
   rect.r.y = Swap16IfLE(y);
   rect.r.w = Swap16IfLE(w);
   rect.r.h = Swap16IfLE(h);
-  rect.encoding = Swap32IfLE(cl->preferredEncoding);
+  rect.encoding = Swap32IfLE(encoding);
 
   memcpy(cl->updateBuf+cl->ublen, (char *)&rect,
          sz_rfbFramebufferUpdateRectHeader);
@@ -0,0 +1,321 @@
+/*
+ * clientlooptest - serve many libvncclient connections from one
+ * rfbClientLoop and check that every framebuffer follows the server's.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "testserver.h"
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+#include <zlib.h>
+#endif
+
+#define WIDTH 800
+#define HEIGHT 600
+#define NUMBER_OF_CLIENTS 24
+#define ROUNDS 20
+
+static const char *encodings[] = {
+  "raw", "hextile", "corre", "rre",
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+  "zlib", "zrle", "trle", "tight",
+#endif
+};
+#define NUMBER_OF_ENCODINGS (int)(sizeof(encodings) / sizeof(encodings[0]))
+
+static rfbClient *clients[NUMBER_OF_CLIENTS];
+static int closedCount;
+
+/* the client data its index is kept as */
+static char indexTag;
+
+static void
+closed(rfbClientLoop *loop, rfbClient *client)
+{
+  clients[(intptr_t)rfbClientGetClientData(client, &indexTag)] = NULL;
+  free(client->frameBuffer);
+  rfbClientCleanup(client);
+  closedCount++;
+}
+
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+/*
+ * A server sending one Tight rectangle in two halves, to take clients off
+ * the loop while they are suspended in the middle of it.
+ */
+
+#define RECT_WIDTH 256
+#define RECT_HEIGHT 128
+
+static int fakeListenSock;
+static unsigned char rectPixels[RECT_WIDTH * RECT_HEIGHT * 3];
+static unsigned char *rectMessage;
+static size_t rectMessageLength, rectFirstHalf;
+static pthread_mutex_t fakeMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t fakeCond = PTHREAD_COND_INITIALIZER;
+static rfbBool halfSent, restRequested;
+static int rectChecked, rectRight;
+
+static rfbBool
+writeAll(int sock, const void *data, size_t length)
+{
+  const char *p = (const char *)data;
+
+  while (length > 0) {
+    ssize_t n = write(sock, p, length);
+    if (n <= 0)
+      return FALSE;
+    p += n;
+    length -= n;
+  }
+  return TRUE;
+}
+
+static void
+buildRectMessage(void)
+{
+  uLongf compressedLength = compressBound(sizeof(rectPixels));
+  unsigned char *p;
+  size_t i;
+
+  for (i = 0; i < sizeof(rectPixels); i++)
+    rectPixels[i] = (unsigned char)rand();
+  rectMessage = malloc(16 + 1 + 3 + compressedLength);
+  p = rectMessage;
+  *p++ = rfbFramebufferUpdate;
+  *p++ = 0;
+  *p++ = 0; *p++ = 1;                     /* one rectangle */
+  *p++ = 0; *p++ = 0; *p++ = 0; *p++ = 0; /* at 0,0 */
+  *p++ = RECT_WIDTH >> 8; *p++ = RECT_WIDTH & 0xff;
+  *p++ = RECT_HEIGHT >> 8; *p++ = RECT_HEIGHT & 0xff;
+  *p++ = 0; *p++ = 0; *p++ = 0; *p++ = rfbEncodingTight;
+  *p++ = 0;                               /* basic, zlib stream 0 */
+  compress2(p + 3, &compressedLength, rectPixels, sizeof(rectPixels), 1);
+  *p++ = (compressedLength & 0x7f) | 0x80;
+  *p++ = ((compressedLength >> 7) & 0x7f) | 0x80;
+  *p++ = compressedLength >> 14;
+  rectMessageLength = p - rectMessage + compressedLength;
+  rectFirstHalf = rectMessageLength / 2;
+}
+
+static void *
+runFakeServer(void *arg)
+{
+  static const unsigned char serverInit[] = {
+    RECT_WIDTH >> 8, RECT_WIDTH & 0xff, RECT_HEIGHT >> 8, RECT_HEIGHT & 0xff,
+    32, 24, 0, 1, 0, 255, 0, 255, 0, 255, 16, 8, 0, 0, 0, 0,
+    0, 0, 0, 4, 'f', 'a', 'k', 'e'
+  };
+  char buffer[4096];
+  int sock = accept(fakeListenSock, NULL, NULL);
+
+  if (sock < 0)
+    return NULL;
+  /* RFB 3.3 without authentication */
+  writeAll(sock, "RFB 003.003\n\0\0\0\1", 16);
+  if (read(sock, buffer, 12) != 12 || read(sock, buffer, 1) != 1)
+    goto out;
+  writeAll(sock, serverInit, sizeof(serverInit));
+
+  writeAll(sock, rectMessage, rectFirstHalf);
+  pthread_mutex_lock(&fakeMutex);
+  halfSent = TRUE;
+  while (!restRequested)
+    pthread_cond_wait(&fakeCond, &fakeMutex);
+  pthread_mutex_unlock(&fakeMutex);
+  writeAll(sock, rectMessage + rectFirstHalf, rectMessageLength - rectFirstHalf);
+
+  /* until the client goes away */
+  while (read(sock, buffer, sizeof(buffer)) > 0)
+    ;
+ out:
+  close(sock);
+  return NULL;
+}
+
+static void
+rectFinished(rfbClient *client)
+{
+  int x, y;
+
+  rectChecked++;
+  for (y = 0; y < RECT_HEIGHT; y++)
+    for (x = 0; x < RECT_WIDTH; x++) {
+      const unsigned char *rgb = rectPixels + (y * RECT_WIDTH + x) * 3;
+      uint32_t expected = (uint32_t)rgb[0] << client->format.redShift |
+        (uint32_t)rgb[1] << client->format.greenShift |
+        (uint32_t)rgb[2] << client->format.blueShift, got;
+      memcpy(&got, client->frameBuffer + (y * RECT_WIDTH + x) * 4, 4);
+      if (got != expected)
+        return;
+    }
+  rectRight++;
+}
+
+/*
+ * Removing a client in the middle of a message finishes the message first,
+ * be it with rfbClientLoopRemove() or right away with rfbClientCleanup().
+ */
+static rfbBool
+removeInMiddleOfRect(rfbClientLoop *loop, rfbBool cleanupOnly)
+{
+  struct sockaddr_in addr;
+  socklen_t addrLength = sizeof(addr);
+  pthread_t fakeThread;
+  rfbClient *client;
+  uint8_t *frameBuffer;
+  char port[32], *args[2];
+  int argn = 2, checked = rectChecked, right = rectRight, i;
+  rfbBool ok = TRUE;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  fakeListenSock = socket(AF_INET, SOCK_STREAM, 0);
+  if (fakeListenSock < 0 || bind(fakeListenSock, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      listen(fakeListenSock, 1) != 0 ||
+      getsockname(fakeListenSock, (struct sockaddr *)&addr, &addrLength) != 0)
+    return FALSE;
+  halfSent = restRequested = FALSE;
+  pthread_create(&fakeThread, NULL, runFakeServer, NULL);
+
+  sprintf(port, "127.0.0.1:%d", ntohs(addr.sin_port));
+  args[0] = "clientlooptest";
+  args[1] = port;
+  client = rfbGetClient(8, 3, 4);
+  client->appData.encodingsString = "tight";
+  client->appData.enableJPEG = FALSE;
+  client->FinishedFrameBufferUpdate = rectFinished;
+  if (!rfbInitClient(client, &argn, args) || !rfbClientLoopAdd(loop, client)) {
+    fprintf(stderr, "could not connect to the fake server\n");
+    ok = FALSE;
+    goto out;
+  }
+
+  /* until the first half arrived and nothing is left to read */
+  for (i = 0; i < 100; i++) {
+    rfbBool sent;
+    pthread_mutex_lock(&fakeMutex);
+    sent = halfSent;
+    pthread_mutex_unlock(&fakeMutex);
+    if (rfbClientLoopRun(loop, 100) == 0 && sent)
+      break;
+  }
+  if (i == 100 || rectChecked != checked) {
+    fprintf(stderr, "client did not stop in the middle of the rectangle\n");
+    ok = FALSE;
+  }
+
+  pthread_mutex_lock(&fakeMutex);
+  restRequested = TRUE;
+  pthread_cond_broadcast(&fakeCond);
+  pthread_mutex_unlock(&fakeMutex);
+  if (!cleanupOnly) {
+    rfbClientLoopRemove(loop, client);
+    if (ok && (rectChecked != checked + 1 || rectRight != right + 1)) {
+      fprintf(stderr, "rectangle was not finished on removal\n");
+      ok = FALSE;
+    }
+  }
+
+ out:
+  frameBuffer = client->frameBuffer;
+  rfbClientCleanup(client);
+  free(frameBuffer);
+  if (ok && (rectChecked != checked + 1 || rectRight != right + 1)) {
+    fprintf(stderr, "rectangle was not finished on cleanup\n");
+    ok = FALSE;
+  }
+  pthread_mutex_lock(&fakeMutex);
+  restRequested = TRUE;
+  pthread_cond_broadcast(&fakeCond);
+  pthread_mutex_unlock(&fakeMutex);
+  pthread_join(fakeThread, NULL);
+  close(fakeListenSock);
+  return ok;
+}
+#endif /* LIBVNCSERVER_HAVE_LIBZ */
+
+int
+main(int argc, char **argv)
+{
+  rfbClientLoop *loop;
+  int i, round, failed = 0;
+
+  if (!testServerStart(&argc, argv, WIDTH, HEIGHT))
+    return 1;
+
+  loop = rfbClientLoopCreate(closed);
+  if (!loop)
+    return 1;
+
+  for (i = 0; i < NUMBER_OF_CLIENTS; i++) {
+    clients[i] = rfbGetClient(8, 3, 4);
+    clients[i]->appData.encodingsString = encodings[i % NUMBER_OF_ENCODINGS];
+    clients[i]->appData.enableJPEG = FALSE;
+    rfbClientSetClientData(clients[i], &indexTag, (void *)(intptr_t)i);
+    if (!testClientConnect(clients[i], "clientlooptest") || !rfbClientLoopAdd(loop, clients[i])) {
+      fprintf(stderr, "could not connect client %d\n", i);
+      return 1;
+    }
+  }
+
+  for (round = 0; round < ROUNDS && !failed; round++) {
+    time_t start = time(NULL);
+    int done = 0;
+    rfbBool same[NUMBER_OF_CLIENTS];
+
+    testServerPaint();
+    memset(same, 0, sizeof(same));
+    while (done < NUMBER_OF_CLIENTS) {
+      if (time(NULL) - start > SECONDS_PER_ROUND || rfbClientLoopRun(loop, 100) < 0) {
+        failed = 1;
+        break;
+      }
+      for (i = 0; i < NUMBER_OF_CLIENTS; i++)
+        if (!same[i] && testClientCaughtUp(clients[i])) {
+          same[i] = TRUE;
+          done++;
+        }
+    }
+    if (failed)
+      for (i = 0; i < NUMBER_OF_CLIENTS; i++)
+        if (!same[i])
+          fprintf(stderr, "round %d: %s client %d did not catch up\n",
+                  round, encodings[i % NUMBER_OF_ENCODINGS], i);
+  }
+
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+  buildRectMessage();
+  if (!failed && (!removeInMiddleOfRect(loop, FALSE) || !removeInMiddleOfRect(loop, TRUE)))
+    failed = 1;
+  free(rectMessage);
+#endif
+
+  /* every client gets reported once the server goes away */
+  testServerStop();
+  for (i = 0; i < 50 && closedCount < NUMBER_OF_CLIENTS; i++)
+    rfbClientLoopRun(loop, 100);
+  if (closedCount != NUMBER_OF_CLIENTS) {
+    fprintf(stderr, "%d of %d clients reported closed\n", closedCount, NUMBER_OF_CLIENTS);
+    failed = 1;
+  }
+
+  for (i = 0; i < NUMBER_OF_CLIENTS; i++)
+    if (clients[i]) {
+      free(clients[i]->frameBuffer);
+      rfbClientCleanup(clients[i]);
+    }
+  rfbClientLoopDestroy(loop);
+  testServerCleanup();
+
+  printf("%s\n", failed ? "FAILED" : "OK");
+  return failed;
+}
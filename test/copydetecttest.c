@@ -0,0 +1,196 @@
+/*
+ * copydetecttest - check how detectCopies finds moved areas: the voting
+ * of rfbFindShift() on hashes, and the row and column hashes of
+ * rfbFindMove() on a framebuffer scrolled against its copy.
+ */
+
+#include "../src/libvncserver/copydetect.c"
+#include <stdio.h>
+
+#define WIDTH 128
+#define HEIGHT 96
+#define N 64
+
+static int failed;
+
+static void
+check(rfbBool ok, const char *what)
+{
+  if (!ok) {
+    fprintf(stderr, "%s\n", what);
+    failed = 1;
+  }
+}
+
+static void
+findShift(void)
+{
+  uint32_t cur[N], prev[N];
+  int i, s, votes;
+
+  /* moved down by 5, new entries at the top */
+  for (i = 0; i < N; i++) {
+    prev[i] = 1000 + i;
+    cur[i] = i >= 5 ? prev[i - 5] : 2000 + i;
+  }
+  s = rfbFindShift(cur, prev, N, &votes);
+  check(s == 5 && votes == N - 5, "a shift down was not found");
+
+  /* moved up by 9 */
+  for (i = 0; i < N; i++)
+    cur[i] = i + 9 < N ? prev[i + 9] : 2000 + i;
+  s = rfbFindShift(cur, prev, N, &votes);
+  check(s == -9 && votes == N - 9, "a shift up was not found");
+
+  /* the majority wins, unchanged entries do not vote */
+  for (i = 0; i < N; i++)
+    cur[i] = i < 10 ? prev[i] : i < 20 ? prev[i - 3] : i < 50 ? prev[i + 4] : 2000 + i;
+  s = rfbFindShift(cur, prev, N, &votes);
+  check(s == -4 && votes == 30, "the shift with the most votes did not win");
+
+  /* entries found more than once in prev do not vote */
+  for (i = 0; i < N; i++) {
+    prev[i] = 1000 + i % 8;
+    cur[i] = prev[(i + 3) % N];
+  }
+  s = rfbFindShift(cur, prev, N, &votes);
+  check(votes == 0, "ambiguous entries voted");
+}
+
+static void
+fill(char *fb, int x1, int y1, int x2, int y2)
+{
+  int x, y;
+
+  for (y = y1; y < y2; y++)
+    for (x = x1; x < x2; x++) {
+      uint32_t v = (uint32_t)rand();
+      memcpy(fb + y * WIDTH * 4 + x * 4, &v, 4);
+    }
+}
+
+/* move the w x h area at x, y by dx, dy within the framebuffer */
+static void
+move(char *fb, int x, int y, int w, int h, int dx, int dy)
+{
+  char *tmp = malloc(WIDTH * HEIGHT * 4);
+  int row;
+
+  memcpy(tmp, fb, WIDTH * HEIGHT * 4);
+  for (row = 0; row < h; row++)
+    memcpy(fb + (y + row + dy) * WIDTH * 4 + (x + dx) * 4,
+           tmp + (y + row) * WIDTH * 4 + x * 4, w * 4);
+  free(tmp);
+}
+
+static rfbBool
+equalRegions(sraRegionPtr a, sraRegionPtr b)
+{
+  sraRegionPtr aMinusB = sraRgnCreateRgn(a), bMinusA = sraRgnCreateRgn(b);
+  rfbBool equal;
+
+  sraRgnSubtract(aMinusB, b);
+  sraRgnSubtract(bMinusA, a);
+  equal = sraRgnEmpty(aMinusB) && sraRgnEmpty(bMinusA);
+  sraRgnDestroy(aMinusB);
+  sraRgnDestroy(bMinusA);
+  return equal;
+}
+
+static rfbBool
+sameRegion(sraRegionPtr a, int x1, int y1, int x2, int y2)
+{
+  sraRegionPtr b = sraRgnCreateRect(x1, y1, x2, y2);
+  rfbBool same = a && equalRegions(a, b);
+
+  sraRgnDestroy(b);
+  return same;
+}
+
+static void
+findMove(rfbScreenInfoPtr screen)
+{
+  rfbCopyDetector *d = (rfbCopyDetector *)screen->copyDetector;
+  sraRegionPtr all = sraRgnCreateRect(0, 0, WIDTH, HEIGHT), moved, remaining;
+  int dx, dy;
+
+  /* the first call only takes the copy to compare with */
+  fill(screen->frameBuffer, 0, 0, WIDTH, HEIGHT);
+  remaining = rfbDetectCopies(screen, all);
+  check(equalRegions(remaining, all), "something was found without a copy");
+  sraRgnDestroy(remaining);
+  check(rfbCopyDetectorMatches(screen, d), "the copy was not taken");
+
+  /* scroll a window's contents up by 12 rows */
+  move(screen->frameBuffer, 16, 20, 80, 60, 0, -12);
+  fill(screen->frameBuffer, 16, 68, 96, 80);
+  moved = rfbFindMove(screen, d, 16, 8, 96, 80, &dx, &dy);
+  check(dx == 0 && dy == -12 && sameRegion(moved, 16, 8, 96, 68),
+        "a vertical scroll was not found");
+  if (moved)
+    sraRgnDestroy(moved);
+
+  /* what was found is left out of what is sent as modified */
+  moved = sraRgnCreateRect(16, 8, 96, 80);
+  remaining = rfbDetectCopies(screen, moved);
+  check(sameRegion(remaining, 16, 68, 96, 80), "the scrolled area was sent as modified");
+  sraRgnDestroy(remaining);
+  sraRgnDestroy(moved);
+
+  /* move a column of text right by 6 */
+  move(screen->frameBuffer, 40, 0, 50, HEIGHT, 6, 0);
+  fill(screen->frameBuffer, 40, 0, 46, HEIGHT);
+  moved = rfbFindMove(screen, d, 40, 0, 96, HEIGHT, &dx, &dy);
+  check(dx == 6 && dy == 0 && sameRegion(moved, 46, 0, 96, HEIGHT),
+        "a horizontal move was not found");
+  if (moved)
+    sraRgnDestroy(moved);
+
+  /* a single changed pixel breaks the match of its row */
+  rfbCopyDetectorSync(screen, d, all);
+  move(screen->frameBuffer, 0, 10, WIDTH, 60, 0, 20);
+  fill(screen->frameBuffer, 0, 10, WIDTH, 30);
+  fill(screen->frameBuffer, 50, 45, 51, 46);
+  moved = rfbFindMove(screen, d, 0, 10, WIDTH, 90, &dx, &dy);
+  remaining = sraRgnCreateRect(0, 30, WIDTH, 90);
+  sraRgnSubtract(remaining, moved ? moved : remaining);
+  check(dx == 0 && dy == 20 && sameRegion(remaining, 0, 45, WIDTH, 46),
+        "a changed pixel went unnoticed");
+  sraRgnDestroy(remaining);
+  if (moved)
+    sraRgnDestroy(moved);
+
+  /* nothing moved in a solid area */
+  rfbCopyDetectorSync(screen, d, all);
+  memset(screen->frameBuffer, 0x33, WIDTH * HEIGHT * 4);
+  moved = rfbFindMove(screen, d, 0, 0, WIDTH, HEIGHT, &dx, &dy);
+  check(!moved, "a move was found in a solid area");
+  if (moved)
+    sraRgnDestroy(moved);
+
+  sraRgnDestroy(all);
+}
+
+int
+main(int argc, char **argv)
+{
+  rfbScreenInfoPtr screen;
+
+  srand(1);
+  findShift();
+
+  screen = rfbGetScreen(&argc, argv, WIDTH, HEIGHT, 8, 3, 4);
+  if (!screen)
+    return 1;
+  screen->frameBuffer = calloc(WIDTH * HEIGHT, 4);
+  screen->detectCopies = TRUE;
+  check(screen->copyDetector != NULL, "the copy detector was not created up front");
+  if (screen->copyDetector)
+    findMove(screen);
+
+  free(screen->frameBuffer);
+  rfbScreenCleanup(screen);
+
+  printf("%s\n", failed ? "FAILED" : "OK");
+  return failed;
+}
@@ -0,0 +1,235 @@
+/*
+ * handshaketest - connect to an in-process server with a WebSockets client
+ * whose upgrade request comes in pieces, and finish the handshake of a
+ * plain RFB client, which also sends its parts in pieces, while the
+ * WebSockets client is still in the middle of its request. Neither may hold
+ * up the other.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "testserver.h"
+
+#define WIDTH 64
+#define HEIGHT 48
+/* long enough for the server to have handled what was sent */
+#define PAUSE_MS 200
+#define TIMEOUT_MS 5000
+
+/* the example of RFC 6455 */
+#define WS_KEY "dGhlIHNhbXBsZSBub25jZQ=="
+#define WS_ACCEPT "s3pPLMBiTxaQ9kYGzzhZRbK+xOo="
+
+static int
+connectToServer(void)
+{
+  struct sockaddr_in addr;
+  int sock = socket(AF_INET, SOCK_STREAM, 0);
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(testServer->port);
+  if (sock >= 0 && connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+static rfbBool
+sendPart(int sock, const void *data, size_t len)
+{
+  usleep(PAUSE_MS * 1000);
+  return write(sock, data, len) == (ssize_t)len;
+}
+
+static rfbBool
+readExact(int sock, void *data, size_t len)
+{
+  char *p = (char *)data;
+
+  while (len > 0) {
+    struct pollfd pfd;
+    ssize_t n;
+
+    pfd.fd = sock;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, TIMEOUT_MS) <= 0 || (n = read(sock, p, len)) <= 0)
+      return FALSE;
+    p += n;
+    len -= n;
+  }
+  return TRUE;
+}
+
+static rfbBool
+nothingToRead(int sock)
+{
+  struct pollfd pfd;
+
+  pfd.fd = sock;
+  pfd.events = POLLIN;
+  return poll(&pfd, 1, 0) == 0;
+}
+
+/* a plain RFB client gets the greeting and answers half of it */
+static rfbBool
+plainClientGreeting(int sock)
+{
+  char version[sz_rfbProtocolVersionMsg];
+
+  if (!readExact(sock, version, sz_rfbProtocolVersionMsg) ||
+      strncmp(version, "RFB 003.008\n", sz_rfbProtocolVersionMsg) != 0 ||
+      !sendPart(sock, "RFB 003", 7)) {
+    fprintf(stderr, "plain client: no protocol version\n");
+    return FALSE;
+  }
+  return TRUE;
+}
+
+/* and then the rest of its handshake, up to ServerInit */
+static rfbBool
+plainClientHandshake(int sock)
+{
+  char types[256];
+  uint8_t count, type = rfbSecTypeNone, shared = 1;
+  uint32_t result;
+  rfbServerInitMsg si;
+  int i;
+
+  if (!sendPart(sock, ".008\n", 5) ||
+      !readExact(sock, &count, 1) || count == 0 || !readExact(sock, types, count)) {
+    fprintf(stderr, "plain client: no security types\n");
+    return FALSE;
+  }
+  for (i = 0; i < count && types[i] != rfbSecTypeNone; i++)
+    ;
+  if (i == count) {
+    fprintf(stderr, "plain client: no security type None\n");
+    return FALSE;
+  }
+  if (!sendPart(sock, &type, 1) || !readExact(sock, &result, 4) || result != 0 ||
+      !sendPart(sock, &shared, 1) || !readExact(sock, &si, sz_rfbServerInitMsg)) {
+    fprintf(stderr, "plain client: no ServerInit\n");
+    return FALSE;
+  }
+  if (ntohs(si.framebufferWidth) != WIDTH || ntohs(si.framebufferHeight) != HEIGHT) {
+    fprintf(stderr, "plain client: ServerInit for %dx%d\n",
+            ntohs(si.framebufferWidth), ntohs(si.framebufferHeight));
+    return FALSE;
+  }
+  return TRUE;
+}
+
+/* the rest of the upgrade request, then the RFB greeting in a frame */
+static rfbBool
+wsClientUpgrade(int sock)
+{
+  static const char rest[] =
+    "y: " WS_KEY "\r\n"
+    "Origin: http://localhost\r\n"
+    "Sec-WebSocket-Protocol: binary\r\n"
+    "Sec-WebSocket-Version: 13\r\n"
+    "\r";
+  char response[1024], frame[2 + sz_rfbProtocolVersionMsg];
+  size_t len = 0;
+
+  /* the end of the request is split up as well */
+  if (!sendPart(sock, rest, sizeof(rest) - 1) || !sendPart(sock, "\n", 1)) {
+    fprintf(stderr, "WebSockets client: could not send\n");
+    return FALSE;
+  }
+  while (len < 4 || memcmp(response + len - 4, "\r\n\r\n", 4) != 0) {
+    if (len == sizeof(response) - 1 || !readExact(sock, response + len, 1)) {
+      fprintf(stderr, "WebSockets client: no response\n");
+      return FALSE;
+    }
+    len++;
+  }
+  response[len] = '\0';
+  if (strncmp(response, "HTTP/1.1 101 ", 13) != 0 || !strstr(response, WS_ACCEPT)) {
+    fprintf(stderr, "WebSockets client: response '%s'\n", response);
+    return FALSE;
+  }
+
+  if (!readExact(sock, frame, sizeof(frame)) || (unsigned char)frame[0] != 0x82 ||
+      frame[1] != sz_rfbProtocolVersionMsg ||
+      strncmp(frame + 2, "RFB 003.008\n", sz_rfbProtocolVersionMsg) != 0) {
+    fprintf(stderr, "WebSockets client: no protocol version\n");
+    return FALSE;
+  }
+  return TRUE;
+}
+
+/* the answer to the greeting, in a frame which arrives in two parts */
+static rfbBool
+wsClientHandshake(int sock)
+{
+  unsigned char header[6] = { 0x82, 0x80 | sz_rfbProtocolVersionMsg, 1, 2, 3, 4 };
+  char payload[sz_rfbProtocolVersionMsg], frame[3];
+  int i;
+
+  for (i = 0; i < sz_rfbProtocolVersionMsg; i++)
+    payload[i] = "RFB 003.008\n"[i] ^ header[2 + i % 4];
+  if (!sendPart(sock, header, sizeof(header)) || !sendPart(sock, payload, sizeof(payload)) ||
+      !readExact(sock, frame, 3) || (unsigned char)frame[0] != 0x82 || frame[1] < 2 ||
+      frame[2] == 0) {
+    fprintf(stderr, "WebSockets client: no security types\n");
+    return FALSE;
+  }
+  return TRUE;
+}
+
+int
+main(int argc, char **argv)
+{
+  static const char start[] =
+    "GET / HTTP/1.1\r\n"
+    "Host: localhost\r\n"
+    "Upgrade: websocket\r\n"
+    "Connection: Upgrade\r\n"
+    "Sec-WebSocket-Ke";
+  int ws, plain, failed = 0;
+
+  if (!testServerStart(&argc, argv, WIDTH, HEIGHT))
+    return 1;
+
+  ws = connectToServer();
+  plain = connectToServer();
+  if (ws < 0 || plain < 0) {
+    fprintf(stderr, "could not connect\n");
+    return 1;
+  }
+
+  /* right away, or it is taken for a plain RFB client */
+  if (write(ws, start, sizeof(start) - 1) != sizeof(start) - 1)
+    failed = 1;
+  /* each of them finishes a step while the other is in the middle of one */
+  if (!failed && !plainClientGreeting(plain))
+    failed = 1;
+  if (!failed && !nothingToRead(ws)) {
+    fprintf(stderr, "WebSockets client: answered before its request was complete\n");
+    failed = 1;
+  }
+  if (!failed && !wsClientUpgrade(ws))
+    failed = 1;
+  if (!failed && !plainClientHandshake(plain))
+    failed = 1;
+  if (!failed && !wsClientHandshake(ws))
+    failed = 1;
+
+  close(ws);
+  close(plain);
+  testServerStop();
+  testServerCleanup();
+
+  printf("%s\n", failed ? "FAILED" : "OK");
+  return failed;
+}
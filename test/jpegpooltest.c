@@ -0,0 +1,450 @@
+/*
+ * jpegpooltest - send the same Tight updates full of JPEG rectangles to a
+ * client decoding them on jpegDecodeThreads and to one decoding them
+ * while reading, and check that both end up with the same framebuffer
+ * after every update and report the same rectangles for it.
+ *
+ * A small scripted server sends, in this order:
+ *  - one large JPEG rectangle and several small ones after it, which the
+ *    threads finish before the large one,
+ *  - JPEG rectangles overdrawn by Tight fills and by other JPEG ones,
+ *  - a CopyRect and a Raw rectangle after JPEG ones, which need their
+ *    pixels in place.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <rfb/rfbclient.h>
+#include "turbojpeg.h"
+
+#define WIDTH 512
+#define HEIGHT 384
+#define UPDATES 4
+#define MAX_REPORTS 64
+#define THREADS 4
+
+typedef struct {
+  int x, y, w, h;
+} Rect;
+
+/* what a client saw, for each update */
+typedef struct {
+  char *frameBuffers[UPDATES];
+  Rect reports[UPDATES][MAX_REPORTS];
+  int nReports[UPDATES];
+  int updates;
+  rfbBool overflow;
+} Seen;
+
+static unsigned char *picture;
+
+typedef struct {
+  char *data;
+  size_t len, size;
+} Buffer;
+
+static void
+put(Buffer *b, const void *data, size_t len)
+{
+  if (b->len + len > b->size) {
+    b->size = (b->len + len) * 2;
+    b->data = realloc(b->data, b->size);
+  }
+  memcpy(b->data + b->len, data, len);
+  b->len += len;
+}
+
+static void
+put8(Buffer *b, int v)
+{
+  unsigned char c = (unsigned char)v;
+  put(b, &c, 1);
+}
+
+static void
+put16(Buffer *b, int v)
+{
+  put8(b, v >> 8);
+  put8(b, v);
+}
+
+static void
+put32(Buffer *b, uint32_t v)
+{
+  put16(b, (int)(v >> 16));
+  put16(b, (int)(v & 0xffff));
+}
+
+static void
+putRectHeader(Buffer *b, int x, int y, int w, int h, uint32_t encoding)
+{
+  put16(b, x);
+  put16(b, y);
+  put16(b, w);
+  put16(b, h);
+  put32(b, encoding);
+}
+
+static void
+putUpdateHeader(Buffer *b, int nRects)
+{
+  put8(b, rfbFramebufferUpdate);
+  put8(b, 0);
+  put16(b, nRects);
+}
+
+/* a part of the picture as a Tight JPEG rectangle */
+static void
+putJpeg(Buffer *b, int x, int y, int w, int h)
+{
+  tjhandle tj = tjInitCompress();
+  /* this TurboJPEG writes into a buffer of tjBufSize() */
+  unsigned char *jpeg = malloc(tjBufSize(w, h, TJSAMP_420));
+  unsigned long len = 0;
+
+  if (!tj || !jpeg || tjCompress2(tj, picture + (y * WIDTH + x) * 4, w, WIDTH * 4, h, TJPF_RGBX,
+                         &jpeg, &len, TJSAMP_420, 90, 0) == -1) {
+    fprintf(stderr, "could not compress: %s\n", tjGetErrorStr());
+    exit(1);
+  }
+  putRectHeader(b, x, y, w, h, rfbEncodingTight);
+  put8(b, rfbTightJpeg << 4);
+  /* the compact length */
+  put8(b, (int)((len & 0x7f) | (len > 0x7f ? 0x80 : 0)));
+  if (len > 0x7f) {
+    put8(b, (int)(((len >> 7) & 0x7f) | (len > 0x3fff ? 0x80 : 0)));
+    if (len > 0x3fff)
+      put8(b, (int)(len >> 14));
+  }
+  put(b, jpeg, len);
+  free(jpeg);
+  tjDestroy(tj);
+}
+
+static void
+putFill(Buffer *b, int x, int y, int w, int h, int r, int g, int bl)
+{
+  putRectHeader(b, x, y, w, h, rfbEncodingTight);
+  put8(b, rfbTightFill << 4);
+  put8(b, r);
+  put8(b, g);
+  put8(b, bl);
+}
+
+static void
+putCopyRect(Buffer *b, int x, int y, int w, int h, int srcX, int srcY)
+{
+  putRectHeader(b, x, y, w, h, rfbEncodingCopyRect);
+  put16(b, srcX);
+  put16(b, srcY);
+}
+
+/* in the client's pixel format, red in the lowest byte */
+static void
+putRaw(Buffer *b, int x, int y, int w, int h)
+{
+  int i, j;
+
+  putRectHeader(b, x, y, w, h, rfbEncodingRaw);
+  for (j = y; j < y + h; j++)
+    for (i = x; i < x + w; i++) {
+      put(b, picture + (j * WIDTH + i) * 4, 3);
+      put8(b, 0);
+    }
+}
+
+static Buffer
+makeUpdates(void)
+{
+  Buffer b = { NULL, 0, 0 };
+  int i;
+
+  /* the small ones are done long before the large one */
+  putUpdateHeader(&b, 5);
+  putJpeg(&b, 0, 0, WIDTH, 256);
+  for (i = 0; i < 4; i++)
+    putJpeg(&b, i * 128, 256, 128, 128);
+
+  /* Tight rectangles drawing over queued JPEG ones */
+  putUpdateHeader(&b, 5);
+  putJpeg(&b, 0, 0, WIDTH, HEIGHT);
+  putFill(&b, 32, 32, 64, 64, 255, 0, 0);
+  putJpeg(&b, 128, 128, 128, 128);
+  putJpeg(&b, 192, 192, 128, 128);
+  putFill(&b, 200, 200, 16, 16, 0, 255, 0);
+
+  /* other encodings reading or writing pixels of queued JPEG ones */
+  putUpdateHeader(&b, 5);
+  putJpeg(&b, 0, 0, 256, HEIGHT);
+  putCopyRect(&b, 256, 0, 256, HEIGHT, 0, 0);
+  putJpeg(&b, 0, 0, 128, 128);
+  putRaw(&b, 64, 64, 128, 32);
+  putJpeg(&b, 256, 256, 256, 128);
+
+  /* JPEG rectangles which do not touch each other */
+  putUpdateHeader(&b, 6);
+  for (i = 0; i < 6; i++)
+    putJpeg(&b, (i % 3) * 160 + 8, (i / 3) * 192 + 8, 144, 176);
+
+  return b;
+}
+
+/* a picture that takes JPEG some effort */
+static void
+makePicture(void)
+{
+  uint32_t seed = 12345;
+  int x, y;
+
+  picture = malloc(WIDTH * HEIGHT * 4);
+  for (y = 0; y < HEIGHT; y++)
+    for (x = 0; x < WIDTH; x++) {
+      unsigned char *p = picture + (y * WIDTH + x) * 4;
+      seed = seed * 1103515245 + 12345;
+      p[0] = (unsigned char)(x + (seed >> 28));
+      p[1] = (unsigned char)(y * 2 + (seed >> 27));
+      p[2] = (unsigned char)((x ^ y) + (seed >> 26));
+      p[3] = 0;
+    }
+}
+
+typedef struct {
+  int listenSock;
+  Buffer *updates;
+} Server;
+
+static rfbBool
+readExactly(int sock, int len)
+{
+  char buf[64];
+
+  while (len > 0) {
+    int n = (int)read(sock, buf, len < (int)sizeof(buf) ? len : (int)sizeof(buf));
+    if (n <= 0)
+      return FALSE;
+    len -= n;
+  }
+  return TRUE;
+}
+
+/* RFB 3.8 without security, then the updates whatever the client asks */
+static void *
+runServer(void *arg)
+{
+  Server *server = (Server *)arg;
+  Buffer b = { NULL, 0, 0 };
+  char buf[256];
+  int sock = accept(server->listenSock, NULL, NULL);
+
+  if (sock < 0)
+    return NULL;
+
+  put(&b, "RFB 003.008\n", 12);
+  put8(&b, 1);
+  put8(&b, rfbSecTypeNone);
+  if (write(sock, b.data, b.len) != (ssize_t)b.len || !readExactly(sock, 12 + 1))
+    goto done;
+
+  b.len = 0;
+  put32(&b, rfbVncAuthOK);
+  if (write(sock, b.data, b.len) != (ssize_t)b.len || !readExactly(sock, 1))
+    goto done;
+
+  b.len = 0;
+  put16(&b, WIDTH);
+  put16(&b, HEIGHT);
+  put8(&b, 32);         /* bits per pixel */
+  put8(&b, 24);         /* depth */
+  put8(&b, 0);          /* little endian */
+  put8(&b, 1);          /* true colour */
+  put16(&b, 255);
+  put16(&b, 255);
+  put16(&b, 255);
+  put8(&b, 0);
+  put8(&b, 8);
+  put8(&b, 16);
+  put8(&b, 0);
+  put8(&b, 0);
+  put8(&b, 0);
+  put32(&b, 4);
+  put(&b, "test", 4);
+  put(&b, server->updates->data, server->updates->len);
+  if (write(sock, b.data, b.len) != (ssize_t)b.len)
+    goto done;
+
+  /* leave the rest of what the client sends unread only once it is gone */
+  shutdown(sock, SHUT_WR);
+  while (read(sock, buf, sizeof(buf)) > 0)
+    ;
+done:
+  free(b.data);
+  close(sock);
+  return NULL;
+}
+
+static void
+gotUpdate(rfbClient *client, int x, int y, int w, int h)
+{
+  Seen *seen = rfbClientGetClientData(client, gotUpdate);
+  int u = seen->updates;
+
+  if (u >= UPDATES || seen->nReports[u] >= MAX_REPORTS) {
+    seen->overflow = TRUE;
+    return;
+  }
+  seen->reports[u][seen->nReports[u]].x = x;
+  seen->reports[u][seen->nReports[u]].y = y;
+  seen->reports[u][seen->nReports[u]].w = w;
+  seen->reports[u][seen->nReports[u]].h = h;
+  seen->nReports[u]++;
+}
+
+static void
+finished(rfbClient *client)
+{
+  Seen *seen = rfbClientGetClientData(client, gotUpdate);
+
+  if (seen->updates >= UPDATES) {
+    seen->overflow = TRUE;
+    return;
+  }
+  seen->frameBuffers[seen->updates] = malloc(WIDTH * HEIGHT * 4);
+  memcpy(seen->frameBuffers[seen->updates], client->frameBuffer, WIDTH * HEIGHT * 4);
+  seen->updates++;
+}
+
+static rfbBool
+receive(int threads, Buffer *updates, Seen *seen)
+{
+  struct sockaddr_in addr;
+  socklen_t addrLen = sizeof(addr);
+  pthread_t serverThread;
+  Server server;
+  rfbClient *client;
+  char port[32], *args[2];
+  int argn = 2;
+  rfbBool ok = TRUE;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  server.listenSock = socket(AF_INET, SOCK_STREAM, 0);
+  server.updates = updates;
+  if (server.listenSock < 0 ||
+      bind(server.listenSock, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      listen(server.listenSock, 1) != 0 ||
+      getsockname(server.listenSock, (struct sockaddr *)&addr, &addrLen) != 0) {
+    perror("listen");
+    return FALSE;
+  }
+  pthread_create(&serverThread, NULL, runServer, &server);
+
+  sprintf(port, "127.0.0.1:%d", ntohs(addr.sin_port));
+  args[0] = "jpegpooltest";
+  args[1] = port;
+  client = rfbGetClient(8, 3, 4);
+  client->jpegDecodeThreads = threads;
+  client->GotFrameBufferUpdate = gotUpdate;
+  client->FinishedFrameBufferUpdate = finished;
+  rfbClientSetClientData(client, gotUpdate, seen);
+  if (!rfbInitClient(client, &argn, args)) {
+    fprintf(stderr, "could not connect\n");
+    close(server.listenSock);
+    pthread_join(serverThread, NULL);
+    return FALSE;
+  }
+
+  while (seen->updates < UPDATES)
+    if (WaitForMessage(client, 1000000) <= 0 || !HandleRFBServerMessage(client)) {
+      fprintf(stderr, "%d threads: only %d updates came through\n", threads, seen->updates);
+      ok = FALSE;
+      break;
+    }
+  if (threads > 1 && !client->jpegPool) {
+    fprintf(stderr, "no JPEG decoding threads were started\n");
+    ok = FALSE;
+  }
+
+  free(client->frameBuffer);
+  rfbClientCleanup(client);
+  pthread_join(serverThread, NULL);
+  close(server.listenSock);
+  return ok;
+}
+
+static int
+compareRects(const void *a, const void *b)
+{
+  return memcmp(a, b, sizeof(Rect));
+}
+
+/* not all decoders leave the unused fourth byte alone */
+static rfbBool
+sameFramebuffer(const char *a, const char *b)
+{
+  int i;
+
+  for (i = 0; i < WIDTH * HEIGHT; i++)
+    if (((a[i * 4] ^ b[i * 4]) | (a[i * 4 + 1] ^ b[i * 4 + 1]) | (a[i * 4 + 2] ^ b[i * 4 + 2])) != 0)
+      return FALSE;
+  return TRUE;
+}
+
+int
+main(int argc, char **argv)
+{
+  static Seen serial, parallel;
+  Buffer updates;
+  int u, failed = 0;
+
+  makePicture();
+  updates = makeUpdates();
+
+  if (!receive(0, &updates, &serial) || !receive(THREADS, &updates, &parallel))
+    failed = 1;
+  if (serial.overflow || parallel.overflow) {
+    fprintf(stderr, "more was reported than sent\n");
+    failed = 1;
+  }
+
+  for (u = 0; !failed && u < UPDATES; u++) {
+    if (!sameFramebuffer(serial.frameBuffers[u], parallel.frameBuffers[u])) {
+      fprintf(stderr, "update %d: the framebuffers differ\n", u);
+      failed = 1;
+    }
+
+    /* all JPEG rectangles come in the order they were sent */
+    if (u == 0 && (serial.nReports[u] != parallel.nReports[u] ||
+                   memcmp(serial.reports[u], parallel.reports[u],
+                          serial.nReports[u] * sizeof(Rect)) != 0)) {
+      fprintf(stderr, "update %d: the rectangles were reported out of order\n", u);
+      failed = 1;
+    }
+
+    /* reported before FinishedFrameBufferUpdate, though maybe later */
+    qsort(serial.reports[u], serial.nReports[u], sizeof(Rect), compareRects);
+    qsort(parallel.reports[u], parallel.nReports[u], sizeof(Rect), compareRects);
+    if (serial.nReports[u] != parallel.nReports[u] ||
+        memcmp(serial.reports[u], parallel.reports[u], serial.nReports[u] * sizeof(Rect)) != 0) {
+      fprintf(stderr, "update %d: %d rectangles reported instead of %d\n",
+              u, parallel.nReports[u], serial.nReports[u]);
+      failed = 1;
+    }
+  }
+
+  for (u = 0; u < UPDATES; u++) {
+    free(serial.frameBuffers[u]);
+    free(parallel.frameBuffers[u]);
+  }
+  free(updates.data);
+  free(picture);
+
+  printf("%s\n", failed ? "FAILED" : "OK");
+  return failed;
+}
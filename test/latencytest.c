@@ -0,0 +1,253 @@
+/*
+ * latencytest - measure the round trip to an in-process server with
+ * SendLatencyProbe(). The server gets fence support from a protocol
+ * extension which answers every fence after a fixed delay, so the latency
+ * reported has to be at least that. Probes must not be sent before the
+ * server announced fences, several may be in flight at once, and fences
+ * which are not probes must still reach GotFence.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <rfb/rfb.h>
+#include <rfb/rfbclient.h>
+
+#define WIDTH 64
+#define HEIGHT 64
+#define DELAY_MS 100
+#define PROBES 3
+#define TIMEOUT_SECONDS 10
+
+static rfbScreenInfoPtr server;
+
+/* shared between the server thread and the client */
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static rfbBool shutdownRequested;
+static rfbBool serverFenceAnswered;
+
+static int latencies;
+static unsigned int lastLatency;
+static int fences;
+
+static void
+sendFence(rfbClientPtr cl, uint32_t flags, const char *data, int len)
+{
+  char buf[sz_rfbFenceMsg + rfbFenceMaxPayload];
+  rfbFenceMsg f;
+
+  memset(&f, 0, sizeof(f));
+  f.type = rfbFence;
+  f.flags = Swap32IfLE(flags);
+  f.length = len;
+  memcpy(buf, &f, sz_rfbFenceMsg);
+  memcpy(buf + sz_rfbFenceMsg, data, len);
+  rfbWriteExact(cl, buf, sz_rfbFenceMsg + len);
+}
+
+static rfbBool
+newClient(rfbClientPtr cl, void **data)
+{
+  return TRUE;
+}
+
+/* a client asking for fences gets a request, as the protocol wants */
+static rfbBool
+enableFence(rfbClientPtr cl, void **data, int encoding)
+{
+  if (encoding != (int)rfbEncodingFence)
+    return FALSE;
+  sendFence(cl, rfbFenceFlagRequest, "srv", 3);
+  return TRUE;
+}
+
+/* answer requests after DELAY_MS, note the answer to our own */
+static rfbBool
+handleFence(rfbClientPtr cl, void *data, const rfbClientToServerMsg *message)
+{
+  rfbFenceMsg f;
+  char payload[256];
+  uint32_t flags;
+
+  if (message->type != rfbFence)
+    return FALSE;
+  f.type = rfbFence;
+  if (rfbReadExact(cl, (char *)&f + 1, sz_rfbFenceMsg - 1) <= 0 ||
+      (f.length > 0 && rfbReadExact(cl, payload, f.length) <= 0)) {
+    rfbCloseClient(cl);
+    return TRUE;
+  }
+
+  flags = Swap32IfLE(f.flags);
+  if (flags & rfbFenceFlagRequest) {
+    usleep(DELAY_MS * 1000);
+    sendFence(cl, flags & ~rfbFenceFlagRequest, payload, f.length);
+  } else if (f.length == 3 && memcmp(payload, "srv", 3) == 0) {
+    pthread_mutex_lock(&mutex);
+    serverFenceAnswered = TRUE;
+    pthread_mutex_unlock(&mutex);
+  }
+  return TRUE;
+}
+
+static int fencePseudoEncodings[] = { (int)rfbEncodingFence, 0 };
+
+static rfbProtocolExtension fenceExtension = {
+  newClient,
+  NULL,
+  fencePseudoEncodings,
+  enableFence,
+  handleFence,
+  NULL,
+  NULL,
+  NULL,
+  NULL
+};
+
+static void *
+runServer(void *arg)
+{
+  for (;;) {
+    rfbBool done;
+
+    pthread_mutex_lock(&mutex);
+    done = shutdownRequested;
+    pthread_mutex_unlock(&mutex);
+    if (done)
+      break;
+    rfbProcessEvents(server, 10000);
+  }
+  rfbShutdownServer(server, TRUE);
+  return NULL;
+}
+
+static void
+gotLatency(rfbClient *client, unsigned int usec)
+{
+  latencies++;
+  lastLatency = usec;
+}
+
+static void
+gotFence(rfbClient *client, uint32_t flags, const char *data, int len)
+{
+  fences++;
+}
+
+/* handle messages until *count reaches n */
+static rfbBool
+waitFor(rfbClient *client, int *count, int n)
+{
+  time_t start = time(NULL);
+
+  while (*count < n) {
+    if (time(NULL) - start > TIMEOUT_SECONDS)
+      return FALSE;
+    if (WaitForMessage(client, 10000) > 0 && !HandleRFBServerMessage(client))
+      return FALSE;
+  }
+  return TRUE;
+}
+
+int
+main(int argc, char **argv)
+{
+  pthread_t serverThread;
+  rfbClient *client;
+  char port[32], *args[2];
+  int argn = 2, i, failed = 0;
+  time_t start;
+
+  rfbRegisterProtocolExtension(&fenceExtension);
+  server = rfbGetScreen(&argc, argv, WIDTH, HEIGHT, 8, 3, 4);
+  if (!server)
+    return 1;
+  server->frameBuffer = calloc(WIDTH * HEIGHT, 4);
+  server->cursor = NULL;
+  server->autoPort = TRUE;
+  server->ipv6port = 0;
+  rfbInitServer(server);
+  pthread_create(&serverThread, NULL, runServer, NULL);
+
+  sprintf(port, "127.0.0.1:%d", server->port);
+  args[0] = "latencytest";
+  args[1] = port;
+  client = rfbGetClient(8, 3, 4);
+  client->GotLatency = gotLatency;
+  client->GotFence = gotFence;
+  if (!rfbInitClient(client, &argn, args)) {
+    fprintf(stderr, "could not connect\n");
+    return 1;
+  }
+
+  /* nothing was handled yet, so the client cannot know about fences */
+  if (SendLatencyProbe(client)) {
+    fprintf(stderr, "a probe was sent before the server announced fences\n");
+    failed = 1;
+  }
+
+  start = time(NULL);
+  for (;;) {
+    rfbBool answered;
+
+    pthread_mutex_lock(&mutex);
+    answered = serverFenceAnswered;
+    pthread_mutex_unlock(&mutex);
+    if (answered)
+      break;
+    if (time(NULL) - start > TIMEOUT_SECONDS ||
+        (WaitForMessage(client, 10000) > 0 && !HandleRFBServerMessage(client))) {
+      fprintf(stderr, "the fence of the server was not answered\n");
+      failed = 1;
+      break;
+    }
+  }
+
+  /* one probe, then several in flight */
+  if (!failed && (!SendLatencyProbe(client) || !waitFor(client, &latencies, 1))) {
+    fprintf(stderr, "the probe did not come back\n");
+    failed = 1;
+  }
+  for (i = 0; !failed && i < PROBES; i++)
+    if (!SendLatencyProbe(client)) {
+      fprintf(stderr, "could not send probe %d\n", i);
+      failed = 1;
+    }
+  if (!failed && !waitFor(client, &latencies, 1 + PROBES)) {
+    fprintf(stderr, "%d of %d probes came back\n", latencies, 1 + PROBES);
+    failed = 1;
+  }
+  if (!failed && (lastLatency < DELAY_MS * 1000 || lastLatency > TIMEOUT_SECONDS * 1000000u ||
+                  client->latency != lastLatency)) {
+    fprintf(stderr, "latency of %u us, the server waits %d ms\n", lastLatency, DELAY_MS);
+    failed = 1;
+  }
+
+  /* other fences are not taken for probes */
+  if (!failed && (!SendFence(client, rfbFenceFlagRequest, "other", 5) ||
+                  !waitFor(client, &fences, 1))) {
+    fprintf(stderr, "the fence did not come back\n");
+    failed = 1;
+  }
+  if (!failed && latencies != 1 + PROBES) {
+    fprintf(stderr, "a fence was taken for a probe\n");
+    failed = 1;
+  }
+
+  pthread_mutex_lock(&mutex);
+  shutdownRequested = TRUE;
+  pthread_mutex_unlock(&mutex);
+  pthread_join(serverThread, NULL);
+
+  free(client->frameBuffer);
+  rfbClientCleanup(client);
+  free(server->frameBuffer);
+  rfbScreenCleanup(server);
+  rfbUnregisterProtocolExtension(&fenceExtension);
+
+  printf("%s\n", failed ? "FAILED" : "OK");
+  return failed;
+}
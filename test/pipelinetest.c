@@ -0,0 +1,139 @@
+/*
+ * pipelinetest - receive from an in-process server with pipelineReceive
+ * and check that every framebuffer follows the server's, that the receive
+ * thread keeps reading while nothing is decoded, and that the end of the
+ * connection comes through.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include "testserver.h"
+
+#define WIDTH 800
+#define HEIGHT 600
+#define ROUNDS 20
+
+static const char *encodings[] = {
+  "raw", "hextile", "corre", "rre",
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+  "zlib", "zrle", "trle", "tight",
+#endif
+};
+#define NUMBER_OF_CLIENTS (int)(sizeof(encodings) / sizeof(encodings[0]))
+
+static rfbClient *clients[NUMBER_OF_CLIENTS];
+
+/* handle what arrived for each client, FALSE if one of them failed */
+static rfbBool
+handleMessages(void)
+{
+  int i;
+
+  for (i = 0; i < NUMBER_OF_CLIENTS; i++)
+    while (WaitForMessage(clients[i], 0) > 0)
+      if (!HandleRFBServerMessage(clients[i])) {
+        fprintf(stderr, "%s client failed\n", encodings[i]);
+        return FALSE;
+      }
+  return TRUE;
+}
+
+/*
+ * Without decoding anything, wait until the sockets are empty: the receive
+ * threads must have taken all of the first, full update off them.
+ */
+static rfbBool
+socketsDrained(void)
+{
+  int i, tries, pending = 0;
+
+  for (tries = 0; tries < 50; tries++) {
+    usleep(100000);
+    pending = 0;
+    for (i = 0; i < NUMBER_OF_CLIENTS; i++) {
+      int n = 0;
+      if (ioctl(clients[i]->sock, FIONREAD, &n) == 0)
+        pending += n;
+    }
+    if (tries >= 5 && pending == 0)
+      return TRUE;
+  }
+  fprintf(stderr, "%d bytes left on the sockets\n", pending);
+  return FALSE;
+}
+
+int
+main(int argc, char **argv)
+{
+  int i, round, failed = 0;
+
+  if (!testServerStart(&argc, argv, WIDTH, HEIGHT))
+    return 1;
+
+  for (i = 0; i < NUMBER_OF_CLIENTS; i++) {
+    clients[i] = rfbGetClient(8, 3, 4);
+    clients[i]->appData.encodingsString = encodings[i];
+    clients[i]->appData.enableJPEG = FALSE;
+    clients[i]->pipelineReceive = TRUE;
+    if (!testClientConnect(clients[i], "pipelinetest")) {
+      fprintf(stderr, "could not connect client %d\n", i);
+      return 1;
+    }
+    if (!clients[i]->receiveQueue) {
+      fprintf(stderr, "client %d receives without a thread\n", i);
+      return 1;
+    }
+  }
+
+  for (round = 0; round < ROUNDS && !failed; round++) {
+    time_t start = time(NULL);
+    int done = 0;
+    rfbBool same[NUMBER_OF_CLIENTS];
+
+    testServerPaint();
+    if (round == 0 && !socketsDrained())
+      failed = 1;
+    memset(same, 0, sizeof(same));
+    while (!failed && done < NUMBER_OF_CLIENTS) {
+      if (time(NULL) - start > SECONDS_PER_ROUND || !handleMessages()) {
+        failed = 1;
+        break;
+      }
+      for (i = 0; i < NUMBER_OF_CLIENTS; i++)
+        if (!same[i] && testClientCaughtUp(clients[i])) {
+          same[i] = TRUE;
+          done++;
+        }
+      usleep(1000);
+    }
+    if (failed)
+      for (i = 0; i < NUMBER_OF_CLIENTS; i++)
+        if (!same[i])
+          fprintf(stderr, "round %d: %s client did not catch up\n", round, encodings[i]);
+  }
+
+  /* once the server goes away, every client notices */
+  testServerStop();
+  for (i = 0; i < NUMBER_OF_CLIENTS; i++) {
+    int tries;
+    for (tries = 0; tries < 50; tries++) {
+      if (WaitForMessage(clients[i], 100000) > 0 && !HandleRFBServerMessage(clients[i]))
+        break;
+    }
+    if (tries == 50) {
+      fprintf(stderr, "%s client did not see the connection end\n", encodings[i]);
+      failed = 1;
+    }
+    free(clients[i]->frameBuffer);
+    rfbClientCleanup(clients[i]);
+  }
+
+  testServerCleanup();
+
+  printf("%s\n", failed ? "FAILED" : "OK");
+  return failed;
+}
@@ -0,0 +1,369 @@
+/*
+ * replaybench - replay a recorded session into LibVNCServer and measure
+ * what the encoders make of it.
+ *
+ * The recording, written by vncrec or rfbVNCRecStart(), is played with
+ * LibVNCClient as fast as it decodes. The rectangles of each update in it
+ * are marked as modified on a screen sharing the player's framebuffer and
+ * sent to a client whose output is only counted, so neither decoding nor
+ * the network take part in the numbers. For every encoding configuration
+ * given, this reports the CPU time and bytes the updates took and how long
+ * sending each of them took.
+ *
+ * usage: replaybench [-v] recording configuration...
+ *
+ * A configuration is a list of encodings separated by '+', in order of
+ * preference, followed by options separated by ',':
+ *
+ *   cN        compression level N
+ *   qN        quality level N
+ *   adaptive  set adaptiveEncoding, which picks among the encodings
+ *   copies    set detectCopies
+ *
+ * for example "hextile", "tight,c6,q8" or "tight+zrle,q7,adaptive".
+ */
+
+#ifdef __STRICT_ANSI__
+#define _BSD_SOURCE
+#define _POSIX_C_SOURCE 200112L
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <rfb/rfb.h>
+#include <rfb/rfbclient.h>
+#include <rfb/rfbregion.h>
+
+#define MAX_CONFIG_ENCODINGS 16
+
+typedef struct { const char *name; uint32_t id; } encoding_t;
+static const encoding_t knownEncodings[] = {
+  { "raw", rfbEncodingRaw },
+  { "rre", rfbEncodingRRE },
+  { "corre", rfbEncodingCoRRE },
+  { "hextile", rfbEncodingHextile },
+  { "ultra", rfbEncodingUltra },
+  { "zlib", rfbEncodingZlib },
+  { "zlibhex", rfbEncodingZlibHex },
+  { "tight", rfbEncodingTight },
+  { "zrle", rfbEncodingZRLE },
+  { "zywrle", rfbEncodingZYWRLE },
+  { "h264", rfbEncodingH264 },
+  { NULL, 0 }
+};
+
+typedef struct {
+  const char *spec;
+  uint32_t encodings[MAX_CONFIG_ENCODINGS];
+  int nEncodings;
+  int compressLevel, qualityLevel;  /* -1 for the server's default */
+  rfbBool adaptive, copies;
+} config_t;
+
+typedef struct {
+  rfbScreenInfoPtr screen;
+  rfbClientPtr sink;
+  int peer;                         /* our end of the sink's socket */
+  MallocFrameBufferProc mallocFrameBuffer;
+  sraRegionPtr damage;
+  int frames;
+  double cpu;                       /* seconds */
+  double *latency;                  /* of every update, in seconds */
+  int latencySize;
+  rfbBool failed;
+} replay_t;
+
+static int replayTag;
+static unsigned long sinkBytes;
+
+static int sinkWrite(rfbClientPtr cl, const char *buf, int len)
+{
+  sinkBytes += len;
+  return len;
+}
+
+static double cpuTime(void)
+{
+#ifdef CLOCK_THREAD_CPUTIME_ID
+  struct timespec ts;
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0)
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+  return (double)clock() / CLOCKS_PER_SEC;
+}
+
+static double wallTime(void)
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static rfbBool parseConfig(const char *spec, config_t *config)
+{
+  char *copy = strdup(spec), *options, *name, *saveptr = NULL;
+  int i;
+
+  memset(config, 0, sizeof(*config));
+  config->spec = spec;
+  config->compressLevel = config->qualityLevel = -1;
+
+  options = strchr(copy, ',');
+  if (options)
+    *options++ = 0;
+
+  for (name = strtok_r(copy, "+", &saveptr); name; name = strtok_r(NULL, "+", &saveptr)) {
+    for (i = 0; knownEncodings[i].name && strcmp(knownEncodings[i].name, name); i++)
+      ;
+    if (!knownEncodings[i].name || config->nEncodings == MAX_CONFIG_ENCODINGS) {
+      fprintf(stderr, "%s: unknown encoding %s\n", spec, name);
+      free(copy);
+      return FALSE;
+    }
+    config->encodings[config->nEncodings++] = knownEncodings[i].id;
+  }
+
+  for (name = options ? strtok_r(options, ",", &saveptr) : NULL; name; name = strtok_r(NULL, ",", &saveptr)) {
+    if (name[0] == 'c' && name[1] >= '0' && name[1] <= '9')
+      config->compressLevel = atoi(name + 1);
+    else if (name[0] == 'q' && name[1] >= '0' && name[1] <= '9')
+      config->qualityLevel = atoi(name + 1);
+    else if (!strcmp(name, "adaptive"))
+      config->adaptive = TRUE;
+    else if (!strcmp(name, "copies"))
+      config->copies = TRUE;
+    else {
+      fprintf(stderr, "%s: unknown option %s\n", spec, name);
+      free(copy);
+      return FALSE;
+    }
+  }
+
+  free(copy);
+  return config->nEncodings > 0;
+}
+
+/* hand the sink client a message, as if it came over its socket */
+static rfbBool sendToSink(replay_t *replay, const void *msg, int len)
+{
+  if (write(replay->peer, msg, len) != len)
+    return FALSE;
+  rfbProcessClientMessage(replay->sink);
+  return replay->sink->sock != RFB_INVALID_SOCKET;
+}
+
+static rfbBool connectSink(replay_t *replay, config_t *config)
+{
+  static const char version[] = "RFB 003.008\n";
+  const char security = rfbSecTypeNone;
+  const char clientInit = 1;
+  char buf[sz_rfbSetEncodingsMsg + 4 * (MAX_CONFIG_ENCODINGS + 3)];
+  rfbSetEncodingsMsg *se = (rfbSetEncodingsMsg *)buf;
+  uint32_t *encs = (uint32_t *)(buf + sz_rfbSetEncodingsMsg);
+  int sv[2], i, n = 0;
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0)
+    return FALSE;
+  replay->peer = sv[1];
+  replay->sink = rfbNewClient(replay->screen, sv[0]);
+  if (!replay->sink)
+    return FALSE;
+  replay->sink->writeToSocket = sinkWrite;
+
+  for (i = 0; i < config->nEncodings; i++)
+    encs[n++] = Swap32IfLE(config->encodings[i]);
+  encs[n++] = Swap32IfLE(rfbEncodingLastRect);
+  if (config->compressLevel >= 0)
+    encs[n++] = Swap32IfLE(rfbEncodingCompressLevel0 + config->compressLevel);
+  if (config->qualityLevel >= 0)
+    encs[n++] = Swap32IfLE(rfbEncodingQualityLevel0 + config->qualityLevel);
+  se->type = rfbSetEncodings;
+  se->pad = 0;
+  se->nEncodings = Swap16IfLE(n);
+
+  return sendToSink(replay, version, strlen(version)) &&
+    sendToSink(replay, &security, 1) &&
+    sendToSink(replay, &clientInit, 1) &&
+    sendToSink(replay, buf, sz_rfbSetEncodingsMsg + 4 * n);
+}
+
+/* The player's callbacks */
+
+static rfbBool mallocFrameBuffer(rfbClient *client)
+{
+  replay_t *replay = rfbClientGetClientData(client, &replayTag);
+  int bpp = client->format.bitsPerPixel / 8;
+
+  if (!replay->mallocFrameBuffer(client))
+    return FALSE;
+  if (replay->screen) {
+    rfbNewFramebuffer(replay->screen, (char *)client->frameBuffer,
+                      client->width, client->height, 8, 3, bpp);
+    replay->screen->serverFormat = client->format;
+    rfbSetTranslateFunction(replay->sink);
+  }
+  return TRUE;
+}
+
+static void gotDamage(rfbClient *client, int x, int y, int w, int h)
+{
+  replay_t *replay = rfbClientGetClientData(client, &replayTag);
+  sraRegionPtr rect = sraRgnCreateRect(x, y, x + w, y + h);
+
+  sraRgnOr(replay->damage, rect);
+  sraRgnDestroy(rect);
+}
+
+static void sendDamage(rfbClient *client)
+{
+  replay_t *replay = rfbClientGetClientData(client, &replayTag);
+  rfbFramebufferUpdateRequestMsg fur;
+  double cpu, wall;
+
+  if (replay->failed || sraRgnEmpty(replay->damage))
+    return;
+
+  fur.type = rfbFramebufferUpdateRequest;
+  fur.incremental = 1;
+  fur.x = fur.y = 0;
+  fur.w = Swap16IfLE(client->width);
+  fur.h = Swap16IfLE(client->height);
+  if (!sendToSink(replay, &fur, sz_rfbFramebufferUpdateRequestMsg)) {
+    replay->failed = TRUE;
+    return;
+  }
+
+  cpu = cpuTime();
+  wall = wallTime();
+  rfbMarkRegionAsModified(replay->screen, replay->damage);
+  rfbUpdateClient(replay->sink);
+  replay->cpu += cpuTime() - cpu;
+  wall = wallTime() - wall;
+
+  if (replay->frames == replay->latencySize) {
+    replay->latencySize = replay->latencySize ? 2 * replay->latencySize : 1024;
+    replay->latency = realloc(replay->latency, replay->latencySize * sizeof(double));
+    if (!replay->latency) {
+      replay->failed = TRUE;
+      return;
+    }
+  }
+  replay->latency[replay->frames++] = wall;
+  sraRgnMakeEmpty(replay->damage);
+}
+
+static int compareDoubles(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+static rfbBool runConfig(const char *recording, config_t *config)
+{
+  replay_t replay;
+  rfbClient *player;
+  rfbStatList *s;
+  unsigned long rawBytes = 0;
+  char name[64];
+
+  memset(&replay, 0, sizeof(replay));
+  replay.peer = -1;
+  replay.damage = sraRgnCreate();
+
+  player = rfbGetClient(8, 3, 4);
+  player->serverHost = strdup(recording);
+  player->serverPort = -1;
+  player->vncRecDoNotSleep = TRUE;
+  replay.mallocFrameBuffer = player->MallocFrameBuffer;
+  player->MallocFrameBuffer = mallocFrameBuffer;
+  player->GotFrameBufferUpdate = gotDamage;
+  player->FinishedFrameBufferUpdate = sendDamage;
+  rfbClientSetClientData(player, &replayTag, &replay);
+  if (!rfbInitClient(player, NULL, NULL)) {
+    fprintf(stderr, "Could not play %s\n", recording);
+    sraRgnDestroy(replay.damage);
+    return FALSE;
+  }
+
+  replay.screen = rfbGetScreen(NULL, NULL, player->width, player->height, 8, 3,
+                               player->format.bitsPerPixel / 8);
+  replay.screen->frameBuffer = (char *)player->frameBuffer;
+  replay.screen->serverFormat = player->format;
+  replay.screen->adaptiveEncoding = config->adaptive;
+  replay.screen->detectCopies = config->copies;
+  replay.screen->deferUpdateTime = 0;
+  replay.screen->cursor = NULL;
+  /* the sink speaks plain RFB right away */
+  replay.screen->webSocketsOnRfbPort = FALSE;
+  if (!connectSink(&replay, config)) {
+    fprintf(stderr, "%s: could not set up the client\n", config->spec);
+    replay.failed = TRUE;
+  }
+  sinkBytes = 0;
+
+  while (!replay.failed && HandleRFBServerMessage(player))
+    ;
+
+  if (!replay.failed) {
+    for (s = replay.sink->statEncList; s; s = s->Next)
+      rawBytes += s->bytesSentIfRaw;
+
+    printf("%-24s %7d %9.1f %8.3f %10.2f %6.1f", config->spec, replay.frames,
+           replay.cpu * 1e3, replay.frames ? replay.cpu * 1e3 / replay.frames : 0,
+           sinkBytes / 1e6, sinkBytes ? (double)rawBytes / sinkBytes : 0);
+    if (replay.frames) {
+      qsort(replay.latency, replay.frames, sizeof(double), compareDoubles);
+      printf(" %8.3f %8.3f %8.3f", replay.latency[replay.frames / 2] * 1e3,
+             replay.latency[replay.frames * 99 / 100] * 1e3,
+             replay.latency[replay.frames - 1] * 1e3);
+    }
+    printf("\n");
+
+    /* what the bytes went to */
+    for (s = replay.sink->statEncList; s; s = s->Next)
+      if (s->sentCount)
+        printf("    %-20s %7u rects %10.2f MB\n", encodingName(s->type, name, sizeof(name)),
+               s->sentCount, s->bytesSent / 1e6);
+  }
+
+  rfbScreenCleanup(replay.screen);
+  if (replay.peer >= 0)
+    close(replay.peer);
+  free(player->frameBuffer);
+  rfbClientCleanup(player);
+  sraRgnDestroy(replay.damage);
+  free(replay.latency);
+  return !replay.failed;
+}
+
+int main(int argc, char **argv)
+{
+  config_t config;
+  const char *recording;
+  int i = 1, failed = 0;
+
+  if (i < argc && !strcmp(argv[i], "-v"))
+    i++;
+  else {
+    rfbLogEnable(FALSE);
+    rfbEnableClientLogging = FALSE;
+  }
+
+  if (argc - i < 2) {
+    fprintf(stderr, "usage: %s [-v] recording configuration...\n", argv[0]);
+    fprintf(stderr, "configurations are encodings separated by '+', optionally followed by\n"
+            "',cN' (compression level), ',qN' (quality level), ',adaptive' and ',copies'\n");
+    return 1;
+  }
+  recording = argv[i++];
+
+  printf("%-24s %7s %9s %8s %10s %6s %8s %8s %8s\n", "configuration", "updates",
+         "cpu ms", "ms/upd", "MB sent", "ratio", "p50 ms", "p99 ms", "max ms");
+  for (; i < argc; i++)
+    if (!parseConfig(argv[i], &config) || !runConfig(recording, &config))
+      failed = 1;
+  return failed;
+}
@@ -0,0 +1,79 @@
+/*
+ * Checks the vectorized decoder loops of libvncclient against the scalar
+ * ones, on random input of all tile sizes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <rfb/rfbclient.h>
+#include "simd.h"
+
+#define MAX_OPS 8
+#define TILE 64
+#define STRIDE (TILE + 5)
+#define GUARD 0x5a5a5a5a
+
+static uint8_t src[TILE * TILE * 3 + 1];
+static uint32_t expected[TILE * STRIDE], got[TILE * STRIDE];
+
+static void randomize(void)
+{
+  size_t i;
+  for (i = 0; i < sizeof(src); i++)
+    src[i] = rand();
+  for (i = 0; i < TILE * STRIDE; i++)
+    expected[i] = got[i] = GUARD;
+}
+
+static int compare(const char *name, const char *what, int w, int h, int arg)
+{
+  if (memcmp(expected, got, sizeof(got)) == 0)
+    return 0;
+  fprintf(stderr, "%s: %s differs from scalar for %dx%d (%d)\n", name, what, w, h, arg);
+  return 1;
+}
+
+int main(int argc, char** argv)
+{
+  const rfbPixelOps* ops[MAX_OPS];
+  const rfbPixelOps* scalar;
+  uint32_t palette[16];
+  int nOps, o, w, h, i, bpp, failed = 0;
+  static const int shifts[] = { 0, 8, -8 };
+
+  nOps = AllPixelOps(ops, MAX_OPS);
+  scalar = ops[0];
+
+  for (o = 1; o < nOps; o++) {
+    printf("checking %s\n", ops[o]->name);
+
+    for (i = 0; i <= TILE * 2; i++) {
+      randomize();
+      scalar->fill(expected + 1, i, 0x12345678);
+      ops[o]->fill(got + 1, i, 0x12345678);
+      failed |= compare(ops[o]->name, "fill", i, 1, 0);
+    }
+
+    for (w = 1; w <= TILE; w++)
+      for (h = 1; h <= TILE; h += 7) {
+        for (bpp = 1; bpp <= 4; bpp *= 2) {
+          randomize();
+          for (i = 0; i < 16; i++)
+            palette[i] = rand() ^ ((uint32_t)rand() << 16);
+          scalar->unpackPalette(expected, STRIDE, src, w, h, bpp, palette);
+          ops[o]->unpackPalette(got, STRIDE, src, w, h, bpp, palette);
+          failed |= compare(ops[o]->name, "unpackPalette", w, h, bpp);
+        }
+
+        for (i = 0; i < (int)(sizeof(shifts) / sizeof(shifts[0])); i++) {
+          randomize();
+          scalar->expandCPixels(expected, STRIDE, src, w, h, shifts[i]);
+          ops[o]->expandCPixels(got, STRIDE, src, w, h, shifts[i]);
+          failed |= compare(ops[o]->name, "expandCPixels", w, h, shifts[i]);
+        }
+      }
+  }
+
+  return failed;
+}
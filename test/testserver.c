@@ -0,0 +1,150 @@
+/*
+ * testserver - the in-process server the client tests talk to.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "testserver.h"
+
+rfbScreenInfoPtr testServer;
+
+static pthread_t serverThread;
+static pthread_mutex_t serverMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t serverCond = PTHREAD_COND_INITIALIZER;
+static int paintRequests, paintCount;
+static rfbBool shutdownRequested;
+
+/* the client data a finished update is noted with */
+static char updatedTag;
+
+static void
+paint(rfbBool all)
+{
+  int width = testServer->width, height = testServer->height;
+  int x1 = rand() % width, x2 = rand() % width, y1 = rand() % height, y2 = rand() % height;
+  int x, y, t, colours = 1 + rand() % 40;
+
+  if (x1 > x2) { t = x1; x1 = x2; x2 = t; }
+  if (y1 > y2) { t = y1; y1 = y2; y2 = t; }
+  x2++; y2++;
+  if (all) {
+    x1 = y1 = 0;
+    x2 = width;
+    y2 = height;
+  }
+  for (y = y1; y < y2; y++)
+    for (x = x1; x < x2; x++) {
+      uint32_t v = (uint32_t)((x / 7 + y / 5) % colours) * 0x030507 + (uint32_t)rand() % 2;
+      memcpy(testServer->frameBuffer + y * testServer->paddedWidthInBytes + x * 4, &v, 4);
+    }
+  rfbMarkRectAsModified(testServer, x1, y1, x2, y2);
+}
+
+static void *
+runServer(void *arg)
+{
+  for (;;) {
+    pthread_mutex_lock(&serverMutex);
+    if (shutdownRequested) {
+      pthread_mutex_unlock(&serverMutex);
+      break;
+    }
+    if (paintCount < paintRequests) {
+      paint(paintCount == 0);
+      paintCount++;
+      pthread_cond_signal(&serverCond);
+    }
+    pthread_mutex_unlock(&serverMutex);
+    rfbProcessEvents(testServer, 10000);
+  }
+  rfbShutdownServer(testServer, TRUE);
+  return NULL;
+}
+
+rfbBool
+testServerStart(int *argc, char **argv, int width, int height)
+{
+  testServer = rfbGetScreen(argc, argv, width, height, 8, 3, 4);
+  if (!testServer)
+    return FALSE;
+  testServer->frameBuffer = calloc(width * height, 4);
+  testServer->cursor = NULL;
+  testServer->deferUpdateTime = 0;
+  testServer->autoPort = TRUE;
+  testServer->ipv6port = 0;
+  rfbInitServer(testServer);
+  return pthread_create(&serverThread, NULL, runServer, NULL) == 0;
+}
+
+void
+testServerPaint(void)
+{
+  pthread_mutex_lock(&serverMutex);
+  paintRequests++;
+  while (paintCount < paintRequests)
+    pthread_cond_wait(&serverCond, &serverMutex);
+  pthread_mutex_unlock(&serverMutex);
+}
+
+void
+testServerStop(void)
+{
+  pthread_mutex_lock(&serverMutex);
+  shutdownRequested = TRUE;
+  pthread_mutex_unlock(&serverMutex);
+  pthread_join(serverThread, NULL);
+}
+
+void
+testServerCleanup(void)
+{
+  free(testServer->frameBuffer);
+  rfbScreenCleanup(testServer);
+  testServer = NULL;
+}
+
+static void
+finished(rfbClient *client)
+{
+  rfbClientSetClientData(client, &updatedTag, &updatedTag);
+}
+
+rfbBool
+testClientConnect(rfbClient *client, const char *programName)
+{
+  char port[32], *args[2];
+  int argn = 2;
+
+  sprintf(port, "127.0.0.1:%d", testServer->port);
+  args[0] = (char *)programName;
+  args[1] = port;
+  client->FinishedFrameBufferUpdate = finished;
+  return rfbInitClient(client, &argn, args);
+}
+
+/* not all decoders leave the unused fourth byte alone */
+rfbBool
+testClientCaughtUp(rfbClient *client)
+{
+  int x, y;
+
+  if (!rfbClientGetClientData(client, &updatedTag))
+    return FALSE;
+  rfbClientSetClientData(client, &updatedTag, NULL);
+
+  pthread_mutex_lock(&serverMutex);
+  for (y = 0; y < testServer->height; y++)
+    for (x = 0; x < testServer->width; x++) {
+      uint32_t a, b;
+      memcpy(&a, client->frameBuffer + (y * testServer->width + x) * 4, 4);
+      memcpy(&b, testServer->frameBuffer + y * testServer->paddedWidthInBytes + x * 4, 4);
+      if ((a ^ b) & 0xffffff) {
+        pthread_mutex_unlock(&serverMutex);
+        return FALSE;
+      }
+    }
+  pthread_mutex_unlock(&serverMutex);
+  return TRUE;
+}
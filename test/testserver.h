@@ -0,0 +1,31 @@
+/*
+ * testserver - the in-process server the client tests talk to. It runs on
+ * a thread of its own and paints the framebuffer when asked to, the first
+ * time all of it, so that the first update is large.
+ */
+
+#ifndef TESTSERVER_H
+#define TESTSERVER_H
+
+#include <rfb/rfb.h>
+#include <rfb/rfbclient.h>
+
+/* how long a client may take to catch up with one painting */
+#define SECONDS_PER_ROUND 10
+
+extern rfbScreenInfoPtr testServer;
+
+/* set up the server on a free port and start its thread */
+rfbBool testServerStart(int *argc, char **argv, int width, int height);
+/* paint a random rectangle and return once it is marked as modified */
+void testServerPaint(void);
+/* shut the server down, which closes the connection of every client */
+void testServerStop(void);
+void testServerCleanup(void);
+
+/* connect a client, which is then watched for finished updates */
+rfbBool testClientConnect(rfbClient *client, const char *programName);
+/* TRUE once an update finished and left the framebuffer the server's */
+rfbBool testClientCaughtUp(rfbClient *client);
+
+#endif
@@ -0,0 +1,242 @@
+/*
+ * vncrectest - record what an in-process server sends, play the recording
+ * back, seek around in it and check that the framebuffer is the one the
+ * recording client had at that time. A recording with a corrupt chunk size
+ * must be turned down.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include "testserver.h"
+
+#define WIDTH 320
+#define HEIGHT 240
+#define ROUNDS 8
+/* between rounds, so that seeking can tell them apart */
+#define ROUND_GAP_MS 300
+#define RECORDING "vncrectest.vnc"
+#define CORRUPT_RECORDING "vncrectest-corrupt.vnc"
+
+/* the framebuffer after each round, and when the recording had it */
+static uint8_t *snapshots[ROUNDS + 1];
+static uint32_t snapshotTimes[ROUNDS + 1];
+
+/* not all decoders leave the unused fourth byte alone */
+static rfbBool
+sameFramebuffer(const uint8_t *a, const uint8_t *b)
+{
+  int i;
+
+  for (i = 0; i < WIDTH * HEIGHT; i++) {
+    uint32_t u, v;
+    memcpy(&u, a + i * 4, 4);
+    memcpy(&v, b + i * 4, 4);
+    if ((u ^ v) & 0xffffff)
+      return FALSE;
+  }
+  return TRUE;
+}
+
+/* handle messages until the client has what the server has */
+static rfbBool
+catchUp(rfbClient *client)
+{
+  time_t start = time(NULL);
+
+  for (;;) {
+    if (testClientCaughtUp(client))
+      return TRUE;
+    if (time(NULL) - start > SECONDS_PER_ROUND)
+      return FALSE;
+    if (WaitForMessage(client, 10000) > 0 && !HandleRFBServerMessage(client))
+      return FALSE;
+  }
+}
+
+static uint32_t
+millisecondsSince(struct timeval *start)
+{
+  struct timeval now;
+
+  gettimeofday(&now, NULL);
+  return (uint32_t)((now.tv_sec - start->tv_sec) * 1000 +
+                    (now.tv_usec - start->tv_usec) / 1000);
+}
+
+static rfbClient *
+openRecording(const char *file)
+{
+  rfbClient *client = rfbGetClient(8, 3, 4);
+  char *args[3];
+  int argn = 3;
+
+  args[0] = "vncrectest";
+  args[1] = "-play";
+  args[2] = (char *)file;
+  client->vncRecDoNotSleep = TRUE;
+  if (!rfbInitClient(client, &argn, args))
+    return NULL;
+  return client;
+}
+
+static rfbBool
+record(void)
+{
+  rfbClient *client = rfbGetClient(8, 3, 4);
+  struct timeval start;
+  int round;
+  rfbBool ok = TRUE;
+
+  client->appData.encodingsString = "tight zrle hextile";
+  client->appData.enableJPEG = FALSE;
+  if (!testClientConnect(client, "vncrectest")) {
+    fprintf(stderr, "could not connect\n");
+    return FALSE;
+  }
+  if (!catchUp(client)) {
+    fprintf(stderr, "the first update did not come through\n");
+    ok = FALSE;
+  }
+
+  /* a keyframe every second, so that seeking uses several of them */
+  if (ok && !rfbVNCRecStart(client, RECORDING, 1)) {
+    fprintf(stderr, "could not start recording\n");
+    ok = FALSE;
+  }
+  gettimeofday(&start, NULL);
+
+  for (round = 0; ok && round <= ROUNDS; round++) {
+    if (round > 0) {
+      usleep(ROUND_GAP_MS * 1000);
+      testServerPaint();
+      if (!catchUp(client)) {
+        fprintf(stderr, "round %d: the client did not catch up\n", round);
+        ok = FALSE;
+        break;
+      }
+    }
+    snapshotTimes[round] = millisecondsSince(&start);
+    snapshots[round] = malloc(WIDTH * HEIGHT * 4);
+    memcpy(snapshots[round], client->frameBuffer, WIDTH * HEIGHT * 4);
+  }
+
+  rfbVNCRecStop(client);
+  free(client->frameBuffer);
+  rfbClientCleanup(client);
+  return ok;
+}
+
+/* seek back and forth, to the middle of the gap after each round */
+static rfbBool
+seek(void)
+{
+  static const int order[] = { 3, 0, 8, 5, 1, 7, 2, 6, 4, 8, 0 };
+  rfbClient *client = openRecording(RECORDING);
+  rfbBool ok = TRUE;
+  int i;
+
+  if (!client) {
+    fprintf(stderr, "could not play the recording\n");
+    return FALSE;
+  }
+  /* the last message arrives a little before its snapshot is taken */
+  if (rfbVNCRecDuration(client) <= snapshotTimes[ROUNDS - 1]) {
+    fprintf(stderr, "the recording lasts only %u ms\n", (unsigned int)rfbVNCRecDuration(client));
+    ok = FALSE;
+  }
+
+  for (i = 0; ok && i < (int)(sizeof(order) / sizeof(order[0])); i++) {
+    int round = order[i];
+    uint32_t time = snapshotTimes[round] + (round > 0 ? ROUND_GAP_MS / 2 : 0);
+
+    if (!rfbVNCRecSeek(client, time)) {
+      fprintf(stderr, "could not seek to %u ms\n", (unsigned int)time);
+      ok = FALSE;
+    } else if (!sameFramebuffer(client->frameBuffer, snapshots[round])) {
+      fprintf(stderr, "at %u ms the framebuffer is not the one of round %d\n",
+              (unsigned int)time, round);
+      ok = FALSE;
+    }
+  }
+
+  /* and play on to the end from the start */
+  if (ok && !rfbVNCRecSeek(client, 0))
+    ok = FALSE;
+  while (ok && HandleRFBServerMessage(client))
+    ;
+  if (ok && !sameFramebuffer(client->frameBuffer, snapshots[ROUNDS])) {
+    fprintf(stderr, "played to the end, the framebuffer is not the last one\n");
+    ok = FALSE;
+  }
+
+  free(client->frameBuffer);
+  rfbClientCleanup(client);
+  return ok;
+}
+
+/* the first chunk claims to be huge */
+static rfbBool
+corruptChunk(void)
+{
+  FILE *in = fopen(RECORDING, "rb"), *out = fopen(CORRUPT_RECORDING, "wb");
+  rfbClient *client;
+  char buf[4096];
+  size_t n, offset = 0;
+
+  if (!in || !out) {
+    fprintf(stderr, "could not copy the recording\n");
+    if (in) fclose(in);
+    if (out) fclose(out);
+    return FALSE;
+  }
+  while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+    /* after the 9 byte magic: type, time, size, then the length */
+    if (offset == 0 && n >= 25)
+      memset(buf + 21, 0x7f, 4);
+    fwrite(buf, 1, n, out);
+    offset += n;
+  }
+  fclose(in);
+  fclose(out);
+
+  client = openRecording(CORRUPT_RECORDING);
+  remove(CORRUPT_RECORDING);
+  if (client) {
+    fprintf(stderr, "a corrupt recording was played\n");
+    free(client->frameBuffer);
+    rfbClientCleanup(client);
+    return FALSE;
+  }
+  return TRUE;
+}
+
+int
+main(int argc, char **argv)
+{
+  int i, failed = 0;
+
+  if (!testServerStart(&argc, argv, WIDTH, HEIGHT))
+    return 1;
+
+  if (!record())
+    failed = 1;
+
+  testServerStop();
+
+  if (!failed && !seek())
+    failed = 1;
+  if (!failed && !corruptChunk())
+    failed = 1;
+
+  remove(RECORDING);
+  for (i = 0; i <= ROUNDS; i++)
+    free(snapshots[i]);
+  testServerCleanup();
+
+  printf("%s\n", failed ? "FAILED" : "OK");
+  return failed;
+}
@@ -24,6 +24,7 @@
 
 import websockets
 import base64
+import zlib
 
 '''
     Create websocket frames for the wstest websocket decoding unit test.
@@ -42,13 +43,17 @@ def add_field(s, name, value, first=False):
 
 
 class Testframe():
-    def __init__(self, frame, descr, modify_bytes={}, experrno=0, mask=True, opcode_overwrite=False):
+    def __init__(self, frame, descr, modify_bytes={}, experrno=0, mask=True, opcode_overwrite=False, compress=False, deflate=None):
         self.frame = frame
         self.descr = descr
         self.modify_bytes = modify_bytes
         self.experrno = experrno
         self.b64 = True if frame.opcode == 1 or opcode_overwrite == 1 else False
         self.mask = mask
+        # compress the payload as permessage-deflate does (RFC 7692)
+        self.compress = compress
+        # whether the decoder has permessage-deflate negotiated
+        self.deflate = compress if deflate is None else deflate
 
     def to_carray_initializer(self, buf):
         values = []
@@ -74,6 +79,10 @@ class Testframe():
             newdata = base64.b64encode(self.frame.data)
             #print("converting\n{0}\nto{1}\n".format(olddata, newdata))
             the_frame = websockets.framing.Frame(self.frame.fin, self.frame.opcode, base64.b64encode(olddata))
+        if self.compress:
+            c = zlib.compressobj(6, zlib.DEFLATED, -15)
+            data = c.compress(self.frame.data) + c.flush(zlib.Z_SYNC_FLUSH)
+            the_frame = websockets.framing.Frame(self.frame.fin, self.frame.opcode, data[:-4], rsv1=True)
         websockets.framing.write_frame(the_frame, self.set_frame_buf, self.mask)
         s = "\t{\n"
         s = add_field(s, "frame", "{0}".format(self.frame_carray), True)
@@ -86,6 +95,7 @@ class Testframe():
         s = add_field(s, "simulate_sock_malfunction_at", "0")
         s = add_field(s, "errno_val", "0")
         s = add_field(s, "close_sock_at", "0")
+        s = add_field(s, "deflate", "1" if self.deflate else "0")
         s += "\n\t}"
         return s
 
@@ -119,6 +129,11 @@ flist.append(Testframe(frag1, "Continuation test frag1"))
 flist.append(Testframe(frag2, "Continuation test frag2", opcode_overwrite=1))
 flist.append(Testframe(frag3, "Continuation test frag3", opcode_overwrite=1))
 
+### permessage-deflate compressed frames
+compressed = bytearray("Frame2 does contain much more text and even goes beyond the 126 byte len field. " * 4, encoding="utf-8")
+flist.append(Testframe(websockets.framing.Frame(1, 2, compressed), "Compressed binary frame", compress=True))
+flist.append(Testframe(websockets.framing.Frame(1, 2, compressed), "Invalid frame: Compressed without permessage-deflate", experrno="EPROTO", compress=True, deflate=False))
+
 s = "struct ws_frame_test tests[] = {\n"
 for i in range(len(flist)):
     s += flist[i].__str__()
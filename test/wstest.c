@@ -69,6 +69,7 @@ struct ws_frame_test {
   int simulate_sock_malfunction_at;
   int errno_val;
   int close_sock_at;
+  int deflate;
 };
 
 #include "wstestdata.inc"
@@ -126,6 +127,7 @@ static uint64_t run_test(struct ws_frame_test *ft, ws_ctx_t *ctx)
   ft->pos = ft->frame;
 
   ctx->ctxInfo.ctxPtr = (void *)ft;
+  ctx->permessageDeflate = ft->deflate;
 
   while (nleft > 0) {
     rfbLog("calling ws_decode with dst=%p, len=%lu\n", dst, nleft);
@@ -174,6 +176,7 @@ int main()
   int i;
   srand(RND_SEED);
   
+  memset(&ctx, 0, sizeof(ctx));
   hybiDecodeCleanupComplete(&ctx);
   ctx.decode = webSocketsDecodeHybi;
   ctx.ctxInfo.readFunc = emu_read;
@@ -194,6 +197,7 @@ int main()
       retall = -1;
     }
   }
+  hybiDecodeFree(&ctx);
   return retall;
 }
 